@@ -0,0 +1,478 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2016 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#include "claws-features.h"
+#endif
+
+#include "defs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "cachelru.h"
+#include "prefs.h"
+#include "utils.h"
+
+/*
+ * The index is kept in memory and written out as a whole by
+ * cache_lru_save(), one line per message:
+ *
+ *   <last use> <size> <date> <pinned> <number> <folder identifier>
+ *
+ * The date and whether the message is pinned are what the caller told
+ * cache_lru_set_info(), so that deciding what to keep needs nothing but
+ * the index. Version 1 lines lack both.
+ *
+ * Losing recent changes to it is harmless: a message it doesn't know
+ * about is only picked up once it is used again, and one that has gone
+ * from the cache is forgotten when its turn to be dropped comes.
+ */
+
+#define LRU_MAGIC	"CLRU2"
+#define LRU_MAGIC_V1	"CLRU1"
+
+typedef struct _LruEntry {
+	time_t atime;
+	goffset size;
+	time_t date;		/* of the message, 0 if unknown */
+	gboolean pinned;	/* never dropped */
+} LruEntry;
+
+struct _CacheLru {
+	gchar *file;
+	GHashTable *folders;	/* folder id -> (number -> LruEntry) */
+	goffset total;
+	gboolean dirty;
+};
+
+typedef struct _LruVictim {
+	const gchar *folder_id;
+	guint num;
+	time_t atime;
+	time_t date;
+} LruVictim;
+
+static GHashTable *cache_lru_folder_new(void)
+{
+	return g_hash_table_new_full(g_direct_hash, g_direct_equal,
+				     NULL, g_free);
+}
+
+static goffset cache_lru_folder_size(GHashTable *entries)
+{
+	GHashTableIter iter;
+	gpointer value;
+	goffset size = 0;
+
+	g_hash_table_iter_init(&iter, entries);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		size += ((LruEntry *)value)->size;
+
+	return size;
+}
+
+static LruEntry *cache_lru_lookup(CacheLru *lru, const gchar *folder_id,
+				   guint num)
+{
+	GHashTable *entries;
+
+	entries = g_hash_table_lookup(lru->folders, folder_id);
+	if (entries == NULL)
+		return NULL;
+	return g_hash_table_lookup(entries, GUINT_TO_POINTER(num));
+}
+
+static LruEntry *cache_lru_set(CacheLru *lru, const gchar *folder_id,
+			       guint num, goffset size, time_t when)
+{
+	GHashTable *entries;
+	LruEntry *entry;
+
+	entries = g_hash_table_lookup(lru->folders, folder_id);
+	if (entries == NULL) {
+		entries = cache_lru_folder_new();
+		g_hash_table_insert(lru->folders, g_strdup(folder_id), entries);
+	}
+
+	entry = g_hash_table_lookup(entries, GUINT_TO_POINTER(num));
+	if (entry == NULL) {
+		entry = g_new0(LruEntry, 1);
+		g_hash_table_insert(entries, GUINT_TO_POINTER(num), entry);
+	}
+	if (size >= 0) {
+		lru->total += size - entry->size;
+		entry->size = size;
+	}
+	entry->atime = MAX(entry->atime, when);
+
+	return entry;
+}
+
+/* Empty folder tables are left in place, so that the identifiers
+ * cache_lru_evict() hands out stay valid while it runs. */
+static gboolean cache_lru_drop(CacheLru *lru, const gchar *folder_id, guint num)
+{
+	GHashTable *entries;
+	LruEntry *entry;
+
+	entries = g_hash_table_lookup(lru->folders, folder_id);
+	if (entries == NULL)
+		return FALSE;
+	entry = g_hash_table_lookup(entries, GUINT_TO_POINTER(num));
+	if (entry == NULL)
+		return FALSE;
+
+	lru->total -= entry->size;
+	g_hash_table_remove(entries, GUINT_TO_POINTER(num));
+	lru->dirty = TRUE;
+
+	return TRUE;
+}
+
+static void cache_lru_read(CacheLru *lru)
+{
+	FILE *fp;
+	gchar buf[BUFFSIZE];
+	gint count = 0;
+	gboolean v1;
+
+	if ((fp = g_fopen(lru->file, "rb")) == NULL)
+		return;
+
+	if (fgets(buf, sizeof(buf), fp) == NULL) {
+		fclose(fp);
+		return;
+	}
+	if (!strncmp(buf, LRU_MAGIC_V1, strlen(LRU_MAGIC_V1)))
+		v1 = TRUE;
+	else if (!strncmp(buf, LRU_MAGIC, strlen(LRU_MAGIC)))
+		v1 = FALSE;
+	else {
+		fclose(fp);
+		return;
+	}
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		gchar *p = buf;
+		LruEntry *entry;
+		time_t atime, date = 0;
+		goffset size;
+		gboolean pinned = FALSE;
+		guint num;
+
+		atime = (time_t)g_ascii_strtoll(p, &p, 10);
+		size = (goffset)g_ascii_strtoll(p, &p, 10);
+		if (!v1) {
+			date = (time_t)g_ascii_strtoll(p, &p, 10);
+			pinned = g_ascii_strtoull(p, &p, 10) != 0;
+		}
+		num = (guint)g_ascii_strtoull(p, &p, 10);
+		if (*p++ != ' ' || num == 0 || size < 0)
+			continue;
+		g_strchomp(p);
+		if (*p == '\0')
+			continue;
+
+		entry = cache_lru_set(lru, p, num, size, atime);
+		entry->date = date;
+		entry->pinned = pinned;
+		count++;
+	}
+	fclose(fp);
+
+	debug_print("read cache index %s: %d messages, %" G_GOFFSET_FORMAT
+		    " bytes\n", lru->file, count, lru->total);
+}
+
+CacheLru *cache_lru_open(const gchar *file)
+{
+	CacheLru *lru;
+
+	cm_return_val_if_fail(file != NULL, NULL);
+
+	lru = g_new0(CacheLru, 1);
+	lru->file = g_strdup(file);
+	lru->folders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					     (GDestroyNotify)g_hash_table_destroy);
+	cache_lru_read(lru);
+	lru->dirty = FALSE;
+
+	return lru;
+}
+
+void cache_lru_close(CacheLru *lru)
+{
+	if (lru == NULL)
+		return;
+
+	cache_lru_save(lru);
+	g_hash_table_destroy(lru->folders);
+	g_free(lru->file);
+	g_free(lru);
+}
+
+gint cache_lru_save(CacheLru *lru)
+{
+	PrefFile *pfile;
+	GHashTableIter iter, entry_iter;
+	gpointer key, value, num, entry;
+
+	cm_return_val_if_fail(lru != NULL, -1);
+
+	if (!lru->dirty)
+		return 0;
+
+	if ((pfile = prefs_write_open(lru->file)) == NULL)
+		return -1;
+
+	if (fprintf(pfile->fp, "%s\n", LRU_MAGIC) < 0)
+		goto err;
+
+	g_hash_table_iter_init(&iter, lru->folders);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		g_hash_table_iter_init(&entry_iter, (GHashTable *)value);
+		while (g_hash_table_iter_next(&entry_iter, &num, &entry)) {
+			if (fprintf(pfile->fp, "%" G_GINT64_FORMAT " %"
+				    G_GOFFSET_FORMAT " %" G_GINT64_FORMAT
+				    " %d %u %s\n",
+				    (gint64)((LruEntry *)entry)->atime,
+				    ((LruEntry *)entry)->size,
+				    (gint64)((LruEntry *)entry)->date,
+				    ((LruEntry *)entry)->pinned ? 1 : 0,
+				    GPOINTER_TO_UINT(num),
+				    (gchar *)key) < 0)
+				goto err;
+		}
+	}
+
+	if (prefs_file_close(pfile) < 0)
+		return -1;
+	lru->dirty = FALSE;
+
+	return 0;
+
+err:
+	FILE_OP_ERROR(lru->file, "fprintf");
+	prefs_file_close_revert(pfile);
+	return -1;
+}
+
+/* A negative size leaves the one already known, if any, unchanged. */
+void cache_lru_touch(CacheLru *lru, const gchar *folder_id, guint num,
+		     goffset size, time_t when)
+{
+	cm_return_if_fail(lru != NULL);
+	cm_return_if_fail(folder_id != NULL);
+
+	cache_lru_set(lru, folder_id, num, size, when);
+	lru->dirty = TRUE;
+}
+
+/* Records the date of a message and whether it is to stay cached
+ * whatever its age, if it is in the index. A date of 0 leaves the one
+ * already known unchanged. Returns whether a message was unpinned. */
+gboolean cache_lru_set_info(CacheLru *lru, const gchar *folder_id, guint num,
+			    time_t date, gboolean pinned)
+{
+	LruEntry *entry;
+	gboolean unpinned;
+
+	cm_return_val_if_fail(lru != NULL, FALSE);
+	cm_return_val_if_fail(folder_id != NULL, FALSE);
+
+	if ((entry = cache_lru_lookup(lru, folder_id, num)) == NULL)
+		return FALSE;
+	if ((date == 0 || entry->date == date) && entry->pinned == pinned)
+		return FALSE;
+
+	unpinned = entry->pinned && !pinned;
+	if (date != 0)
+		entry->date = date;
+	entry->pinned = pinned;
+	lru->dirty = TRUE;
+
+	return unpinned;
+}
+
+void cache_lru_remove(CacheLru *lru, const gchar *folder_id, guint num)
+{
+	cm_return_if_fail(lru != NULL);
+	cm_return_if_fail(folder_id != NULL);
+
+	cache_lru_drop(lru, folder_id, num);
+}
+
+void cache_lru_remove_not_in_list(CacheLru *lru, const gchar *folder_id,
+				  GSList *numlist)
+{
+	GHashTable *entries, *wanted;
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList *cur;
+
+	cm_return_if_fail(lru != NULL);
+	cm_return_if_fail(folder_id != NULL);
+
+	entries = g_hash_table_lookup(lru->folders, folder_id);
+	if (entries == NULL)
+		return;
+
+	wanted = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (cur = numlist; cur != NULL; cur = cur->next)
+		g_hash_table_insert(wanted, cur->data, GINT_TO_POINTER(1));
+
+	g_hash_table_iter_init(&iter, entries);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		if (g_hash_table_lookup(wanted, key) != NULL)
+			continue;
+		lru->total -= ((LruEntry *)value)->size;
+		g_hash_table_iter_remove(&iter);
+		lru->dirty = TRUE;
+	}
+	g_hash_table_destroy(wanted);
+}
+
+void cache_lru_remove_folder(CacheLru *lru, const gchar *folder_id)
+{
+	GHashTable *entries;
+
+	cm_return_if_fail(lru != NULL);
+	cm_return_if_fail(folder_id != NULL);
+
+	entries = g_hash_table_lookup(lru->folders, folder_id);
+	if (entries == NULL)
+		return;
+
+	lru->total -= cache_lru_folder_size(entries);
+	g_hash_table_remove(lru->folders, folder_id);
+	lru->dirty = TRUE;
+}
+
+/* Renames old_id and the folders below it. */
+void cache_lru_rename_folder(CacheLru *lru, const gchar *old_id,
+			     const gchar *new_id)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	GSList *renamed = NULL, *cur;
+	gsize len;
+
+	cm_return_if_fail(lru != NULL);
+	cm_return_if_fail(old_id != NULL);
+	cm_return_if_fail(new_id != NULL);
+
+	len = strlen(old_id);
+	g_hash_table_iter_init(&iter, lru->folders);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		const gchar *id = (const gchar *)key;
+
+		if (strncmp(id, old_id, len) ||
+		    (id[len] != '\0' && id[len] != '/'))
+			continue;
+		renamed = g_slist_prepend(renamed,
+				g_strconcat(new_id, id + len, NULL));
+		renamed = g_slist_prepend(renamed, value);
+		g_hash_table_iter_steal(&iter);
+		g_free(key);
+	}
+
+	for (cur = renamed; cur != NULL; cur = cur->next->next) {
+		GHashTable *entries = (GHashTable *)cur->data;
+		gchar *id = (gchar *)cur->next->data;
+		GHashTable *old;
+
+		if ((old = g_hash_table_lookup(lru->folders, id)) != NULL)
+			lru->total -= cache_lru_folder_size(old);
+		g_hash_table_replace(lru->folders, id, entries);
+		lru->dirty = TRUE;
+	}
+	g_slist_free(renamed);
+}
+
+goffset cache_lru_total(CacheLru *lru)
+{
+	cm_return_val_if_fail(lru != NULL, 0);
+
+	return lru->total;
+}
+
+static gint cache_lru_compare_atime(gconstpointer a, gconstpointer b)
+{
+	time_t ta = ((const LruVictim *)a)->atime;
+	time_t tb = ((const LruVictim *)b)->atime;
+
+	return ta < tb ? -1 : ta > tb ? 1 : 0;
+}
+
+/* Drops messages, least recently used first, until the total is down to
+ * target or only pinned messages and those to be kept are left. Returns
+ * how many went. */
+guint cache_lru_evict(CacheLru *lru, goffset target, CacheLruKeepFunc keep,
+		      CacheLruEvictFunc evict, gpointer data)
+{
+	GArray *victims;
+	GHashTableIter iter, entry_iter;
+	gpointer key, value, num, entry;
+	guint i, count = 0;
+
+	cm_return_val_if_fail(lru != NULL, 0);
+	cm_return_val_if_fail(evict != NULL, 0);
+
+	if (lru->total <= target)
+		return 0;
+
+	victims = g_array_new(FALSE, FALSE, sizeof(LruVictim));
+	g_hash_table_iter_init(&iter, lru->folders);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		g_hash_table_iter_init(&entry_iter, (GHashTable *)value);
+		while (g_hash_table_iter_next(&entry_iter, &num, &entry)) {
+			LruVictim victim;
+
+			if (((LruEntry *)entry)->pinned)
+				continue;
+			victim.folder_id = (const gchar *)key;
+			victim.num = GPOINTER_TO_UINT(num);
+			victim.atime = ((LruEntry *)entry)->atime;
+			victim.date = ((LruEntry *)entry)->date;
+			g_array_append_val(victims, victim);
+		}
+	}
+	g_array_sort(victims, cache_lru_compare_atime);
+
+	for (i = 0; i < victims->len && lru->total > target; i++) {
+		LruVictim *victim = &g_array_index(victims, LruVictim, i);
+
+		if (keep && keep(victim->folder_id, victim->num, victim->date,
+				 data))
+			continue;
+		evict(victim->folder_id, victim->num, data);
+		cache_lru_drop(lru, victim->folder_id, victim->num);
+		count++;
+	}
+	g_array_free(victims, TRUE);
+
+	debug_print("dropped %u messages from the cache, %" G_GOFFSET_FORMAT
+		    " bytes left\n", count, lru->total);
+
+	return count;
+}
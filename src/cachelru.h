@@ -0,0 +1,79 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2016 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __CACHELRU_H__
+#define __CACHELRU_H__
+
+#ifdef HAVE_CONFIG_H
+#include "claws-features.h"
+#endif
+
+#include <glib.h>
+#include <time.h>
+
+/* An index of cached messages across folders, with the size of each and
+ * when it was last used, for dropping the least recently used ones when
+ * the cache has grown too big. Folders are known by their identifier. */
+typedef struct _CacheLru CacheLru;
+
+/* whether a message is to stay cached however long unused; date is
+ * the one given to cache_lru_set_info(), 0 if unknown */
+typedef gboolean (*CacheLruKeepFunc)	(const gchar	*folder_id,
+					 guint		 num,
+					 time_t		 date,
+					 gpointer	 data);
+/* drops a message from the cache */
+typedef void (*CacheLruEvictFunc)	(const gchar	*folder_id,
+					 guint		 num,
+					 gpointer	 data);
+
+CacheLru	*cache_lru_open			(const gchar	*file);
+void		 cache_lru_close		(CacheLru	*lru);
+gint		 cache_lru_save			(CacheLru	*lru);
+
+void		 cache_lru_touch		(CacheLru	*lru,
+						 const gchar	*folder_id,
+						 guint		 num,
+						 goffset	 size,
+						 time_t		 when);
+gboolean	 cache_lru_set_info		(CacheLru	*lru,
+						 const gchar	*folder_id,
+						 guint		 num,
+						 time_t		 date,
+						 gboolean	 pinned);
+void		 cache_lru_remove		(CacheLru	*lru,
+						 const gchar	*folder_id,
+						 guint		 num);
+void		 cache_lru_remove_not_in_list	(CacheLru	*lru,
+						 const gchar	*folder_id,
+						 GSList		*numlist);
+void		 cache_lru_remove_folder	(CacheLru	*lru,
+						 const gchar	*folder_id);
+void		 cache_lru_rename_folder	(CacheLru	*lru,
+						 const gchar	*old_id,
+						 const gchar	*new_id);
+
+goffset		 cache_lru_total		(CacheLru	*lru);
+guint		 cache_lru_evict		(CacheLru	*lru,
+						 goffset	 target,
+						 CacheLruKeepFunc keep,
+						 CacheLruEvictFunc evict,
+						 gpointer	 data);
+
+#endif /* __CACHELRU_H__ */
@@ -0,0 +1,519 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2016 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#include "claws-features.h"
+#endif
+
+#include "defs.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "cachepack.h"
+#include "utils.h"
+
+/*
+ * The pack is two files in the cache directory. PACK_DATA holds the
+ * messages one after the other; PACK_INDEX is a journal of fixed size
+ * records, each either adding a message at some offset or dropping one.
+ * Replacing or dropping a message only leaves its bytes unused; once
+ * more of the pack is unused than used, it is compacted by rewriting
+ * both files.
+ */
+
+#define PACK_DATA	".pack"
+#define PACK_INDEX	".pack.idx"
+#define PACK_MAGIC	"CPK1"
+
+/* don't bother compacting for less than this */
+#define PACK_MIN_WASTE	(1024 * 1024)
+
+enum {
+	PACK_ADD = 1,
+	PACK_DROP = 2
+};
+
+typedef struct _PackRecord {
+	guint32 op;
+	guint32 num;
+	guint64 offset;
+	guint64 length;
+} PackRecord;
+
+typedef struct _PackEntry {
+	guint64 offset;
+	guint64 length;
+} PackEntry;
+
+struct _CachePack {
+	gchar *data_file;
+	gchar *index_file;
+	FILE *data_fp;
+	FILE *index_fp;
+	GHashTable *entries;
+	guint64 live_bytes;
+	guint64 total_bytes;
+};
+
+static gboolean cache_pack_open_files(CachePack *pack, gboolean create)
+{
+	if (create) {
+		claws_unlink(pack->data_file);
+		if ((pack->index_fp = g_fopen(pack->index_file, "wb")) == NULL) {
+			FILE_OP_ERROR(pack->index_file, "fopen");
+			return FALSE;
+		}
+		if (fwrite(PACK_MAGIC, 1, 4, pack->index_fp) != 4 ||
+		    fflush(pack->index_fp) == EOF) {
+			FILE_OP_ERROR(pack->index_file, "fwrite");
+			return FALSE;
+		}
+	} else if ((pack->index_fp = g_fopen(pack->index_file, "ab")) == NULL) {
+		FILE_OP_ERROR(pack->index_file, "fopen");
+		return FALSE;
+	}
+
+	if ((pack->data_fp = g_fopen(pack->data_file, "a+b")) == NULL) {
+		FILE_OP_ERROR(pack->data_file, "fopen");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void cache_pack_close_files(CachePack *pack)
+{
+	if (pack->index_fp)
+		fclose(pack->index_fp);
+	if (pack->data_fp)
+		fclose(pack->data_fp);
+	pack->index_fp = NULL;
+	pack->data_fp = NULL;
+}
+
+static gboolean cache_pack_read_index(CachePack *pack)
+{
+	FILE *fp;
+	gchar magic[4];
+	PackRecord rec;
+	PackEntry *entry;
+
+	if ((fp = g_fopen(pack->index_file, "rb")) == NULL)
+		return FALSE;
+
+	if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, PACK_MAGIC, 4)) {
+		fclose(fp);
+		return FALSE;
+	}
+
+	/* a record cut short by a crash is simply left out */
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+		entry = g_hash_table_lookup(pack->entries, GUINT_TO_POINTER(rec.num));
+		if (entry) {
+			pack->live_bytes -= entry->length;
+			g_hash_table_remove(pack->entries, GUINT_TO_POINTER(rec.num));
+		}
+		if (rec.op != PACK_ADD)
+			continue;
+		if (rec.offset + rec.length > pack->total_bytes)
+			continue;
+
+		entry = g_new(PackEntry, 1);
+		entry->offset = rec.offset;
+		entry->length = rec.length;
+		g_hash_table_insert(pack->entries, GUINT_TO_POINTER(rec.num), entry);
+		pack->live_bytes += entry->length;
+	}
+	fclose(fp);
+
+	return TRUE;
+}
+
+gboolean cache_pack_exists(const gchar *dir)
+{
+	gchar *index_file;
+	gboolean exists;
+
+	cm_return_val_if_fail(dir != NULL, FALSE);
+
+	index_file = g_strconcat(dir, G_DIR_SEPARATOR_S, PACK_INDEX, NULL);
+	exists = is_file_exist(index_file);
+	g_free(index_file);
+
+	return exists;
+}
+
+CachePack *cache_pack_open(const gchar *dir)
+{
+	CachePack *pack;
+	gboolean have_index;
+
+	cm_return_val_if_fail(dir != NULL, NULL);
+
+	if (!is_dir_exist(dir))
+		make_dir_hier(dir);
+
+	pack = g_new0(CachePack, 1);
+	pack->data_file = g_strconcat(dir, G_DIR_SEPARATOR_S, PACK_DATA, NULL);
+	pack->index_file = g_strconcat(dir, G_DIR_SEPARATOR_S, PACK_INDEX, NULL);
+	pack->entries = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+					      NULL, g_free);
+
+	if (is_file_exist(pack->data_file))
+		pack->total_bytes = get_file_size(pack->data_file);
+
+	/* without its index the data is of no use: start over */
+	have_index = cache_pack_read_index(pack);
+	if (!have_index) {
+		g_hash_table_remove_all(pack->entries);
+		pack->live_bytes = pack->total_bytes = 0;
+	}
+
+	if (!cache_pack_open_files(pack, !have_index)) {
+		cache_pack_close(pack);
+		return NULL;
+	}
+
+	debug_print("opened cache pack %s: %u messages, %" G_GUINT64_FORMAT
+		    " of %" G_GUINT64_FORMAT " bytes in use\n", pack->data_file,
+		    g_hash_table_size(pack->entries),
+		    pack->live_bytes, pack->total_bytes);
+
+	return pack;
+}
+
+void cache_pack_close(CachePack *pack)
+{
+	if (pack == NULL)
+		return;
+
+	cache_pack_close_files(pack);
+	g_hash_table_destroy(pack->entries);
+	g_free(pack->data_file);
+	g_free(pack->index_file);
+	g_free(pack);
+}
+
+static gint cache_pack_write_record(CachePack *pack, guint32 op, guint num,
+				    guint64 offset, guint64 length)
+{
+	PackRecord rec;
+
+	/* a failed reopen after compacting leaves no index to write to */
+	if (pack->index_fp == NULL)
+		return -1;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.op = op;
+	rec.num = num;
+	rec.offset = offset;
+	rec.length = length;
+
+	if (fwrite(&rec, sizeof(rec), 1, pack->index_fp) != 1 ||
+	    fflush(pack->index_fp) == EOF) {
+		FILE_OP_ERROR(pack->index_file, "fwrite");
+		return -1;
+	}
+
+	return 0;
+}
+
+static gint cache_pack_compare_offset(gconstpointer a, gconstpointer b,
+				      gpointer data)
+{
+	GHashTable *entries = (GHashTable *)data;
+	PackEntry *ea = g_hash_table_lookup(entries, a);
+	PackEntry *eb = g_hash_table_lookup(entries, b);
+
+	return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+/* Rewrites the pack with only the messages still in use. The old index
+ * goes first, so that a crash halfway through loses the cache rather
+ * than pairing an index with the wrong data. */
+static void cache_pack_compact(CachePack *pack)
+{
+	gchar *new_data, *new_index;
+	FILE *data_fp = NULL, *index_fp = NULL;
+	GList *nums, *cur;
+	guint64 offset = 0;
+	gboolean ok = FALSE;
+
+	if (pack->data_fp == NULL)
+		return;
+
+	debug_print("compacting cache pack %s (%" G_GUINT64_FORMAT " of %"
+		    G_GUINT64_FORMAT " bytes in use)\n", pack->data_file,
+		    pack->live_bytes, pack->total_bytes);
+
+	new_data = g_strconcat(pack->data_file, ".new", NULL);
+	new_index = g_strconcat(pack->index_file, ".new", NULL);
+
+	if ((data_fp = g_fopen(new_data, "wb")) == NULL ||
+	    (index_fp = g_fopen(new_index, "wb")) == NULL ||
+	    fwrite(PACK_MAGIC, 1, 4, index_fp) != 4)
+		goto out;
+
+	nums = g_hash_table_get_keys(pack->entries);
+	nums = g_list_sort_with_data(nums, cache_pack_compare_offset,
+				     pack->entries);
+	for (cur = nums; cur != NULL; cur = cur->next) {
+		PackEntry *entry = g_hash_table_lookup(pack->entries, cur->data);
+		PackRecord rec;
+
+		if (copy_file_part_to_fp(pack->data_fp, entry->offset,
+					 entry->length, data_fp) < 0)
+			break;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.op = PACK_ADD;
+		rec.num = GPOINTER_TO_UINT(cur->data);
+		rec.offset = offset;
+		rec.length = entry->length;
+		if (fwrite(&rec, sizeof(rec), 1, index_fp) != 1)
+			break;
+		offset += entry->length;
+	}
+	ok = (cur == NULL);
+	g_list_free(nums);
+
+out:
+	if (data_fp && fclose(data_fp) == EOF)
+		ok = FALSE;
+	if (index_fp && fclose(index_fp) == EOF)
+		ok = FALSE;
+
+	if (!ok) {
+		g_warning("couldn't compact cache pack %s", pack->data_file);
+		claws_unlink(new_data);
+		claws_unlink(new_index);
+		g_free(new_data);
+		g_free(new_index);
+		return;
+	}
+
+	cache_pack_close_files(pack);
+	claws_unlink(pack->index_file);
+	if (rename_force(new_data, pack->data_file) < 0 ||
+	    rename_force(new_index, pack->index_file) < 0) {
+		g_hash_table_remove_all(pack->entries);
+		pack->live_bytes = pack->total_bytes = 0;
+		cache_pack_open_files(pack, TRUE);
+	} else {
+		/* the entries are now back to back in offset order */
+		offset = 0;
+		nums = g_hash_table_get_keys(pack->entries);
+		nums = g_list_sort_with_data(nums, cache_pack_compare_offset,
+					     pack->entries);
+		for (cur = nums; cur != NULL; cur = cur->next) {
+			PackEntry *entry = g_hash_table_lookup(pack->entries,
+							       cur->data);
+			entry->offset = offset;
+			offset += entry->length;
+		}
+		g_list_free(nums);
+		pack->total_bytes = pack->live_bytes;
+		cache_pack_open_files(pack, FALSE);
+	}
+
+	g_free(new_data);
+	g_free(new_index);
+}
+
+static void cache_pack_maybe_compact(CachePack *pack)
+{
+	guint64 waste = pack->total_bytes - pack->live_bytes;
+
+	if (waste > PACK_MIN_WASTE && waste > pack->live_bytes)
+		cache_pack_compact(pack);
+}
+
+gboolean cache_pack_contains(CachePack *pack, guint num)
+{
+	cm_return_val_if_fail(pack != NULL, FALSE);
+
+	return g_hash_table_lookup(pack->entries, GUINT_TO_POINTER(num)) != NULL;
+}
+
+guint cache_pack_count(CachePack *pack)
+{
+	cm_return_val_if_fail(pack != NULL, 0);
+
+	return g_hash_table_size(pack->entries);
+}
+
+/* Cuts off what a failed write left after offset. The stream is closed
+ * first so that nothing still buffered lands after the cut; should the
+ * cut fail, the next message goes after those bytes all the same. */
+static void cache_pack_drop_tail(CachePack *pack, guint64 offset)
+{
+	fclose(pack->data_fp);
+	if ((pack->data_fp = g_fopen(pack->data_file, "a+b")) == NULL) {
+		FILE_OP_ERROR(pack->data_file, "fopen");
+		return;
+	}
+	if (ftruncate(fileno(pack->data_fp), (off_t)offset) < 0)
+		FILE_OP_ERROR(pack->data_file, "ftruncate");
+	pack->total_bytes = offset;
+}
+
+gint cache_pack_add_file(CachePack *pack, guint num, const gchar *file)
+{
+	FILE *fp;
+	PackEntry *entry, *old;
+	guint64 offset, length;
+	off_t pos;
+
+	cm_return_val_if_fail(pack != NULL, -1);
+	cm_return_val_if_fail(file != NULL, -1);
+
+	if (pack->data_fp == NULL || pack->index_fp == NULL)
+		return -1;
+	if ((fp = g_fopen(file, "rb")) == NULL) {
+		FILE_OP_ERROR(file, "fopen");
+		return -1;
+	}
+	length = get_file_size(file);
+
+	/* The data file is opened for appending, but the stream may last
+	 * have been read from by cache_pack_extract(), so position it
+	 * before writing; and take the offset from where the data really
+	 * ends, not from what we last knew */
+	if (fseeko(pack->data_fp, 0, SEEK_END) < 0 ||
+	    (pos = ftello(pack->data_fp)) < 0) {
+		FILE_OP_ERROR(pack->data_file, "fseeko");
+		fclose(fp);
+		return -1;
+	}
+	offset = pos;
+	if (copy_file_part_to_fp(fp, 0, length, pack->data_fp) < 0 ||
+	    fflush(pack->data_fp) == EOF) {
+		FILE_OP_ERROR(pack->data_file, "fwrite");
+		fclose(fp);
+		cache_pack_drop_tail(pack, offset);
+		return -1;
+	}
+	fclose(fp);
+	pack->total_bytes = offset + length;
+
+	if (cache_pack_write_record(pack, PACK_ADD, num, offset, length) < 0)
+		return -1;
+
+	old = g_hash_table_lookup(pack->entries, GUINT_TO_POINTER(num));
+	if (old)
+		pack->live_bytes -= old->length;
+
+	entry = g_new(PackEntry, 1);
+	entry->offset = offset;
+	entry->length = length;
+	g_hash_table_replace(pack->entries, GUINT_TO_POINTER(num), entry);
+	pack->live_bytes += length;
+
+	if (old)
+		cache_pack_maybe_compact(pack);
+
+	return 0;
+}
+
+gint cache_pack_extract(CachePack *pack, guint num, const gchar *file)
+{
+	PackEntry *entry;
+
+	cm_return_val_if_fail(pack != NULL, -1);
+	cm_return_val_if_fail(file != NULL, -1);
+
+	entry = g_hash_table_lookup(pack->entries, GUINT_TO_POINTER(num));
+	if (entry == NULL || pack->data_fp == NULL)
+		return -1;
+
+	return copy_file_part(pack->data_fp, entry->offset, entry->length, file);
+}
+
+static gint cache_pack_drop(CachePack *pack, guint num)
+{
+	PackEntry *entry;
+
+	entry = g_hash_table_lookup(pack->entries, GUINT_TO_POINTER(num));
+	if (entry == NULL)
+		return 0;
+
+	/* forgetting it without a record would bring it back on reload */
+	if (pack->index_fp == NULL)
+		return -1;
+
+	pack->live_bytes -= entry->length;
+	g_hash_table_remove(pack->entries, GUINT_TO_POINTER(num));
+	return cache_pack_write_record(pack, PACK_DROP, num, 0, 0);
+}
+
+gint cache_pack_remove(CachePack *pack, guint num)
+{
+	cm_return_val_if_fail(pack != NULL, -1);
+
+	if (cache_pack_drop(pack, num) < 0)
+		return -1;
+	cache_pack_maybe_compact(pack);
+
+	return 0;
+}
+
+void cache_pack_remove_not_in_list(CachePack *pack, GSList *numlist)
+{
+	GHashTable *wanted;
+	GHashTableIter iter;
+	GSList *cur, *unwanted = NULL;
+	gpointer key;
+
+	cm_return_if_fail(pack != NULL);
+
+	wanted = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (cur = numlist; cur != NULL; cur = cur->next)
+		g_hash_table_insert(wanted, cur->data, GINT_TO_POINTER(1));
+
+	g_hash_table_iter_init(&iter, pack->entries);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		if (g_hash_table_lookup(wanted, key) == NULL)
+			unwanted = g_slist_prepend(unwanted, key);
+	}
+	g_hash_table_destroy(wanted);
+
+	for (cur = unwanted; cur != NULL; cur = cur->next) {
+		debug_print("removing unwanted message %u from %s\n",
+			    GPOINTER_TO_UINT(cur->data), pack->data_file);
+		if (cache_pack_drop(pack, GPOINTER_TO_UINT(cur->data)) < 0)
+			break;
+	}
+	g_slist_free(unwanted);
+
+	cache_pack_maybe_compact(pack);
+}
+
+void cache_pack_remove_all(CachePack *pack)
+{
+	cm_return_if_fail(pack != NULL);
+
+	cache_pack_close_files(pack);
+	g_hash_table_remove_all(pack->entries);
+	pack->live_bytes = pack->total_bytes = 0;
+	cache_pack_open_files(pack, TRUE);
+}
@@ -0,0 +1,52 @@
+/*
+ * Claws Mail -- a GTK+ based, lightweight, and fast e-mail client
+ * Copyright (C) 2016 the Claws Mail team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef __CACHEPACK_H__
+#define __CACHEPACK_H__
+
+#ifdef HAVE_CONFIG_H
+#include "claws-features.h"
+#endif
+
+#include <glib.h>
+
+/* Message files of a cache directory kept together in one append-only
+ * pack file, with an index from message number to offset and length. */
+typedef struct _CachePack CachePack;
+
+gboolean	 cache_pack_exists		(const gchar	*dir);
+CachePack	*cache_pack_open		(const gchar	*dir);
+void		 cache_pack_close		(CachePack	*pack);
+
+gboolean	 cache_pack_contains		(CachePack	*pack,
+						 guint		 num);
+guint		 cache_pack_count		(CachePack	*pack);
+gint		 cache_pack_add_file		(CachePack	*pack,
+						 guint		 num,
+						 const gchar	*file);
+gint		 cache_pack_extract		(CachePack	*pack,
+						 guint		 num,
+						 const gchar	*file);
+gint		 cache_pack_remove		(CachePack	*pack,
+						 guint		 num);
+void		 cache_pack_remove_not_in_list	(CachePack	*pack,
+						 GSList		*numlist);
+void		 cache_pack_remove_all		(CachePack	*pack);
+
+#endif /* __CACHEPACK_H__ */
@@ -99,10 +99,14 @@
 #define OLD_MARK_FILE		".sylpheed_mark"
 #define MARK_FILE		".claws_mark"
 #define TAGS_FILE		".claws_tags"
+#define JOURNAL_FILE		".claws_journal"
 #define PRINTING_PAGE_SETUP_STORAGE_FILE "print_page_setup"
-#define CACHE_VERSION		24
+#define CACHE_VERSION		26
+#define CACHE_VERSION_STREAM	25
+#define CACHE_VERSION_UNTERMINATED	24
 #define MARK_VERSION		2
 #define TAGS_VERSION		1
+#define JOURNAL_VERSION		1
 
 #ifdef G_OS_WIN32
 #  define ACTIONS_RC		"actionswinrc"
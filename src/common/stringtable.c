@@ -109,6 +109,22 @@ void string_table_free_string(StringTable *table, const gchar *str)
 	}
 }
 
+/* Returns TRUE if str is the table's own copy, as opposed to an equal
+ * string allocated elsewhere. */
+gboolean string_table_owns_string(StringTable *table, const gchar *str)
+{
+	StringEntry *entry;
+
+	cm_return_val_if_fail(table != NULL, FALSE);
+
+	if (str == NULL)
+		return FALSE;
+
+	entry = g_hash_table_lookup(table->hash_table, str);
+
+	return entry != NULL && entry->string == str;
+}
+
 static gboolean string_table_remove_for_each_fn(gchar *key, StringEntry *entry,
 						gpointer user_data)
 {
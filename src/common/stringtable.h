@@ -30,6 +30,7 @@ void         string_table_free    (StringTable *table);
 
 gchar *string_table_insert_string (StringTable *table, const gchar *str);
 void   string_table_free_string   (StringTable *table, const gchar *str);
+gboolean string_table_owns_string (StringTable *table, const gchar *str);
 
 void   string_table_get_stats     (StringTable *table);
 
@@ -2642,8 +2642,8 @@ gint copy_file_part_to_fp(FILE *fp, off_t offset, size_t length, FILE *dest_fp)
 	gint bytes_left, to_read;
 	gchar buf[BUFSIZ];
 
-	if (fseek(fp, offset, SEEK_SET) < 0) {
-		perror("fseek");
+	if (fseeko(fp, offset, SEEK_SET) < 0) {
+		perror("fseeko");
 		return -1;
 	}
 
@@ -34,12 +34,18 @@
 #include <sys/socket.h>
 #endif
 #include <fcntl.h>
+#include <errno.h>
 #ifndef G_OS_WIN32
 #include <sys/mman.h>
 #include <sys/wait.h>
+#include <sys/select.h>
+#include <unistd.h>
 #endif
 #include <gtk/gtk.h>
 #include <log.h>
+#if defined(HAVE_LIBETPAN_PIPELINE) || defined(HAVE_LIBETPAN_MULTIAPPEND)
+#include <libetpan/mailimap_sender.h>
+#endif
 #include "etpan-thread-manager.h"
 #include "etpan-ssl.h"
 #include "utils.h"
@@ -56,6 +62,8 @@ static struct etpan_thread_manager * thread_manager = NULL;
 static chash * courier_workaround_hash = NULL;
 static chash * imap_hash = NULL;
 static chash * session_hash = NULL;
+static chash * idle_hash = NULL;
+static chash * connection_hash = NULL;
 static guint thread_manager_signal = 0;
 static GIOChannel * io_channel = NULL;
 
@@ -255,6 +263,8 @@ void imap_main_init(gboolean skip_ssl_cert_check)
 	
 	imap_hash = chash_new(CHASH_COPYKEY, CHASH_DEFAULTSIZE);
 	session_hash = chash_new(CHASH_COPYKEY, CHASH_DEFAULTSIZE);
+	idle_hash = chash_new(CHASH_COPYKEY, CHASH_DEFAULTSIZE);
+	connection_hash = chash_new(CHASH_COPYKEY, CHASH_DEFAULTSIZE);
 	courier_workaround_hash = chash_new(CHASH_COPYKEY, CHASH_DEFAULTSIZE);
 	
 	thread_manager = etpan_thread_manager_new();
@@ -293,20 +303,77 @@ void imap_main_done(gboolean have_connectivity)
 	etpan_thread_manager_free(thread_manager);
 	
 	chash_free(courier_workaround_hash);
+	chash_free(idle_hash);
+	chash_free(connection_hash);
 	chash_free(session_hash);
 	chash_free(imap_hash);
 }
 
+/* A folder may have several connections to its server, each with its
+ * own mailimap and thread. Operations go to the folder's current
+ * connection, which imap.c switches around the commands it sends. */
+struct conn_key {
+	Folder * folder;
+	int conn;
+};
+
+static void conn_key_set(chashdatum * key, struct conn_key * ck,
+			 Folder * folder, int conn)
+{
+	/* chash compares the bytes of the key, padding included */
+	memset(ck, 0, sizeof(* ck));
+	ck->folder = folder;
+	ck->conn = conn;
+
+	key->data = ck;
+	key->len = sizeof(* ck);
+}
+
+static int get_connection(Folder * folder)
+{
+	chashdatum key;
+	chashdatum value;
+	int r;
+
+	key.data = &folder;
+	key.len = sizeof(folder);
+
+	r = chash_get(connection_hash, &key, &value);
+	if (r < 0)
+		return 0;
+
+	return GPOINTER_TO_INT(value.data);
+}
+
+int imap_threaded_use_connection(Folder * folder, int conn)
+{
+	chashdatum key;
+	chashdatum value;
+	int prev;
+
+	cm_return_val_if_fail(conn >= 0 && conn < IMAP_MAX_CONNECTIONS, 0);
+
+	prev = get_connection(folder);
+
+	key.data = &folder;
+	key.len = sizeof(folder);
+	value.data = GINT_TO_POINTER(conn);
+	value.len = 0;
+	chash_set(connection_hash, &key, &value, NULL);
+
+	return prev;
+}
+
 void imap_init(Folder * folder)
 {
 	struct etpan_thread * thread;
+	struct conn_key ck;
 	chashdatum key;
 	chashdatum value;
 	
 	thread = etpan_thread_manager_get_thread(thread_manager);
 	
-	key.data = &folder;
-	key.len = sizeof(folder);
+	conn_key_set(&key, &ck, folder, get_connection(folder));
 	value.data = thread;
 	value.len = 0;
 	
@@ -316,35 +383,42 @@ void imap_init(Folder * folder)
 void imap_done(Folder * folder)
 {
 	struct etpan_thread * thread;
+	struct conn_key ck;
 	chashdatum key;
 	chashdatum value;
+	int conn;
 	int r;
 	
+	for (conn = 0; conn < IMAP_MAX_CONNECTIONS; conn++) {
+		conn_key_set(&key, &ck, folder, conn);
+
+		r = chash_get(imap_hash, &key, &value);
+		if (r < 0)
+			continue;
+
+		thread = value.data;
+
+		etpan_thread_unbind(thread);
+
+		chash_delete(imap_hash, &key, NULL);
+
+		debug_print("remove thread %d", conn);
+	}
+
 	key.data = &folder;
 	key.len = sizeof(folder);
-	
-	r = chash_get(imap_hash, &key, &value);
-	if (r < 0)
-		return;
-	
-	thread = value.data;
-	
-	etpan_thread_unbind(thread);
-	
-	chash_delete(imap_hash, &key, NULL);
-	
-	debug_print("remove thread");
+	chash_delete(connection_hash, &key, NULL);
 }
 
-static struct etpan_thread * get_thread(Folder * folder)
+static struct etpan_thread * get_thread_conn(Folder * folder, int conn)
 {
 	struct etpan_thread * thread;
+	struct conn_key ck;
 	chashdatum key;
 	chashdatum value;
 	int r;
 
-	key.data = &folder;
-	key.len = sizeof(folder);
+	conn_key_set(&key, &ck, folder, conn);
 
 	r = chash_get(imap_hash, &key, &value);
 	if (r < 0)
@@ -355,88 +429,186 @@ static struct etpan_thread * get_thread(Folder * folder)
 	return thread;
 }
 
-static mailimap * get_imap(Folder * folder)
+static struct etpan_thread * get_thread(Folder * folder)
+{
+	return get_thread_conn(folder, get_connection(folder));
+}
+
+static mailimap * get_imap_conn(Folder * folder, int conn)
 {
 	mailimap * imap;
+	struct conn_key ck;
 	chashdatum key;
 	chashdatum value;
 	int r;
 	
-	key.data = &folder;
-	key.len = sizeof(folder);
+	conn_key_set(&key, &ck, folder, conn);
 	
 	r = chash_get(session_hash, &key, &value);
 	if (r < 0)
 		return NULL;
 	
 	imap = value.data;
-	debug_print("found imap %p\n", imap);
+	debug_print("found imap %p (connection %d)\n", imap, conn);
 	return imap;
 }
 
+static mailimap * get_imap(Folder * folder)
+{
+	return get_imap_conn(folder, get_connection(folder));
+}
+
 static gboolean cb_show_error(gpointer data)
 {
 	mainwindow_show_error();
 	return FALSE;
 }
 
-static void generic_cb(int cancelled, void * result, void * callback_data)
+static void report_alert(mailimap * imap)
 {
-	struct etpan_thread_op * op;
-	
-	op = (struct etpan_thread_op *) callback_data;
-
-	debug_print("generic_cb\n");
-	if (op->imap && op->imap->imap_response_info &&
-	    op->imap->imap_response_info->rsp_alert) {
+	if (imap && imap->imap_response_info &&
+	    imap->imap_response_info->rsp_alert) {
 		log_error(LOG_PROTOCOL, "IMAP4< Alert: %s\n", 
-			op->imap->imap_response_info->rsp_alert);
+			imap->imap_response_info->rsp_alert);
 		g_timeout_add(10, cb_show_error, NULL);
 	} 
-	op->finished = 1;
 }
 
-/* Please do *not* blindly use imap pointers after this function returns,
- * someone may have deleted it while this function was waiting for completion.
- * Check return value to see if imap is still valid.
- * Run get_imap(folder) again to get a fresh and valid pointer.
- */
-static int threaded_run(Folder * folder, void * param, void * result,
-			void (* func)(struct etpan_thread_op * ))
+static void idle_stop_conn(Folder * folder, int conn);
+
+/* An operation in flight on one of the folder's connections. It is
+ * bound to the connection that was current when it was created, so
+ * that callers may go on with other work - including scheduling more
+ * operations - while it runs. */
+struct _IMAPThreadedOp {
+	Folder * folder;
+	int conn;
+	mailimap * imap;
+	void (* run)(struct etpan_thread_op * op);
+	/* called in the main thread when the run is over; returning
+	 * TRUE means the op was scheduled again */
+	gboolean (* done)(IMAPThreadedOp * aop);
+	void (* free_param)(IMAPThreadedOp * aop);
+	void * param;
+	void * result;
+	gboolean stale;
+	gboolean finished;
+	IMAPThreadedFunc func;
+	gpointer data;
+};
+
+static IMAPThreadedOp * threaded_op_new(Folder * folder,
+					void * param, void * result,
+					void (* func)(struct etpan_thread_op *),
+					IMAPThreadedFunc callback,
+					gpointer data)
+{
+	IMAPThreadedOp * aop;
+
+	aop = g_new0(IMAPThreadedOp, 1);
+	aop->folder = folder;
+	aop->conn = get_connection(folder);
+	aop->imap = get_imap_conn(folder, aop->conn);
+	aop->run = func;
+	aop->param = param;
+	aop->result = result;
+	aop->func = callback;
+	aop->data = data;
+
+	imap_folder_ref(folder);
+
+	return aop;
+}
+
+static void threaded_op_free(IMAPThreadedOp * aop)
+{
+	if (aop->free_param)
+		aop->free_param(aop);
+	imap_folder_unref(aop->folder);
+	g_free(aop);
+}
+
+static void threaded_op_cb(int cancelled, void * result, void * callback_data)
+{
+	IMAPThreadedOp * aop = callback_data;
+
+	debug_print("threaded_op_cb\n");
+	report_alert(aop->imap);
+
+	if (aop->imap != get_imap_conn(aop->folder, aop->conn)) {
+		g_warning("returning from operation on a stale imap %p", aop->imap);
+		aop->stale = TRUE;
+	} else if (aop->done && aop->done(aop)) {
+		return;
+	}
+
+	aop->finished = TRUE;
+	if (aop->func) {
+		aop->func(aop->folder, aop, aop->data);
+		threaded_op_free(aop);
+	}
+}
+
+static void threaded_op_schedule(IMAPThreadedOp * aop)
 {
 	struct etpan_thread_op * op;
 	struct etpan_thread * thread;
-	struct mailimap * imap = get_imap(folder);
-	
-	imap_folder_ref(folder);
+
+	/* an idling connection would hold up the op until the server
+	 * speaks, so hand it back first */
+	idle_stop_conn(aop->folder, aop->conn);
 
 	op = etpan_thread_op_new();
 	
-	op->imap = imap;
-	op->param = param;
-	op->result = result;
+	op->imap = aop->imap;
+	op->param = aop->param;
+	op->result = aop->result;
 	
-	op->run = func;
-	op->callback = generic_cb;
-	op->callback_data = op;
+	op->run = aop->run;
+	op->callback = threaded_op_cb;
+	op->callback_data = aop;
+	op->cleanup = etpan_thread_op_free;
 
-	thread = get_thread(folder);
+	thread = get_thread_conn(aop->folder, aop->conn);
 	etpan_thread_op_schedule(thread, op);
-	
-	while (!op->finished) {
+}
+
+/* For ops created without a callback, which the caller frees. Whatever
+ * ran in the main loop meanwhile may have switched the folder to another
+ * connection; the caller carries on with the one the op went to. */
+static void threaded_op_wait(IMAPThreadedOp * aop)
+{
+	while (!aop->finished) {
 		gtk_main_iteration();
 	}
+	if (!aop->stale)
+		imap_threaded_use_connection(aop->folder, aop->conn);
+}
+
+gboolean imap_threaded_op_is_stale(IMAPThreadedOp * aop)
+{
+	return aop->stale;
+}
 
-	etpan_thread_op_free(op);
+/* Please do *not* blindly use imap pointers after this function returns,
+ * someone may have deleted it while this function was waiting for completion.
+ * Check return value to see if imap is still valid.
+ * Run get_imap(folder) again to get a fresh and valid pointer.
+ */
+static int threaded_run(Folder * folder, void * param, void * result,
+			void (* func)(struct etpan_thread_op * ))
+{
+	IMAPThreadedOp * aop;
+	int stale;
 
-	imap_folder_unref(folder);
+	aop = threaded_op_new(folder, param, result, func, NULL, NULL);
+	threaded_op_schedule(aop);
+	threaded_op_wait(aop);
 
-	if (imap != get_imap(folder)) {
-		g_warning("returning from operation on a stale imap %p", imap);
-		return 1;
-	}
+	stale = aop->stale;
+	threaded_op_free(aop);
 
-	return 0;
+	return stale ? 1 : 0;
 }
 
 
@@ -478,6 +650,8 @@ static void threaded_delete_imap(Folder *folder, mailimap *imap)
 {
 	struct etpan_thread_op * op;
 
+	imap_threaded_idle_stop(folder);
+
 	/* No need to wait for completion, threaded_run() won't work here. */
 	op = etpan_thread_op_new();
 	op->imap = imap;
@@ -491,10 +665,10 @@ static void threaded_delete_imap(Folder *folder, mailimap *imap)
 
 static void delete_imap(Folder *folder, mailimap *imap)
 {
+	struct conn_key ck;
 	chashdatum key;
 
-	key.data = &folder;
-	key.len = sizeof(folder);
+	conn_key_set(&key, &ck, folder, get_connection(folder));
 	chash_delete(session_hash, &key, NULL);
 
 	if (!imap)
@@ -531,6 +705,7 @@ int imap_threaded_connect(Folder * folder, const char * server, int port)
 {
 	struct connect_param param;
 	struct connect_result result;
+	struct conn_key ck;
 	chashdatum key;
 	chashdatum value;
 	mailimap * imap, * oldimap;
@@ -544,8 +719,7 @@ int imap_threaded_connect(Folder * folder, const char * server, int port)
 		delete_imap(folder, oldimap);
 	}
 	
-	key.data = &folder;
-	key.len = sizeof(folder);
+	conn_key_set(&key, &ck, folder, get_connection(folder));
 	value.data = imap;
 	value.len = 0;
 	chash_set(session_hash, &key, &value, NULL);
@@ -583,6 +757,7 @@ int imap_threaded_connect_ssl(Folder * folder, const char * server, int port)
 {
 	struct connect_param param;
 	struct connect_result result;
+	struct conn_key ck;
 	chashdatum key;
 	chashdatum value;
 	mailimap * imap, * oldimap;
@@ -597,8 +772,7 @@ int imap_threaded_connect_ssl(Folder * folder, const char * server, int port)
 		delete_imap(folder, oldimap);
 	}
 
-	key.data = &folder;
-	key.len = sizeof(folder);
+	conn_key_set(&key, &ck, folder, get_connection(folder));
 	value.data = imap;
 	value.len = 0;
 	chash_set(session_hash, &key, &value, NULL);
@@ -674,110 +848,411 @@ int imap_threaded_capability(Folder *folder, struct mailimap_capability_data **
 	return result.error;
 	
 }
-	
-struct disconnect_param {
+
+struct enable_param {
 	mailimap * imap;
+	const char * capability;
 };
 
-struct disconnect_result {
+struct enable_result {
 	int error;
 };
 
-static void disconnect_run(struct etpan_thread_op * op)
+static void enable_run(struct etpan_thread_op * op)
 {
 	int r;
-	struct disconnect_param * param;
-	struct disconnect_result * result;
-	
+	struct enable_param * param;
+	struct enable_result * result;
+#ifdef HAVE_LIBETPAN_QRESYNC
+	struct mailimap_capability_data *caps, *enabled = NULL;
+	struct mailimap_capability *cap;
+	clist *cap_list;
+	clistiter *cur;
+#endif
+
 	param = op->param;
 	result = op->result;
 	
 	CHECK_IMAP();
 
-	r = mailimap_logout(param->imap);
-	
+#ifdef HAVE_LIBETPAN_QRESYNC
+	cap_list = clist_new();
+	cap = mailimap_capability_new(MAILIMAP_CAPABILITY_NAME, NULL,
+				      strdup(param->capability));
+	clist_append(cap_list, cap);
+	caps = mailimap_capability_data_new(cap_list);
+
+	r = mailimap_enable(param->imap, caps, &enabled);
+	mailimap_capability_data_free(caps);
+
+	if (r == MAILIMAP_NO_ERROR) {
+		/* the server answers with what it actually enabled */
+		r = MAILIMAP_ERROR_EXTENSION;
+		if (enabled != NULL && enabled->cap_list != NULL) {
+			for (cur = clist_begin(enabled->cap_list); cur != NULL;
+			     cur = clist_next(cur)) {
+				cap = clist_content(cur);
+				if (cap->cap_type == MAILIMAP_CAPABILITY_NAME &&
+				    !strcasecmp(cap->cap_data.cap_name, param->capability))
+					r = MAILIMAP_NO_ERROR;
+			}
+		}
+	}
+	if (enabled != NULL)
+		mailimap_capability_data_free(enabled);
+#else
+	r = MAILIMAP_ERROR_EXTENSION;
+#endif
+
 	result->error = r;
+	debug_print("imap enable run - end %i\n", r);
 }
 
-void imap_threaded_disconnect(Folder * folder)
+int imap_threaded_enable(Folder *folder, const char * capability)
 {
-	struct connect_param param;
-	struct connect_result result;
-	mailimap * imap;
+	struct enable_param param;
+	struct enable_result result;
 	
-	imap = get_imap(folder);
-	if (imap == NULL) {
-		debug_print("was disconnected\n");
-		return;
-	}
+	param.imap = get_imap(folder);
+	param.capability = capability;
 	
-	param.imap = imap;
+	threaded_run(folder, &param, &result, enable_run);
 	
-	if (threaded_run(folder, &param, &result, disconnect_run)) {
-		debug_print("imap already deleted %p\n", imap);
-	} else {
-		debug_print("deleting old imap %p\n", imap);
-		delete_imap(folder, imap);
+	debug_print("enable %s: %d\n", capability, result.error);
+
+	return result.error;
+}
+
+/* compress */
+
+#ifdef HAVE_LIBETPAN_COMPRESS
+/* A stream layer passing everything through to the one below while
+ * counting bytes. One is put under the deflate layer and one above it,
+ * so the protocol log can tell how much compression saved. */
+struct count_data {
+	mailstream_low * low;
+	guint64 bytes_read;
+	guint64 bytes_written;
+	struct count_data * wire;
+};
+
+static ssize_t count_read(mailstream_low * s, void * buf, size_t count)
+{
+	struct count_data * data = s->data;
+	ssize_t r;
+
+	r = mailstream_low_read(data->low, buf, count);
+	if (r > 0)
+		data->bytes_read += r;
+	return r;
+}
+
+static ssize_t count_write(mailstream_low * s, const void * buf, size_t count)
+{
+	struct count_data * data = s->data;
+	ssize_t r;
+
+	r = mailstream_low_write(data->low, buf, count);
+	if (r > 0)
+		data->bytes_written += r;
+	return r;
+}
+
+static int count_close(mailstream_low * s)
+{
+	struct count_data * data = s->data;
+
+	return mailstream_low_close(data->low);
+}
+
+static int count_get_fd(mailstream_low * s)
+{
+	struct count_data * data = s->data;
+
+	return mailstream_low_get_fd(data->low);
+}
+
+static void count_free(mailstream_low * s)
+{
+	struct count_data * data = s->data;
+
+	mailstream_low_free(data->low);
+	g_free(data);
+	free(s);
+}
+
+static void count_cancel(mailstream_low * s)
+{
+	struct count_data * data = s->data;
+
+	mailstream_low_cancel(data->low);
+}
+
+static struct mailstream_cancel * count_get_cancel(mailstream_low * s)
+{
+	struct count_data * data = s->data;
+
+	return mailstream_low_get_cancel(data->low);
+}
+
+static mailstream_low_driver count_driver = {
+	.mailstream_read = count_read,
+	.mailstream_write = count_write,
+	.mailstream_close = count_close,
+	.mailstream_get_fd = count_get_fd,
+	.mailstream_free = count_free,
+	.mailstream_cancel = count_cancel,
+	.mailstream_get_cancel = count_get_cancel,
+};
+
+static struct count_data * count_push(mailstream * stream)
+{
+	struct count_data * data;
+	mailstream_low * low;
+
+	data = g_new0(struct count_data, 1);
+	data->low = mailstream_get_low(stream);
+	low = mailstream_low_new(data, &count_driver);
+	if (low == NULL) {
+		g_free(data);
+		return NULL;
 	}
-	
-	debug_print("disconnect ok\n");
+	mailstream_set_low(stream, low);
+
+	return data;
 }
 
+static struct count_data * count_get(mailimap * imap)
+{
+	mailstream_low * low;
 
-struct list_param {
+	if (imap->imap_stream == NULL)
+		return NULL;
+	low = mailstream_get_low(imap->imap_stream);
+	if (low == NULL || low->driver != &count_driver)
+		return NULL;
+
+	return low->data;
+}
+#endif
+
+struct compress_param {
 	mailimap * imap;
-	const char * base;
-	const char * wildcard;
-	gboolean sub_only;
 };
 
-struct list_result {
+struct compress_result {
 	int error;
-	clist * list;
 };
 
-static void list_run(struct etpan_thread_op * op)
+static void compress_run(struct etpan_thread_op * op)
 {
-	struct list_param * param;
-	struct list_result * result;
+	struct compress_param * param;
+	struct compress_result * result;
+#ifdef HAVE_LIBETPAN_COMPRESS
+	struct count_data * wire, * plain;
 	int r;
-	clist * list;
-	
+#endif
+
 	param = op->param;
 	result = op->result;
 
 	CHECK_IMAP();
 
-	list = NULL;
-	
-	if (param->base == NULL || param->wildcard == NULL) {
-		result->list = list;
-		result->error = -1;
-		debug_print("no base or wildcard (%p %p)\n", param->base, param->wildcard);
+#ifdef HAVE_LIBETPAN_COMPRESS
+	if (param->imap->imap_stream == NULL) {
+		result->error = MAILIMAP_ERROR_BAD_STATE;
 		return;
 	}
-	if (param->sub_only)
-		r = mailimap_lsub(param->imap, param->base,
-			  param->wildcard, &list);
-	else
-		r = mailimap_list(param->imap, param->base,
-			  param->wildcard, &list);
+
+	wire = count_push(param->imap->imap_stream);
+	r = mailimap_compress(param->imap);
+	if (r == MAILIMAP_NO_ERROR && wire != NULL) {
+		plain = count_push(param->imap->imap_stream);
+		if (plain != NULL)
+			plain->wire = wire;
+	}
 	result->error = r;
-	result->list = list;
-	debug_print("imap list run - end\n");
+#else
+	result->error = MAILIMAP_ERROR_EXTENSION;
+#endif
+	debug_print("imap compress run - end %i\n", result->error);
 }
 
-int imap_threaded_list(Folder * folder, const char * base,
-		       const char * wildcard,
-		       clist ** p_result)
+int imap_threaded_compress(Folder * folder)
 {
-	struct list_param param;
-	struct list_result result;
-	
-	debug_print("imap list - begin\n");
-	
+	struct compress_param param;
+	struct compress_result result;
+
 	param.imap = get_imap(folder);
-	param.base = base;
+
+	threaded_run(folder, &param, &result, compress_run);
+
+	debug_print("compress: %d\n", result.error);
+
+	return result.error;
+}
+
+struct compress_stats_result {
+	int error;
+	guint64 plain_read;
+	guint64 plain_written;
+	guint64 wire_read;
+	guint64 wire_written;
+};
+
+static void compress_stats_run(struct etpan_thread_op * op)
+{
+	struct compress_param * param;
+	struct compress_stats_result * result;
+#ifdef HAVE_LIBETPAN_COMPRESS
+	struct count_data * plain;
+#endif
+
+	param = op->param;
+	result = op->result;
+
+	CHECK_IMAP();
+
+	result->error = MAILIMAP_ERROR_EXTENSION;
+#ifdef HAVE_LIBETPAN_COMPRESS
+	plain = count_get(param->imap);
+	if (plain != NULL && plain->wire != NULL) {
+		result->plain_read = plain->bytes_read;
+		result->plain_written = plain->bytes_written;
+		result->wire_read = plain->wire->bytes_read;
+		result->wire_written = plain->wire->bytes_written;
+		result->error = MAILIMAP_NO_ERROR;
+	}
+#endif
+}
+
+static void compress_log_stats(Folder * folder)
+{
+	struct compress_param param;
+	struct compress_stats_result result;
+
+	param.imap = get_imap(folder);
+
+	if (threaded_run(folder, &param, &result, compress_stats_run))
+		return;
+	if (result.error != MAILIMAP_NO_ERROR)
+		return;
+
+	log_print(LOG_PROTOCOL, "IMAP4 compression: received %" G_GUINT64_FORMAT
+		  " bytes (%" G_GUINT64_FORMAT " uncompressed), sent %"
+		  G_GUINT64_FORMAT " bytes (%" G_GUINT64_FORMAT " uncompressed)\n",
+		  result.wire_read, result.plain_read,
+		  result.wire_written, result.plain_written);
+}
+
+struct disconnect_param {
+	mailimap * imap;
+};
+
+struct disconnect_result {
+	int error;
+};
+
+static void disconnect_run(struct etpan_thread_op * op)
+{
+	int r;
+	struct disconnect_param * param;
+	struct disconnect_result * result;
+	
+	param = op->param;
+	result = op->result;
+	
+	CHECK_IMAP();
+
+	r = mailimap_logout(param->imap);
+	
+	result->error = r;
+}
+
+void imap_threaded_disconnect(Folder * folder)
+{
+	struct connect_param param;
+	struct connect_result result;
+	mailimap * imap;
+	
+	imap = get_imap(folder);
+	if (imap == NULL) {
+		debug_print("was disconnected\n");
+		return;
+	}
+	
+	compress_log_stats(folder);
+
+	imap = get_imap(folder);
+	if (imap == NULL)
+		return;
+	param.imap = imap;
+	
+	if (threaded_run(folder, &param, &result, disconnect_run)) {
+		debug_print("imap already deleted %p\n", imap);
+	} else {
+		debug_print("deleting old imap %p\n", imap);
+		delete_imap(folder, imap);
+	}
+	
+	debug_print("disconnect ok\n");
+}
+
+
+struct list_param {
+	mailimap * imap;
+	const char * base;
+	const char * wildcard;
+	gboolean sub_only;
+};
+
+struct list_result {
+	int error;
+	clist * list;
+};
+
+static void list_run(struct etpan_thread_op * op)
+{
+	struct list_param * param;
+	struct list_result * result;
+	int r;
+	clist * list;
+	
+	param = op->param;
+	result = op->result;
+
+	CHECK_IMAP();
+
+	list = NULL;
+	
+	if (param->base == NULL || param->wildcard == NULL) {
+		result->list = list;
+		result->error = -1;
+		debug_print("no base or wildcard (%p %p)\n", param->base, param->wildcard);
+		return;
+	}
+	if (param->sub_only)
+		r = mailimap_lsub(param->imap, param->base,
+			  param->wildcard, &list);
+	else
+		r = mailimap_list(param->imap, param->base,
+			  param->wildcard, &list);
+	result->error = r;
+	result->list = list;
+	debug_print("imap list run - end\n");
+}
+
+int imap_threaded_list(Folder * folder, const char * base,
+		       const char * wildcard,
+		       clist ** p_result)
+{
+	struct list_param param;
+	struct list_result result;
+	
+	debug_print("imap list - begin\n");
+	
+	param.imap = get_imap(folder);
+	param.base = base;
 	param.wildcard = wildcard;
 	param.sub_only = FALSE;
 
@@ -985,16 +1460,23 @@ static void status_run(struct etpan_thread_op * op)
 	debug_print("imap status run - end %i\n", r);
 }
 
-int imap_threaded_status(Folder * folder, const char * mb,
-			 struct mailimap_mailbox_data_status ** data_status,
-			 guint mask)
+static void status_free_param(IMAPThreadedOp * aop)
+{
+	struct status_param * param = aop->param;
+	struct status_result * result = aop->result;
+
+	if (result->data_status)
+		mailimap_mailbox_data_status_free(result->data_status);
+	mailimap_status_att_list_free(param->status_att_list);
+	g_free((gchar *) param->mb);
+	g_free(param);
+	g_free(result);
+}
+
+static struct mailimap_status_att_list * status_att_list_from_mask(guint mask)
 {
-	struct status_param param;
-	struct status_result result;
 	struct mailimap_status_att_list * status_att_list;
-	
-	debug_print("imap status - begin\n");
-	
+
 	status_att_list = mailimap_status_att_list_new_empty();
 	if (mask & 1 << 0) {
 		mailimap_status_att_list_add(status_att_list,
@@ -1016,18 +1498,195 @@ int imap_threaded_status(Folder * folder, const char * mb,
 		mailimap_status_att_list_add(status_att_list,
 				     MAILIMAP_STATUS_ATT_UNSEEN);
 	}
-	param.imap = get_imap(folder);
-	param.mb = mb;
-	param.status_att_list = status_att_list;
+
+	return status_att_list;
+}
+
+static IMAPThreadedOp * imap_threaded_status_async(Folder * folder,
+						   const char * mb, guint mask,
+						   IMAPThreadedFunc func,
+						   gpointer data)
+{
+	struct status_param * param;
+	struct status_result * result;
+	struct mailimap_status_att_list * status_att_list;
+	IMAPThreadedOp * aop;
 	
-	threaded_run(folder, &param, &result, status_run);
+	debug_print("imap status - begin\n");
 	
-	debug_print("imap status - end\n");
+	status_att_list = status_att_list_from_mask(mask);
+	param = g_new0(struct status_param, 1);
+	result = g_new0(struct status_result, 1);
+	param->imap = get_imap(folder);
+	param->mb = g_strdup(mb);
+	param->status_att_list = status_att_list;
 	
+	aop = threaded_op_new(folder, param, result, status_run, func, data);
+	aop->free_param = status_free_param;
+	threaded_op_schedule(aop);
+
+	return aop;
+}
+
+static int imap_threaded_status_finish(IMAPThreadedOp * aop,
+			struct mailimap_mailbox_data_status ** data_status)
+{
+	struct status_result * result = aop->result;
+
+	debug_print("imap status - end\n");
+
+	* data_status = result->data_status;
+	result->data_status = NULL;
+
+	return result->error;
+}
+
+int imap_threaded_status(Folder * folder, const char * mb,
+			 struct mailimap_mailbox_data_status ** data_status,
+			 guint mask)
+{
+	IMAPThreadedOp * aop;
+	int r;
+
+	aop = imap_threaded_status_async(folder, mb, mask, NULL, NULL);
+	threaded_op_wait(aop);
+	r = imap_threaded_status_finish(aop, data_status);
+	threaded_op_free(aop);
+
+	return r;
+}
+
+
+
+struct status_list_param {
+	mailimap * imap;
+	const char ** mbs;
+	guint count;
+	struct mailimap_status_att_list * status_att_list;
+};
+
+struct status_list_result {
+	int error;
+	struct mailimap_mailbox_data_status ** data_status;
+};
+
+#ifdef HAVE_LIBETPAN_PIPELINE
+/* How many commands go out before their answers are read, so that the
+ * server never blocks writing answers while we are still writing */
+#define STATUS_PIPELINE_DEPTH 32
+
+static int status_list_send(mailimap * imap, const char * mb,
+			    struct mailimap_status_att_list * status_att_list)
+{
+	int r;
+
+	r = mailimap_send_current_tag(imap);
+	if (r != MAILIMAP_NO_ERROR)
+		return r;
+	r = mailimap_status_send(imap->imap_stream, mb, status_att_list);
+	if (r != MAILIMAP_NO_ERROR)
+		return r;
+
+	return mailimap_crlf_send(imap->imap_stream);
+}
+
+/* Reads the answer to the command tagged tag; a NO leaves data_status
+ * NULL but the connection usable. */
+static int status_list_read(mailimap * imap, int tag,
+			    struct mailimap_mailbox_data_status ** data_status)
+{
+	struct mailimap_response * response;
+	int r, cond;
+
+	/* libetpan checks the tagged answer against the current tag */
+	imap->imap_tag = tag;
+	if (mailimap_read_line(imap) == NULL)
+		return MAILIMAP_ERROR_STREAM;
+	r = mailimap_parse_response(imap, &response);
+	if (r != MAILIMAP_NO_ERROR)
+		return r;
+
+	if (response->rsp_resp_done->rsp_type != MAILIMAP_RESP_DONE_TYPE_TAGGED) {
+		mailimap_response_free(response);
+		return MAILIMAP_ERROR_STREAM;
+	}
+	cond = response->rsp_resp_done->rsp_data.rsp_tagged->rsp_cond_state->rsp_type;
+	mailimap_response_free(response);
+
+	if (cond == MAILIMAP_RESP_COND_STATE_OK) {
+		* data_status = imap->imap_response_info->rsp_status;
+		imap->imap_response_info->rsp_status = NULL;
+	}
+
+	return MAILIMAP_NO_ERROR;
+}
+#endif
+
+static void status_list_run(struct etpan_thread_op * op)
+{
+	struct status_list_param * param;
+	struct status_list_result * result;
+#ifdef HAVE_LIBETPAN_PIPELINE
+	guint i, start, end;
+	int tag, r = MAILIMAP_NO_ERROR;
+#endif
+
+	param = op->param;
+	result = op->result;
+
+	CHECK_IMAP();
+
+#ifdef HAVE_LIBETPAN_PIPELINE
+	for (start = 0; start < param->count && r == MAILIMAP_NO_ERROR;
+	     start = end) {
+		end = MIN(start + STATUS_PIPELINE_DEPTH, param->count);
+		tag = param->imap->imap_tag + 1;
+
+		for (i = start; i < end && r == MAILIMAP_NO_ERROR; i++)
+			r = status_list_send(param->imap, param->mbs[i],
+					     param->status_att_list);
+		if (r == MAILIMAP_NO_ERROR &&
+		    mailstream_flush(param->imap->imap_stream) == -1)
+			r = MAILIMAP_ERROR_STREAM;
+
+		for (i = start; i < end && r == MAILIMAP_NO_ERROR; i++)
+			r = status_list_read(param->imap, tag + i - start,
+					     &result->data_status[i]);
+	}
+
+	result->error = r;
+	debug_print("imap status list run - end %i\n", r);
+#else
+	result->error = MAILIMAP_ERROR_EXTENSION;
+#endif
+}
+
+/* STATUS of several mailboxes, the commands sent without waiting for
+ * each answer. data_status gets one entry per mailbox, NULL for those
+ * the server refused; the caller frees it and its entries. */
+int imap_threaded_status_list(Folder * folder, const char ** mbs, guint count,
+			      guint mask,
+			      struct mailimap_mailbox_data_status *** data_status)
+{
+	struct status_list_param param;
+	struct status_list_result result;
+
+	debug_print("imap status list - begin\n");
+
+	param.imap = get_imap(folder);
+	param.mbs = mbs;
+	param.count = count;
+	param.status_att_list = status_att_list_from_mask(mask);
+	result.error = MAILIMAP_ERROR_STREAM;
+	result.data_status = g_new0(struct mailimap_mailbox_data_status *,
+				    MAX(count, 1));
+
+	threaded_run(folder, &param, &result, status_list_run);
+	mailimap_status_att_list_free(param.status_att_list);
+
+	debug_print("imap status list - end\n");
+
 	* data_status = result.data_status;
-	
-	mailimap_status_att_list_free(status_att_list);
-	
 	return result.error;
 }
 
@@ -1322,12 +1981,84 @@ int imap_threaded_delete(Folder * folder, const char * mb)
 struct select_param {
 	mailimap * imap;
 	const char * mb;
+	gboolean condstore;
 };
 
 struct select_result {
 	int error;
+	uint64_t highest_modseq;
+	gint exists;
+	gint recent;
+	gint unseen;
+	guint32 uid_validity;
+	gint can_create_flags;
+	GSList * ok_flags;
 };
 
+/* The selection info is copied out here, in the thread, as the next op
+ * on the connection may well be selecting something else by the time
+ * the main loop gets to look at it. */
+static void select_get_info(mailimap * imap, struct select_result * result)
+{
+	clistiter *cur = NULL;
+
+	result->exists = imap->imap_selection_info->sel_exists;
+	result->recent = imap->imap_selection_info->sel_recent;
+	result->unseen = imap->imap_selection_info->sel_unseen;
+	result->uid_validity = imap->imap_selection_info->sel_uidvalidity;
+	result->can_create_flags = FALSE;
+	result->ok_flags = NULL;
+
+	if (imap->imap_selection_info->sel_perm_flags)
+		cur = clist_begin(imap->imap_selection_info->sel_perm_flags);
+
+	for (; cur; cur = clist_next(cur)) {
+		struct mailimap_flag_perm *flag = (struct mailimap_flag_perm *)clist_content(cur);
+		if (flag->fl_type == MAILIMAP_FLAG_PERM_ALL)
+			result->can_create_flags = TRUE;
+		else if (flag->fl_flag && 
+				flag->fl_flag->fl_type == 6 &&
+				!strcmp(flag->fl_flag->fl_data.fl_extension, "*"))
+			result->can_create_flags = TRUE; 
+		if (flag->fl_flag) {
+			MsgPermFlags c_flag = 0;
+			switch (flag->fl_flag->fl_type) {
+			case MAILIMAP_FLAG_ANSWERED:
+				c_flag = IMAP_FLAG_ANSWERED;
+				break;
+			case MAILIMAP_FLAG_FLAGGED:
+				c_flag = IMAP_FLAG_FLAGGED;
+				break;
+			case MAILIMAP_FLAG_DELETED:
+				c_flag = IMAP_FLAG_DELETED;
+				break;
+			case MAILIMAP_FLAG_DRAFT:
+				c_flag = IMAP_FLAG_DRAFT;
+				break;
+			case MAILIMAP_FLAG_SEEN:
+				c_flag = IMAP_FLAG_SEEN;
+				break;
+			case MAILIMAP_FLAG_KEYWORD:
+				if (!strcasecmp(flag->fl_flag->fl_data.fl_keyword, RTAG_FORWARDED))
+					c_flag = IMAP_FLAG_FORWARDED;
+				if (!strcasecmp(flag->fl_flag->fl_data.fl_keyword, RTAG_JUNK))
+					c_flag = IMAP_FLAG_SPAM;
+				if (!strcasecmp(flag->fl_flag->fl_data.fl_keyword, RTAG_NON_JUNK) ||
+				    !strcasecmp(flag->fl_flag->fl_data.fl_keyword, RTAG_NO_JUNK) ||
+				    !strcasecmp(flag->fl_flag->fl_data.fl_keyword, RTAG_NOT_JUNK))
+					c_flag = IMAP_FLAG_HAM;
+				break;
+			default:
+				break;
+			}
+			if (c_flag != 0) {
+				result->ok_flags = g_slist_prepend(result->ok_flags, 
+					GUINT_TO_POINTER(c_flag));
+			}
+		}
+	}
+}
+
 static void select_run(struct etpan_thread_op * op)
 {
 	struct select_param * param;
@@ -1339,99 +2070,111 @@ static void select_run(struct etpan_thread_op * op)
 
 	CHECK_IMAP();
 
-	r = mailimap_select(param->imap, param->mb);
+	result->highest_modseq = 0;
+#ifdef HAVE_LIBETPAN_QRESYNC
+	if (param->condstore)
+		r = mailimap_select_condstore(param->imap, param->mb,
+					      &result->highest_modseq);
+	else
+#endif
+		r = mailimap_select(param->imap, param->mb);
 	
-	result->error = r;
+	if (r == MAILIMAP_NO_ERROR) {
+		if (param->imap->imap_selection_info == NULL)
+			r = MAILIMAP_ERROR_PARSE;
+		else
+			select_get_info(param->imap, result);
+	}
+
+	result->error = r;
 	debug_print("imap select run - end %i\n", r);
 }
 
-int imap_threaded_select(Folder * folder, const char * mb,
-			 gint * exists, gint * recent, gint * unseen,
-			 guint32 * uid_validity,gint *can_create_flags,
-			 GSList **ok_flags)
+static void select_free_param(IMAPThreadedOp * aop)
 {
-	struct select_param param;
-	struct select_result result;
-	mailimap * imap;
+	struct select_param * param = aop->param;
+	struct select_result * result = aop->result;
+
+	g_slist_free(result->ok_flags);
+	g_free((gchar *) param->mb);
+	g_free(param);
+	g_free(result);
+}
+
+static IMAPThreadedOp * imap_threaded_select_async(Folder * folder,
+						   const char * mb,
+						   gboolean condstore,
+						   IMAPThreadedFunc func,
+						   gpointer data)
+{
+	struct select_param * param;
+	struct select_result * result;
+	IMAPThreadedOp * aop;
 
 	debug_print("imap select - begin\n");
 	
-	imap = get_imap(folder);
-	param.imap = imap;
-	param.mb = mb;
+	param = g_new0(struct select_param, 1);
+	result = g_new0(struct select_result, 1);
+	param->imap = get_imap(folder);
+	param->mb = g_strdup(mb);
+	param->condstore = condstore;
 	
-	if (threaded_run(folder, &param, &result, select_run))
+	aop = threaded_op_new(folder, param, result, select_run, func, data);
+	aop->free_param = select_free_param;
+	threaded_op_schedule(aop);
+
+	return aop;
+}
+
+static int imap_threaded_select_finish(IMAPThreadedOp * aop,
+				       gint * exists, gint * recent, gint * unseen,
+				       guint32 * uid_validity,
+				       gint * can_create_flags,
+				       GSList ** ok_flags, guint64 * highest_modseq)
+{
+	struct select_result * result = aop->result;
+
+	if (aop->stale)
 		return MAILIMAP_ERROR_INVAL;
 
-	if (result.error != MAILIMAP_NO_ERROR)
-		return result.error;
+	if (result->error != MAILIMAP_NO_ERROR)
+		return result->error;
 	
-	if (!imap || imap->imap_selection_info == NULL)
-		return MAILIMAP_ERROR_PARSE;
+	if (highest_modseq)
+		* highest_modseq = result->highest_modseq;
 	
-	* exists = imap->imap_selection_info->sel_exists;
-	* recent = imap->imap_selection_info->sel_recent;
-	* unseen = imap->imap_selection_info->sel_unseen;
-	* uid_validity = imap->imap_selection_info->sel_uidvalidity;
-	* can_create_flags = FALSE;
-
-	if (imap->imap_selection_info->sel_perm_flags) {
-		GSList *t_flags = NULL;
-		clistiter *cur = NULL;
-		if (imap->imap_selection_info->sel_perm_flags)
-			cur = clist_begin(imap->imap_selection_info->sel_perm_flags);
-
-		for (; cur; cur = clist_next(cur)) {
-			struct mailimap_flag_perm *flag = (struct mailimap_flag_perm *)clist_content(cur);
-			if (flag->fl_type == MAILIMAP_FLAG_PERM_ALL)
-				*can_create_flags = TRUE;
-			else if (flag->fl_flag && 
-					flag->fl_flag->fl_type == 6 &&
-					!strcmp(flag->fl_flag->fl_data.fl_extension, "*"))
-				*can_create_flags = TRUE; 
-			if (flag->fl_flag && ok_flags) {
-				MsgPermFlags c_flag = 0;
-				switch (flag->fl_flag->fl_type) {
-				case MAILIMAP_FLAG_ANSWERED:
-					c_flag = IMAP_FLAG_ANSWERED;
-					break;
-				case MAILIMAP_FLAG_FLAGGED:
-					c_flag = IMAP_FLAG_FLAGGED;
-					break;
-				case MAILIMAP_FLAG_DELETED:
-					c_flag = IMAP_FLAG_DELETED;
-					break;
-				case MAILIMAP_FLAG_DRAFT:
-					c_flag = IMAP_FLAG_DRAFT;
-					break;
-				case MAILIMAP_FLAG_SEEN:
-					c_flag = IMAP_FLAG_SEEN;
-					break;
-				case MAILIMAP_FLAG_KEYWORD:
-					if (!strcasecmp(flag->fl_flag->fl_data.fl_keyword, RTAG_FORWARDED))
-						c_flag = IMAP_FLAG_FORWARDED;
-					if (!strcasecmp(flag->fl_flag->fl_data.fl_keyword, RTAG_JUNK))
-						c_flag = IMAP_FLAG_SPAM;
-					if (!strcasecmp(flag->fl_flag->fl_data.fl_keyword, RTAG_NON_JUNK) ||
-					    !strcasecmp(flag->fl_flag->fl_data.fl_keyword, RTAG_NO_JUNK) ||
-					    !strcasecmp(flag->fl_flag->fl_data.fl_keyword, RTAG_NOT_JUNK))
-						c_flag = IMAP_FLAG_HAM;
-					break;
-				default:
-					break;
-				}
-				if (c_flag != 0) {
-					t_flags = g_slist_prepend(t_flags, 
-						GUINT_TO_POINTER(c_flag));
-				}
-			}
-		}
-		if (ok_flags)
-			*ok_flags = t_flags;
+	* exists = result->exists;
+	* recent = result->recent;
+	* unseen = result->unseen;
+	* uid_validity = result->uid_validity;
+	* can_create_flags = result->can_create_flags;
+
+	if (ok_flags) {
+		* ok_flags = result->ok_flags;
+		result->ok_flags = NULL;
 	}
 	debug_print("imap select - end\n");
 	
-	return result.error;
+	return result->error;
+}
+
+int imap_threaded_select(Folder * folder, const char * mb,
+			 gint * exists, gint * recent, gint * unseen,
+			 guint32 * uid_validity,gint *can_create_flags,
+			 GSList **ok_flags, guint64 * highest_modseq)
+{
+	IMAPThreadedOp * aop;
+	int r;
+
+	aop = imap_threaded_select_async(folder, mb, highest_modseq != NULL,
+					 NULL, NULL);
+	threaded_op_wait(aop);
+	r = imap_threaded_select_finish(aop, exists, recent, unseen,
+					uid_validity, can_create_flags,
+					ok_flags, highest_modseq);
+	threaded_op_free(aop);
+
+	return r;
 }
 
 static void close_run(struct etpan_thread_op * op)
@@ -1690,6 +2433,95 @@ int imap_threaded_search(Folder * folder, int search_type, IMAPSearchKey* key,
 }
 
 
+struct sort_param {
+	mailimap * imap;
+	int sort_key;
+};
+
+struct sort_result {
+	int error;
+	clist * sort_result;
+};
+
+/* RFC 5256 UID SORT over the whole mailbox, ascending; the result is a
+ * list of UIDs like that of a search */
+static void sort_run(struct etpan_thread_op * op)
+{
+	struct sort_param * param;
+	struct sort_result * result;
+#ifdef HAVE_LIBETPAN_SORT
+	int r;
+	struct mailimap_sort_key * sort_key = NULL;
+	struct mailimap_search_key * search_key;
+	clist * sort_result = NULL;
+#endif
+
+	param = op->param;
+	result = op->result;
+
+	CHECK_IMAP();
+
+	result->sort_result = NULL;
+#ifdef HAVE_LIBETPAN_SORT
+	switch (param->sort_key) {
+	case IMAP_SORT_DATE:
+		sort_key = mailimap_sort_key_new_date(FALSE);
+		break;
+	case IMAP_SORT_SIZE:
+		sort_key = mailimap_sort_key_new_size(FALSE);
+		break;
+	case IMAP_SORT_SUBJECT:
+		sort_key = mailimap_sort_key_new_subject(FALSE);
+		break;
+	}
+	if (sort_key == NULL) {
+		result->error = MAILIMAP_ERROR_MEMORY;
+		return;
+	}
+	search_key = mailimap_search_key_new_all();
+
+	mailstream_logger = imap_logger_uid;
+
+	r = mailimap_uid_sort(param->imap, "UTF-8", sort_key, search_key,
+			      &sort_result);
+
+	mailstream_logger = imap_logger_cmd;
+
+	mailimap_sort_key_free(sort_key);
+	mailimap_search_key_free(search_key);
+
+	result->error = r;
+	if (r == MAILIMAP_NO_ERROR)
+		result->sort_result = sort_result;
+	debug_print("imap sort run - end %i\n", r);
+#else
+	result->error = MAILIMAP_ERROR_EXTENSION;
+#endif
+}
+
+int imap_threaded_sort(Folder * folder, int sort_key, clist ** sort_result)
+{
+	struct sort_param param;
+	struct sort_result result;
+
+	debug_print("imap sort - begin\n");
+
+	param.imap = get_imap(folder);
+	param.sort_key = sort_key;
+
+	threaded_run(folder, &param, &result, sort_run);
+
+	if (result.error != MAILIMAP_NO_ERROR)
+		return result.error;
+
+	debug_print("imap sort - end\n");
+
+	* sort_result = result.sort_result;
+
+	return result.error;
+}
+
+
 struct _IMAPSearchKey {
 	struct mailimap_search_key* key;
 };
@@ -2139,7 +2971,10 @@ result_to_uid_flags_list(clist * fetch_result, carray ** result)
 
 static int imap_get_messages_flags_list(mailimap * imap,
 					uint32_t first_index,
-					carray ** result)
+					uint64_t changedsince,
+					gboolean want_vanished,
+					carray ** result,
+					struct mailimap_set ** vanished)
 {
 	carray * env_list;
 	int r;
@@ -2189,8 +3024,31 @@ static int imap_get_messages_flags_list(mailimap * imap,
 
 	mailstream_logger = imap_logger_fetch;
 	
-	r = mailimap_uid_fetch(imap, set,
-			       fetch_type, &fetch_result);
+	if (changedsince == 0) {
+		r = mailimap_uid_fetch(imap, set,
+				       fetch_type, &fetch_result);
+	} else {
+#ifdef HAVE_LIBETPAN_QRESYNC
+		struct mailimap_qresync_vanished * qr_vanished = NULL;
+
+		if (want_vanished) {
+			r = mailimap_uid_fetch_qresync(imap, set, fetch_type,
+						       changedsince, &fetch_result,
+						       &qr_vanished);
+			if (r == MAILIMAP_NO_ERROR && qr_vanished != NULL) {
+				* vanished = qr_vanished->qr_known_uids;
+				qr_vanished->qr_known_uids = NULL;
+			}
+			if (qr_vanished != NULL)
+				mailimap_qresync_vanished_free(qr_vanished);
+		} else {
+			r = mailimap_uid_fetch_changedsince(imap, set, fetch_type,
+							    changedsince, &fetch_result);
+		}
+#else
+		r = MAILIMAP_ERROR_EXTENSION;
+#endif
+	}
 
 	mailstream_logger = imap_logger_cmd;
 	mailimap_fetch_type_free(fetch_type);
@@ -2233,7 +3091,7 @@ static void fetch_uid_flags_run(struct etpan_thread_op * op)
 
 	fetch_result = NULL;
 	r = imap_get_messages_flags_list(param->imap, param->first_index,
-					 &fetch_result);
+					 0, FALSE, &fetch_result, NULL);
 	
 	result->error = r;
 	result->fetch_result = fetch_result;
@@ -2272,6 +3130,80 @@ int imap_threaded_fetch_uid_flags(Folder * folder, uint32_t first_index,
 }
 
 
+struct fetch_changed_flags_param {
+	mailimap * imap;
+	uint64_t modseq;
+	gboolean vanished;
+};
+
+struct fetch_changed_flags_result {
+	int error;
+	carray * fetch_result;
+	struct mailimap_set * vanished;
+};
+
+static void fetch_changed_flags_run(struct etpan_thread_op * op)
+{
+	struct fetch_changed_flags_param * param;
+	struct fetch_changed_flags_result * result;
+	int r;
+	
+	param = op->param;
+	result = op->result;
+
+	CHECK_IMAP();
+
+	result->fetch_result = NULL;
+	result->vanished = NULL;
+	r = imap_get_messages_flags_list(param->imap, 1, param->modseq,
+					 param->vanished, &result->fetch_result,
+					 &result->vanished);
+	
+	result->error = r;
+	debug_print("imap fetch_changed_flags run - end %i\n", r);
+}
+
+/* UID FETCH 1:* (FLAGS) (CHANGEDSINCE modseq [VANISHED]), as of RFC 7162.
+ * The result has the layout of imap_threaded_fetch_uid_flags()'s; with
+ * vanished set, the UIDs expunged since modseq are returned as well and
+ * must be freed with mailimap_set_free(). */
+int imap_threaded_fetch_uid_flags_changedsince(Folder * folder, guint64 modseq,
+					       gboolean vanished,
+					       carray ** fetch_result,
+					       struct mailimap_set ** vanished_uids)
+{
+	struct fetch_changed_flags_param param;
+	struct fetch_changed_flags_result result;
+	mailimap * imap;
+	
+	debug_print("imap fetch_changed_flags - begin\n");
+	
+	imap = get_imap(folder);
+	param.imap = imap;
+	param.modseq = modseq;
+	param.vanished = vanished;
+	
+	mailstream_logger = imap_logger_noop;
+	log_print(LOG_PROTOCOL, "IMAP4- [fetching flags changed since %" G_GUINT64_FORMAT "...]\n", modseq);
+
+	threaded_run(folder, &param, &result, fetch_changed_flags_run);
+
+	mailstream_logger = imap_logger_cmd;
+
+	if (result.error != MAILIMAP_NO_ERROR)
+		return result.error;
+	
+	debug_print("imap fetch_changed_flags - end\n");
+	
+	* fetch_result = result.fetch_result;
+	if (vanished_uids)
+		* vanished_uids = result.vanished;
+	else if (result.vanished)
+		mailimap_set_free(result.vanished);
+	
+	return result.error;
+}
+
 void imap_fetch_uid_flags_list_free(carray * uid_flags_list)
 {
 	unsigned int i;
@@ -2515,6 +3447,37 @@ struct fetch_content_result {
 	int error;
 };
 
+static int imap_save_content(const char * filename,
+			     const char * content, size_t content_size)
+{
+	int fd;
+	FILE * f;
+
+	fd = g_open(filename, O_RDWR | O_CREAT, 0600);
+	if (fd < 0)
+		return MAILIMAP_ERROR_FETCH;
+	
+	f = fdopen(fd, "wb");
+	if (f == NULL) {
+		close(fd);
+		goto unlink;
+	}
+	
+	if (fwrite(content, 1, content_size, f) < content_size) {
+		fclose(f);
+		goto unlink;
+	}
+	
+	if (fclose(f) == EOF)
+		goto unlink;
+
+	return MAILIMAP_NO_ERROR;
+
+unlink:
+	claws_unlink(filename);
+	return MAILIMAP_ERROR_FETCH;
+}
+
 static void fetch_content_run(struct etpan_thread_op * op)
 {
 	struct fetch_content_param * param;
@@ -2522,8 +3485,6 @@ static void fetch_content_run(struct etpan_thread_op * op)
 	char * content;
 	size_t content_size;
 	int r;
-	int fd;
-	FILE * f;
 	
 	param = op->param;
 	result = op->result;
@@ -2542,40 +3503,8 @@ static void fetch_content_run(struct etpan_thread_op * op)
 	result->error = r;
 	
 	if (r == MAILIMAP_NO_ERROR) {
-		fd = g_open(param->filename, O_RDWR | O_CREAT, 0600);
-		if (fd < 0) {
-			result->error = MAILIMAP_ERROR_FETCH;
-			goto free;
-		}
-		
-		f = fdopen(fd, "wb");
-		if (f == NULL) {
-			result->error = MAILIMAP_ERROR_FETCH;
-			goto close;
-		}
-		
-		r = fwrite(content, 1, content_size, f);
-		if (r < content_size) {
-			result->error = MAILIMAP_ERROR_FETCH;
-			goto fclose;
-		}
-		
-		r = fclose(f);
-		if (r == EOF) {
-			result->error = MAILIMAP_ERROR_FETCH;
-			goto unlink;
-		}
-		goto free;
-		
-	fclose:
-		fclose(f);
-		goto unlink;
-	close:
-		close(fd);
-	unlink:
-		claws_unlink(param->filename);
-	
-	free:
+		result->error = imap_save_content(param->filename,
+						  content, content_size);
 		/* mmap_string_unref is a simple free in libetpan
 		 * when it has MMAP_UNAVAILABLE defined */
 		if (mmap_string_unref(content) != 0)
@@ -2612,73 +3541,748 @@ int imap_threaded_fetch_content(Folder * folder, uint32_t msg_index,
 }
 
 
+struct fetch_bodies_param {
+	mailimap * imap;
+	struct mailimap_set * set;
+	GHashTable * filenames;
+};
 
-static int imap_flags_to_flags(struct mailimap_msg_att_dynamic * att_dyn, GSList **s_tags)
+struct fetch_bodies_result {
+	int error;
+	guint count;
+};
+
+/* Writes out the body of one message of a batch and drops it, so that
+ * only one literal at a time is held in memory. */
+static void fetch_bodies_save(struct mailimap_msg_att * msg_att,
+			      struct fetch_bodies_param * param,
+			      struct fetch_bodies_result * result)
 {
-	int flags;
-	clist * flag_list;
+	struct mailimap_msg_att_body_section * body = NULL;
 	clistiter * cur;
-	GSList *tags = NULL;
+	uint32_t uid = 0;
+	const char * filename;
 
-	flags = MSG_UNREAD;
-	
-	flag_list = att_dyn->att_list;
-	if (flag_list == NULL)
-		return flags;
-	
-	for(cur = clist_begin(flag_list) ; cur != NULL ;
-	    cur = clist_next(cur)) {
-		struct mailimap_flag_fetch * flag_fetch;
-			
-		flag_fetch = clist_content(cur);
-		if (flag_fetch->fl_type == MAILIMAP_FLAG_FETCH_RECENT)
-			flags |= MSG_NEW;
-		else {
-			switch (flag_fetch->fl_flag->fl_type) {
-			case MAILIMAP_FLAG_ANSWERED:
-				flags |= MSG_REPLIED;
-				break;
-			case MAILIMAP_FLAG_FLAGGED:
-				flags |= MSG_MARKED;
-				break;
-			case MAILIMAP_FLAG_DELETED:
-				flags |= MSG_DELETED;
-				break;
-			case MAILIMAP_FLAG_SEEN:
-				flags &= ~MSG_UNREAD;
-				flags &= ~MSG_NEW;
-				break;
-			case MAILIMAP_FLAG_KEYWORD:
-				if (!strcasecmp(flag_fetch->fl_flag->fl_data.fl_keyword, RTAG_FORWARDED))
-					flags |= MSG_FORWARDED;
-				else if (!strcasecmp(flag_fetch->fl_flag->fl_data.fl_keyword, RTAG_JUNK)) 
-					flags |= MSG_SPAM;
-				else if (!strcasecmp(flag_fetch->fl_flag->fl_data.fl_keyword, RTAG_NON_JUNK) ||
-					 !strcasecmp(flag_fetch->fl_flag->fl_data.fl_keyword, RTAG_NO_JUNK) ||
-					 !strcasecmp(flag_fetch->fl_flag->fl_data.fl_keyword, RTAG_NOT_JUNK)) 
-					flags &= ~MSG_SPAM;
-				else if (s_tags)
-					tags = g_slist_prepend(tags, g_strdup(flag_fetch->fl_flag->fl_data.fl_keyword));
-				break;
-			}
-		}
+	if (msg_att->att_list)
+		cur = clist_begin(msg_att->att_list);
+	else
+		cur = NULL;
+
+	for (; cur != NULL; cur = clist_next(cur)) {
+		struct mailimap_msg_att_item * item = clist_content(cur);
+
+		if (item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC)
+			continue;
+		if (item->att_data.att_static->att_type == MAILIMAP_MSG_ATT_UID)
+			uid = item->att_data.att_static->att_data.att_uid;
+		else if (item->att_data.att_static->att_type ==
+			 MAILIMAP_MSG_ATT_BODY_SECTION)
+			body = item->att_data.att_static->att_data.att_body_section;
 	}
-	if (s_tags)
-		*s_tags = tags;
-	return flags;
+
+	if (uid == 0 || body == NULL || body->sec_body_part == NULL)
+		return;
+
+	filename = g_hash_table_lookup(param->filenames, GUINT_TO_POINTER(uid));
+	if (filename != NULL &&
+	    imap_save_content(filename, body->sec_body_part,
+			      body->sec_length) == MAILIMAP_NO_ERROR)
+		result->count++;
+
+	if (mmap_string_unref(body->sec_body_part) != 0)
+		free(body->sec_body_part);
+	body->sec_body_part = NULL;
 }
 
-static int imap_get_msg_att_info(struct mailimap_msg_att * msg_att,
-				 uint32_t * puid,
-				 char ** pheaders,
-				 size_t * pref_size,
-				 struct mailimap_msg_att_dynamic ** patt_dyn)
+#ifdef HAVE_LIBETPAN_MSG_ATT_HANDLER
+static void fetch_bodies_handler(struct mailimap_msg_att * msg_att,
+				 void * context)
 {
-  clistiter * item_cur;
-  uint32_t uid;
-  char * headers;
-  size_t ref_size;
-  struct mailimap_msg_att_dynamic * att_dyn;
+	struct etpan_thread_op * op = context;
+
+	fetch_bodies_save(msg_att, op->param, op->result);
+}
+#endif
+
+static void fetch_bodies_run(struct etpan_thread_op * op)
+{
+	struct fetch_bodies_param * param;
+	struct fetch_bodies_result * result;
+	struct mailimap_fetch_type * fetch_type;
+	struct mailimap_section * section;
+	clist * fetch_result = NULL;
+	clistiter * cur;
+	int r;
+
+	param = op->param;
+	result = op->result;
+
+	CHECK_IMAP();
+
+	fetch_type = mailimap_fetch_type_new_fetch_att_list_empty();
+	mailimap_fetch_type_new_fetch_att_list_add(fetch_type,
+			mailimap_fetch_att_new_uid());
+	section = mailimap_section_new(NULL);
+	mailimap_fetch_type_new_fetch_att_list_add(fetch_type,
+			mailimap_fetch_att_new_body_peek_section(section));
+
+	/* with a handler, each message is written out as soon as it
+	 * has been parsed rather than once the whole batch is in */
+#ifdef HAVE_LIBETPAN_MSG_ATT_HANDLER
+	mailimap_set_msg_att_handler(param->imap, fetch_bodies_handler, op);
+#endif
+	mailstream_logger = imap_logger_fetch;
+
+	r = mailimap_uid_fetch(param->imap, param->set, fetch_type,
+			       &fetch_result);
+
+	mailstream_logger = imap_logger_cmd;
+#ifdef HAVE_LIBETPAN_MSG_ATT_HANDLER
+	mailimap_set_msg_att_handler(param->imap, NULL, NULL);
+#endif
+	mailimap_fetch_type_free(fetch_type);
+
+	if (r == MAILIMAP_NO_ERROR && fetch_result != NULL) {
+		for (cur = clist_begin(fetch_result); cur; cur = clist_next(cur))
+			fetch_bodies_save(clist_content(cur), param, result);
+	}
+	if (fetch_result != NULL)
+		mailimap_fetch_list_free(fetch_result);
+
+	result->error = r;
+	debug_print("imap fetch_bodies run - end %i, %u saved\n",
+		    r, result->count);
+}
+
+/* Fetches the full bodies of the messages in set with a single command,
+ * saving each to the file filenames maps its UID to. */
+int imap_threaded_fetch_bodies(Folder * folder, struct mailimap_set * set,
+			       GHashTable * filenames, guint * count)
+{
+	struct fetch_bodies_param param;
+	struct fetch_bodies_result result;
+
+	debug_print("imap fetch_bodies - begin\n");
+
+	param.imap = get_imap(folder);
+	param.set = set;
+	param.filenames = filenames;
+	result.error = MAILIMAP_NO_ERROR;
+	result.count = 0;
+
+	if (threaded_run(folder, &param, &result, fetch_bodies_run))
+		return MAILIMAP_ERROR_INVAL;
+
+	debug_print("imap fetch_bodies - end\n");
+
+	if (count)
+		* count = result.count;
+
+	return result.error;
+}
+
+/* partial fetch */
+
+struct partial_chunk {
+	gchar * literal;
+	gchar * section;
+};
+
+struct partial_plan {
+	GSList * chunks;
+	GSList * sections;
+	guint32 inline_max;
+	guint omitted;
+};
+
+static void partial_add_literal(struct partial_plan * plan, gchar * literal)
+{
+	struct partial_chunk * chunk = g_new0(struct partial_chunk, 1);
+
+	chunk->literal = literal;
+	plan->chunks = g_slist_prepend(plan->chunks, chunk);
+}
+
+static void partial_add_section(struct partial_plan * plan, gchar * section)
+{
+	struct partial_chunk * chunk = g_new0(struct partial_chunk, 1);
+
+	chunk->section = section;
+	plan->chunks = g_slist_prepend(plan->chunks, chunk);
+	plan->sections = g_slist_prepend(plan->sections, section);
+}
+
+static void partial_plan_free(struct partial_plan * plan)
+{
+	GSList * cur;
+
+	for (cur = plan->chunks; cur; cur = cur->next) {
+		struct partial_chunk * chunk = cur->data;
+		g_free(chunk->literal);
+		g_free(chunk->section);
+		g_free(chunk);
+	}
+	g_slist_free(plan->chunks);
+	g_slist_free(plan->sections);
+}
+
+static const char * partial_get_boundary(struct mailimap_body_type_mpart * mpart)
+{
+	clistiter * cur;
+
+	if (mpart->bd_ext_mpart == NULL || mpart->bd_ext_mpart->bd_parameter == NULL)
+		return NULL;
+
+	for (cur = clist_begin(mpart->bd_ext_mpart->bd_parameter->pa_list);
+	     cur; cur = clist_next(cur)) {
+		struct mailimap_single_body_fld_param * param = clist_content(cur);
+		if (!strcasecmp(param->pa_name, "boundary"))
+			return param->pa_value;
+	}
+	return NULL;
+}
+
+/* Lays out the message as it will be written: our own boundary lines
+ * around sections fetched from the server. Parts too big to be worth
+ * fetching up front are left out, keeping just their MIME headers.
+ * Returns FALSE if the message cannot be rebuilt that way. */
+static gboolean partial_plan_body(struct partial_plan * plan,
+				  struct mailimap_body * body,
+				  const gchar * path)
+{
+	if (body->bd_type == MAILIMAP_BODY_MPART) {
+		struct mailimap_body_type_mpart * mpart = body->bd_data.bd_body_mpart;
+		const char * boundary;
+		clistiter * cur;
+		int i = 1;
+
+		/* signatures must see the parts exactly as sent */
+		if (!strcasecmp(mpart->bd_media_subtype, "signed") ||
+		    !strcasecmp(mpart->bd_media_subtype, "encrypted"))
+			return FALSE;
+
+		boundary = partial_get_boundary(mpart);
+		if (boundary == NULL)
+			return FALSE;
+
+		for (cur = clist_begin(mpart->bd_list); cur; cur = clist_next(cur), i++) {
+			gchar * child;
+			gboolean ok;
+
+			child = *path ? g_strdup_printf("%s.%d", path, i)
+				      : g_strdup_printf("%d", i);
+			partial_add_literal(plan, g_strdup_printf("%s--%s\r\n",
+					    i == 1 ? "" : "\r\n", boundary));
+			partial_add_section(plan, g_strconcat(child, ".MIME", NULL));
+			ok = partial_plan_body(plan, clist_content(cur), child);
+			g_free(child);
+			if (!ok)
+				return FALSE;
+		}
+		partial_add_literal(plan, g_strdup_printf("\r\n--%s--\r\n", boundary));
+	} else {
+		struct mailimap_body_type_1part * part = body->bd_data.bd_body_1part;
+		struct mailimap_body_fields * fields = NULL;
+		const char * subtype;
+		gboolean text = FALSE;
+
+		switch (part->bd_type) {
+		case MAILIMAP_BODY_TYPE_1PART_BASIC:
+			subtype = part->bd_data.bd_type_basic->bd_media_basic->med_subtype;
+			fields = part->bd_data.bd_type_basic->bd_fields;
+			if (subtype && (!strcasecmp(subtype, "pkcs7-mime") ||
+					!strcasecmp(subtype, "x-pkcs7-mime")))
+				return FALSE;
+			break;
+		case MAILIMAP_BODY_TYPE_1PART_MSG:
+			fields = part->bd_data.bd_type_msg->bd_fields;
+			break;
+		case MAILIMAP_BODY_TYPE_1PART_TEXT:
+			fields = part->bd_data.bd_type_text->bd_fields;
+			text = TRUE;
+			break;
+		}
+
+		if (text || fields == NULL || fields->bd_size <= plan->inline_max)
+			partial_add_section(plan, g_strdup(*path ? path : "1"));
+		else
+			plan->omitted++;
+	}
+	return TRUE;
+}
+
+static struct mailimap_section * partial_section_new(const gchar * section)
+{
+	struct mailimap_section_part * part;
+	clist * id_list;
+	gchar ** ids;
+	gboolean mime = FALSE;
+	int i;
+
+	if (!strcmp(section, "HEADER"))
+		return mailimap_section_new_header();
+
+	id_list = clist_new();
+	ids = g_strsplit(section, ".", -1);
+	for (i = 0; ids[i] != NULL; i++) {
+		uint32_t * id;
+
+		if (!strcmp(ids[i], "MIME")) {
+			mime = TRUE;
+			break;
+		}
+		id = malloc(sizeof(* id));
+		* id = strtoul(ids[i], NULL, 10);
+		clist_append(id_list, id);
+	}
+	g_strfreev(ids);
+
+	part = mailimap_section_part_new(id_list);
+	if (mime)
+		return mailimap_section_new_part_mime(part);
+	return mailimap_section_new_part(part);
+}
+
+static gchar * partial_section_name(struct mailimap_section * section)
+{
+	GString * name;
+	clistiter * cur;
+
+	if (section == NULL || section->sec_spec == NULL)
+		return g_strdup("");
+
+	if (section->sec_spec->sec_type == MAILIMAP_SECTION_SPEC_SECTION_MSGTEXT)
+		return g_strdup(section->sec_spec->sec_data.sec_msgtext->sec_type ==
+				MAILIMAP_SECTION_MSGTEXT_HEADER ? "HEADER" : "");
+
+	name = g_string_new(NULL);
+	for (cur = clist_begin(section->sec_spec->sec_data.sec_part->sec_id);
+	     cur; cur = clist_next(cur)) {
+		uint32_t * id = clist_content(cur);
+		g_string_append_printf(name, "%s%u", name->len ? "." : "", * id);
+	}
+	if (section->sec_spec->sec_text != NULL &&
+	    section->sec_spec->sec_text->sec_type == MAILIMAP_SECTION_TEXT_MIME)
+		g_string_append(name, ".MIME");
+
+	return g_string_free(name, FALSE);
+}
+
+static void partial_content_free(gpointer data)
+{
+	/* mmap_string_unref is a simple free in libetpan
+	 * when it has MMAP_UNAVAILABLE defined */
+	if (mmap_string_unref(data) != 0)
+		free(data);
+}
+
+/* Fetches the given sections of a message in one go, filling contents
+ * with the data of each section by name and lengths with its size. */
+static int partial_fetch_sections(mailimap * imap, uint32_t uid,
+				  GSList * sections,
+				  GHashTable * contents, GHashTable * lengths)
+{
+	struct mailimap_fetch_type * fetch_type;
+	struct mailimap_set * set;
+	clist * fetch_result = NULL;
+	clistiter * cur;
+	GSList * s;
+	int r;
+
+	fetch_type = mailimap_fetch_type_new_fetch_att_list_empty();
+	for (s = sections; s; s = s->next) {
+		mailimap_fetch_type_new_fetch_att_list_add(fetch_type,
+			mailimap_fetch_att_new_body_peek_section(
+				partial_section_new(s->data)));
+	}
+	set = mailimap_set_new_single(uid);
+
+	mailstream_logger = imap_logger_fetch;
+	r = mailimap_uid_fetch(imap, set, fetch_type, &fetch_result);
+	mailstream_logger = imap_logger_cmd;
+
+	mailimap_fetch_type_free(fetch_type);
+	mailimap_set_free(set);
+
+	if (r != MAILIMAP_NO_ERROR)
+		return r;
+
+	for (cur = clist_begin(fetch_result); cur; cur = clist_next(cur)) {
+		struct mailimap_msg_att * msg_att = clist_content(cur);
+		clistiter * item_cur;
+
+		for (item_cur = clist_begin(msg_att->att_list); item_cur;
+		     item_cur = clist_next(item_cur)) {
+			struct mailimap_msg_att_item * item = clist_content(item_cur);
+			struct mailimap_msg_att_body_section * body;
+			gchar * name;
+
+			if (item->att_type != MAILIMAP_MSG_ATT_ITEM_STATIC ||
+			    item->att_data.att_static->att_type !=
+			    MAILIMAP_MSG_ATT_BODY_SECTION)
+				continue;
+			body = item->att_data.att_static->att_data.att_body_section;
+			if (body->sec_body_part == NULL)
+				continue;
+			name = partial_section_name(body->sec_section);
+			g_hash_table_insert(lengths, g_strdup(name),
+					    GSIZE_TO_POINTER(body->sec_length));
+			g_hash_table_insert(contents, name, body->sec_body_part);
+			body->sec_body_part = NULL;
+		}
+	}
+	mailimap_fetch_list_free(fetch_result);
+
+	return MAILIMAP_NO_ERROR;
+}
+
+struct fetch_partial_param {
+	mailimap * imap;
+	uint32_t uid;
+	guint32 inline_max;
+	const char * filename;
+};
+
+struct fetch_partial_result {
+	int error;
+	gboolean partial;
+};
+
+static void fetch_partial_run(struct etpan_thread_op * op)
+{
+	struct fetch_partial_param * param;
+	struct fetch_partial_result * result;
+	struct mailimap_fetch_type * fetch_type;
+	struct mailimap_body * body = NULL;
+	struct mailimap_set * set;
+	struct partial_plan plan;
+	GHashTable * contents, * lengths;
+	clist * fetch_result = NULL;
+	clistiter * cur;
+	GSList * s;
+	FILE * f;
+	int r;
+
+	param = op->param;
+	result = op->result;
+
+	CHECK_IMAP();
+
+	result->partial = FALSE;
+
+	fetch_type = mailimap_fetch_type_new_fetch_att(
+			mailimap_fetch_att_new_bodystructure());
+	set = mailimap_set_new_single(param->uid);
+	r = mailimap_uid_fetch(param->imap, set, fetch_type, &fetch_result);
+	mailimap_fetch_type_free(fetch_type);
+	mailimap_set_free(set);
+
+	if (r != MAILIMAP_NO_ERROR) {
+		result->error = r;
+		return;
+	}
+
+	for (cur = clist_begin(fetch_result); cur && !body; cur = clist_next(cur)) {
+		struct mailimap_msg_att * msg_att = clist_content(cur);
+		clistiter * item_cur;
+
+		for (item_cur = clist_begin(msg_att->att_list); item_cur;
+		     item_cur = clist_next(item_cur)) {
+			struct mailimap_msg_att_item * item = clist_content(item_cur);
+
+			if (item->att_type == MAILIMAP_MSG_ATT_ITEM_STATIC &&
+			    item->att_data.att_static->att_type ==
+			    MAILIMAP_MSG_ATT_BODYSTRUCTURE)
+				body = item->att_data.att_static->att_data.att_bodystructure;
+		}
+	}
+	if (body == NULL) {
+		mailimap_fetch_list_free(fetch_result);
+		result->error = MAILIMAP_ERROR_FETCH;
+		return;
+	}
+
+	memset(&plan, 0, sizeof(plan));
+	plan.inline_max = param->inline_max;
+	partial_add_section(&plan, g_strdup("HEADER"));
+	if (!partial_plan_body(&plan, body, "") || plan.omitted == 0) {
+		/* nothing gained, let the caller fetch it whole */
+		partial_plan_free(&plan);
+		mailimap_fetch_list_free(fetch_result);
+		result->error = MAILIMAP_NO_ERROR;
+		return;
+	}
+	mailimap_fetch_list_free(fetch_result);
+	plan.chunks = g_slist_reverse(plan.chunks);
+
+	contents = g_hash_table_new_full(g_str_hash, g_str_equal,
+					 g_free, partial_content_free);
+	lengths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	r = partial_fetch_sections(param->imap, param->uid, plan.sections,
+				   contents, lengths);
+	if (r != MAILIMAP_NO_ERROR)
+		goto out;
+
+	f = g_fopen(param->filename, "wb");
+	if (f == NULL) {
+		r = MAILIMAP_ERROR_FETCH;
+		goto out;
+	}
+	for (s = plan.chunks; s; s = s->next) {
+		struct partial_chunk * chunk = s->data;
+		const gchar * data;
+		gsize len;
+
+		if (chunk->literal) {
+			data = chunk->literal;
+			len = strlen(data);
+		} else {
+			data = g_hash_table_lookup(contents, chunk->section);
+			len = GPOINTER_TO_SIZE(g_hash_table_lookup(lengths, chunk->section));
+			if (data == NULL) {
+				debug_print("section %s missing\n", chunk->section);
+				r = MAILIMAP_ERROR_FETCH;
+				break;
+			}
+		}
+		if (len > 0 && fwrite(data, 1, len, f) < len) {
+			r = MAILIMAP_ERROR_FETCH;
+			break;
+		}
+	}
+	if (fclose(f) == EOF)
+		r = MAILIMAP_ERROR_FETCH;
+	if (r != MAILIMAP_NO_ERROR)
+		claws_unlink(param->filename);
+	else
+		result->partial = TRUE;
+
+out:
+	g_hash_table_destroy(contents);
+	g_hash_table_destroy(lengths);
+	partial_plan_free(&plan);
+	result->error = r;
+	debug_print("imap fetch_partial run - end %i, %u parts left out\n",
+		    r, plan.omitted);
+}
+
+/* Writes to filename a version of the message in which parts bigger
+ * than inline_max, bar text ones, have been left empty. *partial is
+ * FALSE if there was nothing to leave out or the message can't be
+ * rebuilt, in which case nothing is written. */
+int imap_threaded_fetch_partial(Folder * folder, uint32_t uid,
+				guint32 inline_max, const char * filename,
+				gboolean * partial)
+{
+	struct fetch_partial_param param;
+	struct fetch_partial_result result;
+
+	debug_print("imap fetch_partial - begin\n");
+
+	param.imap = get_imap(folder);
+	param.uid = uid;
+	param.inline_max = inline_max;
+	param.filename = filename;
+	result.partial = FALSE;
+
+	if (threaded_run(folder, &param, &result, fetch_partial_run))
+		return MAILIMAP_ERROR_INVAL;
+
+	debug_print("imap fetch_partial - end\n");
+
+	* partial = result.partial;
+
+	return result.error;
+}
+
+struct fetch_section_param {
+	mailimap * imap;
+	uint32_t uid;
+	const char * section;
+	const char * filename;
+	const char * decoded;
+};
+
+/* Decodes base64 content to filename as it would be when shown */
+static int imap_save_base64_decoded(const char * filename,
+				    const char * content, size_t content_size)
+{
+	FILE * f;
+	guchar outbuf[8192];
+	gint state = 0;
+	guint save = 0;
+	size_t pos, inlen, len;
+
+	f = g_fopen(filename, "wb");
+	if (f == NULL)
+		return MAILIMAP_ERROR_FETCH;
+
+	/* 3 bytes out for each 4 in, so outbuf always has room */
+	for (pos = 0; pos < content_size; pos += inlen) {
+		inlen = MIN(content_size - pos, sizeof(outbuf));
+		len = g_base64_decode_step(content + pos, inlen, outbuf,
+					   &state, &save);
+		if (fwrite(outbuf, 1, len, f) < len) {
+			fclose(f);
+			goto unlink;
+		}
+	}
+
+	if (fclose(f) == EOF)
+		goto unlink;
+
+	return MAILIMAP_NO_ERROR;
+
+unlink:
+	claws_unlink(filename);
+	return MAILIMAP_ERROR_FETCH;
+}
+
+struct fetch_section_result {
+	int error;
+};
+
+static void fetch_section_run(struct etpan_thread_op * op)
+{
+	struct fetch_section_param * param;
+	struct fetch_section_result * result;
+	GHashTable * contents, * lengths;
+	GSList sections;
+	const gchar * data;
+	int r;
+
+	param = op->param;
+	result = op->result;
+
+	CHECK_IMAP();
+
+	contents = g_hash_table_new_full(g_str_hash, g_str_equal,
+					 g_free, partial_content_free);
+	lengths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	sections.data = (gpointer) param->section;
+	sections.next = NULL;
+
+	r = partial_fetch_sections(param->imap, param->uid, &sections,
+				   contents, lengths);
+	if (r == MAILIMAP_NO_ERROR) {
+		data = g_hash_table_lookup(contents, param->section);
+		if (data == NULL)
+			r = MAILIMAP_ERROR_FETCH;
+		else {
+			size_t size = GPOINTER_TO_SIZE(g_hash_table_lookup(lengths,
+							param->section));
+
+			/* the encoded section is only kept if it can't
+			 * be decoded, for procmime to decode when shown */
+			if (param->decoded == NULL ||
+			    imap_save_base64_decoded(param->decoded, data,
+						     size) != MAILIMAP_NO_ERROR)
+				r = imap_save_content(param->filename, data, size);
+		}
+	}
+	g_hash_table_destroy(contents);
+	g_hash_table_destroy(lengths);
+
+	result->error = r;
+	debug_print("imap fetch_section run - end %i\n", r);
+}
+
+/* Fetches a single body section, such as "2.1", to filename. If
+ * decoded is set, the section is base64 encoded and is saved decoded
+ * there instead, which is done here so as not to hold up the UI; it
+ * still goes to filename as it is if that fails. The section is still
+ * transferred encoded: libetpan can't FETCH BINARY. */
+int imap_threaded_fetch_section(Folder * folder, uint32_t uid,
+				const char * section, const char * filename,
+				const char * decoded)
+{
+	struct fetch_section_param param;
+	struct fetch_section_result result;
+
+	debug_print("imap fetch_section - begin\n");
+
+	param.imap = get_imap(folder);
+	param.uid = uid;
+	param.section = section;
+	param.filename = filename;
+	param.decoded = decoded;
+
+	if (threaded_run(folder, &param, &result, fetch_section_run))
+		return MAILIMAP_ERROR_INVAL;
+
+	debug_print("imap fetch_section - end\n");
+
+	return result.error;
+}
+
+
+static int imap_flags_to_flags(struct mailimap_msg_att_dynamic * att_dyn, GSList **s_tags)
+{
+	int flags;
+	clist * flag_list;
+	clistiter * cur;
+	GSList *tags = NULL;
+
+	flags = MSG_UNREAD;
+	
+	flag_list = att_dyn->att_list;
+	if (flag_list == NULL)
+		return flags;
+	
+	for(cur = clist_begin(flag_list) ; cur != NULL ;
+	    cur = clist_next(cur)) {
+		struct mailimap_flag_fetch * flag_fetch;
+			
+		flag_fetch = clist_content(cur);
+		if (flag_fetch->fl_type == MAILIMAP_FLAG_FETCH_RECENT)
+			flags |= MSG_NEW;
+		else {
+			switch (flag_fetch->fl_flag->fl_type) {
+			case MAILIMAP_FLAG_ANSWERED:
+				flags |= MSG_REPLIED;
+				break;
+			case MAILIMAP_FLAG_FLAGGED:
+				flags |= MSG_MARKED;
+				break;
+			case MAILIMAP_FLAG_DELETED:
+				flags |= MSG_DELETED;
+				break;
+			case MAILIMAP_FLAG_SEEN:
+				flags &= ~MSG_UNREAD;
+				flags &= ~MSG_NEW;
+				break;
+			case MAILIMAP_FLAG_KEYWORD:
+				if (!strcasecmp(flag_fetch->fl_flag->fl_data.fl_keyword, RTAG_FORWARDED))
+					flags |= MSG_FORWARDED;
+				else if (!strcasecmp(flag_fetch->fl_flag->fl_data.fl_keyword, RTAG_JUNK)) 
+					flags |= MSG_SPAM;
+				else if (!strcasecmp(flag_fetch->fl_flag->fl_data.fl_keyword, RTAG_NON_JUNK) ||
+					 !strcasecmp(flag_fetch->fl_flag->fl_data.fl_keyword, RTAG_NO_JUNK) ||
+					 !strcasecmp(flag_fetch->fl_flag->fl_data.fl_keyword, RTAG_NOT_JUNK)) 
+					flags &= ~MSG_SPAM;
+				else if (s_tags)
+					tags = g_slist_prepend(tags, g_strdup(flag_fetch->fl_flag->fl_data.fl_keyword));
+				break;
+			}
+		}
+	}
+	if (s_tags)
+		*s_tags = tags;
+	return flags;
+}
+
+static int imap_get_msg_att_info(struct mailimap_msg_att * msg_att,
+				 uint32_t * puid,
+				 char ** pheaders,
+				 size_t * pref_size,
+				 struct mailimap_msg_att_dynamic ** patt_dyn)
+{
+  clistiter * item_cur;
+  uint32_t uid;
+  char * headers;
+  size_t ref_size;
+  struct mailimap_msg_att_dynamic * att_dyn;
 
   uid = 0;
   headers = NULL;
@@ -2943,47 +4547,105 @@ static void fetch_env_run(struct etpan_thread_op * op)
 	debug_print("imap fetch_env run - end %i\n", r);
 }
 
-int imap_threaded_fetch_env(Folder * folder, struct mailimap_set * set,
-			    carray ** p_env_list)
+static gboolean fetch_env_done(IMAPThreadedOp * aop)
 {
-	struct fetch_env_param param;
-	struct fetch_env_result result;
-	mailimap * imap;
+	struct fetch_env_result * result = aop->result;
+	chashdatum key;
+	chashdatum value;
+	int r;
+
+	if (result->error == MAILIMAP_NO_ERROR)
+		return FALSE;
+
+	/* some servers choke on the envelope, retry once asking
+	 * for the headers instead */
+	key.data = &aop->imap;
+	key.len = sizeof(aop->imap);
+	r = chash_get(courier_workaround_hash, &key, &value);
+	if (r == 0)
+		return FALSE;
+
+	value.data = NULL;
+	value.len = 0;
+	chash_set(courier_workaround_hash, &key, &value, NULL);
+
+	threaded_op_schedule(aop);
+	return TRUE;
+}
+
+static void fetch_env_free_param(IMAPThreadedOp * aop)
+{
+	struct fetch_env_param * param = aop->param;
+	struct fetch_env_result * result = aop->result;
+
+	if (result->fetch_env_result)
+		imap_fetch_env_free(result->fetch_env_result);
+	mailimap_set_free(param->set);
+	g_free(param);
+	g_free(result);
+}
+
+IMAPThreadedOp * imap_threaded_fetch_env_async(Folder * folder,
+					       struct mailimap_set * set,
+					       IMAPThreadedFunc func,
+					       gpointer data)
+{
+	struct fetch_env_param * param;
+	struct fetch_env_result * result;
+	IMAPThreadedOp * aop;
+	clistiter * cur;
 	
 	debug_print("imap fetch_env - begin\n");
 	
-	imap = get_imap(folder);
-	param.imap = imap;
-	param.set = set;
+	param = g_new0(struct fetch_env_param, 1);
+	result = g_new0(struct fetch_env_result, 1);
+	param->imap = get_imap(folder);
+	/* the caller's set need not outlive the call */
+	param->set = mailimap_set_new_empty();
+	for (cur = clist_begin(set->set_list); cur; cur = clist_next(cur)) {
+		struct mailimap_set_item * item = clist_content(cur);
+		mailimap_set_add_interval(param->set,
+					  item->set_first, item->set_last);
+	}
 	
-	if (threaded_run(folder, &param, &result, fetch_env_run))
+	aop = threaded_op_new(folder, param, result, fetch_env_run, func, data);
+	aop->done = fetch_env_done;
+	aop->free_param = fetch_env_free_param;
+	threaded_op_schedule(aop);
+
+	return aop;
+}
+
+int imap_threaded_fetch_env_finish(IMAPThreadedOp * aop, carray ** p_env_list)
+{
+	struct fetch_env_result * result = aop->result;
+
+	if (aop->stale)
 		return MAILIMAP_ERROR_INVAL;
 
-	if (result.error != MAILIMAP_NO_ERROR) {
-		chashdatum key;
-		chashdatum value;
-		int r;
-		
-		key.data = &imap;
-		key.len = sizeof(imap);
-		r = chash_get(courier_workaround_hash, &key, &value);
-		if (r < 0) {
-			value.data = NULL;
-			value.len = 0;
-			chash_set(courier_workaround_hash, &key, &value, NULL);
-			
-			threaded_run(folder, &param, &result, fetch_env_run);
-		}
-	}
-	
-	if (result.error != MAILIMAP_NO_ERROR)
-		return result.error;
+	if (result->error != MAILIMAP_NO_ERROR)
+		return result->error;
 	
 	debug_print("imap fetch_env - end\n");
 	
-	* p_env_list = result.fetch_env_result;
+	* p_env_list = result->fetch_env_result;
+	result->fetch_env_result = NULL;
 	
-	return result.error;
+	return result->error;
+}
+
+int imap_threaded_fetch_env(Folder * folder, struct mailimap_set * set,
+			    carray ** p_env_list)
+{
+	IMAPThreadedOp * aop;
+	int r;
+
+	aop = imap_threaded_fetch_env_async(folder, set, NULL, NULL);
+	threaded_op_wait(aop);
+	r = imap_threaded_fetch_env_finish(aop, p_env_list);
+	threaded_op_free(aop);
+
+	return r;
 }
 
 void imap_fetch_env_free(carray * env_list)
@@ -3016,6 +4678,47 @@ struct append_result {
 	int uid;
 };
 
+/* Maps the message to upload into memory; release it with
+ * append_data_free() */
+static char * append_data_get(const char * filename, size_t * size)
+{
+	char * data;
+#ifndef G_OS_WIN32
+	struct stat stat_buf;
+	int fd;
+
+	if (stat(filename, &stat_buf) < 0)
+		return NULL;
+	* size = stat_buf.st_size;
+	
+	fd = g_open(filename, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	
+	/* the mapping stays valid once the file is closed */
+	data = mmap(NULL, * size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == (void *) MAP_FAILED)
+		return NULL;
+#else
+	data = file_read_to_str_no_recode(filename);
+	if (data == NULL)
+		return NULL;
+	* size = strlen(data);
+#endif
+
+	return data;
+}
+
+static void append_data_free(char * data, size_t size)
+{
+#ifndef G_OS_WIN32
+	munmap(data, size);
+#else
+	g_free(data);
+#endif
+}
+
 static void append_run(struct etpan_thread_op * op)
 {
 	struct append_param * param;
@@ -3023,10 +4726,6 @@ static void append_run(struct etpan_thread_op * op)
 	int r;
 	char * data;
 	size_t size;
-#ifndef G_OS_WIN32
-	struct stat stat_buf;
-	int fd;
-#endif
 	guint32 uid = 0, val = 0;
 	
 	param = op->param;
@@ -3034,48 +4733,20 @@ static void append_run(struct etpan_thread_op * op)
 	
 	CHECK_IMAP();
 
-#ifndef G_OS_WIN32
-	r = stat(param->filename, &stat_buf);
-	if (r < 0) {
-		result->error = MAILIMAP_ERROR_APPEND;
-		return;
-	}
-	size = stat_buf.st_size;
-	
-	fd = g_open(param->filename, O_RDONLY, 0);
-	if (fd < 0) {
-		result->error = MAILIMAP_ERROR_APPEND;
-		return;
-	}
-	
-	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (data == (void *) MAP_FAILED) {
-		close(fd);
-		result->error = MAILIMAP_ERROR_APPEND;
-		return;
-	}
-#else
-	data = file_read_to_str_no_recode(param->filename);
+	data = append_data_get(param->filename, &size);
 	if (data == NULL) {
 		result->error = MAILIMAP_ERROR_APPEND;
 		return;
 	}
-	size = strlen(data);
-#endif
 	mailstream_logger = imap_logger_append;
 	
 	r = mailimap_uidplus_append(param->imap, param->mailbox,
 			    param->flag_list, NULL,
 			    data, size, &val, &uid);
-
-	mailstream_logger = imap_logger_cmd;
-	
-#ifndef G_OS_WIN32
-	munmap(data, size);
-	close(fd);
-#else
-	g_free(data);
-#endif
+
+	mailstream_logger = imap_logger_cmd;
+	
+	append_data_free(data, size);
 	
 	result->error = r;
 	result->uid = uid;
@@ -3113,6 +4784,255 @@ int imap_threaded_append(Folder * folder, const char * mailbox,
 
 
 
+struct append_list_param {
+	mailimap * imap;
+	const char * mailbox;
+	const char ** filenames;
+	struct mailimap_flag_list ** flag_lists;
+	guint count;
+	gboolean literal_plus;
+};
+
+struct append_list_result {
+	int error;
+	guint32 * uids;
+};
+
+#ifdef HAVE_LIBETPAN_MULTIAPPEND
+static int append_list_send_flags(mailstream * stream,
+				  struct mailimap_flag_list * flag_list)
+{
+	GString *str = g_string_new("(");
+	clistiter *cur;
+	int r = MAILIMAP_NO_ERROR;
+
+	for (cur = clist_begin(flag_list->fl_list); cur != NULL;
+	     cur = clist_next(cur)) {
+		struct mailimap_flag * flag = clist_content(cur);
+
+		if (str->len > 1)
+			g_string_append_c(str, ' ');
+		switch (flag->fl_type) {
+		case MAILIMAP_FLAG_ANSWERED:
+			g_string_append(str, "\\Answered");
+			break;
+		case MAILIMAP_FLAG_FLAGGED:
+			g_string_append(str, "\\Flagged");
+			break;
+		case MAILIMAP_FLAG_DELETED:
+			g_string_append(str, "\\Deleted");
+			break;
+		case MAILIMAP_FLAG_SEEN:
+			g_string_append(str, "\\Seen");
+			break;
+		case MAILIMAP_FLAG_DRAFT:
+			g_string_append(str, "\\Draft");
+			break;
+		case MAILIMAP_FLAG_KEYWORD:
+			g_string_append(str, flag->fl_data.fl_keyword);
+			break;
+		case MAILIMAP_FLAG_EXTENSION:
+			g_string_append_printf(str, "\\%s",
+					       flag->fl_data.fl_extension);
+			break;
+		}
+	}
+	g_string_append(str, ") ");
+
+	if (mailstream_write(stream, str->str, str->len) != (ssize_t) str->len)
+		r = MAILIMAP_ERROR_STREAM;
+	g_string_free(str, TRUE);
+
+	return r;
+}
+
+/* Sends one message of the command. A synchronizing literal has to
+ * wait for the server's go-ahead; with LITERAL+ nothing is waited for
+ * until the whole command is out. */
+static int append_list_send_msg(mailimap * imap,
+				struct mailimap_flag_list * flag_list,
+				const char * data, size_t size,
+				gboolean literal_plus)
+{
+	struct mailimap_response * response;
+	gchar count[32];
+	int r;
+
+	r = append_list_send_flags(imap->imap_stream, flag_list);
+	if (r != MAILIMAP_NO_ERROR)
+		return r;
+
+	g_snprintf(count, sizeof(count), "{%" G_GSIZE_FORMAT "%s}\r\n",
+		   size, literal_plus ? "+" : "");
+	if (mailstream_write(imap->imap_stream, count, strlen(count)) !=
+	    (ssize_t) strlen(count))
+		return MAILIMAP_ERROR_STREAM;
+
+	if (!literal_plus) {
+		if (mailstream_flush(imap->imap_stream) == -1 ||
+		    mailimap_read_line(imap) == NULL)
+			return MAILIMAP_ERROR_STREAM;
+		if (imap->imap_stream_buffer->str[0] != '+') {
+			/* refused: what came is the tagged answer */
+			r = mailimap_parse_response(imap, &response);
+			if (r == MAILIMAP_NO_ERROR)
+				mailimap_response_free(response);
+			return MAILIMAP_ERROR_APPEND;
+		}
+	}
+
+	mailstream_logger = imap_logger_append;
+	if (mailstream_write(imap->imap_stream, data, size) != (ssize_t) size)
+		r = MAILIMAP_ERROR_STREAM;
+	mailstream_logger = imap_logger_cmd;
+
+	return r;
+}
+
+/* The UIDs the messages got, from the APPENDUID response code */
+static void append_list_get_uids(mailimap * imap, guint32 * uids,
+				 guint count)
+{
+	clistiter *cur, *item_cur;
+	guint i = 0;
+
+	if (imap->imap_response_info == NULL)
+		return;
+
+	for (cur = clist_begin(imap->imap_response_info->rsp_extension_list);
+	     cur != NULL; cur = clist_next(cur)) {
+		struct mailimap_extension_data * ext = clist_content(cur);
+		struct mailimap_uidplus_resp_code_apnd * apnd;
+
+		if (ext->ext_extension->ext_id != MAILIMAP_EXTENSION_UIDPLUS ||
+		    ext->ext_type != MAILIMAP_UIDPLUS_RESP_CODE_APND)
+			continue;
+
+		apnd = ext->ext_data;
+		if (apnd->uid_set == NULL)
+			return;
+		for (item_cur = clist_begin(apnd->uid_set->set_list);
+		     item_cur != NULL; item_cur = clist_next(item_cur)) {
+			struct mailimap_set_item * item = clist_content(item_cur);
+			guint32 uid;
+
+			for (uid = item->set_first;
+			     uid <= item->set_last && i < count; uid++)
+				uids[i++] = uid;
+		}
+		return;
+	}
+}
+#endif
+
+/* RFC 3502 MULTIAPPEND: all the messages in a single APPEND command */
+static void append_list_run(struct etpan_thread_op * op)
+{
+	struct append_list_param * param;
+	struct append_list_result * result;
+#ifdef HAVE_LIBETPAN_MULTIAPPEND
+	struct mailimap_response * response;
+	guint i;
+	int r;
+#endif
+
+	param = op->param;
+	result = op->result;
+
+	CHECK_IMAP();
+
+#ifdef HAVE_LIBETPAN_MULTIAPPEND
+	r = mailimap_send_current_tag(param->imap);
+	if (r == MAILIMAP_NO_ERROR)
+		r = mailimap_token_send(param->imap->imap_stream, "APPEND");
+	if (r == MAILIMAP_NO_ERROR)
+		r = mailimap_space_send(param->imap->imap_stream);
+	if (r == MAILIMAP_NO_ERROR)
+		r = mailimap_mailbox_send(param->imap->imap_stream,
+					  param->mailbox);
+	if (r == MAILIMAP_NO_ERROR)
+		r = mailimap_space_send(param->imap->imap_stream);
+
+	for (i = 0; i < param->count && r == MAILIMAP_NO_ERROR; i++) {
+		char * data;
+		size_t size;
+
+		data = append_data_get(param->filenames[i], &size);
+		if (data == NULL) {
+			/* the command is half sent: the connection is lost */
+			r = MAILIMAP_ERROR_STREAM;
+			break;
+		}
+		if (i > 0 && mailstream_write(param->imap->imap_stream,
+					      " ", 1) != 1)
+			r = MAILIMAP_ERROR_STREAM;
+		if (r == MAILIMAP_NO_ERROR)
+			r = append_list_send_msg(param->imap,
+						 param->flag_lists[i],
+						 data, size,
+						 param->literal_plus);
+		append_data_free(data, size);
+	}
+
+	if (r == MAILIMAP_NO_ERROR)
+		r = mailimap_crlf_send(param->imap->imap_stream);
+	if (r == MAILIMAP_NO_ERROR &&
+	    (mailstream_flush(param->imap->imap_stream) == -1 ||
+	     mailimap_read_line(param->imap) == NULL))
+		r = MAILIMAP_ERROR_STREAM;
+	if (r == MAILIMAP_NO_ERROR)
+		r = mailimap_parse_response(param->imap, &response);
+	if (r == MAILIMAP_NO_ERROR) {
+		if (response->rsp_resp_done->rsp_type != MAILIMAP_RESP_DONE_TYPE_TAGGED ||
+		    response->rsp_resp_done->rsp_data.rsp_tagged->rsp_cond_state->rsp_type !=
+		    MAILIMAP_RESP_COND_STATE_OK)
+			r = MAILIMAP_ERROR_APPEND;
+		else
+			append_list_get_uids(param->imap, result->uids,
+					     param->count);
+		mailimap_response_free(response);
+	}
+
+	result->error = r;
+	debug_print("imap append list run - end %i\n", r);
+#else
+	result->error = MAILIMAP_ERROR_EXTENSION;
+#endif
+}
+
+/* Uploads count messages in one command, which the server must have
+ * announced MULTIAPPEND for. uids gets the UID of each message, or 0
+ * where the server didn't tell. */
+int imap_threaded_append_list(Folder * folder, const char * mailbox,
+			      const char ** filenames,
+			      struct mailimap_flag_list ** flag_lists,
+			      guint count, gboolean literal_plus,
+			      guint32 * uids)
+{
+	struct append_list_param param;
+	struct append_list_result result;
+
+	debug_print("imap append list - begin\n");
+
+	memset(uids, 0, count * sizeof(guint32));
+	param.imap = get_imap(folder);
+	param.mailbox = mailbox;
+	param.filenames = filenames;
+	param.flag_lists = flag_lists;
+	param.count = count;
+	param.literal_plus = literal_plus;
+	result.error = MAILIMAP_ERROR_STREAM;
+	result.uids = uids;
+
+	threaded_run(folder, &param, &result, append_list_run);
+
+	debug_print("imap append list - end\n");
+
+	return result.error;
+}
+
+
+
 
 struct expunge_param {
 	mailimap * imap;
@@ -3227,6 +5147,64 @@ int imap_threaded_copy(Folder * folder, struct mailimap_set * set,
 
 
 
+/* RFC 6851; the source and dest sets are taken from the COPYUID
+ * response code like with UID COPY */
+static void move_run(struct etpan_thread_op * op)
+{
+	struct copy_param * param;
+	struct copy_result * result;
+#ifdef HAVE_LIBETPAN_MOVE
+	int r;
+	guint32 val;
+	struct mailimap_set *source = NULL, *dest = NULL;
+#endif
+
+	param = op->param;
+	result = op->result;
+
+	CHECK_IMAP();
+
+	result->source = NULL;
+	result->dest = NULL;
+#ifdef HAVE_LIBETPAN_MOVE
+	r = mailimap_uidplus_uid_move(param->imap, param->set, param->mb,
+		&val, &source, &dest);
+
+	result->error = r;
+	if (r == 0) {
+		result->source = source;
+		result->dest = dest;
+	}
+	debug_print("imap move run - end %i\n", r);
+#else
+	result->error = MAILIMAP_ERROR_EXTENSION;
+#endif
+}
+
+int imap_threaded_move(Folder * folder, struct mailimap_set * set,
+		       const char * mb, struct mailimap_set **source,
+		       struct mailimap_set **dest)
+{
+	struct copy_param param;
+	struct copy_result result;
+
+	debug_print("imap move - begin\n");
+
+	param.imap = get_imap(folder);
+	param.set = set;
+	param.mb = mb;
+
+	threaded_run(folder, &param, &result, move_run);
+	*source = result.source;
+	*dest = result.dest;
+
+	debug_print("imap move - end\n");
+
+	return result.error;
+}
+
+
+
 struct store_param {
 	mailimap * imap;
 	struct mailimap_set * set;
@@ -3434,6 +5412,7 @@ int imap_threaded_connect_cmd(Folder * folder, const char * command,
 {
 	struct connect_cmd_param param;
 	struct connect_cmd_result result;
+	struct conn_key ck;
 	chashdatum key;
 	chashdatum value;
 	mailimap * imap, * oldimap;
@@ -3447,8 +5426,7 @@ int imap_threaded_connect_cmd(Folder * folder, const char * command,
 		delete_imap(folder, oldimap);
 	}
 
-	key.data = &folder;
-	key.len = sizeof(folder);
+	conn_key_set(&key, &ck, folder, get_connection(folder));
 	value.data = imap;
 	value.len = 0;
 	chash_set(session_hash, &key, &value, NULL);
@@ -3466,6 +5444,273 @@ int imap_threaded_connect_cmd(Folder * folder, const char * command,
 }
 #endif /* G_OS_WIN32 */
 
+/* idle */
+
+struct idle_param {
+	mailimap * imap;
+#ifdef HAVE_LIBETPAN_WAIT_IDLE
+	struct mailstream_cancel * cancel;
+#else
+	int wakeup_fd;
+#endif
+	int timeout;
+};
+
+struct idle_result {
+	int error;
+	gboolean changed;
+};
+
+struct idle_state {
+	Folder * folder;
+	int conn;
+#ifndef HAVE_LIBETPAN_WAIT_IDLE
+	int wakeup_fds[2];
+#endif
+	gboolean stopping;
+	IMAPIdleFunc func;
+	gpointer data;
+	struct idle_param param;
+	struct idle_result result;
+};
+
+static struct idle_state * get_idle_conn(Folder * folder, int conn)
+{
+	struct conn_key ck;
+	chashdatum key;
+	chashdatum value;
+	int r;
+
+	conn_key_set(&key, &ck, folder, conn);
+
+	r = chash_get(idle_hash, &key, &value);
+	if (r < 0)
+		return NULL;
+
+	return value.data;
+}
+
+#ifndef G_OS_WIN32
+static int idle_wakeup_new(struct idle_state * state)
+{
+#ifdef HAVE_LIBETPAN_WAIT_IDLE
+	state->param.cancel = mailstream_cancel_new();
+	return state->param.cancel != NULL ? 0 : -1;
+#else
+	if (pipe(state->wakeup_fds) < 0)
+		return -1;
+	state->param.wakeup_fd = state->wakeup_fds[0];
+	return 0;
+#endif
+}
+
+static void idle_wakeup_free(struct idle_state * state)
+{
+#ifdef HAVE_LIBETPAN_WAIT_IDLE
+	mailstream_cancel_free(state->param.cancel);
+#else
+	close(state->wakeup_fds[0]);
+	close(state->wakeup_fds[1]);
+#endif
+}
+
+static void idle_wakeup(struct idle_state * state)
+{
+#ifdef HAVE_LIBETPAN_WAIT_IDLE
+	mailstream_cancel_notify(state->param.cancel);
+#else
+	if (write(state->wakeup_fds[1], "x", 1) < 0)
+		FILE_OP_ERROR("imap idle", "write");
+#endif
+}
+
+/* Sleeps until the server sends something, the main thread wants the
+ * connection back, or the server would consider us inactive. Data the
+ * stream or its TLS and compression layers have buffered already
+ * counts too: select() on the socket does not see it. */
+static void idle_wait(struct idle_param * param)
+{
+	mailstream * stream = param->imap->imap_stream;
+#ifdef HAVE_LIBETPAN_WAIT_IDLE
+	if (stream->read_buffer_len > 0)
+		return;
+
+	mailstream_low_wait_idle(mailstream_get_low(stream), param->cancel,
+				 param->timeout);
+#else
+	struct timeval delay;
+	fd_set readfds;
+	int fd, r;
+
+	if (stream->read_buffer_len > 0)
+		return;
+
+	fd = mailimap_idle_get_fd(param->imap);
+	if (fd < 0)
+		return;
+
+	do {
+		FD_ZERO(&readfds);
+		FD_SET(fd, &readfds);
+		FD_SET(param->wakeup_fd, &readfds);
+		delay.tv_sec = param->timeout;
+		delay.tv_usec = 0;
+		r = select(MAX(fd, param->wakeup_fd) + 1, &readfds,
+			   NULL, NULL, &delay);
+	} while (r < 0 && errno == EINTR);
+#endif
+}
+
+/* Whether the responses mailimap_idle_done() parsed change the
+ * mailbox: new messages (EXISTS), removed ones (EXPUNGE, or VANISHED
+ * with QRESYNC) or changed flags (FETCH). Keepalives such as
+ * "* OK Still here" do not count. */
+static gboolean idle_changed(mailimap * imap, uint32_t exists)
+{
+	struct mailimap_response_info * info = imap->imap_response_info;
+
+	if (imap->imap_selection_info != NULL &&
+	    imap->imap_selection_info->sel_exists != exists)
+		return TRUE;
+
+	if (info == NULL)
+		return FALSE;
+
+	return (info->rsp_expunged != NULL &&
+		!clist_isempty(info->rsp_expunged)) ||
+	       (info->rsp_fetch_list != NULL &&
+		!clist_isempty(info->rsp_fetch_list)) ||
+	       (info->rsp_extension_list != NULL &&
+		!clist_isempty(info->rsp_extension_list));
+}
+
+static void idle_run(struct etpan_thread_op * op)
+{
+	struct idle_param * param;
+	struct idle_result * result;
+	uint32_t exists = 0;
+	int r;
+
+	param = op->param;
+	result = op->result;
+
+	CHECK_IMAP();
+
+	result->changed = FALSE;
+
+	if (param->imap->imap_selection_info != NULL)
+		exists = param->imap->imap_selection_info->sel_exists;
+
+	r = mailimap_idle(param->imap);
+	if (r != MAILIMAP_NO_ERROR) {
+		result->error = r;
+		debug_print("imap idle run - error %i\n", r);
+		return;
+	}
+
+	/* whatever arrived meanwhile is parsed by mailimap_idle_done() */
+	idle_wait(param);
+
+	r = mailimap_idle_done(param->imap);
+	result->error = r;
+	if (r == MAILIMAP_NO_ERROR)
+		result->changed = idle_changed(param->imap, exists);
+	debug_print("imap idle run - end %i, changed %i\n", r, result->changed);
+}
+
+static void idle_done(Folder * folder, IMAPThreadedOp * aop, gpointer data)
+{
+	struct idle_state * state = data;
+	struct conn_key ck;
+	chashdatum key;
+
+	conn_key_set(&key, &ck, folder, state->conn);
+	chash_delete(idle_hash, &key, NULL);
+
+	idle_wakeup_free(state);
+
+	debug_print("imap idle - end\n");
+	if (state->func)
+		state->func(folder, state->result.error,
+			    state->result.changed, state->data);
+
+	g_free(state);
+}
+#endif
+
+int imap_threaded_idle_start(Folder * folder, int timeout,
+			     IMAPIdleFunc func, gpointer data)
+{
+#ifndef G_OS_WIN32
+	IMAPThreadedOp * aop;
+	struct idle_state * state;
+	struct conn_key ck;
+	chashdatum key;
+	chashdatum value;
+	mailimap * imap;
+
+	debug_print("imap idle - begin\n");
+
+	imap = get_imap(folder);
+	if (imap == NULL || get_idle_conn(folder, get_connection(folder)) != NULL)
+		return MAILIMAP_ERROR_BAD_STATE;
+
+	state = g_new0(struct idle_state, 1);
+	if (idle_wakeup_new(state) < 0) {
+		FILE_OP_ERROR("imap idle", "pipe");
+		g_free(state);
+		return MAILIMAP_ERROR_IDLE;
+	}
+	state->folder = folder;
+	state->conn = get_connection(folder);
+	state->func = func;
+	state->data = data;
+	state->param.imap = imap;
+	state->param.timeout = timeout;
+
+	/* idle_done() reports back from the main loop once the server has
+	 * spoken or the idle is stopped */
+	aop = threaded_op_new(folder, &state->param, &state->result,
+			      idle_run, idle_done, state);
+	threaded_op_schedule(aop);
+
+	/* only now, or scheduling would have stopped it */
+	conn_key_set(&key, &ck, folder, state->conn);
+	value.data = state;
+	value.len = 0;
+	chash_set(idle_hash, &key, &value, NULL);
+
+	return MAILIMAP_NO_ERROR;
+#else
+	return MAILIMAP_ERROR_IDLE;
+#endif
+}
+
+static void idle_stop_conn(Folder * folder, int conn)
+{
+	struct idle_state * state;
+
+	state = get_idle_conn(folder, conn);
+	if (state == NULL || state->stopping)
+		return;
+
+	debug_print("imap idle - stop\n");
+	state->stopping = TRUE;
+#ifndef G_OS_WIN32
+	idle_wakeup(state);
+#endif
+}
+
+void imap_threaded_idle_stop(Folder * folder)
+{
+	idle_stop_conn(folder, get_connection(folder));
+}
+
+gboolean imap_threaded_idle_active(Folder * folder)
+{
+	return get_idle_conn(folder, get_connection(folder)) != NULL;
+}
+
 void imap_threaded_cancel(Folder * folder)
 {
 	mailimap * imap;
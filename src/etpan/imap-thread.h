@@ -25,6 +25,7 @@
 #include "folder.h"
 
 #define IMAP_SET_MAX_COUNT 500
+#define IMAP_MAX_CONNECTIONS 8
 
 typedef enum
 {
@@ -38,16 +39,29 @@ typedef enum
 	IMAP_FLAG_HAM		= 1 << 7
 } IMAPFlags;
 
+/* A queued request. The _async variants return one right away and call
+ * func from the main loop once the server has answered; the results are
+ * then picked up with the matching _finish, and the op is freed when
+ * func returns. Ops run on the connection current at creation. */
+typedef struct _IMAPThreadedOp IMAPThreadedOp;
+typedef void (*IMAPThreadedFunc)(Folder * folder, IMAPThreadedOp * op,
+				 gpointer data);
+
+gboolean imap_threaded_op_is_stale(IMAPThreadedOp * op);
+
 void imap_main_set_timeout(int sec);
 void imap_main_init(gboolean skip_ssl_cert_check);
 void imap_main_done(gboolean have_connectivity);
 
 void imap_init(Folder * folder);
 void imap_done(Folder * folder);
+int imap_threaded_use_connection(Folder * folder, int conn);
 
 int imap_threaded_connect(Folder * folder, const char * server, int port);
 int imap_threaded_connect_ssl(Folder * folder, const char * server, int port);
 int imap_threaded_capability(Folder *folder, struct mailimap_capability_data ** caps);
+int imap_threaded_enable(Folder *folder, const char * capability);
+int imap_threaded_compress(Folder *folder);
 
 #ifndef G_OS_WIN32
 int imap_threaded_connect_cmd(Folder * folder, const char * command,
@@ -67,6 +81,8 @@ int imap_threaded_login(Folder * folder,
 int imap_threaded_status(Folder * folder, const char * mb,
 		struct mailimap_mailbox_data_status ** data_status,
 		guint mask);
+int imap_threaded_status_list(Folder * folder, const char ** mbs, guint count,
+		guint mask, struct mailimap_mailbox_data_status *** data_status);
 int imap_threaded_close(Folder * folder);
 
 int imap_threaded_noop(Folder * folder, unsigned int * p_exists, 
@@ -83,7 +99,7 @@ int imap_threaded_delete(Folder * folder, const char * mb);
 int imap_threaded_select(Folder * folder, const char * mb,
 			 gint * exists, gint * recent, gint * unseen,
 			 guint32 * uid_validity, gint * can_create_flags,
-			 GSList **ok_flags);
+			 GSList **ok_flags, guint64 * highest_modseq);
 int imap_threaded_examine(Folder * folder, const char * mb,
 			  gint * exists, gint * recent, gint * unseen,
 			  guint32 * uid_validity);
@@ -139,6 +155,16 @@ void		imap_search_free(IMAPSearchKey* search);
 int imap_threaded_search(Folder * folder, int search_type, IMAPSearchKey* key,
 			 const char *charset, struct mailimap_set * set, clist ** result);
 
+enum {
+	IMAP_SORT_DATE,
+	IMAP_SORT_SIZE,
+	IMAP_SORT_SUBJECT,
+};
+
+/* The UIDs of the selected mailbox in ascending order of sort_key, as a
+ * list to be freed with mailimap_search_result_free() */
+int imap_threaded_sort(Folder * folder, int sort_key, clist ** result);
+
 int imap_threaded_fetch_uid(Folder * folder, uint32_t first_index,
 			    carray ** result);
 
@@ -147,11 +173,24 @@ void imap_fetch_uid_list_free(carray * uid_list);
 int imap_threaded_fetch_uid_flags(Folder * folder, uint32_t first_index,
 				  carray ** fetch_result);
 
+int imap_threaded_fetch_uid_flags_changedsince(Folder * folder, guint64 modseq,
+					       gboolean vanished,
+					       carray ** fetch_result,
+					       struct mailimap_set ** vanished_uids);
+
 void imap_fetch_uid_flags_list_free(carray * uid_flags_list);
 
 int imap_threaded_fetch_content(Folder * folder, uint32_t msg_index,
 				int with_body,
 				const char * filename);
+int imap_threaded_fetch_bodies(Folder * folder, struct mailimap_set * set,
+			       GHashTable * filenames, guint * count);
+int imap_threaded_fetch_partial(Folder * folder, uint32_t uid,
+				guint32 inline_max, const char * filename,
+				gboolean * partial);
+int imap_threaded_fetch_section(Folder * folder, uint32_t uid,
+				const char * section, const char * filename,
+				const char * decoded);
 
 struct imap_fetch_env_info {
 	uint32_t uid;
@@ -162,6 +201,11 @@ struct imap_fetch_env_info {
 
 int imap_threaded_fetch_env(Folder * folder, struct mailimap_set * set,
 			    carray ** p_env_list);
+IMAPThreadedOp *imap_threaded_fetch_env_async(Folder * folder,
+			    struct mailimap_set * set,
+			    IMAPThreadedFunc func, gpointer data);
+int imap_threaded_fetch_env_finish(IMAPThreadedOp * op,
+			    carray ** p_env_list);
 
 void imap_fetch_env_free(carray * env_list);
 
@@ -169,6 +213,11 @@ int imap_threaded_append(Folder * folder, const char * mailbox,
 			 const char * filename,
 			 struct mailimap_flag_list * flag_list,
 			 int *uid);
+int imap_threaded_append_list(Folder * folder, const char * mailbox,
+			      const char ** filenames,
+			      struct mailimap_flag_list ** flag_lists,
+			      guint count, gboolean literal_plus,
+			      guint32 * uids);
 
 int imap_threaded_expunge(Folder * folder);
 
@@ -176,9 +225,21 @@ int imap_threaded_copy(Folder * folder, struct mailimap_set * set,
 		       const char * mb, struct mailimap_set **source,
 		       struct mailimap_set **dest);
 
+int imap_threaded_move(Folder * folder, struct mailimap_set * set,
+		       const char * mb, struct mailimap_set **source,
+		       struct mailimap_set **dest);
+
 int imap_threaded_store(Folder * folder, struct mailimap_set * set,
 			struct mailimap_store_att_flags * store_att_flags);
 
+typedef void (*IMAPIdleFunc)(Folder * folder, int error,
+			     gboolean changed, gpointer data);
+
+int imap_threaded_idle_start(Folder * folder, int timeout,
+			     IMAPIdleFunc func, gpointer data);
+void imap_threaded_idle_stop(Folder * folder);
+gboolean imap_threaded_idle_active(Folder * folder);
+
 void imap_threaded_cancel(Folder * folder);
 
 #endif
@@ -32,6 +32,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
 #ifdef WIN32
 #include <w32lib.h>
 #endif
@@ -62,6 +65,7 @@
 #include "main.h"
 #include "msgcache.h"
 #include "privacy.h"
+#include "claws.h"
 
 /* Dependecies to be removed ?! */
 #include "prefs_common.h"
@@ -82,6 +86,11 @@
 static GList *folder_list = NULL;
 static GSList *class_list = NULL;
 static GSList *folder_unloaded_list = NULL;
+static guint folder_clean_cache_memory_timeout_id = 0;
+static gint folder_scans_running = 0;
+
+/* seconds to wait after a cache was read before evicting others */
+#define FOLDER_CLEAN_CACHE_MEMORY_DELAY	5
 
 void folder_init		(Folder		*folder,
 				 const gchar	*name);
@@ -89,6 +98,7 @@ void folder_init		(Folder		*folder,
 static gchar *folder_item_get_cache_file	(FolderItem	*item);
 static gchar *folder_item_get_mark_file	(FolderItem	*item);
 static gchar *folder_item_get_tags_file	(FolderItem	*item);
+static gchar *folder_item_get_journal_file	(FolderItem	*item);
 static GNode *folder_get_xml_node	(Folder 	*folder);
 static Folder *folder_get_from_xml	(GNode 		*node);
 static void folder_update_op_count_rec	(GNode		*node);
@@ -978,6 +988,7 @@ FolderItem *folder_create_folder(FolderItem *parent, const gchar *name)
 		FolderUpdateData hookdata;
 
 		new_item->cache = msgcache_new();
+		msgcache_attach(new_item->cache, new_item);
 		new_item->cache_dirty = TRUE;
 		new_item->mark_dirty = TRUE;
 		new_item->tags_dirty = TRUE;
@@ -1901,20 +1912,56 @@ gchar *folder_item_get_path(FolderItem *item)
 	return folder->klass->item_get_path(folder, item);
 }
 
-static gint folder_sort_cache_list_by_msgnum(gconstpointer a, gconstpointer b)
+static gint folder_num_array_compare(gconstpointer a, gconstpointer b)
 {
-	MsgInfo *msginfo_a = (MsgInfo *) a;
-	MsgInfo *msginfo_b = (MsgInfo *) b;
+	guint num_a = *(const guint *)a;
+	guint num_b = *(const guint *)b;
 
-	return (msginfo_a->msgnum - msginfo_b->msgnum);
+	return num_a < num_b ? -1 : (num_a > num_b ? 1 : 0);
 }
 
-static gint folder_sort_folder_list(gconstpointer a, gconstpointer b)
+/* Turns the number list returned by get_num_list() into a sorted array */
+static GArray *folder_num_list_to_array(GSList *num_list)
 {
-	guint gint_a = GPOINTER_TO_INT(a);
-	guint gint_b = GPOINTER_TO_INT(b);
-	
-	return (gint_a - gint_b);
+	GArray *nums;
+	GSList *cur;
+
+	nums = g_array_sized_new(FALSE, FALSE, sizeof(guint), g_slist_length(num_list));
+	for (cur = num_list; cur != NULL; cur = cur->next) {
+		guint num = GPOINTER_TO_INT(cur->data);
+
+		g_array_append_val(nums, num);
+	}
+	g_array_sort(nums, folder_num_array_compare);
+
+	return nums;
+}
+
+/* Returns the index of the first element of nums[from..len) that is not
+ * smaller than num, given that nums[from] is. Probes 1, 2, 4, ... elements
+ * ahead and bisects the last step, so a long run that exists on only one
+ * side of the diff is skipped in O(log run) comparisons. */
+static guint folder_num_array_gallop(const guint *nums, guint from, guint len, guint num)
+{
+	guint lo = from, hi = from + 1, step = 1, mid;
+
+	while (hi < len && nums[hi] < num) {
+		lo = hi;
+		step *= 2;
+		hi = lo + step;
+	}
+	if (hi > len)
+		hi = len;
+
+	while (lo + 1 < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (nums[mid] < num)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return hi;
 }
 
 static gint syncronize_flags(FolderItem *item, MsgInfoList *msglist)
@@ -2124,41 +2171,135 @@ static MsgInfo *get_msginfo(FolderItem *item, guint num)
 	return msginfo;
 }
 
-gint folder_item_scan_full(FolderItem *item, gboolean filtering)
+/* New messages of a folder being scanned that its class has handed
+ * over before get_msginfos() returns, see folder_item_scan_add_msginfos() */
+typedef struct _FolderScanStream {
+	GHashTable *added;	/* MsgInfo -> itself, a reference each */
+	guint shown;		/* how many there were at the last refresh */
+} FolderScanStream;
+
+static GHashTable *folder_scan_streams = NULL;	/* FolderItem -> stream */
+
+static void folder_scan_stream_unref(gpointer data)
 {
-	Folder *folder;
-	GSList *folder_list = NULL, *cache_list = NULL;
-	GSList *folder_list_cur, *cache_list_cur, *new_list = NULL;
+	MsgInfo *msginfo = (MsgInfo *)data;
+
+	procmsg_msginfo_free(&msginfo);
+}
+
+static void folder_scan_stream_start(FolderItem *item)
+{
+	FolderScanStream *stream = g_new0(FolderScanStream, 1);
+
+	stream->added = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+					      folder_scan_stream_unref, NULL);
+	if (folder_scan_streams == NULL)
+		folder_scan_streams = g_hash_table_new(g_direct_hash,
+						       g_direct_equal);
+	g_hash_table_insert(folder_scan_streams, item, stream);
+}
+
+/* Returns the messages that were added to the cache early. */
+static GHashTable *folder_scan_stream_end(FolderItem *item)
+{
+	FolderScanStream *stream;
+	GHashTable *added;
+
+	stream = g_hash_table_lookup(folder_scan_streams, item);
+	g_hash_table_remove(folder_scan_streams, item);
+	added = stream->added;
+	g_free(stream);
+
+	return added;
+}
+
+/**
+ * Hand over new messages while get_msginfos() is still fetching the
+ * rest, so that they go into the cache and show up in the summary
+ * right away. Does nothing unless the item is being scanned and its new
+ * messages need no filtering first. The MsgInfos must also be among
+ * those get_msginfos() returns; the cache takes references of its own.
+ *
+ * \param item The FolderItem being scanned
+ * \param msglist The MsgInfos fetched so far, or some of them
+ */
+void folder_item_scan_add_msginfos(FolderItem *item, MsgInfoList *msglist)
+{
+	FolderScanStream *stream;
+	MsgInfoList *cur;
+	guint count;
+	FolderItemUpdateFlags update_flags = F_ITEM_UPDATE_MSGCNT;
+
+	if (folder_scan_streams == NULL || item->cache == NULL ||
+	    (stream = g_hash_table_lookup(folder_scan_streams, item)) == NULL)
+		return;
+
+	for (cur = msglist; cur != NULL; cur = cur->next) {
+		MsgInfo *msginfo = (MsgInfo *)cur->data;
+
+		if (g_hash_table_lookup(stream->added, msginfo) != NULL)
+			continue;
+		msgcache_add_msg(item->cache, msginfo);
+		g_hash_table_insert(stream->added,
+				    procmsg_msginfo_new_ref(msginfo), msginfo);
+
+		/* rough counts until the scan recounts everything */
+		item->total_msgs++;
+		if (MSG_IS_NEW(msginfo->flags))
+			item->new_msgs++;
+		if (MSG_IS_UNREAD(msginfo->flags))
+			item->unread_msgs++;
+	}
+
+	/* redrawing the summary each time would take quadratic time on
+	 * a big folder: only do it once the count has doubled */
+	count = g_hash_table_size(stream->added);
+	if (count >= stream->shown * 2) {
+		stream->shown = count;
+		update_flags |= F_ITEM_UPDATE_CONTENT;
+	}
+	folder_item_update(item, update_flags);
+}
+
+/* First half of a scan: fetches the folder's message numbers. */
+static gint folder_item_scan_get_num_list(FolderItem *item, GSList **folder_list,
+					  gboolean *old_uids_valid)
+{
+	Folder *folder = item->folder;
+
+	if (folder->klass->get_num_list(folder, item, folder_list, old_uids_valid) < 0) {
+		debug_print("Error fetching list of message numbers\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Second half of a scan: reconciles the message numbers with the cache,
+ * fetches new messages and updates the counts. Main thread only. */
+static gint folder_item_scan_diff(FolderItem *item, gboolean filtering,
+				  GSList *folder_list, gboolean old_uids_valid)
+{
+	Folder *folder = item->folder;
+	GSList *new_list = NULL;
 	GSList *exists_list = NULL, *elem;
 	GSList *newmsg_list = NULL;
+	GArray *folder_nums, *cache_nums;
+	const guint *fnums, *cnums;
+	guint fi = 0, ci = 0, fend, cend;
 	guint newcnt = 0, unreadcnt = 0, totalcnt = 0;
 	guint markedcnt = 0, unreadmarkedcnt = 0;
 	guint repliedcnt = 0, forwardedcnt = 0;
 	guint lockedcnt = 0, ignoredcnt = 0, watchedcnt = 0;
 
 	guint cache_max_num, folder_max_num, cache_cur_num, folder_cur_num;
-	gboolean update_flags = 0, old_uids_valid = FALSE;
+	gboolean update_flags = 0;
+	gboolean do_filter;
 	GHashTable *subject_table = NULL;
+	GHashTable *streamed = NULL;
 	
-	cm_return_val_if_fail(item != NULL, -1);
-	if (item->path == NULL) return -1;
-
-	folder = item->folder;
-
-	cm_return_val_if_fail(folder != NULL, -1);
-	cm_return_val_if_fail(folder->klass->get_num_list != NULL, -1);
-
 	item->scanning = ITEM_SCANNING_WITH_FLAGS;
 
-	debug_print("Scanning folder %s for cache changes.\n", item->path ? item->path : "(null)");
-	
-	/* Get list of messages for folder and cache */
-	if (folder->klass->get_num_list(item->folder, item, &folder_list, &old_uids_valid) < 0) {
-		debug_print("Error fetching list of message numbers\n");
-		item->scanning = ITEM_NOT_SCANNING;
-		return(-1);
-	}
-
 	if(prefs_common.thread_by_subject) {
 		subject_table = g_hash_table_new(g_str_hash, g_str_equal);
 	}
@@ -2166,107 +2307,107 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 	if (old_uids_valid) {
 		if (!item->cache)
 			folder_item_read_cache(item);
-		cache_list = msgcache_get_msg_list(item->cache);
+		cache_nums = msgcache_get_msgnum_array(item->cache);
 	} else {
 		if (item->cache)
 			msgcache_destroy(item->cache);
 		item->cache = msgcache_new();
+		msgcache_attach(item->cache, item);
 		item->cache_dirty = TRUE;
 		item->mark_dirty = TRUE;
 		item->tags_dirty = TRUE;
-		cache_list = NULL;
+		cache_nums = g_array_new(FALSE, FALSE, sizeof(guint));
 	}
 
-	/* Sort both lists */
-    	cache_list = g_slist_sort(cache_list, folder_sort_cache_list_by_msgnum);
-	folder_list = g_slist_sort(folder_list, folder_sort_folder_list);
+	/* Diff on sorted arrays of numbers rather than on lists */
+	folder_nums = folder_num_list_to_array(folder_list);
+	g_slist_free(folder_list);
 
-	cache_list_cur = cache_list;
-	folder_list_cur = folder_list;
+	fnums = (const guint *)folder_nums->data;
+	cnums = (const guint *)cache_nums->data;
 
-	if (cache_list_cur != NULL) {
-		GSList *cache_list_last;
-	
-		cache_cur_num = ((MsgInfo *)cache_list_cur->data)->msgnum;
-		cache_list_last = g_slist_last(cache_list);
-		cache_max_num = ((MsgInfo *)cache_list_last->data)->msgnum;
-	} else {
-		cache_cur_num = G_MAXINT;
-		cache_max_num = 0;
-	}
+	cache_max_num = cache_nums->len > 0 ? cnums[cache_nums->len - 1] : 0;
+	folder_max_num = folder_nums->len > 0 ? fnums[folder_nums->len - 1] : 0;
 
-	if (folder_list_cur != NULL) {
-		GSList *folder_list_last;
-	
-		folder_cur_num = GPOINTER_TO_INT(folder_list_cur->data);
-		folder_list_last = g_slist_last(folder_list);
-		folder_max_num = GPOINTER_TO_INT(folder_list_last->data);
-	} else {
-		folder_cur_num = G_MAXINT;
-		folder_max_num = 0;
+	if (folder->klass->increasing_msgnums && old_uids_valid &&
+	    folder_nums->len == cache_nums->len &&
+	    folder_max_num == cache_max_num &&
+	    memcmp(fnums, cnums, folder_nums->len * sizeof(guint)) == 0) {
+		/*
+		 *  Numbers are never reused and messages never change in
+		 *  place, so the same sorted numbers mean the same messages.
+		 *  Other folders (MH) still need is_msg_changed on each one
+		 */
+		debug_print("Message list of %s unchanged, skipping diff\n", item->path);
+		exists_list = msgcache_get_msg_list(item->cache);
+		if (prefs_common.thread_by_subject) {
+			for (elem = exists_list; elem != NULL; elem = elem->next) {
+				MsgInfo *msginfo = (MsgInfo *)elem->data;
+
+				if (MSG_IS_IGNORE_THREAD(msginfo->flags) &&
+				    !subject_table_lookup(subject_table, msginfo->subject))
+					subject_table_insert(subject_table, msginfo->subject, msginfo);
+			}
+		}
+		fi = folder_nums->len;
+		ci = cache_nums->len;
 	}
 
-	while ((cache_cur_num != G_MAXINT) || (folder_cur_num != G_MAXINT)) {
+	while (fi < folder_nums->len || ci < cache_nums->len) {
+		folder_cur_num = fi < folder_nums->len ? fnums[fi] : G_MAXUINT;
+		cache_cur_num = ci < cache_nums->len ? cnums[ci] : G_MAXUINT;
+
 		/*
-		 *  Message only exists in the folder
-		 *  Remember message for fetching
+		 *  Messages only existing in the folder
+		 *  Remember them for fetching
 		 */
 		if (folder_cur_num < cache_cur_num) {
-			gboolean add = FALSE;
+			fend = folder_num_array_gallop(fnums, fi, folder_nums->len, cache_cur_num);
 
-			switch(FOLDER_TYPE(folder)) {
-				case F_NEWS:
-					if (folder_cur_num < cache_max_num)
-						break;
-					
-					if (folder->account->max_articles == 0) {
-						add = TRUE;
-					}
+			for (; fi < fend; fi++) {
+				gboolean add = FALSE;
 
-					if (folder_max_num <= folder->account->max_articles) {
-						add = TRUE;
-					} else if (folder_cur_num > (folder_max_num - folder->account->max_articles)) {
+				folder_cur_num = fnums[fi];
+				switch(FOLDER_TYPE(folder)) {
+					case F_NEWS:
+						if (folder_cur_num < cache_max_num)
+							break;
+					
+						if (folder->account->max_articles == 0) {
+							add = TRUE;
+						}
+
+						if (folder_max_num <= folder->account->max_articles) {
+							add = TRUE;
+						} else if (folder_cur_num > (folder_max_num - folder->account->max_articles)) {
+							add = TRUE;
+						}
+						break;
+					default:
 						add = TRUE;
-					}
-					break;
-				default:
-					add = TRUE;
-					break;
-			}
+						break;
+				}
 			
-			if (add) {
-				new_list = g_slist_prepend(new_list, GINT_TO_POINTER(folder_cur_num));
-				debug_print("Remembered message %d for fetching\n", folder_cur_num);
+				if (add) {
+					new_list = g_slist_prepend(new_list, GINT_TO_POINTER(folder_cur_num));
+					debug_print("Remembered message %d for fetching\n", folder_cur_num);
+				}
 			}
 
-			/* Move to next folder number */
-			if (folder_list_cur)
-				folder_list_cur = folder_list_cur->next;
-
-			if (folder_list_cur != NULL)
-				folder_cur_num = GPOINTER_TO_INT(folder_list_cur->data);
-			else
-				folder_cur_num = G_MAXINT;
-
 			continue;
 		}
 
 		/*
-		 *  Message only exists in the cache
-		 *  Remove the message from the cache
+		 *  Messages only existing in the cache
+		 *  Remove them from the cache
 		 */
 		if (cache_cur_num < folder_cur_num) {
-			msgcache_remove_msg(item->cache, cache_cur_num);
-			debug_print("Removed message %d from cache.\n", cache_cur_num);
-
-			/* Move to next cache number */
-			if (cache_list_cur)
-				cache_list_cur = cache_list_cur->next;
+			cend = folder_num_array_gallop(cnums, ci, cache_nums->len, folder_cur_num);
 
-			if (cache_list_cur != NULL)
-				cache_cur_num = ((MsgInfo *)cache_list_cur->data)->msgnum;
-			else
-				cache_cur_num = G_MAXINT;
+			for (; ci < cend; ci++) {
+				msgcache_remove_msg(item->cache, cnums[ci]);
+				debug_print("Removed message %d from cache.\n", cnums[ci]);
+			}
 
 			update_flags |= F_ITEM_UPDATE_MSGCNT | F_ITEM_UPDATE_CONTENT;
 
@@ -2298,36 +2439,48 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 			}
 			
 			/* Move to next folder and cache number */
-			if (cache_list_cur)
-				cache_list_cur = cache_list_cur->next;
-			
-			if (folder_list_cur)
-				folder_list_cur = folder_list_cur->next;
-
-			if (cache_list_cur != NULL)
-				cache_cur_num = ((MsgInfo *)cache_list_cur->data)->msgnum;
-			else
-				cache_cur_num = G_MAXINT;
-
-			if (folder_list_cur != NULL)
-				folder_cur_num = GPOINTER_TO_INT(folder_list_cur->data);
-			else
-				folder_cur_num = G_MAXINT;
-
-			continue;
+			fi++;
+			ci++;
 		}
 	}
 	
-	for(cache_list_cur = cache_list; cache_list_cur != NULL; cache_list_cur = g_slist_next(cache_list_cur))
-		procmsg_msginfo_free((MsgInfo **)&(cache_list_cur->data));
+	g_array_free(folder_nums, TRUE);
+	g_array_free(cache_nums, TRUE);
 
-	g_slist_free(cache_list);
-	g_slist_free(folder_list);
+	do_filter = (filtering == TRUE) &&
+		    (item->stype == F_INBOX) &&
+		    (item->folder->account != NULL) && 
+		    (item->folder->account->filter_on_recv);
 
 	if (new_list != NULL) {
 		GSList *tmp_list = NULL;
+
+		/* messages to be filtered mustn't be seen before */
+		if (!do_filter)
+			folder_scan_stream_start(item);
 		newmsg_list = get_msginfos(item, new_list);
+		if (!do_filter)
+			streamed = folder_scan_stream_end(item);
 		g_slist_free(new_list);
+
+		/* in the cache already even if fetching the rest failed */
+		if (streamed != NULL && g_hash_table_size(streamed) > 0) {
+			GHashTable *fetched;
+			GHashTableIter iter;
+			gpointer key;
+
+			fetched = g_hash_table_new(g_direct_hash, g_direct_equal);
+			for (elem = newmsg_list; elem != NULL; elem = elem->next)
+				g_hash_table_insert(fetched, elem->data, elem->data);
+			g_hash_table_iter_init(&iter, streamed);
+			while (g_hash_table_iter_next(&iter, &key, NULL)) {
+				if (g_hash_table_lookup(fetched, key) == NULL)
+					newmsg_list = g_slist_prepend(newmsg_list,
+						procmsg_msginfo_new_ref((MsgInfo *)key));
+			}
+			g_hash_table_destroy(fetched);
+		}
+
 		tmp_list = g_slist_concat(g_slist_copy(exists_list), g_slist_copy(newmsg_list));
 		syncronize_flags(item, tmp_list);
 		g_slist_free(tmp_list);
@@ -2341,15 +2494,13 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 
 	if (newmsg_list != NULL) {
 		GSList *elem, *to_filter = NULL;
-		gboolean do_filter = (filtering == TRUE) &&
-		    			(item->stype == F_INBOX) &&
-		   			(item->folder->account != NULL) && 
-		   			(item->folder->account->filter_on_recv);
 		
 		for (elem = newmsg_list; elem != NULL; elem = g_slist_next(elem)) {
 			MsgInfo *msginfo = (MsgInfo *) elem->data;
 
-			msgcache_add_msg(item->cache, msginfo);
+			if (streamed == NULL ||
+			    g_hash_table_lookup(streamed, msginfo) == NULL)
+				msgcache_add_msg(item->cache, msginfo);
 			if (!do_filter) {
 				exists_list = g_slist_prepend(exists_list, msginfo);
 
@@ -2455,6 +2606,8 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 	}
 	folder_item_set_batch(item, FALSE);
 	g_slist_free(exists_list);
+	if (streamed != NULL)
+		g_hash_table_destroy(streamed);
 	
 	if(prefs_common.thread_by_subject) {
 		g_hash_table_destroy(subject_table);
@@ -2490,47 +2643,364 @@ gint folder_item_scan_full(FolderItem *item, gboolean filtering)
 	return 0;
 }
 
+gint folder_item_scan_full(FolderItem *item, gboolean filtering)
+{
+	Folder *folder;
+	GSList *folder_list = NULL;
+	gboolean old_uids_valid = FALSE;
+
+	cm_return_val_if_fail(item != NULL, -1);
+	if (item->path == NULL) return -1;
+
+	folder = item->folder;
+
+	cm_return_val_if_fail(folder != NULL, -1);
+	cm_return_val_if_fail(folder->klass->get_num_list != NULL, -1);
+
+	item->scanning = ITEM_SCANNING_WITH_FLAGS;
+
+	debug_print("Scanning folder %s for cache changes.\n", item->path ? item->path : "(null)");
+	
+	/* Get list of messages for folder and cache */
+	if (folder_item_scan_get_num_list(item, &folder_list, &old_uids_valid) < 0) {
+		item->scanning = ITEM_NOT_SCANNING;
+		return(-1);
+	}
+
+	return folder_item_scan_diff(item, filtering, folder_list, old_uids_valid);
+}
+
 gint folder_item_scan(FolderItem *item)
 {
 	return folder_item_scan_full(item, TRUE);
 }
 
-static void folder_count_total_cache_memusage(FolderItem *item, gpointer data)
+typedef struct _FolderScanJob FolderScanJob;
+struct _FolderScanJob {
+	FolderItem	*item;
+	/* what folder_scan_job_list() may use, set from the main thread */
+	gchar		*dir;
+	gint		(*list_dir)(const gchar *dir, GSList **list,
+				    time_t *mtime);
+
+	GSList		*num_list;
+	time_t		 mtime;
+	gint		 result;
+};
+
+/* Lists a folder from its directory. Touches nothing but the job, so
+ * it may run on a worker thread. */
+static void folder_scan_job_list(FolderScanJob *job)
 {
-	gint *memusage = (gint *)data;
+	job->result = job->dir != NULL &&
+		      job->list_dir(job->dir, &job->num_list, &job->mtime) >= 0
+		      ? 0 : -1;
+}
 
-	if (item->cache == NULL)
-		return;
-	
-	*memusage += msgcache_get_memory_usage(item->cache);
+#ifdef USE_PTHREAD
+typedef struct _FolderScanner FolderScanner;
+struct _FolderScanner {
+	pthread_mutex_t	 mutex;
+	GSList		*pending;
+	GSList		*finished;
+};
+
+static void *folder_scan_thread(void *data)
+{
+	FolderScanner *scanner = (FolderScanner *)data;
+	FolderScanJob *job;
+
+	for (;;) {
+		pthread_mutex_lock(&scanner->mutex);
+		if (scanner->pending != NULL) {
+			job = (FolderScanJob *)scanner->pending->data;
+			scanner->pending = g_slist_delete_link(scanner->pending,
+							       scanner->pending);
+		} else
+			job = NULL;
+		pthread_mutex_unlock(&scanner->mutex);
+
+		if (job == NULL)
+			break;
+
+		folder_scan_job_list(job);
+
+		pthread_mutex_lock(&scanner->mutex);
+		scanner->finished = g_slist_prepend(scanner->finished, job);
+		pthread_mutex_unlock(&scanner->mutex);
+	}
+
+	return NULL;
 }
+#endif
 
-static gint folder_cache_time_compare_func(gconstpointer a, gconstpointer b)
+/* Filtering new messages moves them to other folders, some of which may
+ * be being listed at the same time; such scans are finished last. */
+static gboolean folder_scan_may_filter(FolderItem *item, gboolean filtering)
 {
-	FolderItem *fa = (FolderItem *)a;
-	FolderItem *fb = (FolderItem *)b;
-	
-	return (gint) (msgcache_get_last_access_time(fa->cache) - msgcache_get_last_access_time(fb->cache));
+	return filtering && item->stype == F_INBOX;
 }
 
-static void folder_find_expired_caches(FolderItem *item, gpointer data)
+typedef struct _FolderScanProgress FolderScanProgress;
+struct _FolderScanProgress {
+	gint		 done;
+	gint		 total;
+};
+
+/* Says in the status bar which folder is being scanned now, with how
+ * many of them are done. */
+static void folder_scan_progress(FolderScanProgress *progress,
+				 FolderItem *item)
 {
-	GSList **folder_item_list = (GSList **)data;
-	gint difftime, expiretime;
-	
-	if (item->cache == NULL)
-		return;
+	if (item->path)
+		statusbar_print_all(_("Scanning folder %s/%s..."),
+				    item->folder->name, item->path);
+	else
+		statusbar_print_all(_("Scanning folder %s..."),
+				    item->folder->name);
+	statusbar_progress_all(progress->done++, progress->total, 1);
+}
+
+static gboolean folder_scan_done(FolderItem *item, gint result,
+				 FolderScanDoneFunc done_func, gpointer data)
+{
+	item->scanning = ITEM_NOT_SCANNING;
+	folder_item_update(item, F_ITEM_UPDATE_SCANNING);
+
+	if (done_func)
+		return done_func(item, result, data);
+	return TRUE;
+}
+
+static void folder_scan_job_finish(FolderScanJob *job, gboolean filtering,
+				   FolderScanProgress *progress,
+				   FolderScanDoneFunc done_func, gpointer data)
+{
+	gint result = job->result;
+
+	folder_scan_progress(progress, job->item);
+
+	if (result >= 0) {
+		job->item->mtime = job->mtime;
+		result = folder_item_scan_diff(job->item, filtering,
+					       job->num_list, TRUE);
+	} else {
+		debug_print("Error fetching list of message numbers\n");
+		g_slist_free(job->num_list);
+	}
+
+	folder_scan_done(job->item, result, done_func, data);
+	g_free(job->dir);
+	g_free(job);
+}
+
+static void folder_scan_remote(FolderItem *item, gboolean filtering,
+			       FolderScanProgress *progress,
+			       GSList **skipped_folders,
+			       FolderScanDoneFunc done_func, gpointer data)
+{
+	gint result;
 
-	if (item->opened > 0)
+	if (g_slist_find(*skipped_folders, item->folder)) {
+		progress->done++;
+		item->scanning = ITEM_NOT_SCANNING;
+		folder_item_update(item, F_ITEM_UPDATE_SCANNING);
 		return;
+	}
+
+	folder_scan_progress(progress, item);
+
+	result = folder_item_scan_full(item, filtering);
+
+	if (!folder_scan_done(item, result, done_func, data))
+		*skipped_folders = g_slist_prepend(*skipped_folders, item->folder);
+}
+
+/**
+ * Scan several folders at once. The message numbers of folders whose
+ * class has get_num_list_from_dir are listed on up to
+ * prefs_common.scan_threads worker threads, while the other folders
+ * are scanned one after the other from the main thread meanwhile. Each
+ * folder is reconciled with its cache on the main thread as soon as its
+ * list is in, and done_func is called for it right away.
+ *
+ * Each item is announced through the folder_item_update hooks with
+ * F_ITEM_UPDATE_SCANNING when it is queued and again once it is done.
+ * The status bar tells which folder is being scanned or reconciled.
+ *
+ * \param items The FolderItems to scan. Items being scanned already
+ *              are skipped.
+ * \param filtering Whether to filter new messages in inboxes
+ * \param done_func Called with each item and the result its scan would
+ *                  have returned from folder_item_scan_full(). If it
+ *                  returns FALSE, the items of the same Folder that are
+ *                  scanned from the main thread and have not been
+ *                  started yet are skipped. May be NULL.
+ * \param data Passed to done_func
+ */
+void folder_item_scan_items(GSList *items, gboolean filtering,
+			    FolderScanDoneFunc done_func, gpointer data)
+{
+	GSList *jobs = NULL, *remote_items = NULL, *skipped_folders = NULL;
+	GSList *late_jobs = NULL, *late_items = NULL, *cur;
+	FolderScanJob *job;
+	FolderScanProgress progress;
+	gint count = 0;
+	START_TIMING("");
+
+	progress.done = 0;
+	progress.total = 0;
+	folder_scans_running++;
 
-	difftime = (gint) (time(NULL) - msgcache_get_last_access_time(item->cache));
-	expiretime = prefs_common.cache_min_keep_time * 60;
-	debug_print("Cache unused time: %d (Expire time: %d)\n", difftime, expiretime);
+	for (cur = items; cur != NULL; cur = cur->next) {
+		FolderItem *item = (FolderItem *)cur->data;
 
-	if (difftime > expiretime && !item->opened && !item->processing_pending) {
-		*folder_item_list = g_slist_insert_sorted(*folder_item_list, item, folder_cache_time_compare_func);
+		if (item->path == NULL || item->folder == NULL ||
+		    item->folder->klass->get_num_list == NULL)
+			continue;
+		if (item->scanning != ITEM_NOT_SCANNING)
+			continue;
+
+		item->scanning = ITEM_SCANNING_WITH_FLAGS;
+		folder_item_update(item, F_ITEM_UPDATE_SCANNING);
+		progress.total++;
+
+		if (!item->folder->klass->get_num_list_from_dir) {
+			if (folder_scan_may_filter(item, filtering))
+				late_items = g_slist_prepend(late_items, item);
+			else
+				remote_items = g_slist_prepend(remote_items, item);
+			continue;
+		}
+
+		/* the workers don't touch the item: looking up the path
+		 * may even move the folder's directory */
+		job = g_new0(FolderScanJob, 1);
+		job->item = item;
+		job->dir = folder_item_get_path(item);
+		job->list_dir = item->folder->klass->get_num_list_from_dir;
+		jobs = g_slist_prepend(jobs, job);
+		count++;
+	}
+	jobs = g_slist_reverse(jobs);
+	remote_items = g_slist_reverse(remote_items);
+	late_items = g_slist_reverse(late_items);
+
+#ifdef USE_PTHREAD
+	if (prefs_common.scan_threads > 0 && count > 0) {
+		FolderScanner scanner;
+		pthread_t *threads;
+		gint i, nthreads, started = 0;
+
+		nthreads = MIN(prefs_common.scan_threads, count);
+		threads = g_new(pthread_t, nthreads);
+
+		pthread_mutex_init(&scanner.mutex, NULL);
+		scanner.pending = jobs;
+		scanner.finished = NULL;
+
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_create(&threads[started], NULL,
+					   folder_scan_thread, &scanner) == 0)
+				started++;
+		}
+		debug_print("listing %d folders with %d threads\n",
+			    count, started);
+
+		while (started > 0 && count > 0) {
+			GSList *finished;
+
+			pthread_mutex_lock(&scanner.mutex);
+			finished = g_slist_reverse(scanner.finished);
+			scanner.finished = NULL;
+			pthread_mutex_unlock(&scanner.mutex);
+
+			for (cur = finished; cur != NULL; cur = cur->next) {
+				job = (FolderScanJob *)cur->data;
+				if (folder_scan_may_filter(job->item, filtering))
+					late_jobs = g_slist_prepend(late_jobs, job);
+				else
+					folder_scan_job_finish(job, filtering,
+							       &progress,
+							       done_func, data);
+				count--;
+			}
+			g_slist_free(finished);
+
+			if (count == 0)
+				break;
+
+			/* scan a remote folder while the workers list */
+			if (remote_items != NULL) {
+				FolderItem *item = (FolderItem *)remote_items->data;
+
+				remote_items = g_slist_delete_link(remote_items,
+								   remote_items);
+				folder_scan_remote(item, filtering, &progress,
+						   &skipped_folders,
+						   done_func, data);
+			} else
+				claws_do_idle();
+		}
+
+		for (i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+		pthread_mutex_destroy(&scanner.mutex);
+		g_free(threads);
+
+		/* whatever no thread could be started for */
+		jobs = scanner.pending;
+	}
+#endif
+
+	for (cur = jobs; cur != NULL; cur = cur->next) {
+		job = (FolderScanJob *)cur->data;
+		folder_scan_job_list(job);
+		if (folder_scan_may_filter(job->item, filtering))
+			late_jobs = g_slist_prepend(late_jobs, job);
+		else
+			folder_scan_job_finish(job, filtering, &progress,
+					       done_func, data);
+	}
+	g_slist_free(jobs);
+
+	for (cur = remote_items; cur != NULL; cur = cur->next)
+		folder_scan_remote((FolderItem *)cur->data, filtering,
+				   &progress, &skipped_folders,
+				   done_func, data);
+	g_slist_free(remote_items);
+
+	/* nothing is being listed anymore, so filtering is safe now */
+	late_jobs = g_slist_reverse(late_jobs);
+	for (cur = late_jobs; cur != NULL; cur = cur->next)
+		folder_scan_job_finish((FolderScanJob *)cur->data, filtering,
+				       &progress, done_func, data);
+	g_slist_free(late_jobs);
+
+	for (cur = late_items; cur != NULL; cur = cur->next)
+		folder_scan_remote((FolderItem *)cur->data, filtering,
+				   &progress, &skipped_folders,
+				   done_func, data);
+	g_slist_free(late_items);
+
+	if (progress.total > 0) {
+		statusbar_progress_all(0, 0, 0);
+		statusbar_pop_all();
 	}
+
+	g_slist_free(skipped_folders);
+	folder_scans_running--;
+	END_TIMING();
+}
+
+/**
+ * Tell whether folder_item_scan_items() or folder_item_read_caches()
+ * is running, possibly further up the stack while the main loop is
+ * iterated from within.
+ */
+gboolean folder_scan_is_active(void)
+{
+	return folder_scans_running > 0;
 }
 
 gboolean folder_item_free_cache(FolderItem *item, gboolean force)
@@ -2563,38 +3033,60 @@ void folder_clean_cache_memory_force(void)
 	prefs_common.cache_min_keep_time = old_cache_min_keep_time;
 }
 
+/* Frees least recently used caches until the total is back under
+ * cache_max_mem_usage. The LRU order means the walk can stop at the
+ * first cache that was used within cache_min_keep_time. */
 void folder_clean_cache_memory(FolderItem *protected_item)
 {
-	gint memusage = 0;
+	guint max_memusage = prefs_common.cache_max_mem_usage * 1024;
+	time_t expire_time = time(NULL) - prefs_common.cache_min_keep_time * 60;
+	MsgCache *cache, *next;
 
-	folder_func_to_all_folders(folder_count_total_cache_memusage, &memusage);	
-	debug_print("Total cache memory usage: %d\n", memusage);
-	
-	if (memusage > (prefs_common.cache_max_mem_usage * 1024)) {
-		GSList *folder_item_list = NULL, *listitem;
-		
-		debug_print("Trying to free cache memory\n");
-
-		folder_func_to_all_folders(folder_find_expired_caches, &folder_item_list);	
-		listitem = folder_item_list;
-		while((listitem != NULL) && (memusage > (prefs_common.cache_max_mem_usage * 1024))) {
-			FolderItem *item = (FolderItem *)(listitem->data);
-			gint cache_size = 0;
-			if (item == protected_item) {
-				listitem = listitem->next;
-				continue;
-			}
-			debug_print("Freeing cache memory for %s\n", item->path ? item->path : item->name);
-			cache_size = msgcache_get_memory_usage(item->cache);
-		        if (folder_item_free_cache(item, FALSE))
-				memusage -= cache_size;
+	debug_print("Total cache memory usage: %u\n", msgcache_get_total_memory_usage());
 
-			listitem = listitem->next;
-		}
-		g_slist_free(folder_item_list);
+	if (msgcache_get_total_memory_usage() <= max_memusage)
+		return;
+
+	debug_print("Trying to free cache memory\n");
+
+	for (cache = msgcache_get_lru_next(NULL);
+	     cache != NULL && msgcache_get_total_memory_usage() > max_memusage;
+	     cache = next) {
+		FolderItem *item = msgcache_get_item(cache);
+
+		if (msgcache_get_last_access_time(cache) >= expire_time)
+			break;
+
+		next = msgcache_get_lru_next(cache);
+		if (item == protected_item || item->opened || item->processing_pending)
+			continue;
+
+		debug_print("Freeing cache memory for %s\n", item->path ? item->path : item->name);
+		folder_item_free_cache(item, FALSE);
 	}
 }
 
+static gboolean folder_clean_cache_memory_func(gpointer data)
+{
+	folder_clean_cache_memory_timeout_id = 0;
+	folder_clean_cache_memory(NULL);
+	return FALSE;
+}
+
+/* Runs folder_clean_cache_memory() once things have settled down,
+ * rather than every time a cache is read. */
+void folder_clean_cache_memory_later(void)
+{
+	if (folder_clean_cache_memory_timeout_id != 0)
+		return;
+	if (msgcache_get_total_memory_usage() <= prefs_common.cache_max_mem_usage * 1024)
+		return;
+
+	folder_clean_cache_memory_timeout_id =
+		g_timeout_add_seconds(FOLDER_CLEAN_CACHE_MEMORY_DELAY,
+				      folder_clean_cache_memory_func, NULL);
+}
+
 static void folder_item_remove_cached_msg(FolderItem *item, MsgInfo *msginfo)
 {
 	Folder *folder = item->folder;
@@ -2629,7 +3121,7 @@ static void folder_item_clean_local_files(FolderItem *item, gint days)
 
 static void folder_item_read_cache(FolderItem *item)
 {
-	gchar *cache_file, *mark_file, *tags_file;
+	gchar *cache_file, *mark_file, *tags_file, *journal_file;
 	START_TIMING("");
 	cm_return_if_fail(item != NULL);
 
@@ -2637,10 +3129,15 @@ static void folder_item_read_cache(FolderItem *item)
 	        cache_file = folder_item_get_cache_file(item);
 		mark_file = folder_item_get_mark_file(item);
 		tags_file = folder_item_get_tags_file(item);
+		journal_file = folder_item_get_journal_file(item);
 		item->cache = msgcache_read_cache(item, cache_file);
+		if (item->cache)
+			msgcache_attach(item->cache, item);
 		item->cache_dirty = FALSE;
 		item->mark_dirty = FALSE;
 		item->tags_dirty = FALSE;
+		item->mark_journal_dirty = FALSE;
+		item->tags_journal_dirty = FALSE;
 		if (!item->cache) {
 			MsgInfoList *list, *cur;
 			guint newcnt = 0, unreadcnt = 0;
@@ -2651,12 +3148,15 @@ static void folder_item_read_cache(FolderItem *item)
 			MsgInfo *msginfo;
 
 			item->cache = msgcache_new();
+			msgcache_attach(item->cache, item);
 			item->cache_dirty = TRUE;
 			item->mark_dirty = TRUE;
 			item->tags_dirty = TRUE;
 			folder_item_scan_full(item, TRUE);
 
 			msgcache_read_mark(item->cache, mark_file);
+			msgcache_read_tags(item->cache, tags_file);
+			msgcache_read_journal(item->cache, journal_file);
 
 			list = msgcache_get_msg_list(item->cache);
 			for (cur = list; cur != NULL; cur = g_slist_next(cur)) {
@@ -2692,30 +3192,233 @@ static void folder_item_read_cache(FolderItem *item)
 			item->ignored_msgs = ignoredcnt;
 			item->watched_msgs = watchedcnt;
 			procmsg_msg_list_free(list);
-		} else
+		} else {
 			msgcache_read_mark(item->cache, mark_file);
-
-		msgcache_read_tags(item->cache, tags_file);
+			msgcache_read_tags(item->cache, tags_file);
+			msgcache_read_journal(item->cache, journal_file);
+		}
 
 		g_free(cache_file);
 		g_free(mark_file);
 		g_free(tags_file);
+		g_free(journal_file);
 	} else {
 		item->cache = msgcache_new();
+		msgcache_attach(item->cache, item);
 		item->cache_dirty = TRUE;
 		item->mark_dirty = TRUE;
 		item->tags_dirty = TRUE;
 	}
 
 	END_TIMING();
-	folder_clean_cache_memory(item);
+	folder_clean_cache_memory_later();
+}
+
+typedef struct _FolderCacheLoad FolderCacheLoad;
+struct _FolderCacheLoad {
+	gchar		*identifier;
+	MsgTmpFlags	 tmp_flags;
+	gchar		*cache_file;
+	gchar		*mark_file;
+	gchar		*tags_file;
+	gchar		*journal_file;
+	MsgCache	*cache;
+};
+
+#ifdef USE_PTHREAD
+typedef struct _FolderCacheLoader FolderCacheLoader;
+struct _FolderCacheLoader {
+	pthread_mutex_t	 mutex;
+	GSList		*pending;
+	GSList		*finished;
+};
+#endif
+
+/* Only touches the cache files and the new MsgCache, so this part
+ * can run off the main thread. */
+static void folder_cache_load_decode(FolderCacheLoad *load)
+{
+	load->cache = msgcache_read_cache_detached(load->cache_file,
+						   load->tmp_flags);
+	if (load->cache == NULL)
+		return;
+
+	msgcache_read_mark(load->cache, load->mark_file);
+	msgcache_read_tags(load->cache, load->tags_file);
+	msgcache_read_journal(load->cache, load->journal_file);
+}
+
+/* The main loop runs while the caches are read, so the item is looked
+ * up again: it may have been removed or renamed meanwhile. */
+static void folder_cache_load_attach(FolderCacheLoad *load)
+{
+	FolderItem *item = folder_find_item_from_identifier(load->identifier);
+
+	/* a missing or unreadable cache is left to folder_item_read_cache(),
+	 * as is an item that got its cache some other way meanwhile */
+	if (load->cache != NULL) {
+		if (item != NULL && item->cache == NULL &&
+		    item->path != NULL) {
+			item->cache = load->cache;
+			msgcache_attach(item->cache, item);
+			item->cache_dirty = FALSE;
+			item->mark_dirty = FALSE;
+			item->tags_dirty = FALSE;
+			item->mark_journal_dirty = FALSE;
+			item->tags_journal_dirty = FALSE;
+		} else
+			msgcache_destroy(load->cache);
+	}
+
+	g_free(load->identifier);
+	g_free(load->cache_file);
+	g_free(load->mark_file);
+	g_free(load->tags_file);
+	g_free(load->journal_file);
+	g_free(load);
+}
+
+#ifdef USE_PTHREAD
+static void *folder_cache_load_thread(void *data)
+{
+	FolderCacheLoader *loader = (FolderCacheLoader *)data;
+	FolderCacheLoad *load;
+
+	for (;;) {
+		pthread_mutex_lock(&loader->mutex);
+		if (loader->pending != NULL) {
+			load = (FolderCacheLoad *)loader->pending->data;
+			loader->pending = g_slist_delete_link(loader->pending,
+							      loader->pending);
+		} else
+			load = NULL;
+		pthread_mutex_unlock(&loader->mutex);
+
+		if (load == NULL)
+			break;
+
+		folder_cache_load_decode(load);
+
+		pthread_mutex_lock(&loader->mutex);
+		loader->finished = g_slist_prepend(loader->finished, load);
+		pthread_mutex_unlock(&loader->mutex);
+	}
+
+	return NULL;
+}
+#endif
+
+/**
+ * Read the caches of several folders at once. Decoding the cache
+ * files runs on up to prefs_common.cache_read_threads worker threads;
+ * the caches are attached to their FolderItems from the main thread
+ * as they complete.
+ *
+ * \param items The FolderItems to read the caches of. Items that have
+ *              a cache already are skipped.
+ */
+void folder_item_read_caches(GSList *items)
+{
+	GSList *loads = NULL, *cur;
+	FolderCacheLoad *load;
+	gint count = 0;
+	START_TIMING("");
+
+	folder_scans_running++;
+
+	for (cur = items; cur != NULL; cur = cur->next) {
+		FolderItem *item = (FolderItem *)cur->data;
+
+		if (item->cache != NULL || item->path == NULL)
+			continue;
+
+		load = g_new0(FolderCacheLoad, 1);
+		load->identifier = folder_item_get_identifier(item);
+		if (load->identifier == NULL) {
+			g_free(load);
+			continue;
+		}
+		if (folder_has_parent_of_type(item, F_QUEUE))
+			load->tmp_flags = MSG_QUEUED;
+		else if (folder_has_parent_of_type(item, F_DRAFT))
+			load->tmp_flags = MSG_DRAFT;
+		load->cache_file = folder_item_get_cache_file(item);
+		load->mark_file = folder_item_get_mark_file(item);
+		load->tags_file = folder_item_get_tags_file(item);
+		load->journal_file = folder_item_get_journal_file(item);
+		loads = g_slist_prepend(loads, load);
+		count++;
+	}
+	loads = g_slist_reverse(loads);
+
+#ifdef USE_PTHREAD
+	if (prefs_common.cache_read_threads > 1 && count > 1) {
+		FolderCacheLoader loader;
+		pthread_t *threads;
+		gint i, nthreads, started = 0;
+
+		nthreads = MIN(prefs_common.cache_read_threads, count);
+		threads = g_new(pthread_t, nthreads);
+
+		pthread_mutex_init(&loader.mutex, NULL);
+		loader.pending = loads;
+		loader.finished = NULL;
+
+		for (i = 0; i < nthreads; i++) {
+			if (pthread_create(&threads[started], NULL,
+					   folder_cache_load_thread, &loader) == 0)
+				started++;
+		}
+		debug_print("reading %d folder caches with %d threads\n",
+			    count, started);
+
+		while (started > 0 && count > 0) {
+			GSList *finished;
+
+			pthread_mutex_lock(&loader.mutex);
+			finished = loader.finished;
+			loader.finished = NULL;
+			pthread_mutex_unlock(&loader.mutex);
+
+			for (cur = finished; cur != NULL; cur = cur->next) {
+				folder_cache_load_attach((FolderCacheLoad *)cur->data);
+				count--;
+			}
+			g_slist_free(finished);
+
+			if (count > 0)
+				claws_do_idle();
+		}
+
+		for (i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+		pthread_mutex_destroy(&loader.mutex);
+		g_free(threads);
+
+		/* whatever no thread could be started for */
+		loads = loader.pending;
+	}
+#endif
+
+	for (cur = loads; cur != NULL; cur = cur->next) {
+		load = (FolderCacheLoad *)cur->data;
+		folder_cache_load_decode(load);
+		folder_cache_load_attach(load);
+	}
+	g_slist_free(loads);
+
+	folder_scans_running--;
+	END_TIMING();
+	folder_clean_cache_memory_later();
 }
 
 void folder_item_write_cache(FolderItem *item)
 {
 	gchar *cache_file = NULL, *mark_file = NULL, *tags_file = NULL;
+	gchar *journal_file = NULL;
 	FolderItemPrefs *prefs;
 	gint filemode = 0;
+	gint journal_size;
 	gchar *id;
 	time_t last_mtime = (time_t)0;
 	gboolean need_scan = FALSE;
@@ -2735,13 +3438,60 @@ void folder_item_write_cache(FolderItem *item)
 	debug_print("Save cache for folder %s\n", id);
 	g_free(id);
 
+	journal_file = folder_item_get_journal_file(item);
+
+	/* Only flags and/or tags changed, each change with a journal
+	 * record: append them to the journal rather than rewriting the
+	 * mark and tags files, unless the journal has grown big enough to
+	 * be worth compacting. Any change made without a record (mark_dirty
+	 * or tags_dirty set directly) needs the files rewritten. */
+	if (!item->cache_dirty && !item->mark_dirty && !item->tags_dirty &&
+	    prefs_common.cache_journal_max_size > 0 &&
+	    msgcache_can_journal(item->cache, item->mark_journal_dirty,
+				 item->tags_journal_dirty)) {
+		journal_size = msgcache_write_journal(journal_file, item->cache);
+		if (journal_size >= 0) {
+			item->mark_journal_dirty = FALSE;
+			item->tags_journal_dirty = FALSE;
+			if (journal_size > prefs_common.cache_journal_max_size * 1024) {
+				debug_print("Compacting cache journal (%d bytes)\n",
+					    journal_size);
+				item->mark_dirty = TRUE;
+				item->tags_dirty = TRUE;
+			}
+		}
+	}
+
+	/* what could not go to the journal goes into the files */
+	if (item->mark_journal_dirty)
+		item->mark_dirty = TRUE;
+	if (item->tags_journal_dirty)
+		item->tags_dirty = TRUE;
+	item->mark_journal_dirty = FALSE;
+	item->tags_journal_dirty = FALSE;
+
+	if (!item->cache_dirty && !item->mark_dirty && !item->tags_dirty) {
+		g_free(journal_file);
+		goto out;
+	}
+
+	/* the journal can only be dropped if both files it covers
+	 * are rewritten */
+	if (is_file_exist(journal_file)) {
+		item->mark_dirty = TRUE;
+		item->tags_dirty = TRUE;
+	} else {
+		g_free(journal_file);
+		journal_file = NULL;
+	}
+
 	if (item->cache_dirty)
 		cache_file = folder_item_get_cache_file(item);
 	if (item->cache_dirty || item->mark_dirty)
 		mark_file = folder_item_get_mark_file(item);
 	if (item->cache_dirty || item->tags_dirty)
 		tags_file = folder_item_get_tags_file(item);
-	if (msgcache_write(cache_file, mark_file, tags_file, item->cache) < 0) {
+	if (msgcache_write(cache_file, mark_file, tags_file, journal_file, item->cache) < 0) {
 		prefs = item->prefs;
     		if (prefs && prefs->enable_folder_chmod && prefs->folder_chmod) {
 			/* for cache file */
@@ -2757,15 +3507,17 @@ void folder_item_write_cache(FolderItem *item)
 		item->tags_dirty = FALSE;
 	}
 
+	g_free(cache_file);
+	g_free(mark_file);
+	g_free(tags_file);
+	g_free(journal_file);
+
+out:
 	if (!need_scan && item->folder->klass->set_mtime) {
 		if (item->mtime == last_mtime) {
 			item->folder->klass->set_mtime(item->folder, item);
 		}
 	}
-
-	g_free(cache_file);
-	g_free(mark_file);
-	g_free(tags_file);
 }
 
 MsgInfo *folder_item_get_msginfo(FolderItem *item, gint num)
@@ -2954,6 +3706,38 @@ gchar *folder_item_fetch_msg_full(FolderItem *item, gint num, gboolean headers,
 	return msgfile;
 }
 
+gchar *folder_item_fetch_msg_display(FolderItem *item, gint num)
+{
+	Folder *folder;
+	gchar *msgfile = NULL;
+
+	cm_return_val_if_fail(item != NULL, NULL);
+
+	folder = item->folder;
+
+	if (folder->klass->fetch_msg_display != NULL && !item->no_select)
+		msgfile = folder->klass->fetch_msg_display(folder, item, num);
+	if (msgfile == NULL)
+		msgfile = folder_item_fetch_msg(item, num);
+
+	return msgfile;
+}
+
+gint folder_item_fetch_msg_part(FolderItem *item, gint num, MimeInfo *part)
+{
+	Folder *folder;
+
+	cm_return_val_if_fail(item != NULL, -1);
+	cm_return_val_if_fail(part != NULL, -1);
+
+	folder = item->folder;
+
+	if (folder->klass->fetch_msg_part == NULL)
+		return 0;
+
+	return folder->klass->fetch_msg_part(folder, item, num, part);
+}
+
 
 static gint folder_item_get_msg_num_by_file(FolderItem *dest, const gchar *file)
 {
@@ -3421,6 +4205,7 @@ static gint do_copy_msgs(FolderItem *dest, GSList *msglist, gboolean remove_sour
 	GSList *not_moved = NULL;
 	gint total = 0, curmsg = 0;
 	MsgInfo *msginfo = NULL;
+	gboolean moved = FALSE;
 
 	cm_return_val_if_fail(dest != NULL, -1);
 	cm_return_val_if_fail(msglist != NULL, -1);
@@ -3482,7 +4267,14 @@ static gint do_copy_msgs(FolderItem *dest, GSList *msglist, gboolean remove_sour
 	 * Copy messages to destination folder and 
 	 * store new message numbers in newmsgnums
 	 */
-	if (folder->klass->copy_msgs != NULL) {
+	if (remove_source && folder->klass->move_msgs != NULL &&
+	    msginfo->folder->folder == folder) {
+		if (folder->klass->move_msgs(folder, dest, msglist, relation) < 0) {
+			g_hash_table_destroy(relation);
+			return -1;
+		}
+		moved = TRUE;
+	} else if (folder->klass->copy_msgs != NULL) {
 		if (folder->klass->copy_msgs(folder, dest, msglist, relation) < 0) {
 			g_hash_table_destroy(relation);
 			return -1;
@@ -3519,7 +4311,7 @@ static gint do_copy_msgs(FolderItem *dest, GSList *msglist, gboolean remove_sour
 		 * copying was successfull and update folder
 		 * message counts
 		 */
-		if (not_moved == NULL && item->folder->klass->remove_msgs) {
+		if (not_moved == NULL && !moved && item->folder->klass->remove_msgs) {
 			item->folder->klass->remove_msgs(item->folder,
 					    		        msginfo->folder,
 						    		msglist,
@@ -3539,7 +4331,7 @@ static gint do_copy_msgs(FolderItem *dest, GSList *msglist, gboolean remove_sour
 				continue;
 
 			if ((num >= 0) && (item->folder->klass->remove_msg != NULL)) {
-				if (!item->folder->klass->remove_msgs)
+				if (!moved && !item->folder->klass->remove_msgs)
 					item->folder->klass->remove_msg(item->folder,
 					    		        msginfo->folder,
 						    		msginfo->msgnum);
@@ -3836,6 +4628,7 @@ gint folder_item_remove_all_msg(FolderItem *item)
 		if (result == 0) {
 			folder_item_free_cache(item, TRUE);
 			item->cache = msgcache_new();
+			msgcache_attach(item->cache, item);
 			item->cache_dirty = TRUE;
 			item->mark_dirty = TRUE;
 			item->tags_dirty = TRUE;
@@ -3871,7 +4664,11 @@ void folder_item_change_msg_flags(FolderItem *item, MsgInfo *msginfo, MsgPermFla
 	cm_return_if_fail(item != NULL);
 	cm_return_if_fail(msginfo != NULL);
 	
-	item->mark_dirty = TRUE;
+	if (item->cache) {
+		item->mark_journal_dirty = TRUE;
+		msgcache_journal_flags(item->cache, msginfo->msgnum);
+	} else
+		item->mark_dirty = TRUE;
 
 	if (item->no_select)
 		return;
@@ -3898,7 +4695,11 @@ void folder_item_commit_tags(FolderItem *item, MsgInfo *msginfo, GSList *tags_se
 	if (!folder)
 		return;
 	
-	item->tags_dirty = TRUE;
+	if (item->cache) {
+		item->tags_journal_dirty = TRUE;
+		msgcache_journal_tags(item->cache, msginfo->msgnum);
+	} else
+		item->tags_dirty = TRUE;
 
 	if (folder->klass->commit_tags == NULL)
 		return;
@@ -3993,6 +4794,24 @@ static gchar *folder_item_get_mark_file(FolderItem *item)
 	return file;
 }
 
+static gchar *folder_item_get_journal_file(FolderItem *item)
+{
+	gchar *path;
+	gchar *file;
+
+	cm_return_val_if_fail(item != NULL, NULL);
+	cm_return_val_if_fail(item->path != NULL, NULL);
+
+	path = folder_item_get_path(item);
+	cm_return_val_if_fail(path != NULL, NULL);
+	if (!is_dir_exist(path))
+		make_dir_hier(path);
+	file = g_strconcat(path, G_DIR_SEPARATOR_S, JOURNAL_FILE, NULL);
+	g_free(path);
+
+	return file;
+}
+
 static gchar *folder_item_get_tags_file(FolderItem *item)
 {
 	gchar *path;
@@ -117,9 +117,13 @@ typedef enum
 	F_ITEM_UPDATE_CONTENT = 1 << 1,
 	F_ITEM_UPDATE_ADDMSG = 1 << 2,
 	F_ITEM_UPDATE_REMOVEMSG = 1 << 3,
-	F_ITEM_UPDATE_NAME = 1 << 4
+	F_ITEM_UPDATE_NAME = 1 << 4,
+	F_ITEM_UPDATE_SCANNING = 1 << 5
 } FolderItemUpdateFlags;
 
+typedef gboolean (*FolderScanDoneFunc)	(FolderItem	*item,
+					 gint		 result,
+					 gpointer	 data);
 typedef void (*FolderUIFunc)		(Folder		*folder,
 					 FolderItem	*item,
 					 gpointer	 data);
@@ -200,6 +204,13 @@ struct _FolderClass
 	* the server.
 	*/
 	gboolean    supports_server_search;
+	/**
+	* A boolean to indicate that message numbers are only ever assigned in
+	* increasing order, are never reused and that a message never changes
+	* under its number (like IMAP UIDs). A scan can then take an unchanged
+	* message count and highest number to mean nothing changed at all.
+	*/
+	gboolean    increasing_msgnums;
 
 	/**
 	 * Klass-specific prefs pages
@@ -409,6 +420,23 @@ struct _FolderClass
 						 FolderItem	*item,
 						 GSList	       **list,
 						 gboolean	*old_uids_valid);
+	/**
+	 * Optional. Lists the message numbers in a \c FolderItem's
+	 * directory as get_num_list() would, without touching the
+	 * \c FolderItem or its \c Folder, so that it can run on a thread
+	 * other than the main one and several folders can be listed at once.
+	 * The old UIDs are taken to be valid.
+	 *
+	 * \param dir The directory, as returned by folder_item_get_path()
+	 * \param list Pointer to a GSList where message numbers are added
+	 * \param mtime Set to the directory's mtime as of the listing, for
+	 *              the folder system to store in the \c FolderItem
+	 * \return The number of message numbers added to the list on
+	 *         success, a negative number otherwise.
+	 */
+	gint		 (*get_num_list_from_dir)(const gchar	*dir,
+						 GSList	       **list,
+						 time_t		*mtime);
 	/**
 	 * Tell the folder system if a \c FolderItem should be scanned
 	 * (cache data syncronized with the folder content) when it is required
@@ -707,6 +735,40 @@ struct _FolderClass
 						 GSList		*tags_unset);
 	void		(*item_opened)		(FolderItem	*item);
 	void		(*item_closed)		(FolderItem	*item);
+
+	/* Gets a file to display a message from, in which large parts may
+	 * have been left empty; fetch_msg_part fills such a part in when it
+	 * is needed. Return NULL to have the message fetched whole.
+	 */
+	gchar 		*(*fetch_msg_display)	(Folder		*folder,
+						 FolderItem	*item,
+						 gint		 num);
+	gint		(*fetch_msg_part)	(Folder		*folder,
+						 FolderItem	*item,
+						 gint		 num,
+						 MimeInfo	*part);
+
+	/* Moves messages between FolderItems of the same Folder, like
+	 * copy_msgs followed by remove_msgs on the source. If NULL, that is
+	 * what the folder system does instead.
+	 */
+	gint		(*move_msgs)		(Folder		*folder,
+						 FolderItem	*dest,
+						 MsgInfoList	*msglist,
+						 GHashTable	*relation);
+
+	/* Called before scan_required is asked about many of the folder's
+	 * items in a row, so that their state can be fetched all at once.
+	 */
+	void		(*prepare_scan_required)(Folder	*folder);
+
+	/* Returns the item's message numbers in ascending order of
+	 * sort_key, as ordered by the server, or NULL to have the messages
+	 * sorted locally.
+	 */
+	GSList		*(*get_sort_order)	(Folder		*folder,
+						 FolderItem	*item,
+						 FolderSortKey	 sort_key);
 };
 
 enum {
@@ -745,6 +807,9 @@ struct _FolderItem
 	gboolean cache_dirty;
 	gboolean mark_dirty;
 	gboolean tags_dirty;
+	/* changed only in ways recorded in the cache journal */
+	gboolean mark_journal_dirty;
+	gboolean tags_journal_dirty;
 
 	/* special flags */
 	guint no_sub         : 1; /* no child allowed?    */
@@ -913,6 +978,13 @@ gint   folder_item_close		(FolderItem	*item);
 gint   folder_item_scan			(FolderItem	*item);
 gint   folder_item_scan_full		(FolderItem 	*item, 
 					 gboolean 	 filtering);
+void   folder_item_scan_items		(GSList		*items,
+					 gboolean	 filtering,
+					 FolderScanDoneFunc done_func,
+					 gpointer	 data);
+gboolean folder_scan_is_active		(void);
+void   folder_item_scan_add_msginfos	(FolderItem	*item,
+					 MsgInfoList	*msglist);
 MsgInfo *folder_item_get_msginfo	(FolderItem 	*item,
 					 gint		 num);
 MsgInfo *folder_item_get_msginfo_by_msgid(FolderItem 	*item,
@@ -927,6 +999,11 @@ gchar *folder_item_fetch_msg_full	(FolderItem	*item,
 					 gint		 num, 
 					 gboolean 	 get_headers,
 					 gboolean	 get_body);
+gchar *folder_item_fetch_msg_display	(FolderItem	*item,
+					 gint		 num);
+gint   folder_item_fetch_msg_part	(FolderItem	*item,
+					 gint		 num,
+					 MimeInfo	*part);
 gint   folder_item_add_msg		(FolderItem	*dest,
 					 const gchar	*file,
 					 MsgFlags	*flags,
@@ -966,8 +1043,10 @@ gboolean folder_item_is_msg_changed	(FolderItem	*item,
 					 MsgInfo	*msginfo);
 
 void folder_clean_cache_memory		(FolderItem *protected_item);
+void folder_clean_cache_memory_later	(void);
 void folder_clean_cache_memory_force	(void);
 void folder_item_write_cache		(FolderItem *item);
+void folder_item_read_caches		(GSList *items);
 
 void folder_item_apply_processing	(FolderItem *item);
 
@@ -1086,22 +1086,98 @@ void folderview_rescan_tree(Folder *folder, gboolean rebuild)
 	inc_unlock();
 }
 
+/* Reads the caches of the folders folderview_check_new() is about to
+ * scan in one go, so they get decoded in parallel rather than one by
+ * one from folder_item_scan(). Only local folders and folders that are
+ * always scanned are considered, so that no server gets asked twice. */
+static void folderview_check_new_read_caches(FolderView *folderview,
+					     Folder *folder)
+{
+	GtkCMCTree *ctree = GTK_CMCTREE(folderview->ctree);
+	GtkCMCTreeNode *node;
+	FolderItem *item;
+	GSList *items = NULL;
+
+	for (node = GTK_CMCTREE_NODE(GTK_CMCLIST(ctree)->row_list);
+	     node != NULL; node = gtkut_ctree_node_next(ctree, node)) {
+		item = gtk_cmctree_node_get_row_data(ctree, node);
+		if (!item || !item->path || !item->folder) continue;
+		if (item->no_select) continue;
+		if (folder && folder != item->folder) continue;
+		if (!folder && !FOLDER_IS_LOCAL(item->folder)) continue;
+		if (!item->prefs->newmailcheck) continue;
+		if (item->processing_pending == TRUE) continue;
+		if (item->scanning != ITEM_NOT_SCANNING) continue;
+		if (item->cache != NULL) continue;
+
+		if (!item->folder->klass->scan_required ||
+		    item->folder->inbox == item ||
+		    item->opened == TRUE ||
+		    (FOLDER_IS_LOCAL(item->folder) &&
+		     item->folder->klass->scan_required(item->folder, item)))
+			items = g_slist_prepend(items, item);
+	}
+
+	items = g_slist_reverse(items);
+	folder_item_read_caches(items);
+	g_slist_free(items);
+}
+
+typedef struct _FolderViewCheckNew FolderViewCheckNew;
+struct _FolderViewCheckNew {
+	FolderView	*folderview;
+	Folder		*folder;
+};
+
+/* Called by folder_item_scan_items() as each folder completes */
+static gboolean folderview_check_new_done(FolderItem *item, gint result,
+					  gpointer data)
+{
+	FolderViewCheckNew *check = (FolderViewCheckNew *)data;
+	FolderView *folderview = check->folderview;
+	GtkCMCTreeNode *node;
+
+	folderview_scan_tree_func(item->folder, item, NULL);
+
+	if (result < 0) {
+		summaryview_unlock(folderview->summaryview, item);
+		if (check->folder) {
+			if (FOLDER_TYPE(item->folder) == F_NEWS ||
+			    FOLDER_IS_LOCAL(check->folder))
+				log_error(LOG_PROTOCOL, _("Couldn't scan folder %s\n"),
+					item->path ? item->path:item->name);
+			else
+				return FALSE;
+		}
+		return TRUE;
+	}
+
+	node = gtk_cmctree_find_by_row_data(GTK_CMCTREE(folderview->ctree),
+					    NULL, item);
+	if (node)
+		folderview_update_node(folderview, node);
+
+	return TRUE;
+}
+
 /** folderview_check_new()
  *  Scan and update the folder and return the 
  *  count the number of new messages since last check. 
+ *  The folders are scanned concurrently by folder_item_scan_items().
  *  \param folder the folder to check for new messages
  *  \return the number of new messages since last check
  */
 gint folderview_check_new(Folder *folder)
 {
 	GList *list;
+	GSList *checked, *to_scan, *cur;
 	FolderItem *item;
 	FolderView *folderview;
+	FolderViewCheckNew check;
 	GtkCMCTree *ctree;
 	GtkCMCTreeNode *node;
 	gint new_msgs = 0;
 	gint former_new_msgs = 0;
-	gint former_new = 0, former_unread = 0, former_total;
 
 	for (list = folderview_list; list != NULL; list = list->next) {
 		folderview = (FolderView *)list->data;
@@ -1110,9 +1186,14 @@ gint folderview_check_new(Folder *folder)
 		inc_lock();
 		main_window_lock(folderview->mainwin);
 
+		folderview_check_new_read_caches(folderview, folder);
+		if (folder && folder->klass->prepare_scan_required)
+			folder->klass->prepare_scan_required(folder);
+
+		checked = NULL;
+		to_scan = NULL;
 		for (node = GTK_CMCTREE_NODE(GTK_CMCLIST(ctree)->row_list);
 		     node != NULL; node = gtkut_ctree_node_next(ctree, node)) {
-			gchar *str = NULL;
 			item = gtk_cmctree_node_get_row_data(ctree, node);
 			if (!item || !item->path || !item->folder) continue;
 			if (item->no_select) continue;
@@ -1130,54 +1211,28 @@ gint folderview_check_new(Folder *folder)
 				continue;
 			}
 
-			str = get_scan_str(item);
-
-			STATUSBAR_PUSH(folderview->mainwin, str);
-			GTK_EVENTS_FLUSH();
-			g_free(str);
-
-			folderview_scan_tree_func(item->folder, item, NULL);
-			former_new    = item->new_msgs;
-			former_unread = item->unread_msgs;
-			former_total  = item->total_msgs;
-
-			if (item->folder->klass->scan_required &&
-			    (item->folder->klass->scan_required(item->folder, item) ||
-			     item->folder->inbox == item ||
-			     item->opened == TRUE ||
-			     item->processing_pending == TRUE)) {
-				if (folder_item_scan(item) < 0) {
-					if (folder) {
-						summaryview_unlock(folderview->summaryview, item);
-						if (FOLDER_TYPE(item->folder) == F_NEWS || FOLDER_IS_LOCAL(folder)) {
-							log_error(LOG_PROTOCOL, _("Couldn't scan folder %s\n"),
-								item->path ? item->path:item->name);
-							STATUSBAR_POP(folderview->mainwin);
-							continue;
-						} else if (!FOLDER_IS_LOCAL(folder)) {
-							STATUSBAR_POP(folderview->mainwin);
-							break;
-						}
-					}
-				}
-			} else if (!item->folder->klass->scan_required) {
-				if (folder_item_scan(item) < 0) {
-					summaryview_unlock(folderview->summaryview, item);
-					if (folder && !FOLDER_IS_LOCAL(folder)) {
-						STATUSBAR_POP(folderview->mainwin);
-						break;
-					}
-				}
-			}
-			if (former_new    != item->new_msgs ||
-			    former_unread != item->unread_msgs ||
-			    former_total  != item->total_msgs)
-				folderview_update_node(folderview, node);
+			former_new_msgs += item->new_msgs;
+			checked = g_slist_prepend(checked, item);
 
-			new_msgs += item->new_msgs;
-			former_new_msgs += former_new;
-			STATUSBAR_POP(folderview->mainwin);
+			if (!item->folder->klass->scan_required ||
+			    item->folder->klass->scan_required(item->folder, item) ||
+			    item->folder->inbox == item ||
+			    item->opened == TRUE ||
+			    item->processing_pending == TRUE)
+				to_scan = g_slist_prepend(to_scan, item);
 		}
+		to_scan = g_slist_reverse(to_scan);
+
+		check.folderview = folderview;
+		check.folder = folder;
+		folder_item_scan_items(to_scan, TRUE,
+				       folderview_check_new_done, &check);
+		g_slist_free(to_scan);
+
+		for (cur = checked; cur != NULL; cur = cur->next)
+			new_msgs += ((FolderItem *)cur->data)->new_msgs;
+		g_slist_free(checked);
+
 		folderview->scanning_folder = NULL;
 		main_window_unlock(folderview->mainwin);
 		inc_unlock();
@@ -1705,9 +1760,17 @@ static gboolean folderview_update_item_claws(gpointer source, gpointer data)
 
 		if ((update_info->update_flags & F_ITEM_UPDATE_CONTENT) && 
 		     update_info->item == folderview->summaryview->folder_item &&
-		     update_info->item != NULL)
+		     update_info->item != NULL) {
 			if (!quicksearch_has_sat_predicate(folderview->summaryview->quicksearch))
 				summary_show(folderview->summaryview, update_info->item);
+		} else if ((update_info->update_flags & F_ITEM_UPDATE_CONTENT) &&
+			   update_info->item == folderview->opening) {
+			/* new messages of a folder being opened arrive in
+			 * chunks: show the first ones rather than wait */
+			summary_set_prefs_from_folderitem(folderview->summaryview,
+							  update_info->item);
+			summary_show(folderview->summaryview, update_info->item);
+		}
 	}
 	
 	return FALSE;
@@ -2226,7 +2289,9 @@ static void folderview_selected(GtkCMCTree *ctree, GtkCMCTreeNode *row,
 	if (folderview->scanning_folder == item->folder) {
 		res = -2;
 	} else {
+		folderview->opening = item;
 		res = folder_item_open(item);
+		folderview->opening = NULL;
 	}
 
 	if (res == -1 && item->no_select == FALSE) {
@@ -2262,7 +2327,7 @@ static void folderview_selected(GtkCMCTree *ctree, GtkCMCTreeNode *row,
 	summary_set_prefs_from_folderitem(folderview->summaryview, item);
 	opened = summary_show(folderview->summaryview, item);
 	
-	folder_clean_cache_memory(item);
+	folder_clean_cache_memory_later();
 
 	if (!opened) {
 		gtkut_ctree_set_focus_row(ctree, old_opened);
@@ -78,6 +78,7 @@ struct _FolderView
 	FolderColumnState col_state[N_FOLDER_COLS];
 	gint col_pos[N_FOLDER_COLS];
 	Folder *scanning_folder;
+	FolderItem *opening;	/* item being scanned before it's shown */
 	GtkUIManager *ui_manager;
 	GtkActionGroup *popup_common_action_group;
 	GtkActionGroup *popup_specific_action_group;
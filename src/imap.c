@@ -55,6 +55,7 @@
 #include "socket.h"
 #include "recv.h"
 #include "procheader.h"
+#include "procmime.h"
 #include "prefs_account.h"
 #include "codeconv.h"
 #include "md5.h"
@@ -66,6 +67,8 @@
 #include "claws.h"
 #include "statusbar.h"
 #include "msgcache.h"
+#include "cachelru.h"
+#include "cachepack.h"
 #include "imap-thread.h"
 #include "account.h"
 #include "tags.h"
@@ -96,6 +99,12 @@ struct _IMAPFolder
 	guint max_set_size;
 	gchar *search_charset;
 	gboolean search_charset_supported;
+	guint idle_tag;
+	/* when imap_status_prefetch() last ran */
+	time_t status_time;
+
+	/* extra IMAPSessions, besides rfolder.session */
+	GSList *pool;
 };
 
 struct _IMAPSession
@@ -106,6 +115,11 @@ struct _IMAPSession
 
 	GSList *capability;
 	gboolean uidplus;
+	gboolean condstore;
+	gboolean qresync;
+	gboolean move;
+	gboolean multiappend;
+	gboolean literal_plus;
 
 	gchar *mbox;
 	guint cmd_count;
@@ -118,8 +132,11 @@ struct _IMAPSession
 	guint unseen;
 	guint uid_validity;
 	guint uid_next;
+	guint64 highest_modseq;
 
 	Folder * folder;
+	gint conn;
+	gint lock_depth;
 	gboolean busy;
 	gboolean cancelled;
 	gboolean sens_update_block;
@@ -134,6 +151,10 @@ struct _IMAPNameSpace
 
 #define IMAPBUFSIZE	8192
 
+/* Messages uploaded in one MULTIAPPEND command, which the server only
+ * commits once it has them all */
+#define IMAP_MULTIAPPEND_MAX	50
+
 #define IMAP_IS_SEEN(flags)	((flags & IMAP_FLAG_SEEN) != 0)
 #define IMAP_IS_ANSWERED(flags)	((flags & IMAP_FLAG_ANSWERED) != 0)
 #define IMAP_IS_FLAGGED(flags)	((flags & IMAP_FLAG_FLAGGED) != 0)
@@ -151,6 +172,17 @@ struct _IMAPNameSpace
 
 #define IMAP_CMD_LIMIT	1000
 
+/* how many bytes of message bodies a prefetch batch may ask for */
+#define IMAP_PREFETCH_MAX_BYTES	(4 * 1024 * 1024)
+
+/* parts up to this size are fetched along with a partial message */
+#define IMAP_PARTIAL_INLINE_MAX	(64 * 1024)
+
+/* seconds the connection must be left alone before it starts idling,
+ * and how long to idle before renewing (RFC 2177 asks for < 29 min) */
+#define IMAP_IDLE_DELAY		2
+#define IMAP_IDLE_TIMEOUT	(25 * 60)
+
 enum {
 	ITEM_CAN_CREATE_FLAGS_UNKNOWN = 0,
 	ITEM_CAN_CREATE_FLAGS,
@@ -177,7 +209,33 @@ struct _IMAPFolderItem
 	GHashTable *tags_set_table;
 	GHashTable *tags_unset_table;
 	GSList *ok_flags;
-
+	/* timeout sending flag changes queued outside batch mode */
+	guint store_tag;
+
+	/* RFC 7162: HIGHESTMODSEQ as of the last complete flags sync, the
+	 * one the sync in progress will reach, and the flags and tags
+	 * that changed in between, keyed by UID */
+	guint64 highest_modseq;
+	guint64 pending_modseq;
+	GHashTable *changed_flags;
+	GHashTable *changed_tags;
+
+	/* cached bodies packed together, see imap_item_get_pack() */
+	CachePack *pack;
+
+	/* STATUS gathered by imap_status_prefetch(), until used */
+	gboolean status_valid;
+	gint status_exists;
+	gint status_unseen;
+	guint32 status_uid_next;
+	guint32 status_uid_validity;
+
+	/* the last order imap_get_sort_order() got from the server, kept
+	 * while the folder's message count and next UID stay the same */
+	GSList *sort_order;
+	FolderSortKey sort_order_key;
+	gint sort_order_total;
+	guint sort_order_uid_next;
 };
 
 static XMLTag *imap_item_get_xml(Folder *folder, FolderItem *item);
@@ -192,7 +250,8 @@ static Folder	*imap_folder_new	(const gchar	*name,
 static void	 imap_folder_destroy	(Folder		*folder);
 
 static IMAPSession *imap_session_new	(Folder         *folder,
-					 const PrefsAccount 	*account);
+					 const PrefsAccount 	*account,
+					 gint		 conn);
 static gint 	imap_session_authenticate(IMAPSession 	*session,
 				      	  PrefsAccount 	*account);
 static void 	imap_session_destroy	(Session 	*session);
@@ -205,6 +264,19 @@ static gchar   *imap_fetch_msg_full	(Folder 	*folder,
 					 gint 		 uid,
 					 gboolean	 headers,
 					 gboolean	 body);
+static gchar   *imap_fetch_msg_real	(Folder 	*folder, 
+					 FolderItem 	*item, 
+					 gint 		 uid,
+					 gboolean	 headers,
+					 gboolean	 body,
+					 gboolean	 interactive);
+static gchar   *imap_fetch_msg_display	(Folder 	*folder, 
+					 FolderItem 	*item, 
+					 gint 		 uid);
+static gint	imap_fetch_msg_part	(Folder 	*folder, 
+					 FolderItem 	*item, 
+					 gint 		 uid,
+					 MimeInfo	*part);
 static void	imap_remove_cached_msg	(Folder 	*folder, 
 					 FolderItem 	*item, 
 					 MsgInfo	*msginfo);
@@ -232,6 +304,9 @@ static gint	search_msgs		(Folder			*folder,
 					 MatcherList		*predicate,
 					 SearchProgressNotify	progress_cb,
 					 gpointer		progress_data);
+static GSList	*imap_get_sort_order	(Folder		*folder,
+					 FolderItem	*item,
+					 FolderSortKey	 sort_key);
 
 static gint 	imap_remove_msg		(Folder 	*folder, 
 					 FolderItem 	*item, 
@@ -266,6 +341,7 @@ static gint 	imap_remove_folder	(Folder 	*folder,
 					 FolderItem 	*item);
 
 static FolderItem *imap_folder_item_new	(Folder		*folder);
+static void imap_item_free_changed_flags	(IMAPFolderItem	*item);
 static void imap_folder_item_destroy	(Folder		*folder,
 					 FolderItem	*item);
 
@@ -286,11 +362,16 @@ static FolderItem *imap_create_special_folder
 					 SpecialFolderItemType	 stype,
 					 const gchar		*name);
 
+static gint imap_move_msgs		(Folder		*folder,
+					 FolderItem	*dest,
+					 MsgInfoList	*msglist,
+					 GHashTable	*relation);
 static gint imap_do_copy_msgs		(Folder		*folder,
 					 FolderItem	*dest,
 					 MsgInfoList	*msglist,
 					 GHashTable	*relation,
-					 gboolean	 same_dest_ok);
+					 gboolean	 same_dest_ok,
+					 gboolean	 move);
 
 static gint imap_do_remove_msgs		(Folder		*folder,
 					 FolderItem	*dest,
@@ -298,6 +379,14 @@ static gint imap_do_remove_msgs		(Folder		*folder,
 					 GHashTable	*relation);
 
 static void imap_delete_all_cached_messages	(FolderItem	*item);
+static void imap_queue_flags		(IMAPFolderItem	*item,
+					 IMAPFlags	 flags_set,
+					 IMAPFlags	 flags_unset,
+					 gint		 num);
+static void imap_schedule_flags		(IMAPFolderItem	*item);
+static void imap_flush_flags		(FolderItem	*item);
+static guint imap_queued_flags_count	(IMAPFolderItem	*item);
+static void imap_drop_queued_flags	(IMAPFolderItem	*item);
 static void imap_set_batch		(Folder		*folder,
 					 FolderItem	*item,
 					 gboolean	 batch);
@@ -389,11 +478,23 @@ static gint imap_cmd_append	(IMAPSession	*session,
 				 const gchar	*file,
 				 IMAPFlags	 flags,
 				 guint32	*new_uid);
+static gint imap_cmd_append_list(IMAPSession	*session,
+				 IMAPFolderItem *item,
+				 const gchar	*destfolder,
+				 const gchar	**files,
+				 IMAPFlags	*flags,
+				 guint		 count,
+				 guint32	*new_uids);
 static gint imap_cmd_copy       (IMAPSession *session,
 				 struct mailimap_set * set,
 				 const gchar *destfolder,
 				 struct mailimap_set ** source,
 				 struct mailimap_set ** dest);
+static gint imap_cmd_move       (IMAPSession *session,
+				 struct mailimap_set * set,
+				 const gchar *destfolder,
+				 struct mailimap_set ** source,
+				 struct mailimap_set ** dest);
 static gint imap_cmd_store	(IMAPSession	*session,
 			   	 IMAPFolderItem *item,
 				 struct mailimap_set * set,
@@ -419,6 +520,7 @@ static MsgInfo *imap_get_msginfo 		(Folder 	*folder,
 						 gint 		 num);
 static gboolean imap_scan_required		(Folder 	*folder,
 						 FolderItem 	*item);
+static void imap_status_prefetch		(Folder		*folder);
 static void imap_change_flags			(Folder 	*folder,
 						 FolderItem 	*item,
 						 MsgInfo 	*msginfo,
@@ -462,6 +564,7 @@ FolderClass *imap_get_class(void)
 		imap_class.idstr = "imap";
 		imap_class.uistr = "IMAP4";
 		imap_class.supports_server_search = TRUE;
+		imap_class.increasing_msgnums = TRUE;
 
 		/* Folder functions */
 		imap_class.new_folder = imap_folder_new;
@@ -479,6 +582,7 @@ FolderClass *imap_get_class(void)
 		imap_class.close = imap_close;
 		imap_class.get_num_list = imap_get_num_list;
 		imap_class.scan_required = imap_scan_required;
+		imap_class.prepare_scan_required = imap_status_prefetch;
 		imap_class.set_xml = folder_set_xml;
 		imap_class.get_xml = folder_get_xml;
 		imap_class.item_set_xml = imap_item_set_xml;
@@ -493,7 +597,9 @@ FolderClass *imap_get_class(void)
 		imap_class.add_msgs = imap_add_msgs;
 		imap_class.copy_msg = imap_copy_msg;
 		imap_class.copy_msgs = imap_copy_msgs;
+		imap_class.move_msgs = imap_move_msgs;
 		imap_class.search_msgs = search_msgs;
+		imap_class.get_sort_order = imap_get_sort_order;
 		imap_class.remove_msg = imap_remove_msg;
 		imap_class.remove_msgs = imap_remove_msgs;
 		imap_class.expunge = imap_expunge;
@@ -505,6 +611,8 @@ FolderClass *imap_get_class(void)
 		imap_class.synchronise = imap_synchronise;
 		imap_class.remove_cached_msg = imap_remove_cached_msg;
 		imap_class.commit_tags = imap_commit_tags;
+		imap_class.fetch_msg_display = imap_fetch_msg_display;
+		imap_class.fetch_msg_part = imap_fetch_msg_part;
 #ifdef USE_PTREAD
 		pthread_mutex_init(&imap_mutex, NULL);
 #endif
@@ -526,12 +634,31 @@ static void imap_refresh_sensitivity (IMAPSession *session)
 	}
 }
 
+/* Points the folder's commands at the session's own connection, on
+ * every lock, re-locks included. Other sessions of the folder only run
+ * nested in the main loop while this one waits for the server, and
+ * each wait puts the connection it was started on back before
+ * returning, so whatever they switch to is undone before this session
+ * sends its next command. Once no lock is left, commands go back to
+ * the main connection. */
+static void imap_session_use_conn(IMAPSession *session, gboolean locking)
+{
+	if (locking)
+		session->lock_depth++;
+	else if (session->lock_depth > 0)
+		session->lock_depth--;
+
+	imap_threaded_use_connection(session->folder,
+			session->lock_depth > 0 ? session->conn : 0);
+}
+
 static void lock_session(IMAPSession *session)
 {
 	if (session) {
 		debug_print("locking session %p (%d)\n", session, session->busy);
 		if (session->busy)
 			debug_print("         SESSION WAS LOCKED !!      \n");
+		imap_session_use_conn(session, TRUE);
                 session->busy = TRUE;
 		imap_refresh_sensitivity(session);
 	} else {
@@ -543,6 +670,7 @@ static void unlock_session(IMAPSession *session)
 {
 	if (session) {
 		debug_print("unlocking session %p\n", session);
+		imap_session_use_conn(session, FALSE);
 		session->busy = FALSE;
 		imap_refresh_sensitivity(session);
 	} else {
@@ -562,6 +690,11 @@ static gboolean imap_ping(gpointer data)
 		return TRUE;
 	
 	lock_session(imap_session);
+	/* an idling connection is kept alive by the server */
+	if (imap_threaded_idle_active(imap_session->folder)) {
+		unlock_session(imap_session);
+		return TRUE;
+	}
 	r = imap_cmd_noop(imap_session);
 	unlock_session(imap_session);
 
@@ -580,6 +713,9 @@ static void imap_disc_session_destroy(IMAPSession *session)
 	if (rfolder == NULL)
 		return;
 	log_warning(LOG_PROTOCOL, _("IMAP4 connection broken\n"));
+	/* its locks are never undone */
+	session->lock_depth = 0;
+	imap_threaded_use_connection(session->folder, 0);
 	SESSION(session)->state = SESSION_DISCONNECTED;
 	SESSION(session)->sock = NULL;
 }
@@ -769,11 +905,35 @@ static Folder *imap_folder_new(const gchar *name, const gchar *path)
 	return folder;
 }
 
+static void imap_pool_destroy(Folder *folder, gboolean logout)
+{
+	IMAPFolder *ifolder = IMAP_FOLDER(folder);
+	GSList *cur;
+
+	for (cur = ifolder->pool; cur != NULL; cur = cur->next) {
+		IMAPSession *session = IMAP_SESSION(cur->data);
+
+		if (!logout) {
+			SESSION(session)->state = SESSION_DISCONNECTED;
+			SESSION(session)->sock = NULL;
+		}
+		imap_safe_destroy(session);
+	}
+	g_slist_free(ifolder->pool);
+	ifolder->pool = NULL;
+}
+
 static void imap_folder_destroy(Folder *folder)
 {
+	imap_threaded_idle_stop(folder);
 	while (imap_folder_get_refcnt(folder) > 0)
 		gtk_main_iteration();
 
+	imap_pool_destroy(folder, TRUE);
+
+	if (IMAP_FOLDER(folder)->idle_tag != 0)
+		g_source_remove(IMAP_FOLDER(folder)->idle_tag);
+
 	g_free(IMAP_FOLDER(folder)->search_charset);
 
 	folder_remote_folder_destroy(REMOTE_FOLDER(folder));
@@ -807,6 +967,12 @@ static void imap_folder_item_destroy(Folder *folder, FolderItem *_item)
 
 	g_return_if_fail(item != NULL);
 	g_slist_free(item->uid_list);
+	g_slist_free(item->sort_order);
+	imap_item_free_changed_flags(item);
+	cache_pack_close(item->pack);
+	if (item->store_tag != 0)
+		g_source_remove(item->store_tag);
+	imap_drop_queued_flags(item);
 
 	g_free(_item);
 }
@@ -1030,7 +1196,7 @@ static IMAPSession *imap_reconnect_if_possible(Folder *folder, IMAPSession *sess
 	return session;
 }
 
-static IMAPSession *imap_session_get(Folder *folder)
+static IMAPSession *imap_session_get_primary(Folder *folder)
 {
 	RemoteFolder *rfolder = REMOTE_FOLDER(folder);
 	IMAPSession *session = NULL;
@@ -1073,7 +1239,7 @@ new_conn:
 		if (time(NULL) - rfolder->last_failure <= 2)
 			return NULL;
 		rfolder->connecting = TRUE;
-		session = imap_session_new(folder, folder->account);
+		session = imap_session_new(folder, folder->account, 0);
 	}
 	if(session == NULL) {
 		rfolder->last_failure = time(NULL);
@@ -1133,8 +1299,86 @@ new_conn:
 	return IMAP_SESSION(session);
 }
 
+/* Returns the folder's main session, on its first connection. */
+static IMAPSession *imap_session_get(Folder *folder)
+{
+	IMAPSession *session;
+	gint prev;
+
+	prev = imap_threaded_use_connection(folder, 0);
+	session = imap_session_get_primary(folder);
+	imap_threaded_use_connection(folder, prev);
+
+	return session;
+}
+
+/* Returns a session that isn't busy, so that fetching the message the
+ * user wants to read doesn't wait behind a folder scan or a large
+ * download. Another connection is opened, up to the account's limit,
+ * when all of them are in use; past that, the main session is returned
+ * and the command queues behind the current one. */
+static IMAPSession *imap_session_get_free(Folder *folder)
+{
+	IMAPFolder *ifolder = IMAP_FOLDER(folder);
+	IMAPSession *session, *extra;
+	gboolean used[IMAP_MAX_CONNECTIONS] = { FALSE };
+	GSList *cur, *next;
+	gint max, conn, prev;
+	gint r;
+
+	session = imap_session_get(folder);
+	if (session == NULL || !session->busy)
+		return session;
+
+	for (cur = ifolder->pool; cur != NULL; cur = next) {
+		extra = IMAP_SESSION(cur->data);
+		next = cur->next;
+		if (extra->busy) {
+			used[extra->conn] = TRUE;
+			continue;
+		}
+		if (SESSION(extra)->state == SESSION_DISCONNECTED ||
+		    extra->do_destroy || !extra->authenticated) {
+			ifolder->pool = g_slist_delete_link(ifolder->pool, cur);
+			imap_safe_destroy(extra);
+			continue;
+		}
+		return extra;
+	}
+
+	max = CLAMP(folder->account->imap_max_connections,
+		    1, IMAP_MAX_CONNECTIONS);
+	for (conn = 1; conn < max && used[conn]; conn++)
+		;
+	if (conn >= max)
+		return session;
+
+	debug_print("opening IMAP connection %d\n", conn);
+	prev = imap_threaded_use_connection(folder, conn);
+	extra = imap_session_new(folder, folder->account, conn);
+	if (extra != NULL && !extra->authenticated) {
+		r = imap_session_authenticate(extra, folder->account);
+		if (r != MAILIMAP_NO_ERROR || !extra->authenticated) {
+			if (!is_fatal(r))
+				imap_threaded_disconnect(folder);
+			SESSION(extra)->state = SESSION_DISCONNECTED;
+			SESSION(extra)->sock = NULL;
+			imap_safe_destroy(extra);
+			extra = NULL;
+		}
+	}
+	imap_threaded_use_connection(folder, prev);
+
+	if (extra == NULL)
+		return session;
+
+	ifolder->pool = g_slist_prepend(ifolder->pool, extra);
+	return extra;
+}
+
 static IMAPSession *imap_session_new(Folder * folder,
-				     const PrefsAccount *account)
+				     const PrefsAccount *account,
+				     gint conn)
 {
 	IMAPSession *session;
 	gushort port;
@@ -1244,7 +1488,10 @@ static IMAPSession *imap_session_new(Folder * folder,
 	session->expunge = 0;
 	session->cmd_count = 0;
 	session->folder = folder;
-	IMAP_FOLDER(session->folder)->last_seen_separator = 0;
+	session->conn = conn;
+	session->lock_depth = 0;
+	if (conn == 0)
+		IMAP_FOLDER(session->folder)->last_seen_separator = 0;
 
 #ifdef USE_GNUTLS
 	if (account->ssl_imap == SSL_STARTTLS) {
@@ -1263,6 +1510,11 @@ static IMAPSession *imap_session_new(Folder * folder,
 		imap_free_capabilities(session);
 		session->authenticated = FALSE;
 		session->uidplus = FALSE;
+		session->condstore = FALSE;
+		session->qresync = FALSE;
+		session->move = FALSE;
+		session->multiappend = FALSE;
+		session->literal_plus = FALSE;
 		session->cmd_count = 1;
 	}
 #endif
@@ -1274,6 +1526,199 @@ static IMAPSession *imap_session_new(Folder * folder,
 	return session;
 }
 
+/* Turns on compression and the extensions used for synchronising flags
+ * incrementally. Servers may announce more capabilities once logged in,
+ * so they are asked again first. */
+static void imap_enable_extensions(IMAPSession *session)
+{
+	PrefsAccount *account = session->folder->account;
+
+	imap_free_capabilities(session);
+	if (imap_get_capabilities(session) != MAILIMAP_NO_ERROR)
+		return;
+
+	if (account->imap_use_compress &&
+	    imap_has_capability(session, "COMPRESS=DEFLATE")) {
+		if (imap_threaded_compress(session->folder) == MAILIMAP_NO_ERROR)
+			log_message(LOG_PROTOCOL, "IMAP connection is compressed\n");
+		else
+			log_warning(LOG_PROTOCOL, _("Couldn't enable IMAP compression\n"));
+	}
+
+	session->condstore = imap_has_capability(session, "CONDSTORE");
+	if (imap_has_capability(session, "QRESYNC") &&
+	    imap_threaded_enable(session->folder, "QRESYNC") == MAILIMAP_NO_ERROR) {
+		/* enabling QRESYNC enables CONDSTORE as well */
+		session->condstore = TRUE;
+		session->qresync = TRUE;
+	}
+#ifdef HAVE_LIBETPAN_MOVE
+	session->move = imap_has_capability(session, "MOVE");
+#endif
+#ifdef HAVE_LIBETPAN_MULTIAPPEND
+	session->multiappend = imap_has_capability(session, "MULTIAPPEND");
+	session->literal_plus = imap_has_capability(session, "LITERAL+");
+#endif
+	debug_print("IMAP: CONDSTORE %d, QRESYNC %d, MOVE %d, MULTIAPPEND %d\n",
+		    session->condstore, session->qresync, session->move,
+		    session->multiappend);
+}
+
+static gboolean imap_idle_find_opened_func(GNode *node, gpointer data)
+{
+	FolderItem *item = FOLDER_ITEM(node->data);
+
+	if (item->opened && item->path != NULL) {
+		*(FolderItem **)data = item;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* Idles on the folder the user has open if it belongs to this account,
+ * on the Inbox otherwise. */
+static FolderItem *imap_idle_get_item(Folder *folder)
+{
+	FolderItem *item = NULL;
+
+	if (folder->node != NULL)
+		g_node_traverse(folder->node, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+				imap_idle_find_opened_func, &item);
+	if (item == NULL)
+		item = folder->inbox;
+
+	return item;
+}
+
+static gboolean imap_idle_scan_func(gpointer data)
+{
+	gchar *id = (gchar *)data;
+	FolderItem *item;
+	GSList *items;
+
+	item = folder_find_item_from_identifier(id);
+	g_free(id);
+	if (item == NULL)
+		return FALSE;
+
+	debug_print("IMAP: IDLE reported changes in %s\n", item->path);
+	items = g_slist_prepend(NULL, item);
+	folder_item_scan_items(items, TRUE, NULL, NULL);
+	g_slist_free(items);
+
+	return FALSE;
+}
+
+static void imap_idle_schedule(Folder *folder);
+
+static void imap_idle_done(Folder *folder, int error, gboolean changed,
+			   gpointer data)
+{
+	RemoteFolder *rfolder = REMOTE_FOLDER(folder);
+	IMAPSession *session;
+	FolderItem *item;
+	gchar *id = (gchar *)data;
+
+	if (rfolder->session == NULL) {
+		g_free(id);
+		return;
+	}
+	session = IMAP_SESSION(rfolder->session);
+
+	if (error != MAILIMAP_NO_ERROR) {
+		/* imap_handle_error() would unlock a session someone
+		 * else may be using for a non-fatal error */
+		if (is_fatal(error))
+			imap_handle_error(SESSION(session), NULL, error);
+		else
+			debug_print("IMAP: IDLE failed: %d\n", error);
+		g_free(id);
+		return;
+	}
+
+	if (!changed) {
+		/* renewal, or the connection was needed for something else */
+		g_free(id);
+		imap_idle_schedule(folder);
+		return;
+	}
+
+	item = folder_find_item_from_identifier(id);
+	if (item == NULL) {
+		g_free(id);
+		return;
+	}
+	IMAP_FOLDER_ITEM(item)->should_update = TRUE;
+	if (session->mbox != NULL && !strcmp(session->mbox, item->path))
+		session->folder_content_changed = TRUE;
+
+	/* This may be running while another command waits for its answer,
+	 * so the scan is left to the main loop. Once it is done,
+	 * imap_get_num_list() goes back to idling. */
+	g_idle_add(imap_idle_scan_func, id);
+}
+
+static gboolean imap_idle_start_func(gpointer data)
+{
+	Folder *folder = (Folder *)data;
+	RemoteFolder *rfolder = REMOTE_FOLDER(folder);
+	IMAPSession *session;
+	FolderItem *item;
+	gchar *id;
+	gint ok;
+
+	if (rfolder->session == NULL || rfolder->session->state != SESSION_READY)
+		goto out;
+	session = IMAP_SESSION(rfolder->session);
+	if (!session->authenticated || session->do_destroy ||
+	    prefs_common.work_offline || !imap_has_capability(session, "IDLE"))
+		goto out;
+	/* try again once the connection is free */
+	if (session->busy || imap_threaded_idle_active(folder))
+		return TRUE;
+
+	item = imap_idle_get_item(folder);
+	if (item == NULL)
+		goto out;
+
+	IMAP_FOLDER(folder)->idle_tag = 0;
+
+	lock_session(session);
+	ok = imap_select(session, IMAP_FOLDER(folder), item,
+			 NULL, NULL, NULL, NULL, NULL, FALSE);
+	unlock_session(session);
+	if (ok != MAILIMAP_NO_ERROR)
+		return FALSE;
+
+	id = folder_item_get_identifier(item);
+	debug_print("IMAP: idling on %s\n", id);
+	ok = imap_threaded_idle_start(folder, IMAP_IDLE_TIMEOUT,
+				      imap_idle_done, id);
+	if (ok != MAILIMAP_NO_ERROR)
+		g_free(id);
+
+	return FALSE;
+
+out:
+	IMAP_FOLDER(folder)->idle_tag = 0;
+	return FALSE;
+}
+
+/* Lets the connection idle once it has been unused for a moment, so new
+ * mail is reported by the server as it arrives. */
+static void imap_idle_schedule(Folder *folder)
+{
+	IMAPFolder *ifolder = IMAP_FOLDER(folder);
+
+	if (!prefs_common.imap_use_idle)
+		return;
+
+	if (ifolder->idle_tag != 0)
+		g_source_remove(ifolder->idle_tag);
+	ifolder->idle_tag = g_timeout_add_seconds(IMAP_IDLE_DELAY,
+						  imap_idle_start_func, folder);
+}
+
 static gint imap_session_authenticate(IMAPSession *session, 
 				      PrefsAccount *account)
 {
@@ -1341,13 +1786,21 @@ try_again:
 	}
 	statuswindow_pop_all();
 	session->authenticated = TRUE;
+	imap_enable_extensions(session);
 	return MAILIMAP_NO_ERROR;
 }
 
 static void imap_session_destroy(Session *session)
 {
-	if (session->state != SESSION_DISCONNECTED)
-		imap_threaded_disconnect(IMAP_SESSION(session)->folder);
+	IMAPSession *imap_session = IMAP_SESSION(session);
+	gint prev;
+
+	if (session->state != SESSION_DISCONNECTED) {
+		prev = imap_threaded_use_connection(imap_session->folder,
+						    imap_session->conn);
+		imap_threaded_disconnect(imap_session->folder);
+		imap_threaded_use_connection(imap_session->folder, prev);
+	}
 	
 	imap_free_capabilities(IMAP_SESSION(session));
 	g_free(IMAP_SESSION(session)->mbox);
@@ -1405,120 +1858,614 @@ static gchar *imap_get_cached_filename(FolderItem *item, guint msgnum)
 	return filename;
 }
 
-static void imap_remove_cached_msg(Folder *folder, FolderItem *item, MsgInfo *msginfo)
+static gchar *imap_get_partial_dir(FolderItem *item, guint msgnum)
 {
-	gchar *filename;
-
-	filename = imap_get_cached_filename(item, msginfo->msgnum);
+	gchar *path, *dir;
 
-	cm_return_if_fail(filename != NULL);
+	path = folder_item_get_path(item);
+	dir = g_strconcat(path, G_DIR_SEPARATOR_S, ".partial",
+			  G_DIR_SEPARATOR_S, itos(msgnum), NULL);
+	g_free(path);
 
-	if (is_file_exist(filename)) {
-		claws_unlink(filename);
-	}
-	g_free(filename);
+	return dir;
 }
 
-typedef struct _TagsData {
-	gchar *str;
-	GSList *msglist;
-	IMAPFolderItem *item;
-} TagsData;
+static void imap_remove_partial(FolderItem *item, guint msgnum)
+{
+	gchar *dir = imap_get_partial_dir(item, msgnum);
 
-static void imap_commit_tags(FolderItem *item, MsgInfo *msginfo, GSList *tags_set, GSList *tags_unset)
+	if (is_dir_exist(dir))
+		remove_dir_recursive(dir);
+	g_free(dir);
+}
+
+/* Removes the partly fetched messages whose UID isn't in numlist, or
+ * all of them if numlist is NULL. */
+static void imap_remove_partial_not_in_list(FolderItem *item,
+					    GSList *numlist)
 {
-	IMAPSession *session;
-	gint ok, can_create_tags;
-	Folder *folder = NULL;
-	TagsData *ht_data = NULL;
+	GHashTable *wanted;
+	gchar *path, *top;
+	const gchar *d;
+	GDir *dp;
 	GSList *cur;
 
-	g_return_if_fail(item != NULL);
-	g_return_if_fail(msginfo != NULL);
+	path = folder_item_get_path(item);
+	top = g_strconcat(path, G_DIR_SEPARATOR_S, ".partial", NULL);
+	g_free(path);
 
-	folder = item->folder;
-	debug_print("getting session...\n");
-	session = imap_session_get(folder);
-	
-	if (!session) {
-		debug_print("can't get session\n");
+	if (numlist == NULL) {
+		if (is_dir_exist(top))
+			remove_dir_recursive(top);
+		g_free(top);
 		return;
 	}
 
-	ok = imap_select(session, IMAP_FOLDER(folder), item,
-			 NULL, NULL, NULL, NULL, &can_create_tags, FALSE);
-
-	if (ok != MAILIMAP_NO_ERROR) {
+	if ((dp = g_dir_open(top, 0, NULL)) == NULL) {
+		g_free(top);
 		return;
 	}
 
-	
-	if (IMAP_FOLDER_ITEM(item)->can_create_flags != ITEM_CAN_CREATE_FLAGS)
-		return;
-	
-	if (IMAP_FOLDER_ITEM(item)->batching) {
-		/* instead of performing an UID STORE command for each message change,
-		 * as a lot of them can change "together", we just fill in hashtables
-		 * and defer the treatment so that we're able to send only one
-		 * command.
-		 */
-		debug_print("IMAP batch mode on, deferring tags change\n");
-		for (cur = tags_set; cur; cur = cur->next) {
-			gint cur_tag = GPOINTER_TO_INT(cur->data);
-			if (cur_tag) {
-				ht_data = g_hash_table_lookup(IMAP_FOLDER_ITEM(item)->tags_set_table, 
-					GINT_TO_POINTER(cur_tag));
-				if (ht_data == NULL) {
-					ht_data = g_new0(TagsData, 1);
-					ht_data->str = g_strdup(tags_get_tag(cur_tag));
-					ht_data->item = IMAP_FOLDER_ITEM(item);
-					g_hash_table_insert(IMAP_FOLDER_ITEM(item)->tags_set_table, 
-						GINT_TO_POINTER(cur_tag), ht_data);
-				}
-				ht_data->msglist = g_slist_prepend(ht_data->msglist, GINT_TO_POINTER(msginfo->msgnum));
-			} 
-		}
-		for (cur = tags_unset; cur; cur = cur->next) {
-			gint cur_tag = GPOINTER_TO_INT(cur->data);
-			if (cur_tag) {
-				ht_data = g_hash_table_lookup(IMAP_FOLDER_ITEM(item)->tags_unset_table, 
-					GINT_TO_POINTER(cur_tag));
-				if (ht_data == NULL) {
-					ht_data = g_new0(TagsData, 1);
-					ht_data->str = g_strdup(tags_get_tag(cur_tag));
-					ht_data->item = IMAP_FOLDER_ITEM(item);
-					g_hash_table_insert(IMAP_FOLDER_ITEM(item)->tags_unset_table, 
-						GINT_TO_POINTER(cur_tag), ht_data);
-				}
-				ht_data->msglist = g_slist_prepend(ht_data->msglist, GINT_TO_POINTER(msginfo->msgnum));
-			}
-		}
-	} else {
-		GSList *list_set = NULL;
-		GSList *list_unset = NULL;
-		GSList numlist;
-		
-		numlist.data = GINT_TO_POINTER(msginfo->msgnum);
-		numlist.next = NULL;
-	
-		debug_print("IMAP changing tags NOW\n");
-		for (cur = tags_set; cur; cur = cur->next) {
-			gint cur_tag = GPOINTER_TO_INT(cur->data);
-			const gchar *str = tags_get_tag(cur_tag);
-			if (IS_NOT_RESERVED_TAG(str))
-				list_set = g_slist_prepend(list_set, g_strdup(str));
-		}
-		if (list_set) {
-			ok = imap_set_message_flags(session, 
-				IMAP_FOLDER_ITEM(item), &numlist, 0, list_set, TRUE);
-			slist_free_strings_full(list_set);
-			if (ok != MAILIMAP_NO_ERROR) {
-				return;
-			}
-		}
+	wanted = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (cur = numlist; cur != NULL; cur = cur->next)
+		g_hash_table_insert(wanted, cur->data, GINT_TO_POINTER(1));
 
-		for (cur = tags_unset; cur; cur = cur->next) {
-			gint cur_tag = GPOINTER_TO_INT(cur->data);
+	while ((d = g_dir_read_name(dp)) != NULL) {
+		gint num = to_number(d);
+
+		if (num > 0 && g_hash_table_lookup(wanted,
+					GINT_TO_POINTER(num)) == NULL) {
+			debug_print("removing partly fetched message %d\n", num);
+			imap_remove_partial(item, num);
+		}
+	}
+	g_dir_close(dp);
+	g_hash_table_destroy(wanted);
+	g_free(top);
+}
+
+/* With imap_cache_pack set, fully cached bodies are moved from their
+ * numbered files into a pack in the cache directory, and extracted
+ * again when the message is fetched. A pack left over from when the
+ * option was set is still used until it runs empty. */
+static CachePack *imap_item_get_pack(FolderItem *item)
+{
+	IMAPFolderItem *imap_item = IMAP_FOLDER_ITEM(item);
+	gchar *path;
+
+	if (imap_item->pack)
+		return imap_item->pack;
+
+	path = folder_item_get_path(item);
+	if (prefs_common.imap_cache_pack || cache_pack_exists(path))
+		imap_item->pack = cache_pack_open(path);
+	g_free(path);
+
+	return imap_item->pack;
+}
+
+static gboolean imap_close_pack_func(GNode *node, gpointer data)
+{
+	IMAPFolderItem *item = (IMAPFolderItem *)node->data;
+
+	cache_pack_close(item->pack);
+	item->pack = NULL;
+
+	return FALSE;
+}
+
+/* for when the cache directories of item and its children move */
+static void imap_item_close_packs(FolderItem *item)
+{
+	g_node_traverse(item->node, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+			imap_close_pack_func, NULL);
+}
+
+static void imap_pack_cached_msg(FolderItem *item, guint msgnum,
+				 const gchar *filename)
+{
+	CachePack *pack;
+
+	if (!prefs_common.imap_cache_pack)
+		return;
+	if ((pack = imap_item_get_pack(item)) == NULL)
+		return;
+
+	if (cache_pack_contains(pack, msgnum) ||
+	    cache_pack_add_file(pack, msgnum, filename) == 0)
+		claws_unlink(filename);
+}
+
+static gboolean imap_unpack_cached_msg(FolderItem *item, guint msgnum,
+				       const gchar *filename)
+{
+	CachePack *pack = imap_item_get_pack(item);
+
+	if (pack == NULL || !cache_pack_contains(pack, msgnum))
+		return FALSE;
+
+	debug_print("extracting message %d from cache pack\n", msgnum);
+	return cache_pack_extract(pack, msgnum, filename) == 0;
+}
+
+static void imap_unpack_remove(FolderItem *item, guint msgnum)
+{
+	CachePack *pack = imap_item_get_pack(item);
+
+	if (pack)
+		cache_pack_remove(pack, msgnum);
+}
+
+/* Packs the fully cached messages left as numbered files, as those
+ * fetched for display are, once the folder is no longer shown. */
+static void imap_pack_cached_msgs(FolderItem *item)
+{
+	GDir *dp;
+	const gchar *d;
+	gchar *path;
+	gint num;
+
+	if (!prefs_common.imap_cache_pack || item->cache == NULL)
+		return;
+
+	path = folder_item_get_path(item);
+	if ((dp = g_dir_open(path, 0, NULL)) == NULL) {
+		g_free(path);
+		return;
+	}
+
+	while ((d = g_dir_read_name(dp)) != NULL) {
+		MsgInfo *cached;
+		gchar *filename;
+
+		if ((num = to_number(d)) <= 0)
+			continue;
+		cached = msgcache_get_msg(item->cache, num);
+		if (cached == NULL)
+			continue;
+		filename = g_strconcat(path, G_DIR_SEPARATOR_S, d, NULL);
+		if (MSG_IS_FULLY_CACHED(cached->flags) &&
+		    g_file_test(filename, G_FILE_TEST_IS_REGULAR))
+			imap_pack_cached_msg(item, num, filename);
+		g_free(filename);
+		procmsg_msginfo_free(&cached);
+	}
+	g_dir_close(dp);
+	g_free(path);
+}
+
+/* With imap_cache_max_size set, the cached bodies of all IMAP folders
+ * are listed in one index with their size and when they were last
+ * read, and the least recently read are dropped once the cache grows
+ * past the limit. Flagged messages and those the folder is set to keep
+ * for offline use stay; the index itself says which are flagged and
+ * how old each is, so trimming never needs a folder's cache. */
+#define IMAP_CACHE_LRU_INDEX	".lru_index"
+#define IMAP_CACHE_LRU_SAVE_DELAY 60
+
+static CacheLru *imap_cache_lru = NULL;
+static guint imap_cache_lru_save_tag = 0;
+static guint imap_cache_lru_trim_tag = 0;
+/* the message touched last, which the next trim leaves alone */
+static gchar *imap_cache_lru_last_id = NULL;
+static guint imap_cache_lru_last_num = 0;
+/* what a trim could not get the total below, 0 if it got to the limit */
+static goffset imap_cache_lru_stuck = 0;
+
+typedef struct _IMAPCacheLruData {
+	GHashTable *items;	/* folder id -> FolderItem, or NULL */
+} IMAPCacheLruData;
+
+static void imap_remove_cached_num(FolderItem *item, guint msgnum);
+
+/* the size of what is cached of a message as files, -1 if nothing is */
+static goffset imap_get_cached_size(FolderItem *item, guint msgnum)
+{
+	gchar *filename, *dir;
+	const gchar *d;
+	GDir *dp;
+	goffset size = -1;
+
+	filename = imap_get_cached_filename(item, msgnum);
+	if (filename && is_file_exist(filename))
+		size = get_file_size(filename);
+	g_free(filename);
+
+	dir = imap_get_partial_dir(item, msgnum);
+	if ((dp = g_dir_open(dir, 0, NULL)) != NULL) {
+		while ((d = g_dir_read_name(dp)) != NULL) {
+			gchar *part = g_strconcat(dir, G_DIR_SEPARATOR_S, d, NULL);
+			goffset part_size = get_file_size(part);
+
+			if (part_size > 0)
+				size = MAX(size, 0) + part_size;
+			g_free(part);
+		}
+		g_dir_close(dp);
+	}
+	g_free(dir);
+
+	return size;
+}
+
+static gboolean imap_cache_lru_seed_func(GNode *node, gpointer data)
+{
+	FolderItem *item = FOLDER_ITEM(node->data);
+	gchar *path, *id;
+	const gchar *d;
+	GDir *dp;
+	gint num;
+
+	if (item->path == NULL)
+		return FALSE;
+
+	path = folder_item_get_path(item);
+	if ((dp = g_dir_open(path, 0, NULL)) == NULL) {
+		g_free(path);
+		return FALSE;
+	}
+
+	id = folder_item_get_identifier(item);
+	while ((d = g_dir_read_name(dp)) != NULL) {
+		gchar *filename;
+
+		if ((num = to_number(d)) <= 0)
+			continue;
+		filename = g_strconcat(path, G_DIR_SEPARATOR_S, d, NULL);
+		if (is_file_exist(filename))
+			cache_lru_touch((CacheLru *)data, id, num,
+					get_file_size(filename),
+					get_file_mtime(filename));
+		g_free(filename);
+	}
+	g_dir_close(dp);
+	g_free(id);
+	g_free(path);
+
+	return FALSE;
+}
+
+/* Lists what is already cached when the index is first made, taking
+ * the time a message was cached for when it was last read. */
+static void imap_cache_lru_seed(CacheLru *lru)
+{
+	GList *cur;
+
+	debug_print("listing cached IMAP messages\n");
+	for (cur = folder_get_list(); cur != NULL; cur = cur->next) {
+		Folder *folder = (Folder *)cur->data;
+
+		if (folder->klass == &imap_class)
+			g_node_traverse(folder->node, G_PRE_ORDER,
+					G_TRAVERSE_ALL, -1,
+					imap_cache_lru_seed_func, lru);
+	}
+}
+
+static CacheLru *imap_cache_lru_get(void)
+{
+	gchar *file;
+	gboolean seed;
+
+	if (imap_cache_lru || prefs_common.imap_cache_max_size <= 0)
+		return imap_cache_lru;
+
+	file = g_strconcat(get_imap_cache_dir(), G_DIR_SEPARATOR_S,
+			   IMAP_CACHE_LRU_INDEX, NULL);
+	if (!is_dir_exist(get_imap_cache_dir()))
+		make_dir_hier(get_imap_cache_dir());
+	seed = !is_file_exist(file);
+	imap_cache_lru = cache_lru_open(file);
+	g_free(file);
+
+	if (imap_cache_lru && seed)
+		imap_cache_lru_seed(imap_cache_lru);
+
+	return imap_cache_lru;
+}
+
+static gboolean imap_cache_lru_save_func(gpointer data)
+{
+	imap_cache_lru_save_tag = 0;
+	if (imap_cache_lru)
+		cache_lru_save(imap_cache_lru);
+
+	return FALSE;
+}
+
+static void imap_cache_lru_save(void)
+{
+	if (imap_cache_lru_save_tag) {
+		g_source_remove(imap_cache_lru_save_tag);
+		imap_cache_lru_save_tag = 0;
+	}
+	if (imap_cache_lru)
+		cache_lru_save(imap_cache_lru);
+}
+
+/* Reading a cache would run the main loop in the middle of a trim, so
+ * only folders whose cache is loaded are looked at. */
+static FolderItem *imap_cache_lru_item(const gchar *folder_id,
+				       IMAPCacheLruData *lru_data)
+{
+	FolderItem *item;
+	gpointer value;
+
+	if (g_hash_table_lookup_extended(lru_data->items, folder_id,
+					 NULL, &value))
+		return (FolderItem *)value;
+
+	item = folder_find_item_from_identifier(folder_id);
+	if (item && item->folder->klass != &imap_class)
+		item = NULL;
+	g_hash_table_insert(lru_data->items, g_strdup(folder_id), item);
+
+	return item;
+}
+
+/* Flagged messages are pinned in the index and never get here. */
+static gboolean imap_cache_lru_keep(const gchar *folder_id, guint num,
+				    time_t date, gpointer data)
+{
+	FolderItem *item = imap_cache_lru_item(folder_id, data);
+
+	if (num == imap_cache_lru_last_num && imap_cache_lru_last_id &&
+	    !strcmp(folder_id, imap_cache_lru_last_id))
+		return TRUE;
+	if (item == NULL || !item->prefs->offlinesync)
+		return FALSE;
+	/* keeping all bodies for offline use */
+	if (item->prefs->offlinesync_days <= 0)
+		return TRUE;
+
+	return date != 0 && (time(NULL) - date) / (60*60*24) <=
+		item->prefs->offlinesync_days;
+}
+
+static void imap_cache_lru_evict(const gchar *folder_id, guint num,
+				 gpointer data)
+{
+	FolderItem *item = imap_cache_lru_item(folder_id, data);
+	MsgInfo *msginfo;
+
+	if (item == NULL)
+		return;
+
+	debug_print("dropping least recently used message %s/%d\n",
+		    folder_id, num);
+	imap_remove_cached_num(item, num);
+	if (item->cache &&
+	    (msginfo = msgcache_get_msg(item->cache, num)) != NULL) {
+		procmsg_msginfo_unset_flags(msginfo, MSG_FULLY_CACHED, 0);
+		procmsg_msginfo_free(&msginfo);
+	}
+}
+
+static gboolean imap_cache_lru_trim_func(gpointer data)
+{
+	CacheLru *lru = imap_cache_lru;
+	goffset limit = (goffset)prefs_common.imap_cache_max_size * 1024 * 1024;
+	IMAPCacheLruData lru_data;
+
+	imap_cache_lru_trim_tag = 0;
+	if (lru == NULL || limit <= 0 || cache_lru_total(lru) <= limit)
+		return FALSE;
+
+	/* make some room, not to be back here for the next message */
+	lru_data.items = g_hash_table_new_full(g_str_hash, g_str_equal,
+					       g_free, NULL);
+	cache_lru_evict(lru, limit - limit / 10, imap_cache_lru_keep,
+			imap_cache_lru_evict, &lru_data);
+	g_hash_table_destroy(lru_data.items);
+
+	/* what is left is kept; don't go through it all again for each
+	 * message read, only once the cache has grown some more */
+	if (cache_lru_total(lru) > limit) {
+		imap_cache_lru_stuck = cache_lru_total(lru);
+		debug_print("can't get the IMAP cache below %" G_GOFFSET_FORMAT
+			    " bytes\n", imap_cache_lru_stuck);
+	} else
+		imap_cache_lru_stuck = 0;
+
+	return FALSE;
+}
+
+/* Records in the index whether a message is flagged, and its date. */
+static void imap_cache_lru_note(const gchar *folder_id, MsgInfo *msginfo,
+				gboolean marked)
+{
+	if (imap_cache_lru == NULL)
+		return;
+
+	if (cache_lru_set_info(imap_cache_lru, folder_id, msginfo->msgnum,
+			       msginfo->date_t, marked))
+		imap_cache_lru_stuck = 0;
+}
+
+/* Notes a message as just read or cached. */
+static void imap_cache_lru_touch(FolderItem *item, guint msgnum)
+{
+	CacheLru *lru = imap_cache_lru_get();
+	MsgInfo *msginfo;
+	goffset limit;
+	gchar *id;
+
+	if (lru == NULL)
+		return;
+
+	id = folder_item_get_identifier(item);
+	cache_lru_touch(lru, id, msgnum, imap_get_cached_size(item, msgnum),
+			time(NULL));
+	if (item->cache &&
+	    (msginfo = msgcache_get_msg(item->cache, msgnum)) != NULL) {
+		imap_cache_lru_note(id, msginfo, MSG_IS_MARKED(msginfo->flags));
+		procmsg_msginfo_free(&msginfo);
+	}
+	g_free(imap_cache_lru_last_id);
+	imap_cache_lru_last_id = id;
+	imap_cache_lru_last_num = msgnum;
+
+	if (imap_cache_lru_save_tag == 0)
+		imap_cache_lru_save_tag = g_timeout_add_seconds(
+				IMAP_CACHE_LRU_SAVE_DELAY,
+				imap_cache_lru_save_func, NULL);
+
+	limit = (goffset)prefs_common.imap_cache_max_size * 1024 * 1024;
+	if (cache_lru_total(lru) <= MAX(limit, imap_cache_lru_stuck + limit / 10))
+		return;
+
+	/* not from here: the caller may be about to use the message */
+	if (imap_cache_lru_trim_tag == 0)
+		imap_cache_lru_trim_tag = g_idle_add(imap_cache_lru_trim_func,
+						     NULL);
+}
+
+static void imap_cache_lru_forget(FolderItem *item, guint msgnum)
+{
+	gchar *id;
+
+	if (imap_cache_lru_get() == NULL)
+		return;
+
+	id = folder_item_get_identifier(item);
+	cache_lru_remove(imap_cache_lru, id, msgnum);
+	g_free(id);
+}
+
+static void imap_cache_lru_forget_folder(FolderItem *item)
+{
+	gchar *id;
+
+	if (imap_cache_lru_get() == NULL)
+		return;
+
+	id = folder_item_get_identifier(item);
+	cache_lru_remove_folder(imap_cache_lru, id);
+	g_free(id);
+}
+
+static void imap_remove_cached_num(FolderItem *item, guint msgnum)
+{
+	gchar *filename;
+
+	filename = imap_get_cached_filename(item, msgnum);
+
+	cm_return_if_fail(filename != NULL);
+
+	if (is_file_exist(filename)) {
+		claws_unlink(filename);
+	}
+	g_free(filename);
+	imap_remove_partial(item, msgnum);
+	imap_unpack_remove(item, msgnum);
+	imap_cache_lru_forget(item, msgnum);
+}
+
+static void imap_remove_cached_msg(Folder *folder, FolderItem *item, MsgInfo *msginfo)
+{
+	imap_remove_cached_num(item, msginfo->msgnum);
+}
+
+typedef struct _TagsData {
+	gchar *str;
+	GSList *msglist;
+	IMAPFolderItem *item;
+} TagsData;
+
+static void imap_commit_tags(FolderItem *item, MsgInfo *msginfo, GSList *tags_set, GSList *tags_unset)
+{
+	IMAPSession *session;
+	gint ok, can_create_tags;
+	Folder *folder = NULL;
+	TagsData *ht_data = NULL;
+	GSList *cur;
+
+	g_return_if_fail(item != NULL);
+	g_return_if_fail(msginfo != NULL);
+
+	folder = item->folder;
+	debug_print("getting session...\n");
+	session = imap_session_get(folder);
+	
+	if (!session) {
+		debug_print("can't get session\n");
+		return;
+	}
+
+	ok = imap_select(session, IMAP_FOLDER(folder), item,
+			 NULL, NULL, NULL, NULL, &can_create_tags, FALSE);
+
+	if (ok != MAILIMAP_NO_ERROR) {
+		return;
+	}
+
+	
+	if (IMAP_FOLDER_ITEM(item)->can_create_flags != ITEM_CAN_CREATE_FLAGS)
+		return;
+	
+	if (IMAP_FOLDER_ITEM(item)->batching) {
+		/* instead of performing an UID STORE command for each message change,
+		 * as a lot of them can change "together", we just fill in hashtables
+		 * and defer the treatment so that we're able to send only one
+		 * command.
+		 */
+		debug_print("IMAP batch mode on, deferring tags change\n");
+		for (cur = tags_set; cur; cur = cur->next) {
+			gint cur_tag = GPOINTER_TO_INT(cur->data);
+			if (cur_tag) {
+				ht_data = g_hash_table_lookup(IMAP_FOLDER_ITEM(item)->tags_set_table, 
+					GINT_TO_POINTER(cur_tag));
+				if (ht_data == NULL) {
+					ht_data = g_new0(TagsData, 1);
+					ht_data->str = g_strdup(tags_get_tag(cur_tag));
+					ht_data->item = IMAP_FOLDER_ITEM(item);
+					g_hash_table_insert(IMAP_FOLDER_ITEM(item)->tags_set_table, 
+						GINT_TO_POINTER(cur_tag), ht_data);
+				}
+				ht_data->msglist = g_slist_prepend(ht_data->msglist, GINT_TO_POINTER(msginfo->msgnum));
+			} 
+		}
+		for (cur = tags_unset; cur; cur = cur->next) {
+			gint cur_tag = GPOINTER_TO_INT(cur->data);
+			if (cur_tag) {
+				ht_data = g_hash_table_lookup(IMAP_FOLDER_ITEM(item)->tags_unset_table, 
+					GINT_TO_POINTER(cur_tag));
+				if (ht_data == NULL) {
+					ht_data = g_new0(TagsData, 1);
+					ht_data->str = g_strdup(tags_get_tag(cur_tag));
+					ht_data->item = IMAP_FOLDER_ITEM(item);
+					g_hash_table_insert(IMAP_FOLDER_ITEM(item)->tags_unset_table, 
+						GINT_TO_POINTER(cur_tag), ht_data);
+				}
+				ht_data->msglist = g_slist_prepend(ht_data->msglist, GINT_TO_POINTER(msginfo->msgnum));
+			}
+		}
+	} else {
+		GSList *list_set = NULL;
+		GSList *list_unset = NULL;
+		GSList numlist;
+		
+		numlist.data = GINT_TO_POINTER(msginfo->msgnum);
+		numlist.next = NULL;
+	
+		debug_print("IMAP changing tags NOW\n");
+		for (cur = tags_set; cur; cur = cur->next) {
+			gint cur_tag = GPOINTER_TO_INT(cur->data);
+			const gchar *str = tags_get_tag(cur_tag);
+			if (IS_NOT_RESERVED_TAG(str))
+				list_set = g_slist_prepend(list_set, g_strdup(str));
+		}
+		if (list_set) {
+			ok = imap_set_message_flags(session, 
+				IMAP_FOLDER_ITEM(item), &numlist, 0, list_set, TRUE);
+			slist_free_strings_full(list_set);
+			if (ok != MAILIMAP_NO_ERROR) {
+				return;
+			}
+		}
+
+		for (cur = tags_unset; cur; cur = cur->next) {
+			gint cur_tag = GPOINTER_TO_INT(cur->data);
 			const gchar *str = tags_get_tag(cur_tag);
 			if (IS_NOT_RESERVED_TAG(str))
 				list_unset = g_slist_prepend(list_unset, g_strdup(str));
@@ -1536,6 +2483,21 @@ static void imap_commit_tags(FolderItem *item, MsgInfo *msginfo, GSList *tags_se
 
 static gchar *imap_fetch_msg_full(Folder *folder, FolderItem *item, gint uid,
 				  gboolean headers, gboolean body)
+{
+	gchar *filename;
+
+	filename = imap_fetch_msg_real(folder, item, uid, headers, body, TRUE);
+	if (filename)
+		imap_cache_lru_touch(item, uid);
+
+	return filename;
+}
+
+/* Interactive fetches are for a message the user is waiting for, and may
+ * go out on another connection when the main one is busy. */
+static gchar *imap_fetch_msg_real(Folder *folder, FolderItem *item, gint uid,
+				  gboolean headers, gboolean body,
+				  gboolean interactive)
 {
 	gchar *path, *filename;
 	IMAPSession *session;
@@ -1558,6 +2520,9 @@ static gchar *imap_fetch_msg_full(Folder *folder, FolderItem *item, gint uid,
 	filename = imap_get_cached_filename(item, uid);
 	debug_print("trying to fetch cached %s\n", filename);
 
+	if (!is_file_exist(filename))
+		imap_unpack_cached_msg(item, uid, filename);
+
 	if (is_file_exist(filename)) {
 		/* see whether the local file represents the whole message
 		 * or not. As the IMAP server reports size with \r chars,
@@ -1603,107 +2568,566 @@ static gchar *imap_fetch_msg_full(Folder *folder, FolderItem *item, gint uid,
 	}
 
 	debug_print("getting session...\n");
-	session = imap_session_get(folder);
+	if (interactive)
+		session = imap_session_get_free(folder);
+	else
+		session = imap_session_get(folder);
+	
+	if (!session) {
+		g_free(filename);
+		return NULL;
+	}
+	session_set_access_time(SESSION(session));
+	lock_session(session); /* unlocked later in the function */
+
+	debug_print("IMAP fetching messages\n");
+	ok = imap_select(session, IMAP_FOLDER(folder), item,
+			 NULL, NULL, NULL, NULL, NULL, FALSE);
+	if (ok != MAILIMAP_NO_ERROR) {
+		g_warning("can't select mailbox %s", item->path);
+		g_free(filename);
+		return NULL;
+	}
+
+	session_set_access_time(SESSION(session));
+
+	debug_print("getting message %d...\n", uid);
+	ok = imap_cmd_fetch(session, (guint32)uid, filename, headers, body);
+
+	if (ok != MAILIMAP_NO_ERROR) {
+		g_warning("can't fetch message %d", uid);
+		g_free(filename);
+		return NULL;
+	}
+
+	session_set_access_time(SESSION(session));
+	unlock_session(session);
+
+	ok = file_strip_crs(filename);
+
+	if (ok == 0 && headers && body) {
+		MsgInfo *cached = msgcache_get_msg(item->cache,uid);
+		if (cached) {
+			procmsg_msginfo_set_flags(cached, MSG_FULLY_CACHED, 0);
+			procmsg_msginfo_free(&cached);
+		}
+	} else if (ok == -1) {
+		MsgInfo *cached = msgcache_get_msg(item->cache,uid);
+		if (cached) {
+			procmsg_msginfo_unset_flags(cached, MSG_FULLY_CACHED, 0);
+			procmsg_msginfo_free(&cached);
+		}
+	}
+	return filename;
+}
+
+static gboolean imap_is_msg_fully_cached(Folder *folder, FolderItem *item, gint uid)
+{
+	gchar *filename;
+	guint size = 0;
+	MsgInfo *cached = msgcache_get_msg(item->cache,uid);
+	
+	if (!cached)
+		return FALSE;
+
+	if (MSG_IS_FULLY_CACHED(cached->flags)) {
+		procmsg_msginfo_free(&cached);
+		return TRUE;
+	}
+
+	filename = imap_get_cached_filename(item, uid);
+
+	if (is_file_exist(filename)) {
+		if (cached && cached->total_size == cached->size) {
+			/* fast path */
+			g_free(filename);
+			procmsg_msginfo_set_flags(cached, MSG_FULLY_CACHED, 0);
+			return TRUE;
+		}
+		size = get_file_size_with_crs(filename);
+	}
+	g_free(filename);
+	debug_print("msg %d cached, has size %d, full should be %zd.\n", uid, size, cached->size);
+	if (cached && size >= cached->size) {
+		cached->total_size = cached->size;
+		procmsg_msginfo_set_flags(cached, MSG_FULLY_CACHED, 0);
+		procmsg_msginfo_free(&cached);
+		return TRUE;
+	}
+	if (cached)
+		procmsg_msginfo_free(&cached);
+	return FALSE;	
+}
+
+void imap_cache_msg(FolderItem *item, gint msgnum)
+{
+	Folder *folder = NULL;
+	
+	if (!item)
+		return;
+	folder = item->folder;
 	
+	if (!imap_is_msg_fully_cached(folder, item, msgnum)) {
+		gchar *tmp = imap_fetch_msg_real(folder, item, msgnum,
+						 TRUE, TRUE, FALSE);
+		debug_print("fetched %s\n", tmp);
+		if (tmp)
+			imap_cache_lru_touch(item, msgnum);
+		g_free(tmp);
+	}
+}
+
+/* The IMAP section number of a part, counting only through multiparts:
+ * anything inside an attached message comes along with it. */
+static gchar *imap_get_part_section(MimeInfo *part)
+{
+	GNode *node = part->node;
+	gchar *section = NULL, *tmp;
+
+	if (node->parent == NULL)
+		return NULL;
+
+	while (node->parent->parent != NULL) {
+		MimeInfo *parent = (MimeInfo *)node->parent->data;
+		gint pos;
+
+		if (parent->type != MIMETYPE_MULTIPART) {
+			g_free(section);
+			return NULL;
+		}
+		pos = g_node_child_position(node->parent, node) + 1;
+		if (section)
+			tmp = g_strdup_printf("%d.%s", pos, section);
+		else
+			tmp = g_strdup_printf("%d", pos);
+		g_free(section);
+		section = tmp;
+		node = node->parent;
+	}
+
+	/* a single part message body */
+	if (section == NULL)
+		section = g_strdup("1");
+
+	return section;
+}
+
+/* Whether part is one that imap_fetch_msg_display() left empty.
+ * Text is always fetched up front, so an empty text part is just that. */
+static gboolean imap_part_is_missing(MimeInfo *part, const gchar *skeleton)
+{
+	return part->content == MIMECONTENT_FILE &&
+	       part->length == 0 &&
+	       part->type != MIMETYPE_MULTIPART &&
+	       part->type != MIMETYPE_TEXT &&
+	       !strcmp(part->data.filename, skeleton);
+}
+
+typedef struct _PartialData {
+	const gchar *skeleton;
+	GSList *missing;
+} PartialData;
+
+static gboolean imap_partial_find_missing(GNode *node, gpointer data)
+{
+	PartialData *partial = (PartialData *)data;
+	MimeInfo *part = (MimeInfo *)node->data;
+	gchar *section;
+
+	if (!imap_part_is_missing(part, partial->skeleton))
+		return FALSE;
+	section = imap_get_part_section(part);
+	if (section)
+		partial->missing = g_slist_prepend(partial->missing, part);
+	g_free(section);
+
+	return FALSE;
+}
+
+/* Once every part left out of a partially fetched message has been
+ * fetched, put the whole message together as the regular cache file.
+ * Parts kept only decoded can't be put back as they were sent, so such
+ * a message stays partial until it is fetched whole. */
+static void imap_partial_complete(FolderItem *item, gint uid,
+				  const gchar *dir, const gchar *skeleton)
+{
+	MimeInfo *mimeinfo;
+	MsgInfo *cached;
+	PartialData partial;
+	FILE *in = NULL, *out = NULL;
+	gchar *filename = NULL, *tmp = NULL;
+	GSList *cur;
+	off_t pos = 0;
+
+	mimeinfo = procmime_scan_file(skeleton);
+	if (!mimeinfo)
+		return;
+
+	partial.skeleton = skeleton;
+	partial.missing = NULL;
+	g_node_traverse(mimeinfo->node, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+			imap_partial_find_missing, &partial);
+	partial.missing = g_slist_reverse(partial.missing);
+
+	for (cur = partial.missing; cur != NULL; cur = cur->next) {
+		gchar *section = imap_get_part_section((MimeInfo *)cur->data);
+		gchar *part_file = g_strconcat(dir, G_DIR_SEPARATOR_S, section, NULL);
+		gboolean have = is_file_exist(part_file);
+
+		g_free(section);
+		g_free(part_file);
+		if (!have)
+			goto out;
+	}
+
+	debug_print("all parts of message %d fetched, putting it together\n", uid);
+	filename = imap_get_cached_filename(item, uid);
+	if (!filename)
+		goto out;
+	tmp = g_strconcat(filename, ".tmp", NULL);
+
+	if ((in = g_fopen(skeleton, "rb")) == NULL ||
+	    (out = g_fopen(tmp, "wb")) == NULL)
+		goto out;
+
+	for (cur = partial.missing; cur != NULL; cur = cur->next) {
+		MimeInfo *part = (MimeInfo *)cur->data;
+		gchar *section = imap_get_part_section(part);
+		gchar *part_file = g_strconcat(dir, G_DIR_SEPARATOR_S, section, NULL);
+		FILE *part_fp;
+		gint ok;
+
+		ok = copy_file_part_to_fp(in, pos, part->offset - pos, out);
+		if (ok == 0 && (part_fp = g_fopen(part_file, "rb")) != NULL) {
+			ok = copy_file_part_to_fp(part_fp, 0,
+						  get_file_size(part_file), out);
+			fclose(part_fp);
+		} else {
+			ok = -1;
+		}
+		g_free(section);
+		g_free(part_file);
+		if (ok < 0)
+			goto out;
+		pos = part->offset;
+	}
+	if (copy_file_part_to_fp(in, pos, get_file_size(skeleton) - pos, out) < 0)
+		goto out;
+
+	if (fclose(out) == EOF) {
+		out = NULL;
+		claws_unlink(tmp);
+		goto out;
+	}
+	out = NULL;
+	if (rename_force(tmp, filename) < 0)
+		goto out;
+
+	cached = msgcache_get_msg(item->cache, uid);
+	if (cached) {
+		procmsg_msginfo_set_flags(cached, MSG_FULLY_CACHED, 0);
+		procmsg_msginfo_free(&cached);
+	}
+
+out:
+	if (out) {
+		fclose(out);
+		claws_unlink(tmp);
+	}
+	if (in)
+		fclose(in);
+	g_free(tmp);
+	g_free(filename);
+	g_slist_free(partial.missing);
+	procmime_mimeinfo_free_all(&mimeinfo);
+}
+
+/* For big messages, fetch the headers and the text for display and
+ * leave the other large parts for imap_fetch_msg_part() to get when
+ * they are needed. */
+static gchar *imap_fetch_msg_display(Folder *folder, FolderItem *item, gint uid)
+{
+	IMAPSession *session;
+	MsgInfo *cached;
+	gchar *dir, *filename;
+	gboolean partial = FALSE;
+	gboolean small;
+	gint ok;
+
+	if (prefs_common.imap_partial_fetch_size <= 0 || uid == 0)
+		return NULL;
+
+	if (imap_is_msg_fully_cached(folder, item, uid)) {
+		imap_remove_partial(item, uid);
+		return NULL;
+	}
+
+	cached = msgcache_get_msg(item->cache, uid);
+	if (!cached)
+		return NULL;
+	small = cached->size < (goffset)prefs_common.imap_partial_fetch_size * 1024;
+	procmsg_msginfo_free(&cached);
+	if (small)
+		return NULL;
+
+	dir = imap_get_partial_dir(item, uid);
+	filename = g_strconcat(dir, G_DIR_SEPARATOR_S, "message", NULL);
+	if (is_file_exist(filename)) {
+		g_free(dir);
+		imap_cache_lru_touch(item, uid);
+		return filename;
+	}
+	if (!is_dir_exist(dir))
+		make_dir_hier(dir);
+	g_free(dir);
+
+	/* let the usual path ask about going online */
+	if (prefs_common.work_offline) {
+		g_free(filename);
+		return NULL;
+	}
+
+	session = imap_session_get_free(folder);
 	if (!session) {
 		g_free(filename);
 		return NULL;
 	}
-	session_set_access_time(SESSION(session));
-	lock_session(session); /* unlocked later in the function */
+	session_set_access_time(SESSION(session));
+	lock_session(session);
+
+	ok = imap_select(session, IMAP_FOLDER(folder), item,
+			 NULL, NULL, NULL, NULL, NULL, FALSE);
+	if (ok != MAILIMAP_NO_ERROR) {
+		g_warning("can't select mailbox %s", item->path);
+		g_free(filename);
+		return NULL;
+	}
+
+	statusbar_print_all(_("Fetching message..."));
+	ok = imap_threaded_fetch_partial(folder, uid, IMAP_PARTIAL_INLINE_MAX,
+					 filename, &partial);
+	statusbar_pop_all();
+	if (ok != MAILIMAP_NO_ERROR) {
+		imap_handle_error(SESSION(session), NULL, ok);
+		g_free(filename);
+		return NULL;
+	}
+
+	session_set_access_time(SESSION(session));
+	unlock_session(session);
+
+	if (!partial || file_strip_crs(filename) != 0) {
+		claws_unlink(filename);
+		g_free(filename);
+		return NULL;
+	}
+
+	debug_print("message %d partially fetched to %s\n", uid, filename);
+	imap_cache_lru_touch(item, uid);
+	return filename;
+}
+
+static gint imap_fetch_msg_part(Folder *folder, FolderItem *item, gint uid,
+				MimeInfo *part)
+{
+	IMAPSession *session;
+	gchar *dir, *skeleton, *section, *filename, *decoded = NULL;
+	gint ok = MAILIMAP_NO_ERROR;
+
+	dir = imap_get_partial_dir(item, uid);
+	skeleton = g_strconcat(dir, G_DIR_SEPARATOR_S, "message", NULL);
+
+	if (!imap_part_is_missing(part, skeleton) ||
+	    (section = imap_get_part_section(part)) == NULL) {
+		g_free(skeleton);
+		g_free(dir);
+		return 0;
+	}
+	filename = g_strconcat(dir, G_DIR_SEPARATOR_S, section, NULL);
+	/* attachments get decoded as they arrive and only the decoded copy
+	 * is kept; text is left to procmime, which also converts its line
+	 * endings */
+	if (part->encoding_type == ENC_BASE64 &&
+	    part->type != MIMETYPE_TEXT && part->type != MIMETYPE_MESSAGE &&
+	    part->type != MIMETYPE_MULTIPART)
+		decoded = g_strconcat(filename, ".decoded", NULL);
+
+	if (!is_file_exist(filename) &&
+	    (decoded == NULL || !is_file_exist(decoded))) {
+		session = imap_session_get_free(folder);
+		if (!session) {
+			ok = MAILIMAP_ERROR_CONNECTION_REFUSED;
+			goto out;
+		}
+		session_set_access_time(SESSION(session));
+		lock_session(session);
+
+		ok = imap_select(session, IMAP_FOLDER(folder), item,
+				 NULL, NULL, NULL, NULL, NULL, FALSE);
+		if (ok != MAILIMAP_NO_ERROR) {
+			g_warning("can't select mailbox %s", item->path);
+			goto out;
+		}
+
+		debug_print("fetching part %s of message %d\n", section, uid);
+		statusbar_print_all(_("Fetching message part..."));
+		ok = imap_threaded_fetch_section(folder, uid, section, filename,
+						 decoded);
+		statusbar_pop_all();
+		if (ok != MAILIMAP_NO_ERROR) {
+			imap_handle_error(SESSION(session), NULL, ok);
+			goto out;
+		}
+		session_set_access_time(SESSION(session));
+		unlock_session(session);
+
+		if (is_file_exist(filename) && file_strip_crs(filename) != 0) {
+			claws_unlink(filename);
+			ok = MAILIMAP_ERROR_FETCH;
+			goto out;
+		}
+	}
 
-	debug_print("IMAP fetching messages\n");
-	ok = imap_select(session, IMAP_FOLDER(folder), item,
-			 NULL, NULL, NULL, NULL, NULL, FALSE);
-	if (ok != MAILIMAP_NO_ERROR) {
-		g_warning("can't select mailbox %s", item->path);
-		g_free(filename);
-		return NULL;
+	/* point the part at what was fetched */
+	g_free(part->data.filename);
+	part->offset = 0;
+	part->tmp = FALSE;
+	if (decoded != NULL && is_file_exist(decoded)) {
+		part->data.filename = g_strdup(decoded);
+		part->length = get_file_size(decoded);
+		part->encoding_type = ENC_BINARY;
+	} else {
+		part->data.filename = g_strdup(filename);
+		part->length = get_file_size(filename);
 	}
 
-	session_set_access_time(SESSION(session));
+	imap_partial_complete(item, uid, dir, skeleton);
+	imap_cache_lru_touch(item, uid);
 
-	debug_print("getting message %d...\n", uid);
-	ok = imap_cmd_fetch(session, (guint32)uid, filename, headers, body);
+out:
+	g_free(decoded);
+	g_free(filename);
+	g_free(section);
+	g_free(skeleton);
+	g_free(dir);
 
-	if (ok != MAILIMAP_NO_ERROR) {
-		g_warning("can't fetch message %d", uid);
-		g_free(filename);
-		return NULL;
-	}
+	return ok == MAILIMAP_NO_ERROR ? 0 : -1;
+}
 
-	session_set_access_time(SESSION(session));
-	unlock_session(session);
+static void imap_cache_msgs_done(FolderItem *item, GHashTable *filenames)
+{
+	GHashTableIter iter;
+	gpointer key, value;
 
-	ok = file_strip_crs(filename);
+	g_hash_table_iter_init(&iter, filenames);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		MsgInfo *cached;
 
-	if (ok == 0 && headers && body) {
-		MsgInfo *cached = msgcache_get_msg(item->cache,uid);
+		if (!is_file_exist((gchar *)value) ||
+		    file_strip_crs((gchar *)value) != 0)
+			continue;
+		cached = msgcache_get_msg(item->cache, GPOINTER_TO_UINT(key));
 		if (cached) {
 			procmsg_msginfo_set_flags(cached, MSG_FULLY_CACHED, 0);
 			procmsg_msginfo_free(&cached);
-		}
-	} else if (ok == -1) {
-		MsgInfo *cached = msgcache_get_msg(item->cache,uid);
-		if (cached) {
-			procmsg_msginfo_unset_flags(cached, MSG_FULLY_CACHED, 0);
-			procmsg_msginfo_free(&cached);
+			imap_pack_cached_msg(item, GPOINTER_TO_UINT(key),
+					     (gchar *)value);
+			imap_cache_lru_touch(item, GPOINTER_TO_UINT(key));
 		}
 	}
-	return filename;
+	g_hash_table_remove_all(filenames);
 }
 
-static gboolean imap_is_msg_fully_cached(Folder *folder, FolderItem *item, gint uid)
+/* Like imap_cache_msg() for a whole list of messages, fetching the
+ * bodies in batches of up to IMAP_PREFETCH_MAX_BYTES instead of one
+ * command per message. */
+void imap_cache_msgs(FolderItem *item, GSList *msglist)
 {
-	gchar *filename;
-	guint size = 0;
-	MsgInfo *cached = msgcache_get_msg(item->cache,uid);
-	
-	if (!cached)
-		return FALSE;
+	Folder *folder;
+	IMAPSession *session;
+	GHashTable *filenames;
+	struct mailimap_set *set;
+	GSList *cur;
+	gchar *path;
+	goffset batch_size = 0;
+	gint done = 0, total = g_slist_length(msglist);
+	gint ok = MAILIMAP_NO_ERROR;
 
-	if (MSG_IS_FULLY_CACHED(cached->flags)) {
-		procmsg_msginfo_free(&cached);
-		return TRUE;
+	if (!item || !msglist)
+		return;
+	folder = item->folder;
+
+	path = folder_item_get_path(item);
+	if (!is_dir_exist(path)) {
+		if(is_file_exist(path))
+			claws_unlink(path);
+		make_dir_hier(path);
 	}
+	g_free(path);
 
-	filename = imap_get_cached_filename(item, uid);
+	session = imap_session_get(folder);
+	if (!session)
+		return;
+	lock_session(session);
 
-	if (is_file_exist(filename)) {
-		if (cached && cached->total_size == cached->size) {
-			/* fast path */
-			g_free(filename);
-			procmsg_msginfo_set_flags(cached, MSG_FULLY_CACHED, 0);
-			return TRUE;
-		}
-		size = get_file_size_with_crs(filename);
-	}
-	g_free(filename);
-	debug_print("msg %d cached, has size %d, full should be %zd.\n", uid, size, cached->size);
-	if (cached && size >= cached->size) {
-		cached->total_size = cached->size;
-		procmsg_msginfo_set_flags(cached, MSG_FULLY_CACHED, 0);
-		procmsg_msginfo_free(&cached);
-		return TRUE;
+	ok = imap_select(session, IMAP_FOLDER(folder), item,
+			 NULL, NULL, NULL, NULL, NULL, FALSE);
+	if (ok != MAILIMAP_NO_ERROR) {
+		g_warning("can't select mailbox %s", item->path);
+		return;
 	}
-	if (cached)
-		procmsg_msginfo_free(&cached);
-	return FALSE;	
-}
 
-void imap_cache_msg(FolderItem *item, gint msgnum)
-{
-	Folder *folder = NULL;
-	
-	if (!item)
-		return;
-	folder = item->folder;
-	
-	if (!imap_is_msg_fully_cached(folder, item, msgnum)) {
-		gchar *tmp = imap_fetch_msg_full(folder, item, msgnum, TRUE, TRUE);
-		debug_print("fetched %s\n", tmp);
-		g_free(tmp);
+	filenames = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+					  NULL, g_free);
+	set = mailimap_set_new_empty();
+
+	statusbar_print_all(_("Fetching messages..."));
+	for (cur = msglist; cur != NULL; cur = cur->next) {
+		MsgInfo *msginfo = (MsgInfo *)cur->data;
+		guint count = 0;
+
+		if (!imap_is_msg_fully_cached(folder, item, msginfo->msgnum)) {
+			gchar *filename = imap_get_cached_filename(item,
+							msginfo->msgnum);
+			g_hash_table_insert(filenames,
+					    GUINT_TO_POINTER(msginfo->msgnum),
+					    filename);
+			mailimap_set_add_single(set, msginfo->msgnum);
+			batch_size += msginfo->size;
+		}
+		done++;
+
+		if (g_hash_table_size(filenames) == 0)
+			continue;
+		if (cur->next != NULL &&
+		    batch_size < IMAP_PREFETCH_MAX_BYTES &&
+		    g_hash_table_size(filenames) < IMAP_FOLDER(folder)->max_set_size)
+			continue;
+
+		debug_print("prefetching %d bodies (%"G_GOFFSET_FORMAT" bytes)\n",
+			    g_hash_table_size(filenames), batch_size);
+		ok = imap_threaded_fetch_bodies(folder, set, filenames, &count);
+		mailimap_set_free(set);
+		set = mailimap_set_new_empty();
+		batch_size = 0;
+
+		if (ok != MAILIMAP_NO_ERROR) {
+			imap_handle_error(SESSION(session), NULL, ok);
+			g_hash_table_remove_all(filenames);
+			break;
+		}
+		session_set_access_time(SESSION(session));
+		imap_cache_msgs_done(item, filenames);
+		statusbar_progress_all(done, total, 1);
 	}
+	statusbar_progress_all(0, 0, 0);
+	statusbar_pop_all();
+
+	mailimap_set_free(set);
+	g_hash_table_destroy(filenames);
+
+	if (ok == MAILIMAP_NO_ERROR)
+		unlock_session(session);
 }
 
 static gint imap_add_msg(Folder *folder, FolderItem *dest, 
@@ -1725,6 +3149,66 @@ static gint imap_add_msg(Folder *folder, FolderItem *dest,
 	return ret;
 }
 
+static IMAPFlags imap_add_msg_get_flags(FolderItem *dest,
+					MsgFileInfo *fileinfo)
+{
+	IMAPFlags iflags = 0;
+
+	if (fileinfo->flags) {
+		if (MSG_IS_MARKED(*fileinfo->flags))
+			iflags |= IMAP_FLAG_FLAGGED;
+		if (MSG_IS_REPLIED(*fileinfo->flags))
+			iflags |= IMAP_FLAG_ANSWERED;
+		if (MSG_IS_FORWARDED(*fileinfo->flags))
+			iflags |= IMAP_FLAG_FORWARDED;
+		if (MSG_IS_SPAM(*fileinfo->flags))
+			iflags |= IMAP_FLAG_SPAM;
+		else
+			iflags |= IMAP_FLAG_HAM;
+		if (!MSG_IS_UNREAD(*fileinfo->flags))
+			iflags |= IMAP_FLAG_SEEN;
+		
+	}
+	
+	if (folder_has_parent_of_type(dest, F_QUEUE) ||
+	    folder_has_parent_of_type(dest, F_OUTBOX) ||
+	    folder_has_parent_of_type(dest, F_DRAFT) ||
+	    folder_has_parent_of_type(dest, F_TRASH))
+		iflags |= IMAP_FLAG_SEEN;
+
+	return iflags;
+}
+
+/* Puts the local file of an appended message in the imapcache, so that
+ * we don't have to fetch it back later. */
+static void imap_add_msg_done(FolderItem *dest, MsgFileInfo *fileinfo,
+			      guint32 new_uid, GHashTable *relation)
+{
+	debug_print("appended new message as %d\n", new_uid);
+
+	if (new_uid == 0) {
+		debug_print("Missing UID (0)\n");
+	} else {
+		gchar *cache_path = folder_item_get_path(dest);
+		if (!is_dir_exist(cache_path))
+			make_dir_hier(cache_path);
+		if (is_dir_exist(cache_path)) {
+			gchar *cache_file = g_strconcat(
+				cache_path, G_DIR_SEPARATOR_S, 
+				itos(new_uid), NULL);
+			copy_file(fileinfo->file, cache_file, TRUE);
+			debug_print("got UID %d, copied to cache: %s\n", new_uid, cache_file);
+			g_free(cache_file);
+		}
+		g_free(cache_path);
+	}
+
+	if (relation != NULL)
+		g_hash_table_insert(relation, fileinfo->msginfo != NULL ? 
+				  (gpointer) fileinfo->msginfo : (gpointer) fileinfo,
+				  GINT_TO_POINTER(new_uid));
+}
+
 static gint imap_add_msgs(Folder *folder, FolderItem *dest, GSList *file_list,
 		   GHashTable *relation)
 {
@@ -1736,6 +3220,10 @@ static gint imap_add_msgs(Folder *folder, FolderItem *dest, GSList *file_list,
 	gint ok = MAILIMAP_NO_ERROR;
 	gint curnum = 0, total = 0;
 	gboolean missing_uids = FALSE;
+	const gchar *files[IMAP_MULTIAPPEND_MAX];
+	IMAPFlags flags[IMAP_MULTIAPPEND_MAX];
+	guint32 new_uids[IMAP_MULTIAPPEND_MAX];
+	guint count, i;
 
 	g_return_val_if_fail(folder != NULL, -1);
 	g_return_val_if_fail(dest != NULL, -1);
@@ -1753,84 +3241,47 @@ static gint imap_add_msgs(Folder *folder, FolderItem *dest, GSList *file_list,
 	}
 	statusbar_print_all(_("Adding messages..."));
 	total = g_slist_length(file_list);
-	for (cur = file_list; cur != NULL; cur = cur->next) {
-		IMAPFlags iflags = 0;
-		guint32 new_uid = 0;
-		gchar *real_file = NULL;
-		fileinfo = (MsgFileInfo *)cur->data;
+	for (cur = file_list; cur != NULL; ) {
+		GSList *batch = cur;
 
 		statusbar_progress_all(curnum, total, total < 10 ? 1:10);
-		curnum++;
-
-		if (fileinfo->flags) {
-			if (MSG_IS_MARKED(*fileinfo->flags))
-				iflags |= IMAP_FLAG_FLAGGED;
-			if (MSG_IS_REPLIED(*fileinfo->flags))
-				iflags |= IMAP_FLAG_ANSWERED;
-			if (MSG_IS_FORWARDED(*fileinfo->flags))
-				iflags |= IMAP_FLAG_FORWARDED;
-			if (MSG_IS_SPAM(*fileinfo->flags))
-				iflags |= IMAP_FLAG_SPAM;
-			else
-				iflags |= IMAP_FLAG_HAM;
-			if (!MSG_IS_UNREAD(*fileinfo->flags))
-				iflags |= IMAP_FLAG_SEEN;
-			
+
+		/* with MULTIAPPEND, a batch goes up in a single command */
+		for (count = 0; cur != NULL && count < IMAP_MULTIAPPEND_MAX &&
+		     (count == 0 || session->multiappend); cur = cur->next) {
+			fileinfo = (MsgFileInfo *)cur->data;
+			files[count] = fileinfo->file;
+			flags[count] = imap_add_msg_get_flags(dest, fileinfo);
+			new_uids[count] = 0;
+			count++;
 		}
-		
-		if (real_file == NULL)
-			real_file = g_strdup(fileinfo->file);
-		
-		if (folder_has_parent_of_type(dest, F_QUEUE) ||
-		    folder_has_parent_of_type(dest, F_OUTBOX) ||
-		    folder_has_parent_of_type(dest, F_DRAFT) ||
-		    folder_has_parent_of_type(dest, F_TRASH))
-			iflags |= IMAP_FLAG_SEEN;
+		curnum += count;
 
-		ok = imap_cmd_append(session, IMAP_FOLDER_ITEM(dest), destdir, real_file, iflags, 
-				     &new_uid);
+		if (count == 1)
+			ok = imap_cmd_append(session, IMAP_FOLDER_ITEM(dest), destdir,
+					     files[0], flags[0], &new_uids[0]);
+		else
+			ok = imap_cmd_append_list(session, IMAP_FOLDER_ITEM(dest),
+						  destdir, files, flags, count,
+						  new_uids);
 
 		if (ok != MAILIMAP_NO_ERROR) {
-			g_warning("can't append message %s", real_file);
-			g_free(real_file);
+			g_warning("can't append message %s%s", files[0],
+				  count > 1 ? " and following" : "");
 			g_free(destdir);
 			statusbar_progress_all(0,0,0);
 			statusbar_pop_all();
 			return -1;
-		} else {
-			debug_print("appended new message as %d\n", new_uid);
-			/* put the local file in the imapcache, so that we don't
-			 * have to fetch it back later. */
-			
-			if (new_uid == 0) {
-				missing_uids = TRUE;
-				debug_print("Missing UID (0)\n");
-			}
-			if (new_uid > 0) {
-				gchar *cache_path = folder_item_get_path(dest);
-				if (!is_dir_exist(cache_path))
-					make_dir_hier(cache_path);
-				if (is_dir_exist(cache_path)) {
-					gchar *cache_file = g_strconcat(
-						cache_path, G_DIR_SEPARATOR_S, 
-						itos(new_uid), NULL);
-					copy_file(real_file, cache_file, TRUE);
-					debug_print("got UID %d, copied to cache: %s\n", new_uid, cache_file);
-					g_free(cache_file);
-				}
-				g_free(cache_path);
-			}
 		}
 
-		if (relation != NULL)
-			g_hash_table_insert(relation, fileinfo->msginfo != NULL ? 
-					  (gpointer) fileinfo->msginfo : (gpointer) fileinfo,
-					  GINT_TO_POINTER(new_uid));
-		if (last_uid < new_uid) {
-			last_uid = new_uid;
+		for (i = 0; i < count; i++, batch = batch->next) {
+			imap_add_msg_done(dest, (MsgFileInfo *)batch->data,
+					  new_uids[i], relation);
+			if (new_uids[i] == 0)
+				missing_uids = TRUE;
+			if (last_uid < new_uids[i])
+				last_uid = new_uids[i];
 		}
-
-		g_free(real_file);
 	}
 	
 	statusbar_progress_all(0,0,0);
@@ -1884,9 +3335,11 @@ static GSList *flatten_mailimap_set(struct mailimap_set * set)
 	
 	return result;
 }
+/* With move set, the messages are moved with UID MOVE, which the
+ * session must support, instead of copied. */
 static gint imap_do_copy_msgs(Folder *folder, FolderItem *dest, 
 			      MsgInfoList *msglist, GHashTable *relation,
-			      gboolean same_dest_ok)
+			      gboolean same_dest_ok, gboolean move)
 {
 	FolderItem *src;
 	gchar *destdir;
@@ -1894,7 +3347,7 @@ static gint imap_do_copy_msgs(Folder *folder, FolderItem *dest,
 	MsgInfo *msginfo;
 	IMAPSession *session;
 	gint ok = MAILIMAP_NO_ERROR;
-	GHashTable *uid_hash;
+	GHashTable *uid_hash, *done_hash;
 	gint last_num = 0;
 
 	g_return_val_if_fail(folder != NULL, -1);
@@ -1914,6 +3367,7 @@ static gint imap_do_copy_msgs(Folder *folder, FolderItem *dest,
 		g_warning("the src folder is identical to the dest.");
 		return -1;
 	}
+	imap_flush_flags(src);
 
 	if (src->folder != dest->folder) {
 		GSList *infolist = NULL, *cur;
@@ -1955,27 +3409,39 @@ static gint imap_do_copy_msgs(Folder *folder, FolderItem *dest,
 
 	seq_list = imap_get_lep_set_from_msglist(IMAP_FOLDER(folder), msglist);
 	uid_hash = g_hash_table_new(g_direct_hash, g_direct_equal);
+	/* the messages of the sets the server has taken */
+	done_hash = g_hash_table_new(g_direct_hash, g_direct_equal);
 	
-	statusbar_print_all(_("Copying messages..."));
+	statusbar_print_all(move ? _("Moving messages...") : _("Copying messages..."));
 	for (cur = seq_list; cur != NULL; cur = g_slist_next(cur)) {
 		struct mailimap_set * seq_set;
 		struct mailimap_set * source = NULL;
 		struct mailimap_set * dest = NULL;
 		seq_set = cur->data;
 
-		debug_print("Copying messages from %s to %s ...\n",
-			    src->path, destdir);
+		debug_print("%s messages from %s to %s ...\n",
+			    move ? "Moving" : "Copying", src->path, destdir);
 
 		lock_session(session); /* unlocked later in the function */
-		ok = imap_cmd_copy(session, seq_set, destdir,
-			&source, &dest);
+		if (move)
+			ok = imap_cmd_move(session, seq_set, destdir,
+				&source, &dest);
+		else
+			ok = imap_cmd_copy(session, seq_set, destdir,
+				&source, &dest);
 		
 		if (is_fatal(ok)) {
 			session = NULL;
 		}
 
 		if (ok == MAILIMAP_NO_ERROR) {
+			GSList *done = flatten_mailimap_set(seq_set), *d_cur;
+
 			unlock_session(session);
+			for (d_cur = done; d_cur; d_cur = d_cur->next)
+				g_hash_table_insert(done_hash, d_cur->data,
+						    d_cur->data);
+			g_slist_free(done);
 			if (relation && source && dest) {
 				GSList *s_list = flatten_mailimap_set(source);
 				GSList *d_list = flatten_mailimap_set(dest);
@@ -2002,18 +3468,20 @@ static gint imap_do_copy_msgs(Folder *folder, FolderItem *dest,
 		if (dest)
 			mailimap_set_free(dest);
 
-		if (ok != MAILIMAP_NO_ERROR) {
-			g_hash_table_destroy(uid_hash);
-			imap_lep_set_free(seq_list);
-			statusbar_pop_all();
-			return -1;
-		}
+		/* what the earlier sets did stands, and is recorded below;
+		 * with a move, those messages are gone from src already */
+		if (ok != MAILIMAP_NO_ERROR)
+			break;
 	}
 
 	for (cur = msglist; cur != NULL; cur = g_slist_next(cur)) {
 		MsgInfo *msginfo = (MsgInfo *)cur->data;
 		gpointer hashval;
 
+		if (!g_hash_table_lookup(done_hash,
+					 GINT_TO_POINTER(msginfo->msgnum)))
+			continue;
+
 		hashval = g_hash_table_lookup(uid_hash, GINT_TO_POINTER(msginfo->msgnum));
 		
 		if (hashval != NULL) {
@@ -2039,11 +3507,22 @@ static gint imap_do_copy_msgs(Folder *folder, FolderItem *dest,
 				if (!is_dir_exist(cache_path))
 					make_dir_hier(cache_path);
 				if (is_file_exist(real_file) && is_dir_exist(cache_path)) {
-					if (copy_file(real_file, cache_file, TRUE) < 0)
+					if ((move ? move_file(real_file, cache_file, TRUE)
+						  : copy_file(real_file, cache_file, TRUE)) < 0)
 						debug_print("couldn't cache to %s: %s\n", cache_file,
 							    strerror(errno));
-					else
+					else {
 						debug_print("copied to cache: %s\n", cache_file);
+						imap_cache_lru_touch(dest, num);
+					}
+				} else if (is_dir_exist(cache_path) &&
+					   imap_unpack_cached_msg(msginfo->folder,
+						msginfo->msgnum, cache_file)) {
+					/* a move drops it from the pack with
+					 * the rest of the source's cache below */
+					debug_print("copied to cache from pack: %s\n",
+						    cache_file);
+					imap_cache_lru_touch(dest, num);
 				}
 				g_free(real_file);
 				g_free(cache_file);
@@ -2059,6 +3538,20 @@ static gint imap_do_copy_msgs(Folder *folder, FolderItem *dest,
 	imap_lep_set_free(seq_list);
 
 	g_free(destdir);
+
+	if (move) {
+		/* the server expunged the originals already */
+		if (session)
+			session->folder_content_changed = TRUE;
+		for (cur = msglist; cur != NULL; cur = g_slist_next(cur)) {
+			MsgInfo *msginfo = (MsgInfo *)cur->data;
+			if (g_hash_table_lookup(done_hash,
+						GINT_TO_POINTER(msginfo->msgnum)))
+				imap_remove_cached_msg(folder, src, msginfo);
+		}
+		imap_scan_required(folder, src);
+	}
+	g_hash_table_destroy(done_hash);
 	
 	IMAP_FOLDER_ITEM(dest)->lastuid = 0;
 	IMAP_FOLDER_ITEM(dest)->uid_next = 0;
@@ -2097,7 +3590,38 @@ static gint imap_copy_msgs(Folder *folder, FolderItem *dest,
 	msginfo = (MsgInfo *)msglist->data;
 	g_return_val_if_fail(msginfo->folder != NULL, -1);
 
-	ret = imap_do_copy_msgs(folder, dest, msglist, relation, FALSE);
+	ret = imap_do_copy_msgs(folder, dest, msglist, relation, FALSE, FALSE);
+	return ret;
+}
+
+static gint imap_move_msgs(Folder *folder, FolderItem *dest, 
+		    MsgInfoList *msglist, GHashTable *relation)
+{
+	MsgInfo *msginfo;
+	IMAPSession *session;
+	gint ret;
+
+	g_return_val_if_fail(folder != NULL, -1);
+	g_return_val_if_fail(dest != NULL, -1);
+	g_return_val_if_fail(msglist != NULL, -1);
+
+	msginfo = (MsgInfo *)msglist->data;
+	g_return_val_if_fail(msginfo->folder != NULL, -1);
+
+	debug_print("getting session...\n");
+	session = imap_session_get(folder);
+	if (!session) {
+		return -1;
+	}
+
+	if (session->move)
+		return imap_do_copy_msgs(folder, dest, msglist, relation,
+					 FALSE, TRUE);
+
+	/* without MOVE, copy, then flag as deleted and expunge */
+	ret = imap_do_copy_msgs(folder, dest, msglist, relation, FALSE, FALSE);
+	if (ret >= 0)
+		imap_do_remove_msgs(folder, msginfo->folder, msglist, relation);
 	return ret;
 }
 
@@ -2480,30 +4004,107 @@ static gint	search_msgs		(Folder			*folder,
 
 		*msgs = imap_uid_list_from_lep(uidlist, &result);
 
-		mailimap_search_result_free(uidlist);
+		mailimap_search_result_free(uidlist);
+
+		if (charset_to_use != NULL)
+			g_free(charset_to_use);
+
+		return result;
+	} else if (charset_to_use != NULL) {
+		/* If search failed and was on an 8-bit string, try the next
+		 * available charset to search if there still are some.
+		 */
+		g_free(charset_to_use);
+		
+		imap_change_search_charset(IMAP_FOLDER(folder));
+		if (IMAP_FOLDER(folder)->search_charset_supported)
+			return search_msgs(folder, container, msgs, on_server, predicate,
+				   progress_cb, progress_data);
+		else
+			return -1;
+	} else {
+		return -1;
+	}
+}
+
+/* With imap_server_sort_min set, folders with at least that many
+ * messages are sorted by the server (RFC 5256) for the keys it knows,
+ * rather than by comparing the messages here. */
+static GSList *imap_get_sort_order(Folder *folder, FolderItem *item,
+				   FolderSortKey sort_key)
+{
+	IMAPFolderItem *imap_item = IMAP_FOLDER_ITEM(item);
+	IMAPSession *session;
+	clist *uidlist = NULL;
+	GSList *order;
+	gint imap_sort_key;
+	gint ok;
+
+	g_return_val_if_fail(folder != NULL, NULL);
+	g_return_val_if_fail(item != NULL, NULL);
+
+	if (prefs_common.imap_server_sort_min <= 0 ||
+	    item->total_msgs < prefs_common.imap_server_sort_min ||
+	    prefs_common.work_offline)
+		return NULL;
+
+	/* FROM and TO sort by address on the server, not by the name the
+	 * column shows, so those are left to the summary */
+	switch (sort_key) {
+	case SORT_BY_DATE:
+		imap_sort_key = IMAP_SORT_DATE;
+		break;
+	case SORT_BY_SIZE:
+		imap_sort_key = IMAP_SORT_SIZE;
+		break;
+	case SORT_BY_SUBJECT:
+		imap_sort_key = IMAP_SORT_SUBJECT;
+		break;
+	default:
+		return NULL;
+	}
+
+	if (imap_item->sort_order != NULL &&
+	    imap_item->sort_order_key == sort_key &&
+	    imap_item->sort_order_total == item->total_msgs &&
+	    imap_item->sort_order_uid_next == imap_item->uid_next)
+		return g_slist_copy(imap_item->sort_order);
+
+	session = imap_session_get(folder);
+	if (!session)
+		return NULL;
+	if (!imap_has_capability(session, "SORT"))
+		return NULL;
+	lock_session(session);
+
+	ok = imap_select(session, IMAP_FOLDER(folder), item,
+			 NULL, NULL, NULL, NULL, NULL, FALSE);
+	if (ok != MAILIMAP_NO_ERROR)
+		return NULL;
+
+	debug_print("asking the server to sort %s\n", item->path);
+	ok = imap_threaded_sort(folder, imap_sort_key, &uidlist);
+	if (ok == MAILIMAP_ERROR_EXTENSION) {
+		unlock_session(session);
+		return NULL;
+	} else if (ok != MAILIMAP_NO_ERROR) {
+		imap_handle_error(SESSION(session), NULL, ok);
+		return NULL;
+	}
+	unlock_session(session);
+
+	order = imap_uid_list_from_lep(uidlist, NULL);
+	mailimap_search_result_free(uidlist);
 
-		if (charset_to_use != NULL)
-			g_free(charset_to_use);
+	g_slist_free(imap_item->sort_order);
+	imap_item->sort_order = order;
+	imap_item->sort_order_key = sort_key;
+	imap_item->sort_order_total = item->total_msgs;
+	imap_item->sort_order_uid_next = imap_item->uid_next;
 
-		return result;
-	} else if (charset_to_use != NULL) {
-		/* If search failed and was on an 8-bit string, try the next
-		 * available charset to search if there still are some.
-		 */
-		g_free(charset_to_use);
-		
-		imap_change_search_charset(IMAP_FOLDER(folder));
-		if (IMAP_FOLDER(folder)->search_charset_supported)
-			return search_msgs(folder, container, msgs, on_server, predicate,
-				   progress_cb, progress_data);
-		else
-			return -1;
-	} else {
-		return -1;
-	}
+	return g_slist_copy(order);
 }
 
-
 static gint imap_do_remove_msgs(Folder *folder, FolderItem *dest, 
 			        MsgInfoList *msglist, GHashTable *relation)
 {
@@ -2517,6 +4118,9 @@ static gint imap_do_remove_msgs(Folder *folder, FolderItem *dest,
 	g_return_val_if_fail(dest != NULL, -1);
 	g_return_val_if_fail(msglist != NULL, -1);
 
+	msginfo = (MsgInfo *)msglist->data;
+	imap_flush_flags(msginfo->folder);
+
 	debug_print("getting session...\n");
 	session = imap_session_get(folder);
 	if (!session) {
@@ -2525,8 +4129,6 @@ static gint imap_do_remove_msgs(Folder *folder, FolderItem *dest,
 
 	lock_session(session); /* unlocked later in the function */
 
-	msginfo = (MsgInfo *)msglist->data;
-
 	ok = imap_select(session, IMAP_FOLDER(folder), msginfo->folder,
 			 NULL, NULL, NULL, NULL, NULL, FALSE);
 	if (ok != MAILIMAP_NO_ERROR) {
@@ -2569,6 +4171,8 @@ static gint imap_do_remove_msgs(Folder *folder, FolderItem *dest,
 		for (cur = msglist; cur; cur = cur->next) {
 			msginfo = (MsgInfo *)cur->data;
 			remove_numbered_files(dir, msginfo->msgnum, msginfo->msgnum);
+			imap_unpack_remove(msginfo->folder, msginfo->msgnum);
+			imap_cache_lru_forget(msginfo->folder, msginfo->msgnum);
 		}
 	}
 	g_free(dir);
@@ -2615,6 +4219,8 @@ static gboolean imap_is_msg_changed(Folder *folder, FolderItem *item,
 
 static gint imap_close(Folder *folder, FolderItem *item)
 {
+	imap_flush_flags(item);
+	imap_pack_cached_msgs(item);
 	return 0;
 }
 
@@ -3315,6 +4921,7 @@ static gint imap_rename_folder(Folder *folder, FolderItem *item,
 	gchar *paths[2];
 	gchar *old_cache_dir;
 	gchar *new_cache_dir;
+	gchar *old_id, *new_id;
 	IMAPSession *session;
 	gchar separator;
 	gint ok = MAILIMAP_NO_ERROR;
@@ -3385,12 +4992,21 @@ static gint imap_rename_folder(Folder *folder, FolderItem *item,
 	item->name = g_strdup(name);
 
 	old_cache_dir = folder_item_get_path(item);
+	old_id = folder_item_get_identifier(item);
+	imap_item_close_packs(item);
 
 	paths[0] = g_strdup(item->path);
 	paths[1] = newpath;
 	g_node_traverse(item->node, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
 			imap_rename_folder_func, paths);
 
+	if (imap_cache_lru_get()) {
+		new_id = folder_item_get_identifier(item);
+		cache_lru_rename_folder(imap_cache_lru, old_id, new_id);
+		g_free(new_id);
+	}
+	g_free(old_id);
+
 	if (is_dir_exist(old_cache_dir)) {
 		new_cache_dir = folder_item_get_path(item);
 		if (g_rename(old_cache_dir, new_cache_dir) < 0) {
@@ -3493,6 +5109,8 @@ static gint imap_remove_folder_real(Folder *folder, FolderItem *item)
 	}
 
 	g_free(path);
+	imap_item_close_packs(item);
+	imap_cache_lru_forget_folder(item);
 	cache_dir = folder_item_get_path(item);
 	if (is_dir_exist(cache_dir) && remove_dir_recursive(cache_dir) < 0)
 		g_warning("can't remove directory '%s'", cache_dir);
@@ -3523,195 +5141,195 @@ static gint imap_remove_folder(Folder *folder, FolderItem *item)
 	return imap_remove_folder_real(folder, item);
 }
 
-typedef struct _uncached_data {
-	IMAPSession *session;
-	FolderItem *item;
-	MsgNumberList *numlist;
-	guint cur;
-	guint total;
-	gboolean done;
+/* Envelopes are fetched in chunks of this many messages */
+#define MAX_MSG_NUM 200
+
+typedef struct _uncached_chunk {
+	carray *env_list;
 	int ok;
-} uncached_data;
+	gboolean done;
+} uncached_chunk;
 
-static void *imap_get_uncached_messages_thread(void *data)
+static void imap_uncached_fetched(Folder *folder, IMAPThreadedOp *op,
+				  gpointer data)
 {
-	uncached_data *stuff = (uncached_data *)data;
-	IMAPSession *session = stuff->session;
-	FolderItem *item = stuff->item;
-	MsgNumberList *numlist = stuff->numlist;
-	GSList *newlist = NULL;
-	GSList *llast = NULL;
-	GSList *seq_list, *cur;
+	uncached_chunk *chunk = (uncached_chunk *)data;
+
+	chunk->ok = imap_threaded_fetch_env_finish(op, &chunk->env_list);
+	chunk->done = TRUE;
+}
+
+static uncached_chunk *imap_uncached_fetch(IMAPSession *session,
+					   struct mailimap_set *set)
+{
+	uncached_chunk *chunk = g_new0(uncached_chunk, 1);
+
+	chunk->ok = MAILIMAP_NO_ERROR;
+	imap_threaded_fetch_env_async(session->folder, set,
+				      imap_uncached_fetched, chunk);
+	return chunk;
+}
+
+/* Turns the envelopes of a chunk into MsgInfos, appending them to
+ * *list, whose last element is *last. */
+static void imap_uncached_convert(FolderItem *item, carray *env_list,
+				  GSList **list, GSList **last,
+				  gboolean *got_alien_tags)
+{
+	unsigned int i;
+
+	for(i = 0 ; i < carray_count(env_list) ; i += 2) {
+		struct imap_fetch_env_info * info;
+		MsgInfo * msginfo;
+		GSList *tags = NULL, *cur = NULL;
+		info = carray_get(env_list, i);
+		tags = carray_get(env_list, i+1);
+		msginfo = imap_envelope_from_lep(info, item);
+		if (msginfo == NULL) {
+			slist_free_strings_full(tags);
+			continue;
+		}
+		g_slist_free(msginfo->tags);
+		msginfo->tags = NULL;
+
+		for (cur = tags; cur; cur = cur->next) {
+			gchar *real_tag = imap_modified_utf7_to_utf8(cur->data, TRUE);
+			gint id = 0;
+			id = tags_get_id_for_str(real_tag);
+			if (id == -1) {
+				id = tags_add_tag(real_tag);
+				*got_alien_tags = TRUE;
+			}
+			if (!g_slist_find(msginfo->tags, GINT_TO_POINTER(id))) {
+				msginfo->tags = g_slist_prepend(
+						msginfo->tags,
+						GINT_TO_POINTER(id));
+			}
+			g_free(real_tag);
+		}
+		if (msginfo->tags)
+			msginfo->tags = g_slist_reverse(msginfo->tags);
+		slist_free_strings_full(tags);
+		msginfo->folder = item;
+		if (*list == NULL)
+			*last = *list = g_slist_append(NULL, msginfo);
+		else {
+			*last = g_slist_append(*last, msginfo);
+			*last = (*last)->next;
+		}
+	}
+}
+
+/* Fetches the envelopes of the messages in numlist, newest first. The
+ * request for a chunk goes out before the previous one is converted,
+ * so the connection is kept busy and at most two chunks of raw
+ * envelopes are held at a time. */
+static GSList *imap_get_uncached_messages(IMAPSession *session,
+					FolderItem *item,
+					MsgNumberList *numlist,
+					int *r)
+{
+	GSList *result = NULL, *last = NULL;
+	GSList *chunk_list, *chunk_last;
+	GSList *sorted, *cur, *seq_list = NULL, *set_cur;
+	uncached_chunk *chunk, *next = NULL;
 	gboolean got_alien_tags = FALSE;
+	guint done = 0, total;
+
+	*r = MAILIMAP_NO_ERROR;
 
-	debug_print("uncached_messages\n");
-	
 	if (session == NULL || item == NULL || item->folder == NULL
-	    || FOLDER_CLASS(item->folder) != &imap_class) {
-		stuff->done = TRUE;
+	    || FOLDER_CLASS(item->folder) != &imap_class)
+		return NULL;
+
+	if (prefs_common.work_offline && 
+	    !inc_offline_should_override(FALSE,
+		_("Claws Mail needs network access in order "
+		  "to access the IMAP server."))) {
 		return NULL;
 	}
-	
-	seq_list = imap_get_lep_set_from_numlist(IMAP_FOLDER(item->folder), numlist);
-	debug_print("get msgs info\n");
-	for (cur = seq_list; cur != NULL; cur = g_slist_next(cur)) {
-		struct mailimap_set * imapset;
-		unsigned int i;
-		int r;
-		carray * env_list;
-		int count;
-		
-		if (session->cancelled)
-			break;
-		
-		imapset = cur->data;
-		
-		r = imap_threaded_fetch_env(session->folder,
-					    imapset, &env_list);
-		if (r != MAILIMAP_NO_ERROR) {
-			imap_handle_error(SESSION(session), NULL, r);
-			if (is_fatal(r)) {
-				stuff->ok = r;
-				return NULL;
-			}
+
+	total = g_slist_length(numlist);
+	debug_print("messages list : %i\n", total);
+
+	sorted = g_slist_sort(g_slist_copy(numlist), g_int_compare);
+	sorted = g_slist_reverse(sorted);
+	for (cur = sorted; cur != NULL; ) {
+		GSList *chunk_end = cur;
+		gint count;
+
+		for (count = 1; count < MAX_MSG_NUM && chunk_end->next; count++)
+			chunk_end = chunk_end->next;
+		/* cut this chunk off the list */
+		cur = chunk_end->next;
+		chunk_end->next = NULL;
+		seq_list = g_slist_concat(seq_list,
+			imap_get_lep_set_from_numlist(IMAP_FOLDER(item->folder),
+						      sorted));
+		g_slist_free(sorted);
+		sorted = cur;
+	}
+
+	set_cur = seq_list;
+	if (set_cur != NULL)
+		next = imap_uncached_fetch(session, set_cur->data);
+
+	while (next != NULL) {
+		chunk = next;
+		next = NULL;
+		while (!chunk->done)
+			gtk_main_iteration();
+		imap_threaded_use_connection(session->folder, session->conn);
+
+		set_cur = set_cur->next;
+		if (set_cur != NULL && !is_fatal(chunk->ok) && !session->cancelled)
+			next = imap_uncached_fetch(session, set_cur->data);
+
+		if (chunk->ok != MAILIMAP_NO_ERROR) {
+			imap_handle_error(SESSION(session), NULL, chunk->ok);
+			if (is_fatal(chunk->ok))
+				*r = chunk->ok;
+			g_free(chunk);
 			continue;
 		}
 
 		session_set_access_time(SESSION(session));
-
-		count = 0;
-		for(i = 0 ; i < carray_count(env_list) ; i += 2) {
-			struct imap_fetch_env_info * info;
-			MsgInfo * msginfo;
-			GSList *tags = NULL, *cur = NULL;
-			info = carray_get(env_list, i);
-			tags = carray_get(env_list, i+1);
-			msginfo = imap_envelope_from_lep(info, item);
-			if (msginfo == NULL) {
-				slist_free_strings_full(tags);
-				continue;
-			}
-			g_slist_free(msginfo->tags);
-			msginfo->tags = NULL;
-
-			for (cur = tags; cur; cur = cur->next) {
-				gchar *real_tag = imap_modified_utf7_to_utf8(cur->data, TRUE);
-				gint id = 0;
-				id = tags_get_id_for_str(real_tag);
-				if (id == -1) {
-					id = tags_add_tag(real_tag);
-					got_alien_tags = TRUE;
-				}
-				if (!g_slist_find(msginfo->tags, GINT_TO_POINTER(id))) {
-					msginfo->tags = g_slist_prepend(
-							msginfo->tags,
-							GINT_TO_POINTER(id));
-				}
-				g_free(real_tag);
-			}
-			if (msginfo->tags)
-				msginfo->tags = g_slist_reverse(msginfo->tags);
-			slist_free_strings_full(tags);
-			msginfo->folder = item;
-			if (!newlist)
-				llast = newlist = g_slist_append(newlist, msginfo);
-			else {
-				llast = g_slist_append(llast, msginfo);
-				llast = llast->next;
-			}
-			count ++;
+		done += carray_count(chunk->env_list) / 2;
+		chunk_list = chunk_last = NULL;
+		imap_uncached_convert(item, chunk->env_list,
+				      &chunk_list, &chunk_last,
+				      &got_alien_tags);
+		imap_fetch_env_free(chunk->env_list);
+		g_free(chunk);
+
+		/* let the summary show this chunk while the next arrives */
+		folder_item_scan_add_msginfos(item, chunk_list);
+		if (chunk_list != NULL) {
+			if (last != NULL)
+				last->next = chunk_list;
+			else
+				result = chunk_list;
+			last = chunk_last;
 		}
-		
-		imap_fetch_env_free(env_list);
+
+		statusbar_progress_all(MIN(done, total), total, 1);
 	}
-	
+
 	if (got_alien_tags) {
 		tags_write_tags();
 		main_window_reflect_tags_changes(mainwindow_get_mainwindow());
 	}
 
 	imap_lep_set_free(seq_list);
-	
-	session_set_access_time(SESSION(session));
-	stuff->done = TRUE;
-	return newlist;
-}
 
-#define MAX_MSG_NUM 50
-
-static GSList *imap_get_uncached_messages(IMAPSession *session,
-					FolderItem *item,
-					MsgNumberList *numlist,
-					int *r)
-{
-	GSList *result = NULL;
-	GSList * cur;
-	uncached_data *data = g_new0(uncached_data, 1);
-	
-	cur = numlist;
-	data->total = g_slist_length(numlist);
-	data->ok = MAILIMAP_NO_ERROR;
-	debug_print("messages list : %i\n", data->total);
-
-	while (cur != NULL) {
-		GSList * partial_result;
-		int count;
-		GSList * newlist;
-		GSList * llast;
-		
-		llast = NULL;
-		count = 0;
-		newlist = NULL;
-		while (count < MAX_MSG_NUM) {
-			void * p;
-			
-			p = cur->data;
-			
-			if (newlist == NULL)
-				llast = newlist = g_slist_append(newlist, p);
-			else {
-				llast = g_slist_append(llast, p);
-				llast = llast->next;
-			}
-			count ++;
-			
-			cur = cur->next;
-			if (cur == NULL)
-				break;
-		}
-		
-		data->done = FALSE;
-		data->session = session;
-		data->item = item;
-		data->numlist = newlist;
-		data->cur += count;
-		
-		if (prefs_common.work_offline && 
-		    !inc_offline_should_override(FALSE,
-			_("Claws Mail needs network access in order "
-			  "to access the IMAP server."))) {
-			g_free(data);
-			return NULL;
-		}
-		
-		partial_result =
-			(GSList *)imap_get_uncached_messages_thread(data);
-		*r = data->ok;
-		if (data->ok != MAILIMAP_NO_ERROR) {
-			goto bail;
-		}
-		statusbar_progress_all(data->cur,data->total, 1);
-		
-		g_slist_free(newlist);
-		
-		result = g_slist_concat(result, partial_result);
-	}
-bail:
-	g_free(data);
-	
 	statusbar_progress_all(0,0,0);
 	statusbar_pop_all();
-	
+
+	if (*r != MAILIMAP_NO_ERROR) {
+		procmsg_msg_list_free(result);
+		return NULL;
+	}
+
 	return result;
 }
 
@@ -3729,6 +5347,11 @@ static void imap_delete_all_cached_messages(FolderItem *item)
 	if (is_dir_exist(dir))
 		remove_all_numbered_files(dir);
 	g_free(dir);
+	/* the UIDs of these skeletons may now be other messages' */
+	imap_remove_partial_not_in_list(item, NULL);
+	if (imap_item_get_pack(item))
+		cache_pack_remove_all(IMAP_FOLDER_ITEM(item)->pack);
+	imap_cache_lru_forget_folder(item);
 
 	debug_print("done.\n");
 }
@@ -3977,6 +5600,56 @@ static gint imap_select(IMAPSession *session, IMAPFolder *folder,
 	return ok;
 }
 
+/* Picks the values asked for out of a STATUS response, returning a
+ * mask of those found as imap_status() builds it. */
+static int imap_status_values(struct mailimap_mailbox_data_status *data_status,
+			      gint *messages, guint32 *uid_next,
+			      guint32 *uid_validity, gint *unseen)
+{
+	clistiter * iter;
+	int got_values = 0;
+
+	if (data_status->st_info_list) {
+		for(iter = clist_begin(data_status->st_info_list) ; iter != NULL ;
+		    iter = clist_next(iter)) {
+			struct mailimap_status_info * info;		
+
+			info = clist_content(iter);
+			switch (info->st_att) {
+			case MAILIMAP_STATUS_ATT_MESSAGES:
+				if (messages) {
+					* messages = info->st_value;
+					got_values |= 1 << 0;
+				}
+				break;
+
+			case MAILIMAP_STATUS_ATT_UIDNEXT:
+				if (uid_next) {
+					* uid_next = info->st_value;
+					got_values |= 1 << 2;
+				}
+				break;
+
+			case MAILIMAP_STATUS_ATT_UIDVALIDITY:
+				if (uid_validity) {
+					* uid_validity = info->st_value;
+					got_values |= 1 << 3;
+				}
+				break;
+
+			case MAILIMAP_STATUS_ATT_UNSEEN:
+				if (unseen) {
+					* unseen = info->st_value;
+					got_values |= 1 << 4;
+				}
+				break;
+			}
+		}
+	}
+
+	return got_values;
+}
+
 static gint imap_status(IMAPSession *session, IMAPFolder *folder,
 			const gchar *path, IMAPFolderItem *item,
 			gint *messages,
@@ -3984,7 +5657,6 @@ static gint imap_status(IMAPSession *session, IMAPFolder *folder,
 			gint *unseen, gboolean block)
 {
 	int r = MAILIMAP_NO_ERROR;
-	clistiter * iter;
 	struct mailimap_mailbox_data_status * data_status;
 	int got_values;
 	gchar *real_path;
@@ -4041,50 +5713,129 @@ static gint imap_status(IMAPSession *session, IMAPFolder *folder,
 		return MAILIMAP_ERROR_BAD_STATE;
 	}
 	
-	got_values = 0;
-	if (data_status->st_info_list) {
-		for(iter = clist_begin(data_status->st_info_list) ; iter != NULL ;
-		    iter = clist_next(iter)) {
-			struct mailimap_status_info * info;		
+	got_values = imap_status_values(data_status, messages, uid_next,
+					uid_validity, unseen);
+	mailimap_mailbox_data_status_free(data_status);
+	
+	if (got_values != mask) {
+		g_warning("status: incomplete values received (%d)", got_values);
+	}
+	return MAILIMAP_NO_ERROR;
+}
 
-			info = clist_content(iter);
-			switch (info->st_att) {
-			case MAILIMAP_STATUS_ATT_MESSAGES:
-				if (messages) {
-					* messages = info->st_value;
-					got_values |= 1 << 0;
-				}
-				break;
+/* How long a round of prefetched STATUS answers stays usable */
+#define IMAP_STATUS_PREFETCH_AGE 30
 
-			case MAILIMAP_STATUS_ATT_UIDNEXT:
-				if (uid_next) {
-					* uid_next = info->st_value;
-					got_values |= 1 << 2;
-				}
-				break;
+static gboolean imap_status_prefetch_func(GNode *node, gpointer data)
+{
+	IMAPFolderItem *item = (IMAPFolderItem *)node->data;
+	GSList **items = (GSList **)data;
 
-			case MAILIMAP_STATUS_ATT_UIDVALIDITY:
-				if (uid_validity) {
-					* uid_validity = info->st_value;
-					got_values |= 1 << 3;
-				}
-				break;
+	item->status_valid = FALSE;
+	if (item->item.path == NULL || item->item.no_select ||
+	    item->should_update ||
+	    (item->item.prefs && !item->item.prefs->newmailcheck))
+		return FALSE;
 
-			case MAILIMAP_STATUS_ATT_UNSEEN:
-				if (unseen) {
-					* unseen = info->st_value;
-					got_values |= 1 << 4;
-				}
-				break;
-			}
+	*items = g_slist_prepend(*items, item);
+	return FALSE;
+}
+
+/* Asks for the STATUS of all the folders that a check for new mail
+ * goes through at once, instead of one by one as imap_scan_required()
+ * gets to them: the commands are pipelined, so that a few round trips
+ * cover the whole tree. The answers are kept for imap_scan_required()
+ * to use once each. Does nothing if libetpan can't pipeline. */
+static void imap_status_prefetch(Folder *folder)
+{
+	IMAPSession *session;
+	GSList *items = NULL, *cur;
+	GPtrArray *mbs, *ids;
+	struct mailimap_mailbox_data_status **data_status = NULL;
+	guint i;
+	gint r = MAILIMAP_NO_ERROR;
+
+	if (folder->node == NULL)
+		return;
+
+	debug_print("getting session...\n");
+	session = imap_session_get(folder);
+	if (session == NULL)
+		return;
+	lock_session(session);
+
+	IMAP_FOLDER(folder)->status_time = time(NULL);
+
+	g_node_traverse(folder->node, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+			imap_status_prefetch_func, &items);
+
+	/* the items may go away while the commands run: they are found
+	 * again by identifier when the answers are in */
+	mbs = g_ptr_array_new();
+	ids = g_ptr_array_new();
+	for (cur = items; cur != NULL; cur = cur->next) {
+		IMAPFolderItem *item = (IMAPFolderItem *)cur->data;
+		gchar *real_path;
+
+		/* STATUS is not to be used on the selected mailbox */
+		if (session->mbox != NULL && !strcmp(session->mbox, item->item.path))
+			continue;
+		real_path = imap_get_real_path(session, IMAP_FOLDER(folder),
+					       item->item.path, &r);
+		if (is_fatal(r)) {
+			g_free(real_path);
+			break;
 		}
+		g_ptr_array_add(mbs, real_path);
+		g_ptr_array_add(ids, folder_item_get_identifier(FOLDER_ITEM(item)));
+	}
+	g_slist_free(items);
+
+	if (!is_fatal(r) && mbs->len > 0) {
+		debug_print("prefetching STATUS of %d folders\n", mbs->len);
+		/* MESSAGES, UIDNEXT, UIDVALIDITY and UNSEEN */
+		r = imap_threaded_status_list(folder, (const char **)mbs->pdata,
+					      mbs->len,
+					      1 << 0 | 1 << 2 | 1 << 3 | 1 << 4,
+					      &data_status);
+		if (r == MAILIMAP_ERROR_EXTENSION)
+			r = MAILIMAP_NO_ERROR;
+		else if (r != MAILIMAP_NO_ERROR)
+			imap_handle_error(SESSION(session), NULL, r);
 	}
-	mailimap_mailbox_data_status_free(data_status);
-	
-	if (got_values != mask) {
-		g_warning("status: incomplete values received (%d)", got_values);
+
+	for (i = 0; i < mbs->len; i++) {
+		FolderItem *found;
+		IMAPFolderItem *item;
+
+		if (data_status != NULL && data_status[i] != NULL &&
+		    (found = folder_find_item_from_identifier(
+				(gchar *)ids->pdata[i])) != NULL &&
+		    found->folder == folder) {
+			item = IMAP_FOLDER_ITEM(found);
+			item->status_exists = 0;
+			item->status_unseen = 0;
+			item->status_uid_next = 0;
+			item->status_uid_validity = 0;
+			item->status_valid = imap_status_values(data_status[i],
+					&item->status_exists,
+					&item->status_uid_next,
+					&item->status_uid_validity,
+					&item->status_unseen) == 0x1d;
+		}
+		if (data_status != NULL && data_status[i] != NULL)
+			mailimap_mailbox_data_status_free(data_status[i]);
+		g_free(mbs->pdata[i]);
+		g_free(ids->pdata[i]);
 	}
-	return MAILIMAP_NO_ERROR;
+	g_free(data_status);
+	g_ptr_array_free(mbs, TRUE);
+	g_ptr_array_free(ids, TRUE);
+
+	imap_threaded_use_connection(folder, session->conn);
+
+	if (!is_fatal(r))
+		unlock_session(session);
 }
 
 static void imap_free_capabilities(IMAPSession *session)
@@ -4211,14 +5962,17 @@ static gint imap_cmd_select(IMAPSession *session, const gchar *folder,
 			    GSList **ok_flags, gboolean block)
 {
 	int r;
+	guint64 highest_modseq = 0;
 
 	r = imap_threaded_select(session->folder, folder,
-				 exists, recent, unseen, uid_validity, can_create_flags, ok_flags);
+				 exists, recent, unseen, uid_validity, can_create_flags, ok_flags,
+				 session->condstore ? &highest_modseq : NULL);
 	if (r != MAILIMAP_NO_ERROR) {
 		imap_handle_error(SESSION(session), NULL, r);
 		debug_print("select err %d\n", r);
 		return r;
 	}
+	session->highest_modseq = highest_modseq;
 	return MAILIMAP_NO_ERROR;
 }
 
@@ -4388,6 +6142,38 @@ static gint imap_cmd_append(IMAPSession *session,
 	return MAILIMAP_NO_ERROR;
 }
 
+static gint imap_cmd_append_list(IMAPSession *session,
+				 IMAPFolderItem *item,
+				 const gchar *destfolder,
+				 const gchar **files, IMAPFlags *flags,
+				 guint count, guint32 *new_uids)
+{
+	struct mailimap_flag_list **flag_lists;
+	guint i;
+	int r;
+
+	flag_lists = g_new(struct mailimap_flag_list *, count);
+	for (i = 0; i < count; i++)
+		flag_lists[i] = imap_flag_to_lep(item, flags[i], NULL);
+	lock_session(session);
+	r = imap_threaded_append_list(session->folder, destfolder,
+				      files, flag_lists, count,
+				      session->literal_plus, new_uids);
+	for (i = 0; i < count; i++)
+		mailimap_flag_list_free(flag_lists[i]);
+	g_free(flag_lists);
+
+	if (r != MAILIMAP_NO_ERROR) {
+		imap_handle_error(SESSION(session), NULL, r);
+		debug_print("append list err %d\n", r);
+		return r;
+	}
+
+	unlock_session(session);
+
+	return MAILIMAP_NO_ERROR;
+}
+
 static gint imap_cmd_copy(IMAPSession *session, struct mailimap_set * set,
 			  const gchar *destfolder,
 			  struct mailimap_set **source, struct mailimap_set **dest)
@@ -4407,6 +6193,25 @@ static gint imap_cmd_copy(IMAPSession *session, struct mailimap_set * set,
 	return MAILIMAP_NO_ERROR;
 }
 
+static gint imap_cmd_move(IMAPSession *session, struct mailimap_set * set,
+			  const gchar *destfolder,
+			  struct mailimap_set **source, struct mailimap_set **dest)
+{
+	int r;
+
+	g_return_val_if_fail(session != NULL, MAILIMAP_ERROR_BAD_STATE);
+	g_return_val_if_fail(set != NULL, MAILIMAP_ERROR_BAD_STATE);
+	g_return_val_if_fail(destfolder != NULL, MAILIMAP_ERROR_BAD_STATE);
+
+	r = imap_threaded_move(session->folder, set, destfolder, source, dest);
+	if (r != MAILIMAP_NO_ERROR) {
+		imap_handle_error(SESSION(session), NULL, r);
+		return r;
+	}
+
+	return MAILIMAP_NO_ERROR;
+}
+
 static gint imap_cmd_store(IMAPSession *session, 
 			   IMAPFolderItem *item,
 			   struct mailimap_set * set,
@@ -4457,7 +6262,10 @@ static gint imap_cmd_expunge(IMAPSession *session)
 
 gint imap_expunge(Folder *folder, FolderItem *item)
 {
-	IMAPSession *session = imap_session_get(folder);
+	IMAPSession *session;
+
+	imap_flush_flags(item);
+	session = imap_session_get(folder);
 	if (session == NULL)
 		return -1;
 	
@@ -4521,37 +6329,253 @@ static gboolean imap_rename_folder_func(GNode *node, gpointer data)
 	return FALSE;
 }
 
+static void imap_free_changed_tags_func(gpointer key, gpointer value, gpointer data)
+{
+	slist_free_strings_full((GSList *)value);
+}
+
+static void imap_item_free_changed_flags(IMAPFolderItem *item)
+{
+	if (item->changed_flags) {
+		g_hash_table_destroy(item->changed_flags);
+		item->changed_flags = NULL;
+	}
+	if (item->changed_tags) {
+		g_hash_table_foreach(item->changed_tags, imap_free_changed_tags_func, NULL);
+		g_hash_table_destroy(item->changed_tags);
+		item->changed_tags = NULL;
+	}
+}
+
+typedef struct _IMAPUidRange {
+	guint32 first;
+	guint32 last;
+} IMAPUidRange;
+
+static gint imap_uid_range_compare(gconstpointer a, gconstpointer b)
+{
+	guint32 fa = ((const IMAPUidRange *)a)->first;
+	guint32 fb = ((const IMAPUidRange *)b)->first;
+
+	return fa < fb ? -1 : fa > fb ? 1 : 0;
+}
+
+/* The ranges of set, sorted and merged, for imap_uid_ranges_contain()
+ * to look UIDs up in without walking the set each time. */
+static GArray *imap_uid_ranges_from_set(struct mailimap_set *set)
+{
+	GArray *ranges = g_array_new(FALSE, FALSE, sizeof(IMAPUidRange));
+	clistiter *cur;
+	guint i, merged = 0;
+
+	if (set == NULL || set->set_list == NULL)
+		return ranges;
+
+	for (cur = clist_begin(set->set_list); cur != NULL; cur = clist_next(cur)) {
+		struct mailimap_set_item *item = clist_content(cur);
+		guint32 first = item->set_first, last = item->set_last;
+		IMAPUidRange range;
+
+		/* 0 stands for "*" */
+		if (first == 0)
+			first = G_MAXUINT32;
+		if (last == 0)
+			last = G_MAXUINT32;
+		range.first = MIN(first, last);
+		range.last = MAX(first, last);
+		g_array_append_val(ranges, range);
+	}
+	g_array_sort(ranges, imap_uid_range_compare);
+
+	for (i = 1; i < ranges->len; i++) {
+		IMAPUidRange *prev = &g_array_index(ranges, IMAPUidRange, merged);
+		IMAPUidRange *range = &g_array_index(ranges, IMAPUidRange, i);
+
+		if (range->first <= prev->last ||
+		    range->first == prev->last + 1)
+			prev->last = MAX(prev->last, range->last);
+		else
+			g_array_index(ranges, IMAPUidRange, ++merged) = *range;
+	}
+	if (ranges->len > 0)
+		g_array_set_size(ranges, merged + 1);
+
+	return ranges;
+}
+
+static gboolean imap_uid_ranges_contain(GArray *ranges, guint32 uid)
+{
+	guint lo = 0, hi = ranges->len;
+
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+		IMAPUidRange *range = &g_array_index(ranges, IMAPUidRange, mid);
+
+		if (uid < range->first)
+			hi = mid;
+		else if (uid > range->last)
+			lo = mid + 1;
+		else
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Fetches the flags changed since the item's HIGHESTMODSEQ for
+ * imap_get_flags() to use. With QRESYNC, the UIDs are also worked out
+ * from the ones already known, the changed ones and the vanished ones,
+ * so that they need not be fetched all over again; *uids_known tells
+ * whether they added up to the EXISTS count. */
+static gint get_changed_uids(IMAPSession *session, Folder *folder,
+			     IMAPFolderItem *item, GSList **uidlist,
+			     gboolean *uids_known)
+{
+	carray *lep_uidtab = NULL;
+	struct mailimap_set *vanished = NULL;
+	GArray *vanished_ranges;
+	GHashTable *known;
+	GHashTableIter iter;
+	gpointer key;
+	GSList *list = NULL, *cur;
+	GArray *cache_nums = NULL;
+	guint i, count = 0;
+	int r;
+
+	item->changed_flags = g_hash_table_new(g_direct_hash, g_direct_equal);
+	item->changed_tags = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	if (session->highest_modseq != item->highest_modseq) {
+		r = imap_threaded_fetch_uid_flags_changedsince(folder,
+				item->highest_modseq, session->qresync,
+				&lep_uidtab, session->qresync ? &vanished : NULL);
+		if (r != MAILIMAP_NO_ERROR) {
+			imap_item_free_changed_flags(item);
+			return r;
+		}
+		imap_flags_hash_from_lep_uid_flags_tab(lep_uidtab,
+				item->changed_flags, item->changed_tags);
+		imap_fetch_uid_flags_list_free(lep_uidtab);
+	}
+	debug_print("IMAP: %d messages changed since modseq %" G_GUINT64_FORMAT "\n",
+		    g_hash_table_size(item->changed_flags), item->highest_modseq);
+
+	if (!session->qresync) {
+		if (vanished)
+			mailimap_set_free(vanished);
+		return MAILIMAP_NO_ERROR;
+	}
+
+	/* the UIDs known from the last sync, minus the vanished ones */
+	vanished_ranges = imap_uid_ranges_from_set(vanished);
+	if (vanished)
+		mailimap_set_free(vanished);
+	known = g_hash_table_new(g_direct_hash, g_direct_equal);
+	if (item->uid_list == NULL) {
+		if (item->item.cache == NULL) {
+			GSList *items = g_slist_prepend(NULL, item);
+
+			folder_item_read_caches(items);
+			g_slist_free(items);
+		}
+		if (item->item.cache != NULL)
+			cache_nums = msgcache_get_msgnum_array(item->item.cache);
+	}
+	if (cache_nums != NULL) {
+		for (i = 0; i < cache_nums->len; i++) {
+			guint32 uid = g_array_index(cache_nums, guint, i);
+
+			if (!imap_uid_ranges_contain(vanished_ranges, uid))
+				g_hash_table_insert(known, GUINT_TO_POINTER(uid), GINT_TO_POINTER(1));
+		}
+		g_array_free(cache_nums, TRUE);
+	} else {
+		for (cur = item->uid_list; cur != NULL; cur = cur->next) {
+			guint32 uid = GPOINTER_TO_UINT(cur->data);
+
+			if (!imap_uid_ranges_contain(vanished_ranges, uid))
+				g_hash_table_insert(known, GUINT_TO_POINTER(uid), GINT_TO_POINTER(1));
+		}
+	}
+	g_array_free(vanished_ranges, TRUE);
+
+	/* plus the new ones */
+	g_hash_table_iter_init(&iter, item->changed_flags);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		g_hash_table_insert(known, key, GINT_TO_POINTER(1));
+
+	g_hash_table_iter_init(&iter, known);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		list = g_slist_prepend(list, key);
+		count++;
+	}
+	g_hash_table_destroy(known);
+
+	if (count != session->exists) {
+		debug_print("IMAP: %d UIDs after resync, but %d exist\n",
+			    count, session->exists);
+		g_slist_free(list);
+		return MAILIMAP_NO_ERROR;
+	}
+	*uidlist = list;
+	*uids_known = TRUE;
+
+	return MAILIMAP_NO_ERROR;
+}
+
 static gint get_list_of_uids(IMAPSession *session, Folder *folder, IMAPFolderItem *item, GSList **msgnum_list)
 {
 	GSList *uidlist, *elem;
 	int r = -1;
 	clist * lep_uidlist;
 	gint ok, nummsgs = 0;
+	gint exists;
+	gboolean uids_known = FALSE;
 
 	if (session == NULL) {
 		return -1;
 	}
 
+	/* with CONDSTORE, always reselect to get a current HIGHESTMODSEQ */
 	ok = imap_select(session, IMAP_FOLDER(folder), FOLDER_ITEM(item),
-			 NULL, NULL, NULL, NULL, NULL, TRUE);
+			 session->condstore ? &exists : NULL,
+			 NULL, NULL, NULL, NULL, TRUE);
 	if (ok != MAILIMAP_NO_ERROR) {
 		return -1;
 	}
 
+	uidlist = NULL;
+
+	imap_item_free_changed_flags(item);
+	item->pending_modseq = session->highest_modseq;
+	if (session->condstore && item->highest_modseq != 0 &&
+	    session->highest_modseq >= item->highest_modseq &&
+	    session->uid_validity == item->item.mtime) {
+		r = get_changed_uids(session, folder, item, &uidlist, &uids_known);
+		if (is_fatal(r)) {
+			imap_handle_error(SESSION(session), NULL, r);
+			return -1;
+		}
+		if (r != MAILIMAP_NO_ERROR)
+			debug_print("IMAP: incremental resync failed: %d\n", r);
+	}
+
 	g_slist_free(item->uid_list);
 	item->uid_list = NULL;
 
-	uidlist = NULL;
-	
-	if (folder->account && folder->account->low_bandwidth) {
+	if (uids_known) {
+		/* known from QRESYNC already */
+		r = MAILIMAP_NO_ERROR;
+	} else if (folder->account && folder->account->low_bandwidth) {
 		r = imap_threaded_search(folder, IMAP_SEARCH_TYPE_SIMPLE,
 				NULL, NULL, NULL, &lep_uidlist);
-	}
+		if (r == MAILIMAP_NO_ERROR) {
+			uidlist = imap_uid_list_from_lep(lep_uidlist, NULL);
+			mailimap_search_result_free(lep_uidlist);
+		}
+	} else
+		r = -1;
 	
-	if (r == MAILIMAP_NO_ERROR) {
-		uidlist = imap_uid_list_from_lep(lep_uidlist, NULL);
-		mailimap_search_result_free(lep_uidlist);
-	} else {
+	if (r != MAILIMAP_NO_ERROR) {
 		carray * lep_uidtab;
 		if (r != -1) { /* inited */
 			imap_handle_error(SESSION(session), NULL, r);
@@ -4650,6 +6674,7 @@ gint imap_get_num_list(Folder *folder, FolderItem *_item, GSList **msgnum_list,
 		debug_print("get_num_list: trashing num list\n");
 		debug_print("Freeing imap uid cache\n");
 		item->lastuid = 0;
+		item->highest_modseq = 0;
 		g_slist_free(item->uid_list);
 		item->uid_list = NULL;
 
@@ -4678,11 +6703,20 @@ gint imap_get_num_list(Folder *folder, FolderItem *_item, GSList **msgnum_list,
 	debug_print("removing old messages from %s\n", dir);
 	remove_numbered_files_not_in_list(dir, *msgnum_list);
 	g_free(dir);
+	imap_remove_partial_not_in_list((FolderItem *)item, *msgnum_list);
+	if (imap_item_get_pack((FolderItem *)item))
+		cache_pack_remove_not_in_list(item->pack, *msgnum_list);
+	if (imap_cache_lru_get()) {
+		gchar *id = folder_item_get_identifier((FolderItem *)item);
+		cache_lru_remove_not_in_list(imap_cache_lru, id, *msgnum_list);
+		g_free(id);
+	}
 	
 	debug_print("get_num_list - ok - %i\n", nummsgs);
 	statusbar_pop_all();
 	item->should_trash_cache = FALSE;
 	item->should_update = FALSE;
+	imap_idle_schedule(folder);
 	return nummsgs;
 }
 
@@ -4875,10 +6909,20 @@ gboolean imap_scan_required(Folder *folder, FolderItem *_item)
 			return TRUE;
 		}
 	} else {
-		ok = imap_status(session, IMAP_FOLDER(folder), item->item.path, IMAP_FOLDER_ITEM(item),
-				 &exists, &uid_next, &uid_val, &unseen, FALSE);
-		if (ok != MAILIMAP_NO_ERROR) {
-			return FALSE;
+		if (item->status_valid &&
+		    time(NULL) - IMAP_FOLDER(folder)->status_time <= IMAP_STATUS_PREFETCH_AGE) {
+			exists = item->status_exists;
+			unseen = item->status_unseen;
+			uid_next = item->status_uid_next;
+			uid_val = item->status_uid_validity;
+			item->status_valid = FALSE;
+		} else {
+			ok = imap_status(session, IMAP_FOLDER(folder), item->item.path,
+					 IMAP_FOLDER_ITEM(item), &exists, &uid_next,
+					 &uid_val, &unseen, FALSE);
+			if (ok != MAILIMAP_NO_ERROR) {
+				return FALSE;
+			}
 		}
 		
 		debug_print("exists %d, item->item.total_msgs %d\n"
@@ -4915,7 +6959,6 @@ void imap_change_flags(Folder *folder, FolderItem *item, MsgInfo *msginfo, MsgPe
 	IMAPFlags flags_set = 0, flags_unset = 0;
 	gint ok = MAILIMAP_NO_ERROR;
 	MsgNumberList numlist;
-	hashtable_data *ht_data = NULL;
 
 	g_return_if_fail(folder != NULL);
 	g_return_if_fail(folder->klass == &imap_class);
@@ -4957,6 +7000,14 @@ void imap_change_flags(Folder *folder, FolderItem *item, MsgInfo *msginfo, MsgPe
 	if ( MSG_IS_DELETED(msginfo->flags) && !(newflags & MSG_DELETED))
 		flags_unset |= IMAP_FLAG_DELETED;
 
+	if ((flags_set | flags_unset) & IMAP_FLAG_FLAGGED &&
+	    imap_cache_lru_get() != NULL) {
+		gchar *id = folder_item_get_identifier(item);
+
+		imap_cache_lru_note(id, msginfo, (newflags & MSG_MARKED) != 0);
+		g_free(id);
+	}
+
 	if (!flags_set && !flags_unset) {
 		/* the changed flags were not translatable to IMAP-speak.
 		 * like MSG_POSTFILTERED, so just apply. */
@@ -4964,6 +7015,21 @@ void imap_change_flags(Folder *folder, FolderItem *item, MsgInfo *msginfo, MsgPe
 		return;
 	}
 
+	if (IMAP_FOLDER_ITEM(item)->batching || prefs_common.imap_store_delay > 0) {
+		/* instead of performing an UID STORE command for each message change,
+		 * as a lot of them can change "together", we just fill in hashtables
+		 * and defer the treatment so that we're able to send only one
+		 * command.
+		 */
+		debug_print("IMAP deferring flags change\n");
+		imap_queue_flags(IMAP_FOLDER_ITEM(item), flags_set, flags_unset,
+				 msginfo->msgnum);
+		if (!IMAP_FOLDER_ITEM(item)->batching)
+			imap_schedule_flags(IMAP_FOLDER_ITEM(item));
+		msginfo->flags.perm_flags = newflags;
+		return;
+	}
+
 	debug_print("getting session...\n");
 	session = imap_session_get(folder);
 	if (!session) {
@@ -4977,50 +7043,18 @@ void imap_change_flags(Folder *folder, FolderItem *item, MsgInfo *msginfo, MsgPe
 	numlist.next = NULL;
 	numlist.data = GINT_TO_POINTER(msginfo->msgnum);
 
-	if (IMAP_FOLDER_ITEM(item)->batching) {
-		/* instead of performing an UID STORE command for each message change,
-		 * as a lot of them can change "together", we just fill in hashtables
-		 * and defer the treatment so that we're able to send only one
-		 * command.
-		 */
-		debug_print("IMAP batch mode on, deferring flags change\n");
-		if (flags_set) {
-			ht_data = g_hash_table_lookup(IMAP_FOLDER_ITEM(item)->flags_set_table, 
-				GINT_TO_POINTER(flags_set));
-			if (ht_data == NULL) {
-				ht_data = g_new0(hashtable_data, 1);
-				ht_data->item = IMAP_FOLDER_ITEM(item);
-				g_hash_table_insert(IMAP_FOLDER_ITEM(item)->flags_set_table, 
-					GINT_TO_POINTER(flags_set), ht_data);
-			}
-			ht_data->msglist = g_slist_prepend(ht_data->msglist, GINT_TO_POINTER(msginfo->msgnum));
-		} 
-		if (flags_unset) {
-			ht_data = g_hash_table_lookup(IMAP_FOLDER_ITEM(item)->flags_unset_table, 
-				GINT_TO_POINTER(flags_unset));
-			if (ht_data == NULL) {
-				ht_data = g_new0(hashtable_data, 1);
-				ht_data->item = IMAP_FOLDER_ITEM(item);
-				g_hash_table_insert(IMAP_FOLDER_ITEM(item)->flags_unset_table, 
-					GINT_TO_POINTER(flags_unset), ht_data);
-			}
-			ht_data->msglist = g_slist_prepend(ht_data->msglist, 
-					GINT_TO_POINTER(msginfo->msgnum));		
-		}
-	} else {
-		debug_print("IMAP changing flags\n");
-		if (flags_set) {
-			ok = imap_set_message_flags(session, IMAP_FOLDER_ITEM(item), &numlist, flags_set, NULL, TRUE);
-			if (ok != MAILIMAP_NO_ERROR) {
-				return;
-			}
+	debug_print("IMAP changing flags\n");
+	if (flags_set) {
+		ok = imap_set_message_flags(session, IMAP_FOLDER_ITEM(item), &numlist, flags_set, NULL, TRUE);
+		if (ok != MAILIMAP_NO_ERROR) {
+			return;
 		}
+	}
 
-		if (flags_unset) {
-			ok = imap_set_message_flags(session, IMAP_FOLDER_ITEM(item), &numlist, flags_unset, NULL, FALSE);
-			if (ok != MAILIMAP_NO_ERROR) {
-				return;
-			}
+	if (flags_unset) {
+		ok = imap_set_message_flags(session, IMAP_FOLDER_ITEM(item), &numlist, flags_unset, NULL, FALSE);
+		if (ok != MAILIMAP_NO_ERROR) {
+			return;
 		}
 	}
 	msginfo->flags.perm_flags = newflags;
@@ -5038,6 +7072,8 @@ static gint imap_remove_msg(Folder *folder, FolderItem *item, gint uid)
 	g_return_val_if_fail(FOLDER_CLASS(folder) == &imap_class, -1);
 	g_return_val_if_fail(item != NULL, -1);
 
+	imap_flush_flags(item);
+
 	debug_print("getting session...\n");
 	session = imap_session_get(folder);
 	if (!session) return -1;
@@ -5070,6 +7106,8 @@ static gint imap_remove_msg(Folder *folder, FolderItem *item, gint uid)
 	if (is_dir_exist(dir))
 		remove_numbered_files(dir, uid, uid);
 	g_free(dir);
+	imap_unpack_remove(item, uid);
+	imap_cache_lru_forget(item, uid);
 	return MAILIMAP_NO_ERROR;
 }
 
@@ -5144,6 +7182,8 @@ static /*gint*/ void *imap_get_flags_thread(void *data)
 	gboolean selected_folder;
 	gint exists_cnt, unseen_cnt;
 	gboolean got_alien_tags = FALSE;
+	gboolean incremental = FALSE;
+	gchar *lru_id = NULL;
 
 	session = imap_session_get(folder);
 
@@ -5180,7 +7220,14 @@ static /*gint*/ void *imap_get_flags_thread(void *data)
 		seq_list = g_slist_append(NULL, set);
 	}
 
-	if (folder->account && folder->account->low_bandwidth) {
+	if (IMAP_FOLDER_ITEM(fitem)->changed_flags != NULL) {
+		/* get_list_of_uids() got what changed since the last sync */
+		flags_hash = IMAP_FOLDER_ITEM(fitem)->changed_flags;
+		tags_hash = IMAP_FOLDER_ITEM(fitem)->changed_tags;
+		IMAP_FOLDER_ITEM(fitem)->changed_flags = NULL;
+		IMAP_FOLDER_ITEM(fitem)->changed_tags = NULL;
+		incremental = TRUE;
+	} else if (folder->account && folder->account->low_bandwidth) {
 		for (cur = seq_list; cur != NULL; cur = g_slist_next(cur)) {
 			struct mailimap_set * imapset;
 			clist * lep_uidlist;
@@ -5299,8 +7346,18 @@ static /*gint*/ void *imap_get_flags_thread(void *data)
 	}
 
 bail:
-	if (r == MAILIMAP_NO_ERROR)
+	if (r == MAILIMAP_NO_ERROR) {
+		/* only a sync of the whole folder brings it up to date */
+		if (full_search && IMAP_FOLDER_ITEM(fitem)->pending_modseq != 0)
+			IMAP_FOLDER_ITEM(fitem)->highest_modseq =
+				IMAP_FOLDER_ITEM(fitem)->pending_modseq;
 		unlock_session(session);
+	}
+	IMAP_FOLDER_ITEM(fitem)->pending_modseq = 0;
+
+	/* bring the flags in the body cache index up to date too */
+	if (imap_cache_lru_get() != NULL)
+		lru_id = folder_item_get_identifier(fitem);
 	
 	for (elem = sorted_list; elem != NULL; elem = g_slist_next(elem)) {
 		MsgInfo *msginfo;
@@ -5312,7 +7369,10 @@ bail:
 		wasnew = (flags & MSG_NEW);
 		oldflags = flags & ~(MSG_NEW|MSG_UNREAD|MSG_REPLIED|MSG_FORWARDED|MSG_MARKED|MSG_DELETED|MSG_SPAM);
 
-		if (folder->account && folder->account->low_bandwidth) {
+		if (incremental && !g_hash_table_lookup_extended(flags_hash,
+				GINT_TO_POINTER(msginfo->msgnum), NULL, NULL)) {
+			/* unchanged since the last sync */
+		} else if (!incremental && folder->account && folder->account->low_bandwidth) {
 			if (fitem->opened || fitem->processing_pending || fitem == folder->inbox) {
 				flags &= ~((reverse_seen ? 0 : MSG_UNREAD | MSG_NEW) | MSG_REPLIED | MSG_FORWARDED | MSG_MARKED | MSG_SPAM);
 			} else {
@@ -5388,8 +7448,13 @@ bail:
 			}
 		}
 
+		if (lru_id != NULL)
+			imap_cache_lru_note(lru_id, msginfo,
+					    (flags & MSG_MARKED) != 0);
+
 		g_hash_table_insert(msgflags, msginfo, GINT_TO_POINTER(flags));
 	}
+	g_free(lru_id);
 	
 	if (got_alien_tags) {
 		tags_write_tags();
@@ -5436,6 +7501,9 @@ static gint imap_get_flags(Folder *folder, FolderItem *item,
 		return -1;
 	}
 
+	/* what's still queued would be undone by the server's flags */
+	imap_flush_flags(item);
+
 	tmp = folder_item_get_msg_list(item);
 
 	if (g_slist_length(tmp) <= g_slist_length(msginfo_list))
@@ -5463,6 +7531,12 @@ static gboolean process_flags(gpointer key, gpointer value, gpointer user_data)
 	gint ok = MAILIMAP_ERROR_BAD_STATE;
 	IMAPSession *session = NULL;
 	
+	if (data->msglist == NULL) {
+		/* all overridden by later changes */
+		g_free(data);
+		return TRUE;
+	}
+
 	debug_print("getting session...\n");
 	session = imap_session_get(item->folder);
 
@@ -5537,8 +7611,91 @@ static gboolean process_tags(gpointer key, gpointer value, gpointer user_data)
 	return TRUE;
 }
 
+static guint queued_flags_count(GHashTable *table, gboolean tags)
+{
+	GHashTableIter iter;
+	gpointer value;
+	guint count = 0;
+
+	if (table == NULL)
+		return 0;
+
+	g_hash_table_iter_init(&iter, table);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		count += g_slist_length(tags ? ((TagsData *)value)->msglist
+					     : ((hashtable_data *)value)->msglist);
+	return count;
+}
+
+/* How many flag and tag changes are queued for item, one per message
+ * and change. */
+static guint imap_queued_flags_count(IMAPFolderItem *item)
+{
+	return queued_flags_count(item->flags_set_table, FALSE) +
+	       queued_flags_count(item->flags_unset_table, FALSE) +
+	       queued_flags_count(item->tags_set_table, TRUE) +
+	       queued_flags_count(item->tags_unset_table, TRUE);
+}
+
+static gboolean drop_flags(gpointer key, gpointer value, gpointer user_data)
+{
+	hashtable_data *data = (hashtable_data *)value;
+
+	g_slist_free(data->msglist);
+	g_free(data);
+	return TRUE;
+}
+
+static gboolean drop_tags(gpointer key, gpointer value, gpointer user_data)
+{
+	TagsData *data = (TagsData *)value;
+
+	g_slist_free(data->msglist);
+	g_free(data->str);
+	g_free(data);
+	return TRUE;
+}
+
+static void drop_queue(GHashTable **table, GHRFunc func)
+{
+	if (*table == NULL)
+		return;
+	g_hash_table_foreach_remove(*table, func, NULL);
+	g_hash_table_destroy(*table);
+	*table = NULL;
+}
+
+/* Throws away the changes still queued for item, which is going away,
+ * leaving a note of them in the log. */
+static void imap_drop_queued_flags(IMAPFolderItem *item)
+{
+	guint count = imap_queued_flags_count(item);
+
+	if (count > 0)
+		log_warning(LOG_PROTOCOL,
+			    _("IMAP: %d flag changes in %s were not sent to the server\n"),
+			    count, FOLDER_ITEM(item)->path ? FOLDER_ITEM(item)->path : "");
+
+	drop_queue(&item->flags_set_table, drop_flags);
+	drop_queue(&item->flags_unset_table, drop_flags);
+	drop_queue(&item->tags_set_table, drop_tags);
+	drop_queue(&item->tags_unset_table, drop_tags);
+}
+
 static void process_hashtable(IMAPFolderItem *item)
 {
+	guint count = imap_queued_flags_count(item);
+
+	/* without a connection, keep the changes for imap_flush_flags()
+	 * to send once the folder is used online again */
+	if (count > 0 &&
+	    (prefs_common.work_offline ||
+	     imap_session_get(FOLDER_ITEM(item)->folder) == NULL)) {
+		debug_print("IMAP: keeping %d flag changes in %s for later\n",
+			    count, FOLDER_ITEM(item)->path);
+		return;
+	}
+
 	if (item->flags_set_table) {
 		g_hash_table_foreach_remove(item->flags_set_table, process_flags, GINT_TO_POINTER(TRUE));
 		g_hash_table_destroy(item->flags_set_table);
@@ -5562,6 +7719,132 @@ static void process_hashtable(IMAPFolderItem *item)
 	
 }
 
+static void imap_queue_flags_add(IMAPFolderItem *item, GHashTable *table,
+				 IMAPFlags flags, gint num)
+{
+	hashtable_data *ht_data;
+
+	ht_data = g_hash_table_lookup(table, GINT_TO_POINTER(flags));
+	if (ht_data == NULL) {
+		ht_data = g_new0(hashtable_data, 1);
+		ht_data->item = item;
+		g_hash_table_insert(table, GINT_TO_POINTER(flags), ht_data);
+	}
+	ht_data->msglist = g_slist_prepend(ht_data->msglist, GINT_TO_POINTER(num));
+}
+
+/* Queues flags for setting in table, taking num out of the changes in
+ * opposite that would undo them: as the set and unset tables are
+ * processed one after the other, only the latest change may be left. */
+static void imap_queue_flags_change(IMAPFolderItem *item, GHashTable *table,
+				    GHashTable *opposite, IMAPFlags flags,
+				    gint num)
+{
+	GList *keys, *cur;
+
+	keys = g_hash_table_get_keys(opposite);
+	for (cur = keys; cur != NULL; cur = cur->next) {
+		IMAPFlags other = GPOINTER_TO_INT(cur->data);
+		hashtable_data *ht_data;
+
+		if (!(other & flags))
+			continue;
+		ht_data = g_hash_table_lookup(opposite, cur->data);
+		if (!g_slist_find(ht_data->msglist, GINT_TO_POINTER(num)))
+			continue;
+		ht_data->msglist = g_slist_remove(ht_data->msglist,
+						  GINT_TO_POINTER(num));
+		if (other & ~flags)
+			imap_queue_flags_add(item, opposite, other & ~flags, num);
+	}
+	g_list_free(keys);
+
+	imap_queue_flags_add(item, table, flags, num);
+}
+
+static void imap_queue_flags(IMAPFolderItem *item, IMAPFlags flags_set,
+			     IMAPFlags flags_unset, gint num)
+{
+	if (!item->flags_set_table)
+		item->flags_set_table = g_hash_table_new(NULL, g_direct_equal);
+	if (!item->flags_unset_table)
+		item->flags_unset_table = g_hash_table_new(NULL, g_direct_equal);
+
+	if (flags_set)
+		imap_queue_flags_change(item, item->flags_set_table,
+					item->flags_unset_table, flags_set, num);
+	if (flags_unset)
+		imap_queue_flags_change(item, item->flags_unset_table,
+					item->flags_set_table, flags_unset, num);
+}
+
+static gboolean imap_store_timeout(gpointer data)
+{
+	IMAPFolderItem *item = (IMAPFolderItem *)data;
+	RemoteFolder *rfolder = REMOTE_FOLDER(FOLDER_ITEM(item)->folder);
+
+	/* batch mode sends them when it ends */
+	if (item->batching) {
+		item->store_tag = 0;
+		return FALSE;
+	}
+	/* try again once the connection is free */
+	if (rfolder->session != NULL && IMAP_SESSION(rfolder->session)->busy)
+		return TRUE;
+
+	item->store_tag = 0;
+	process_hashtable(item);
+
+	return FALSE;
+}
+
+/* Sends flag changes made outside batch mode after imap_store_delay,
+ * so that those made in between go out together. */
+static void imap_schedule_flags(IMAPFolderItem *item)
+{
+	if (item->store_tag != 0)
+		return;
+	item->store_tag = g_timeout_add(prefs_common.imap_store_delay,
+					imap_store_timeout, item);
+}
+
+/* Sends the queued flag changes of item now, before anything that
+ * needs the flags on the server to be current. */
+static void imap_flush_flags(FolderItem *_item)
+{
+	IMAPFolderItem *item = IMAP_FOLDER_ITEM(_item);
+
+	if (item == NULL)
+		return;
+
+	if (item->store_tag != 0) {
+		g_source_remove(item->store_tag);
+		item->store_tag = 0;
+	}
+	/* also those kept back while offline */
+	if (!item->batching && imap_queued_flags_count(item) > 0)
+		process_hashtable(item);
+}
+
+static gboolean imap_flush_flags_func(GNode *node, gpointer data)
+{
+	imap_flush_flags(FOLDER_ITEM(node->data));
+	return FALSE;
+}
+
+/* They stay queued, but are lost if this is the end of the session. */
+static gboolean imap_log_queued_flags_func(GNode *node, gpointer data)
+{
+	FolderItem *item = FOLDER_ITEM(node->data);
+	guint count = imap_queued_flags_count(IMAP_FOLDER_ITEM(item));
+
+	if (count > 0)
+		log_warning(LOG_PROTOCOL,
+			    _("IMAP: %d flag changes in %s have not been sent to the server\n"),
+			    count, item->path ? item->path : "");
+	return FALSE;
+}
+
 static void imap_set_batch (Folder *folder, FolderItem *_item, gboolean batch)
 {
 	IMAPFolderItem *item = (IMAPFolderItem *)_item;
@@ -5993,10 +8276,20 @@ void imap_disconnect_all(gboolean have_connectivity)
 		if (account->protocol == A_IMAP4) {
 			RemoteFolder *folder = (RemoteFolder *)account->folder;
 			if (folder && folder->session) {
+				if (have_connectivity && !imap_is_busy(FOLDER(folder)) &&
+				    FOLDER(folder)->node != NULL)
+					g_node_traverse(FOLDER(folder)->node, G_PRE_ORDER,
+							G_TRAVERSE_ALL, -1,
+							imap_flush_flags_func, NULL);
+				if (FOLDER(folder)->node != NULL)
+					g_node_traverse(FOLDER(folder)->node, G_PRE_ORDER,
+							G_TRAVERSE_ALL, -1,
+							imap_log_queued_flags_func, NULL);
 				if (imap_is_busy(FOLDER(folder)))
 					imap_threaded_cancel(FOLDER(folder));
 
 				IMAPSession *session = (IMAPSession *)folder->session;
+				imap_pool_destroy(FOLDER(folder), have_connectivity);
 				if (have_connectivity)
 					imap_threaded_disconnect(FOLDER(folder));
 				SESSION(session)->state = SESSION_DISCONNECTED;
@@ -6009,6 +8302,8 @@ void imap_disconnect_all(gboolean have_connectivity)
 
 	if(short_timeout)
 		imap_main_set_timeout(prefs_common.io_timeout_secs);
+
+	imap_cache_lru_save();
 }
 
 void imap_folder_unref(Folder *folder)
@@ -6161,6 +8456,10 @@ void imap_cache_msg(FolderItem *item, gint msgnum)
 {
 }
 
+void imap_cache_msgs(FolderItem *item, GSList *msglist)
+{
+}
+
 void imap_cancel_all(void)
 {
 }
@@ -6203,6 +8502,9 @@ static void imap_item_set_xml(Folder *folder, FolderItem *item, XMLTag *tag)
 			IMAP_FOLDER_ITEM(item)->last_sync = atoi(attr->value);
 		if (!strcmp(attr->name, "last_change"))
 			IMAP_FOLDER_ITEM(item)->last_change = atoi(attr->value);
+		if (!strcmp(attr->name, "highestmodseq"))
+			IMAP_FOLDER_ITEM(item)->highest_modseq =
+				g_ascii_strtoull(attr->value, NULL, 10);
 	}
 	if (IMAP_FOLDER_ITEM(item)->last_change == 0)
 		IMAP_FOLDER_ITEM(item)->last_change = time(NULL);
@@ -6222,6 +8524,13 @@ static XMLTag *imap_item_get_xml(Folder *folder, FolderItem *item)
 			IMAP_FOLDER_ITEM(item)->last_sync));
 	xml_tag_add_attr(tag, xml_attr_new_int("last_change", 
 			IMAP_FOLDER_ITEM(item)->last_change));
+	if (IMAP_FOLDER_ITEM(item)->highest_modseq != 0) {
+		gchar *modseq = g_strdup_printf("%" G_GUINT64_FORMAT,
+				IMAP_FOLDER_ITEM(item)->highest_modseq);
+
+		xml_tag_add_attr(tag, xml_attr_new("highestmodseq", modseq));
+		g_free(modseq);
+	}
 
 #endif
 	return tag;
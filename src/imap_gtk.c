@@ -436,8 +436,7 @@ void imap_gtk_synchronise(FolderItem *item, gint days)
 	if (item->no_select == FALSE) {
 		GSList *mlist;
 		GSList *cur;
-		gint num = 0;
-		gint total = item->total_msgs;
+		GSList *wanted = NULL;
 		time_t t = time(NULL);
 
 		mlist = folder_item_get_msg_list(item);
@@ -445,13 +444,14 @@ void imap_gtk_synchronise(FolderItem *item, gint days)
 			MsgInfo *msginfo = (MsgInfo *)cur->data;
 			gint age = (t - msginfo->date_t) / (60*60*24);
 			if (days == 0 || age <= days)
-				imap_cache_msg(msginfo->folder, msginfo->msgnum);
-			statusbar_progress_all(num++,total, 100);
-			if (num % 100 == 0)
-				GTK_EVENTS_FLUSH();
+				wanted = g_slist_prepend(wanted, msginfo);
 		}
+		wanted = g_slist_reverse(wanted);
 
-		statusbar_progress_all(0,0,0);
+		/* bodies are fetched in batches rather than one by one */
+		imap_cache_msgs(item, wanted);
+
+		g_slist_free(wanted);
 		procmsg_msg_list_free(mlist);
 	}
 
@@ -1373,7 +1373,11 @@ gint messageview_show(MessageView *messageview, MsgInfo *msginfo,
 		statuswindow_print_all(_("Fetching message (%s)..."),
 			to_human_readable(msginfo->size));
 	
-	file = procmsg_get_message_file_path(msginfo);
+	if (msginfo->folder)
+		file = folder_item_fetch_msg_display(msginfo->folder,
+						     msginfo->msgnum);
+	else
+		file = procmsg_get_message_file_path(msginfo);
 
 	if (msginfo->size > 1024*1024)
 		statuswindow_pop_all();
@@ -32,6 +32,10 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#  include <fcntl.h>
+#  include <sys/inotify.h>
+#endif
 
 #include "folder.h"
 #include "folder_item_prefs.h"
@@ -44,6 +48,8 @@
 #include "gtkutils.h"
 #include "timing.h"
 #include "msgcache.h"
+#include "prefs_common.h"
+#include "inc.h"
 
 /* Define possible missing constants for Windows. */
 #ifdef G_OS_WIN32
@@ -150,6 +156,7 @@ FolderClass *mh_get_class(void)
 		mh_class.idstr = "mh";
 		mh_class.uistr = "MH";
 		mh_class.supports_server_search = FALSE;
+		mh_class.increasing_msgnums = FALSE;
 		
 		/* Folder functions */
 		mh_class.new_folder = mh_folder_new;
@@ -165,6 +172,7 @@ FolderClass *mh_get_class(void)
 		mh_class.rename_folder = mh_rename_folder;
 		mh_class.remove_folder = mh_remove_folder;
 		mh_class.get_num_list = mh_get_num_list;
+		mh_class.get_num_list_from_dir = mh_get_num_list_from_dir;
 		mh_class.scan_required = mh_scan_required;
 		mh_class.set_mtime = mh_set_mtime;
 		mh_class.close = mh_item_close;
@@ -209,14 +217,232 @@ static void mh_folder_init(Folder *folder, const gchar *name, const gchar *path)
 
 }
 
+#ifdef HAVE_SYS_INOTIFY_H
+/* Directories of MH folders are watched with inotify once they have
+ * been checked, so that unchanged folders need not be stat()ed, and so
+ * that mail delivered by other programs gets scanned in right away. */
+typedef struct _MHWatch MHWatch;
+struct _MHWatch {
+	gint	  wd;		/* -1 if the directory couldn't be watched */
+	gchar	 *id;		/* identifier of the FolderItem */
+	gboolean  changed;	/* a message changed since the last check */
+	gboolean  pending;	/* waiting to be scanned by the timer */
+};
+
+#define MH_WATCH_EVENTS	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+			 IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | \
+			 IN_DELETE_SELF | IN_MOVE_SELF)
+#define MH_WATCH_SCAN_DELAY 250 /* msecs */
+
+static gint mh_watch_fd = -1;
+static gboolean mh_watch_failed = FALSE;
+static GIOChannel *mh_watch_channel = NULL;
+static guint mh_watch_scan_tag = 0;
+static GHashTable *mh_watch_by_id = NULL;	/* id -> MHWatch */
+static GHashTable *mh_watch_by_wd = NULL;	/* wd -> MHWatch */
+
+static void mh_watch_free(MHWatch *watch)
+{
+	if (watch->wd >= 0) {
+		g_hash_table_remove(mh_watch_by_wd, GINT_TO_POINTER(watch->wd));
+		inotify_rm_watch(mh_watch_fd, watch->wd);
+	}
+	g_hash_table_remove(mh_watch_by_id, watch->id);
+	g_free(watch->id);
+	g_free(watch);
+}
+
+static void mh_watch_collect_func(gpointer key, gpointer value, gpointer data)
+{
+	MHWatch *watch = (MHWatch *)value;
+	GSList **ids = (GSList **)data;
+
+	if (watch->pending) {
+		watch->pending = FALSE;
+		*ids = g_slist_prepend(*ids, g_strdup(watch->id));
+	}
+}
+
+static gboolean mh_watch_scan_func(gpointer data)
+{
+	GSList *ids = NULL, *items = NULL, *cur;
+
+	/* mail being fetched ends up in these folders anyway, and a scan
+	 * already running may be iterating the main loop: try again later
+	 * rather than filtering the same folders from within it */
+	if (inc_is_active() || inc_lock_count > 0 || folder_scan_is_active())
+		return TRUE;
+
+	mh_watch_scan_tag = 0;
+
+	g_hash_table_foreach(mh_watch_by_id, mh_watch_collect_func, &ids);
+	for (cur = ids; cur != NULL; cur = cur->next) {
+		FolderItem *item = folder_find_item_from_identifier((gchar *)cur->data);
+
+		g_free(cur->data);
+		if (item == NULL || item->no_select || !item->prefs->newmailcheck)
+			continue;
+		if (item->processing_pending || item->scanning != ITEM_NOT_SCANNING)
+			continue;
+		if (mh_scan_required(item->folder, item))
+			items = g_slist_prepend(items, item);
+	}
+	g_slist_free(ids);
+
+	if (items != NULL) {
+		debug_print("MH: scanning %d folders changed on disk\n",
+			    g_slist_length(items));
+		folder_item_scan_items(items, TRUE, NULL, NULL);
+		g_slist_free(items);
+	}
+
+	return FALSE;
+}
+
+static void mh_watch_mark_changed(MHWatch *watch)
+{
+	watch->changed = TRUE;
+	watch->pending = TRUE;
+	if (mh_watch_scan_tag == 0)
+		mh_watch_scan_tag = g_timeout_add(MH_WATCH_SCAN_DELAY,
+						  mh_watch_scan_func, NULL);
+}
+
+static void mh_watch_mark_all_func(gpointer key, gpointer value, gpointer data)
+{
+	mh_watch_mark_changed((MHWatch *)value);
+}
+
+static gboolean mh_watch_input_cb(GIOChannel *source, GIOCondition condition,
+				  gpointer data)
+{
+	guint64 buf[512];
+	const gchar *p, *end;
+	const struct inotify_event *ev;
+	MHWatch *watch;
+	gssize len;
+
+	len = read(mh_watch_fd, buf, sizeof(buf));
+	if (len <= 0)
+		return TRUE;
+
+	end = (const gchar *)buf + len;
+	for (p = (const gchar *)buf; p < end; p += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *)p;
+
+		if (ev->mask & IN_Q_OVERFLOW) {
+			debug_print("MH: inotify queue overflow\n");
+			g_hash_table_foreach(mh_watch_by_wd,
+					     mh_watch_mark_all_func, NULL);
+			continue;
+		}
+
+		watch = g_hash_table_lookup(mh_watch_by_wd, GINT_TO_POINTER(ev->wd));
+		if (watch == NULL)
+			continue;
+
+		if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+			/* the directory is gone, checks fall back to stat() */
+			mh_watch_free(watch);
+			continue;
+		}
+
+		/* only message files matter */
+		if (ev->len > 0 && to_number(ev->name) > 0)
+			mh_watch_mark_changed(watch);
+	}
+
+	return TRUE;
+}
+
+static gboolean mh_watch_init(void)
+{
+	if (mh_watch_fd >= 0)
+		return TRUE;
+	if (mh_watch_failed || !prefs_common.watch_mh_folders)
+		return FALSE;
+
+	mh_watch_fd = inotify_init();
+	if (mh_watch_fd < 0) {
+		FILE_OP_ERROR("MH", "inotify_init");
+		mh_watch_failed = TRUE;
+		return FALSE;
+	}
+	fcntl(mh_watch_fd, F_SETFL, fcntl(mh_watch_fd, F_GETFL) | O_NONBLOCK);
+	fcntl(mh_watch_fd, F_SETFD, FD_CLOEXEC);
+
+	mh_watch_by_id = g_hash_table_new(g_str_hash, g_str_equal);
+	mh_watch_by_wd = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	mh_watch_channel = g_io_channel_unix_new(mh_watch_fd);
+	g_io_add_watch(mh_watch_channel, G_IO_IN, mh_watch_input_cb, NULL);
+
+	return TRUE;
+}
+
+/* Returns the watch of the item's directory, starting to watch it if
+ * needed; a new watch is marked changed, as nothing is known yet. */
+static MHWatch *mh_watch_get(FolderItem *item, const gchar *path)
+{
+	MHWatch *watch, *old;
+	gchar *id;
+
+	if (!mh_watch_init())
+		return NULL;
+
+	id = folder_item_get_identifier(item);
+	if (id == NULL)
+		return NULL;
+
+	watch = g_hash_table_lookup(mh_watch_by_id, id);
+	if (watch != NULL) {
+		g_free(id);
+		return watch;
+	}
+
+	watch = g_new0(MHWatch, 1);
+	watch->id = id;
+	watch->changed = TRUE;
+	watch->wd = inotify_add_watch(mh_watch_fd, path, MH_WATCH_EVENTS);
+	if (watch->wd < 0) {
+		debug_print("MH: can't watch %s: %s\n", path, g_strerror(errno));
+	} else {
+		/* a renamed item keeps its directory's watch descriptor */
+		old = g_hash_table_lookup(mh_watch_by_wd, GINT_TO_POINTER(watch->wd));
+		if (old != NULL) {
+			g_hash_table_remove(mh_watch_by_wd, GINT_TO_POINTER(old->wd));
+			old->wd = -1;
+			mh_watch_free(old);
+		}
+		g_hash_table_insert(mh_watch_by_wd, GINT_TO_POINTER(watch->wd), watch);
+	}
+	g_hash_table_insert(mh_watch_by_id, watch->id, watch);
+
+	return watch;
+}
+#endif
+
 gboolean mh_scan_required(Folder *folder, FolderItem *item)
 {
 	gchar *path;
 	GStatBuf s;
+#ifdef HAVE_SYS_INOTIFY_H
+	MHWatch *watch;
+#endif
 
 	path = folder_item_get_path(item);
 	cm_return_val_if_fail(path != NULL, FALSE);
 
+#ifdef HAVE_SYS_INOTIFY_H
+	/* rssyl borrows this function, but manages its own folders */
+	watch = folder->klass == mh_get_class() ? mh_watch_get(item, path) : NULL;
+	if (watch != NULL && watch->wd >= 0 && !watch->changed) {
+		debug_print("MH scan not required, no change seen: %s\n", path);
+		g_free(path);
+		return FALSE;
+	}
+#endif
+
 	if (g_stat(path, &s) < 0) {
 		FILE_OP_ERROR(path, "stat");
 		g_free(path);
@@ -237,6 +463,11 @@ gboolean mh_scan_required(Folder *folder, FolderItem *item)
 		    path?path:"(null)",
 		    (long int) s.st_mtime,
 		    (long int) item->mtime);
+#ifdef HAVE_SYS_INOTIFY_H
+	/* up to date now, until the next event */
+	if (watch != NULL)
+		watch->changed = FALSE;
+#endif
 	g_free(path);
 	return FALSE;
 }
@@ -284,32 +515,33 @@ static void mh_get_last_num(Folder *folder, FolderItem *item)
 	item->last_num = max;
 }
 
-gint mh_get_num_list(Folder *folder, FolderItem *item, GSList **list, gboolean *old_uids_valid)
+/* Touches nothing but the directory, for folder_item_scan_items() to
+ * list several folders at once. */
+static gint mh_get_num_list_from_dir(const gchar *path, GSList **list,
+				     time_t *mtime)
 {
-
-	gchar *path;
+	GStatBuf s;
 	GDir *dp;
 	const gchar *d;
 	GError *error = NULL;
 	gint num, nummsgs = 0;
 
-	cm_return_val_if_fail(item != NULL, -1);
-
-	debug_print("mh_get_num_list(): Scanning %s ...\n", item->path?item->path:"(null)");
-
-	*old_uids_valid = TRUE;
-
-	path = folder_item_get_path(item);
 	cm_return_val_if_fail(path != NULL, -1);
 
+	/* before reading it, so that a message arriving meanwhile makes
+	 * the folder look changed next time */
+	if (g_stat(path, &s) < 0) {
+		FILE_OP_ERROR(path, "stat");
+		return -1;
+	}
+	*mtime = s.st_mtime;
+
 	if ((dp = g_dir_open(path, 0, &error)) == NULL) {
 		g_message("Couldn't open current directory: %s (%d).\n",
 				error->message, error->code);
 		g_error_free(error);
-		g_free(path);
 		return -1;
 	}
-	g_free(path);
 
 	while ((d = g_dir_read_name(dp)) != NULL) {
 		if ((num = to_number(d)) > 0) {
@@ -319,7 +551,31 @@ gint mh_get_num_list(Folder *folder, FolderItem *item, GSList **list, gboolean *
 	}
 	g_dir_close(dp);
 
-	mh_set_mtime(folder, item);
+	return nummsgs;
+}
+
+gint mh_get_num_list(Folder *folder, FolderItem *item, GSList **list, gboolean *old_uids_valid)
+{
+
+	gchar *path;
+	time_t mtime;
+	gint nummsgs;
+
+	cm_return_val_if_fail(item != NULL, -1);
+
+	debug_print("mh_get_num_list(): Scanning %s ...\n", item->path?item->path:"(null)");
+
+	*old_uids_valid = TRUE;
+
+	path = folder_item_get_path(item);
+	cm_return_val_if_fail(path != NULL, -1);
+
+	nummsgs = mh_get_num_list_from_dir(path, list, &mtime);
+	g_free(path);
+	if (nummsgs < 0)
+		return -1;
+
+	item->mtime = mtime;
 	return nummsgs;
 }
 
@@ -56,6 +56,7 @@
 #include "timing.h"
 #include "manage_window.h"
 #include "privacy.h"
+#include "folder.h"
 
 typedef enum
 {
@@ -140,6 +141,7 @@ static void icon_scroll_size_allocate_cb(GtkWidget 	*widget,
 					 GtkAllocation  *layout_size, 
 					 MimeView 	*mimeview);
 static MimeInfo *mimeview_get_part_to_use(MimeView *mimeview);
+static void mimeview_fetch_part(MimeView *mimeview, MimeInfo *partinfo);
 static const gchar *get_part_name(MimeInfo *partinfo);
 static const gchar *get_part_description(MimeInfo *partinfo);
 
@@ -892,6 +894,20 @@ static MimeViewer *get_viewer_for_mimeinfo(MimeView *mimeview, MimeInfo *partinf
 	return viewer;
 }
 
+/* A big message may be shown before all of it has been fetched; get
+ * the part from the folder before it is looked at. */
+static void mimeview_fetch_part(MimeView *mimeview, MimeInfo *partinfo)
+{
+	MsgInfo *msginfo = mimeview->messageview->msginfo;
+
+	if (!partinfo || partinfo->length != 0 || !msginfo || !msginfo->folder)
+		return;
+
+	if (folder_item_fetch_msg_part(msginfo->folder, msginfo->msgnum,
+				       partinfo) < 0)
+		g_warning("couldn't fetch part of message %d", msginfo->msgnum);
+}
+
 gboolean mimeview_show_part(MimeView *mimeview, MimeInfo *partinfo)
 {
 	MimeViewer *viewer;
@@ -901,6 +917,7 @@ gboolean mimeview_show_part(MimeView *mimeview, MimeInfo *partinfo)
 		mimeview->messageview->partial_display_shown = FALSE;
 	}
 
+	mimeview_fetch_part(mimeview, partinfo);
 	viewer = get_viewer_for_mimeinfo(mimeview, partinfo);
 	if (viewer == NULL) {
 		if (mimeview->mimeviewer != NULL)
@@ -1681,6 +1698,7 @@ static void mimeview_drag_data_get(GtkWidget	    *widget,
 
 	partinfo = mimeview_get_selected_part(mimeview);
 	if (!partinfo) return;
+	mimeview_fetch_part(mimeview, partinfo);
 
 	if (strlen(get_part_name(partinfo)) > 0) {
 		filename = g_path_get_basename(get_part_name(partinfo));
@@ -1912,6 +1930,7 @@ static void mimeview_save_all(MimeView *mimeview)
 			gchar *filename = mimeview_get_filename_for_part
 				(partinfo, dirname, number++);
 
+			mimeview_fetch_part(mimeview, partinfo);
 			mimeview_write_part(filename, partinfo);
 			g_free(filename);
 		}
@@ -1998,6 +2017,7 @@ void mimeview_save_as(MimeView *mimeview)
 		return;
 	}
 
+	mimeview_fetch_part(mimeview, partinfo);
 	mimeview_write_part(filename, partinfo);
 
 	filedir = g_path_get_dirname(filename);
@@ -2034,6 +2054,7 @@ void mimeview_launch(MimeView *mimeview, MimeInfo *partinfo)
 		partinfo = mimeview_get_part_to_use(mimeview);
 
 	cm_return_if_fail(partinfo != NULL);
+	mimeview_fetch_part(mimeview, partinfo);
 
 	filename = procmime_get_tmp_file_name(partinfo);
 
@@ -2070,6 +2091,7 @@ static void mimeview_open_part_with(MimeView *mimeview, MimeInfo *partinfo, gboo
 	gint err;
 
 	cm_return_if_fail(partinfo != NULL);
+	mimeview_fetch_part(mimeview, partinfo);
 
 	filename = procmime_get_tmp_file_name(partinfo);
 
@@ -2165,6 +2187,7 @@ static void mimeview_send_to(MimeView *mimeview, MimeInfo *partinfo)
 	if (!mimeview->file) return;
 
 	cm_return_if_fail(partinfo != NULL);
+	mimeview_fetch_part(mimeview, partinfo);
 
 	filename = procmime_get_tmp_file_name(partinfo);
 
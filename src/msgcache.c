@@ -91,8 +91,6 @@ static gboolean msgcache_use_mmap_read = TRUE;
 static gboolean msgcache_use_mmap_read = TRUE;
 #endif
 
-static gboolean swapping = TRUE;
-
 typedef enum
 {
 	DATA_READ,
@@ -100,11 +98,116 @@ typedef enum
 	DATA_APPEND
 } DataOpenMode;
 
+/* Each journal record starts with its type, followed by a record
+ * laid out exactly like the ones in the mark and tags files. */
+typedef enum
+{
+	JOURNAL_FLAGS	= 1,
+	JOURNAL_TAGS	= 2
+} JournalRecordType;
+
+/* A CACHE_VERSION file holds, after the charset, the number of
+ * records, references and string heap bytes, then one fixed-width
+ * record of CACHE_RECORD_FIELDS ints per message, the heap offsets of
+ * all references and finally the string heap. Strings in the heap are
+ * NUL-terminated; offset 0 (an empty string) stands for NULL. */
+typedef enum
+{
+	CACHE_RECORD_NUM,
+	CACHE_RECORD_SIZE,
+	CACHE_RECORD_MTIME,
+	CACHE_RECORD_DATE_T,
+	CACHE_RECORD_TMP_FLAGS,
+	CACHE_RECORD_PLANNED_DOWNLOAD,
+	CACHE_RECORD_TOTAL_SIZE,
+	CACHE_RECORD_FROMNAME,
+	CACHE_RECORD_DATE,
+	CACHE_RECORD_FROM,
+	CACHE_RECORD_TO,
+	CACHE_RECORD_CC,
+	CACHE_RECORD_NEWSGROUPS,
+	CACHE_RECORD_SUBJECT,
+	CACHE_RECORD_MSGID,
+	CACHE_RECORD_INREPLYTO,
+	CACHE_RECORD_XREF,
+	CACHE_RECORD_REFS,
+	CACHE_RECORD_REFNUM,
+	CACHE_RECORD_FIELDS
+} CacheRecordField;
+
+#define CACHE_RECORD_SIZE_BYTES	(CACHE_RECORD_FIELDS * 4)
+#define CACHE_HEADER_SIZE_BYTES	(3 * 4)
+
+typedef struct _MsgCacheWriter MsgCacheWriter;
+struct _MsgCacheWriter {
+	GByteArray	*records;
+	GByteArray	*refs;
+	GByteArray	*heap;
+	/* heap offset of every string written so far, so that
+	 * repeated addresses and references are stored once */
+	GHashTable	*offsets;
+	guint		 count;
+	guint		 nrefs;
+};
+
+/* Backs the MsgInfos read from a cache file. The structs and their
+ * strings are carved out of a few large blocks instead of being
+ * allocated one by one, or the strings point straight into the cache
+ * file mapping (they are stored NUL-terminated), so a whole folder
+ * is set up and torn down in bulk. MsgInfos still referenced when the
+ * cache goes away get private copies of their strings and only keep
+ * the struct blocks alive. */
+typedef struct _MsgCacheArenaBlock MsgCacheArenaBlock;
+struct _MsgCacheArenaBlock {
+	gchar		*data;
+	gsize		 size;
+	gsize		 used;
+};
+
+struct _MsgCacheStorage {
+	gint		 refcnt;
+	gchar		*map;
+	gsize		 map_len;
+
+	GSList		*str_blocks;
+	gsize		 str_block_size;
+	gsize		 str_size;
+	GSList		*msginfo_blocks;
+};
+
+/* Windows can't replace a file that is still mapped, as
+ * msgcache_write() does with the cache file, so the strings are only
+ * left in the mapping elsewhere. */
+#ifdef G_OS_WIN32
+#define MSGCACHE_KEEP_MAPPING	FALSE
+#else
+#define MSGCACHE_KEEP_MAPPING	TRUE
+#endif
+
+#define ARENA_MSGINFO_BLOCK	(1024 * sizeof(MsgInfo))
+#define ARENA_STR_BLOCK		(64 * 1024)
+#define ARENA_ALIGN(n)		(((n) + sizeof(gpointer) - 1) & ~(gsize)(sizeof(gpointer) - 1))
+
 struct _MsgCache {
 	GHashTable	*msgnum_table;
 	GHashTable	*msgid_table;
+	/* msgid_table is only filled on first use after reading a
+	 * columnar cache, so that loading doesn't touch the strings */
+	gboolean	 msgid_table_pending;
 	guint		 memusage;
 	time_t		 last_access;
+
+	/* set once the cache is attached to its FolderItem, and then
+	 * kept in msgcache_lru, least recently used first */
+	FolderItem	*item;
+	GList		*lru_link;
+
+	/* msgnums whose flags/tags changed since the mark/tags
+	 * files or the journal were last written */
+	GHashTable	*journal_flags;
+	GHashTable	*journal_tags;
+
+	MsgCacheStorage	*storage;
 };
 
 typedef struct _StringConverter StringConverter;
@@ -126,6 +229,26 @@ struct _CharsetConverter {
 	gchar *dstcharset;
 };
 
+static GQueue msgcache_lru = G_QUEUE_INIT;
+static guint msgcache_total_memusage = 0;
+
+static void msgcache_touch(MsgCache *cache)
+{
+	cache->last_access = time(NULL);
+
+	if (cache->lru_link != NULL && cache->lru_link != msgcache_lru.tail) {
+		g_queue_unlink(&msgcache_lru, cache->lru_link);
+		g_queue_push_tail_link(&msgcache_lru, cache->lru_link);
+	}
+}
+
+static void msgcache_charge(MsgCache *cache, gint memusage)
+{
+	cache->memusage += memusage;
+	if (cache->lru_link != NULL)
+		msgcache_total_memusage += memusage;
+}
+
 MsgCache *msgcache_new(void)
 {
 	MsgCache *cache;
@@ -133,13 +256,218 @@ MsgCache *msgcache_new(void)
 	cache = g_new0(MsgCache, 1),
 	cache->msgnum_table = g_hash_table_new(g_int_hash, g_int_equal);
 	cache->msgid_table = g_hash_table_new(g_str_hash, g_str_equal);
+	cache->journal_flags = g_hash_table_new(g_direct_hash, g_direct_equal);
+	cache->journal_tags = g_hash_table_new(g_direct_hash, g_direct_equal);
 	cache->last_access = time(NULL);
 
 	return cache;
 }
 
+static gpointer msgcache_arena_alloc(GSList **blocks, gsize size,
+				     gsize block_size, gboolean align)
+{
+	MsgCacheArenaBlock *block = *blocks != NULL ? (*blocks)->data : NULL;
+	gsize used = 0;
+	gpointer mem;
+
+	if (block != NULL)
+		used = align ? ARENA_ALIGN(block->used) : block->used;
+
+	if (block == NULL || used > block->size || block->size - used < size) {
+		block = g_new(MsgCacheArenaBlock, 1);
+		block->size = MAX(size, block_size);
+		block->data = g_malloc(block->size);
+		block->used = used = 0;
+		*blocks = g_slist_prepend(*blocks, block);
+	}
+
+	mem = block->data + used;
+	block->used = used + size;
+
+	return mem;
+}
+
+static void msgcache_arena_free(GSList *blocks)
+{
+	GSList *cur;
+
+	for (cur = blocks; cur != NULL; cur = cur->next) {
+		MsgCacheArenaBlock *block = (MsgCacheArenaBlock *) cur->data;
+
+		g_free(block->data);
+		g_free(block);
+	}
+	g_slist_free(blocks);
+}
+
+static MsgCacheStorage *msgcache_storage_new(gsize str_block_size)
+{
+	MsgCacheStorage *storage;
+
+	storage = g_new0(MsgCacheStorage, 1);
+	storage->refcnt = 1;
+	storage->str_block_size = MAX(str_block_size, ARENA_STR_BLOCK);
+
+	return storage;
+}
+
+MsgCacheStorage *msgcache_storage_ref(MsgCacheStorage *storage)
+{
+	cm_return_val_if_fail(storage != NULL, NULL);
+
+	storage->refcnt++;
+
+	return storage;
+}
+
+static void msgcache_storage_free_strings(MsgCacheStorage *storage)
+{
+	if (storage->map != NULL) {
+#ifdef G_OS_WIN32
+		UnmapViewOfFile((void*) storage->map);
+#else
+		munmap(storage->map, storage->map_len);
+#endif
+		storage->map = NULL;
+		storage->map_len = 0;
+	}
+
+	msgcache_arena_free(storage->str_blocks);
+	storage->str_blocks = NULL;
+	storage->str_size = 0;
+}
+
+void msgcache_storage_unref(MsgCacheStorage *storage)
+{
+	if (storage == NULL)
+		return;
+
+	storage->refcnt--;
+	if (storage->refcnt > 0)
+		return;
+
+	msgcache_storage_free_strings(storage);
+	msgcache_arena_free(storage->msginfo_blocks);
+	g_free(storage);
+}
+
+gboolean msgcache_storage_owns(MsgCacheStorage *storage, gconstpointer ptr)
+{
+	const gchar *p = (const gchar *) ptr;
+	GSList *cur;
+
+	if (storage == NULL || ptr == NULL)
+		return FALSE;
+
+	if (storage->map != NULL &&
+	    p >= storage->map && p < storage->map + storage->map_len)
+		return TRUE;
+
+	for (cur = storage->str_blocks; cur != NULL; cur = cur->next) {
+		MsgCacheArenaBlock *block = (MsgCacheArenaBlock *) cur->data;
+
+		if (p >= block->data && p < block->data + block->used)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static gpointer msgcache_storage_alloc(MsgCacheStorage *storage, gsize size,
+				       gboolean align)
+{
+	storage->str_size += size;
+
+	return msgcache_arena_alloc(&storage->str_blocks, size,
+				    storage->str_block_size, align);
+}
+
+static gchar *msgcache_storage_take_str(MsgCacheStorage *storage, gchar *str)
+{
+	gchar *newstr;
+	gsize len;
+
+	if (str == NULL)
+		return NULL;
+
+	len = strlen(str);
+	newstr = msgcache_storage_alloc(storage, len + 1, FALSE);
+	memcpy(newstr, str, len + 1);
+	g_free(str);
+
+	return newstr;
+}
+
+static MsgInfo *msgcache_storage_new_msginfo(MsgCacheStorage *storage)
+{
+	MsgInfo *msginfo;
+
+	msginfo = msgcache_arena_alloc(&storage->msginfo_blocks, sizeof(MsgInfo),
+				       ARENA_MSGINFO_BLOCK, TRUE);
+	memset(msginfo, 0, sizeof(MsgInfo));
+	msginfo->refcnt = 1;
+	msginfo->storage = msgcache_storage_ref(storage);
+
+	return msginfo;
+}
+
+static void msgcache_storage_add_ref(MsgCacheStorage *storage, MsgInfo *msginfo,
+				     GSList **last, gchar *ref)
+{
+	GSList *node;
+
+	node = msgcache_storage_alloc(storage, sizeof(GSList), TRUE);
+	node->data = ref;
+	node->next = NULL;
+
+	if (*last != NULL)
+		(*last)->next = node;
+	else
+		msginfo->references = node;
+	*last = node;
+}
+
+/* Gives a MsgInfo that outlives its cache private copies of whatever
+ * still points into the cache's strings. */
+static void msgcache_msginfo_unshare(MsgInfo *msginfo)
+{
+	MsgCacheStorage *storage = msginfo->storage;
+	GSList *cur, *refs = NULL;
+
+	if (storage == NULL)
+		return;
+
+#define UNSHARE(str)					\
+	if (msgcache_storage_owns(storage, str))	\
+		str = g_strdup(str)
+
+	UNSHARE(msginfo->fromname);
+	UNSHARE(msginfo->date);
+	UNSHARE(msginfo->from);
+	UNSHARE(msginfo->to);
+	UNSHARE(msginfo->cc);
+	UNSHARE(msginfo->newsgroups);
+	UNSHARE(msginfo->subject);
+	UNSHARE(msginfo->msgid);
+	UNSHARE(msginfo->inreplyto);
+	UNSHARE(msginfo->xref);
+#undef UNSHARE
+
+	if (msgcache_storage_owns(storage, msginfo->references)) {
+		for (cur = msginfo->references; cur != NULL; cur = cur->next) {
+			gchar *ref = (gchar *) cur->data;
+
+			refs = g_slist_prepend(refs,
+				msgcache_storage_owns(storage, ref) ? g_strdup(ref) : ref);
+		}
+		msginfo->references = g_slist_reverse(refs);
+	}
+}
+
 static gboolean msgcache_msginfo_free_func(gpointer num, gpointer msginfo, gpointer user_data)
 {
+	if (((MsgInfo *) msginfo)->refcnt > 1)
+		msgcache_msginfo_unshare((MsgInfo *) msginfo);
 	procmsg_msginfo_free((MsgInfo **)&msginfo);
 	return TRUE;
 }											  
@@ -151,6 +479,18 @@ void msgcache_destroy(MsgCache *cache)
 	g_hash_table_foreach_remove(cache->msgnum_table, msgcache_msginfo_free_func, NULL);
 	g_hash_table_destroy(cache->msgid_table);
 	g_hash_table_destroy(cache->msgnum_table);
+	g_hash_table_destroy(cache->journal_flags);
+	g_hash_table_destroy(cache->journal_tags);
+	if (cache->lru_link != NULL) {
+		msgcache_total_memusage -= cache->memusage;
+		g_queue_delete_link(&msgcache_lru, cache->lru_link);
+	}
+	if (cache->storage != NULL) {
+		/* whatever is left is only referenced by unshared MsgInfos */
+		if (cache->storage->refcnt > 1)
+			msgcache_storage_free_strings(cache->storage);
+		msgcache_storage_unref(cache->storage);
+	}
 	g_free(cache);
 }
 
@@ -165,8 +505,8 @@ void msgcache_add_msg(MsgCache *cache, MsgInfo *msginfo)
 	g_hash_table_insert(cache->msgnum_table, &newmsginfo->msgnum, newmsginfo);
 	if(newmsginfo->msgid != NULL)
 		g_hash_table_insert(cache->msgid_table, newmsginfo->msgid, newmsginfo);
-	cache->memusage += procmsg_msginfo_memusage(msginfo);
-	cache->last_access = time(NULL);
+	msgcache_charge(cache, procmsg_msginfo_memusage(msginfo));
+	msgcache_touch(cache);
 
 	msginfo->folder->cache_dirty = TRUE;
 
@@ -183,15 +523,17 @@ void msgcache_remove_msg(MsgCache *cache, guint msgnum)
 	if(!msginfo)
 		return;
 
-	cache->memusage -= procmsg_msginfo_memusage(msginfo);
+	msgcache_charge(cache, -(gint)procmsg_msginfo_memusage(msginfo));
 	if(msginfo->msgid)
 		g_hash_table_remove(cache->msgid_table, msginfo->msgid);
 	g_hash_table_remove(cache->msgnum_table, &msginfo->msgnum);
 
 	msginfo->folder->cache_dirty = TRUE;
 
+	if (msginfo->refcnt > 1)
+		msgcache_msginfo_unshare(msginfo);
 	procmsg_msginfo_free(&msginfo);
-	cache->last_access = time(NULL);
+	msgcache_touch(cache);
 
 
 	debug_print("Cache size: %d messages, %u bytes\n", g_hash_table_size(cache->msgnum_table), cache->memusage);
@@ -209,7 +551,9 @@ void msgcache_update_msg(MsgCache *cache, MsgInfo *msginfo)
 		g_hash_table_remove(cache->msgid_table, oldmsginfo->msgid);
 	if (oldmsginfo) {
 		g_hash_table_remove(cache->msgnum_table, &oldmsginfo->msgnum);
-		cache->memusage -= procmsg_msginfo_memusage(oldmsginfo);
+		msgcache_charge(cache, -(gint)procmsg_msginfo_memusage(oldmsginfo));
+		if (oldmsginfo->refcnt > 1)
+			msgcache_msginfo_unshare(oldmsginfo);
 		procmsg_msginfo_free(&oldmsginfo);
 	}
 
@@ -217,8 +561,8 @@ void msgcache_update_msg(MsgCache *cache, MsgInfo *msginfo)
 	g_hash_table_insert(cache->msgnum_table, &newmsginfo->msgnum, newmsginfo);
 	if(newmsginfo->msgid)
 		g_hash_table_insert(cache->msgid_table, newmsginfo->msgid, newmsginfo);
-	cache->memusage += procmsg_msginfo_memusage(newmsginfo);
-	cache->last_access = time(NULL);
+	msgcache_charge(cache, procmsg_msginfo_memusage(newmsginfo));
+	msgcache_touch(cache);
 	
 	debug_print("Cache size: %d messages, %u bytes\n", g_hash_table_size(cache->msgnum_table), cache->memusage);
 
@@ -236,11 +580,20 @@ MsgInfo *msgcache_get_msg(MsgCache *cache, guint num)
 	msginfo = g_hash_table_lookup(cache->msgnum_table, &num);
 	if(!msginfo)
 		return NULL;
-	cache->last_access = time(NULL);
+	msgcache_touch(cache);
 	
 	return procmsg_msginfo_new_ref(msginfo);
 }
 
+static void msgcache_fill_msgid_table_func(gpointer key, gpointer value, gpointer user_data)
+{
+	MsgCache *cache = (MsgCache *)user_data;
+	MsgInfo *msginfo = (MsgInfo *)value;
+
+	if (msginfo->msgid != NULL)
+		g_hash_table_insert(cache->msgid_table, msginfo->msgid, msginfo);
+}
+
 MsgInfo *msgcache_get_msg_by_id(MsgCache *cache, const gchar *msgid)
 {
 	MsgInfo *msginfo;
@@ -248,10 +601,16 @@ MsgInfo *msgcache_get_msg_by_id(MsgCache *cache, const gchar *msgid)
 	cm_return_val_if_fail(cache != NULL, NULL);
 	cm_return_val_if_fail(msgid != NULL, NULL);
 
+	if (cache->msgid_table_pending) {
+		g_hash_table_foreach(cache->msgnum_table,
+				     msgcache_fill_msgid_table_func, cache);
+		cache->msgid_table_pending = FALSE;
+	}
+
 	msginfo = g_hash_table_lookup(cache->msgid_table, msgid);
 	if(!msginfo)
 		return NULL;
-	cache->last_access = time(NULL);
+	msgcache_touch(cache);
 	
 	return procmsg_msginfo_new_ref(msginfo);	
 }
@@ -271,13 +630,46 @@ MsgInfoList *msgcache_get_msg_list(MsgCache *cache)
 	cm_return_val_if_fail(cache != NULL, NULL);
 
 	g_hash_table_foreach((GHashTable *)cache->msgnum_table, msgcache_get_msg_list_func, (gpointer)&msg_list);	
-	cache->last_access = time(NULL);
+	msgcache_touch(cache);
 	
 	msg_list = g_slist_reverse(msg_list);
 	END_TIMING();
 	return msg_list;
 }
 
+static gint msgcache_msgnum_compare(gconstpointer a, gconstpointer b)
+{
+	guint num_a = *(const guint *)a;
+	guint num_b = *(const guint *)b;
+
+	return num_a < num_b ? -1 : (num_a > num_b ? 1 : 0);
+}
+
+static void msgcache_get_msgnum_array_func(gpointer key, gpointer value, gpointer user_data)
+{
+	GArray *nums = (GArray *)user_data;
+	guint num = ((MsgInfo *)value)->msgnum;
+
+	g_array_append_val(nums, num);
+}
+
+/* Returns the message numbers in the cache as a sorted array of guint,
+ * without taking a reference on every MsgInfo. */
+GArray *msgcache_get_msgnum_array(MsgCache *cache)
+{
+	GArray *nums;
+
+	cm_return_val_if_fail(cache != NULL, NULL);
+
+	nums = g_array_sized_new(FALSE, FALSE, sizeof(guint),
+				 g_hash_table_size(cache->msgnum_table));
+	g_hash_table_foreach(cache->msgnum_table, msgcache_get_msgnum_array_func, nums);
+	g_array_sort(nums, msgcache_msgnum_compare);
+	msgcache_touch(cache);
+
+	return nums;
+}
+
 time_t msgcache_get_last_access_time(MsgCache *cache)
 {
 	cm_return_val_if_fail(cache != NULL, 0);
@@ -292,13 +684,93 @@ gint msgcache_get_memory_usage(MsgCache *cache)
 	return cache->memusage;
 }
 
+/* Makes the cache count towards msgcache_get_total_memory_usage() and
+ * take part in LRU eviction. Only called from the main thread, once
+ * the cache is set as item->cache. */
+static void msgcache_set_folder_func(gpointer key, gpointer value,
+				     gpointer user_data)
+{
+	((MsgInfo *)value)->folder = (FolderItem *)user_data;
+}
+
+void msgcache_attach(MsgCache *cache, FolderItem *item)
+{
+	cm_return_if_fail(cache != NULL);
+	cm_return_if_fail(item != NULL);
+
+	if (cache->item != item)
+		g_hash_table_foreach(cache->msgnum_table,
+				     msgcache_set_folder_func, item);
+	cache->item = item;
+	if (cache->lru_link == NULL) {
+		g_queue_push_tail(&msgcache_lru, cache);
+		cache->lru_link = msgcache_lru.tail;
+		msgcache_total_memusage += cache->memusage;
+	}
+	msgcache_touch(cache);
+}
+
+FolderItem *msgcache_get_item(MsgCache *cache)
+{
+	cm_return_val_if_fail(cache != NULL, NULL);
+
+	return cache->item;
+}
+
+/* Walks the attached caches from least to most recently used: pass
+ * NULL to get the first one. */
+MsgCache *msgcache_get_lru_next(MsgCache *cache)
+{
+	GList *link;
+
+	link = cache != NULL ? cache->lru_link->next : msgcache_lru.head;
+
+	return link != NULL ? (MsgCache *)link->data : NULL;
+}
+
+guint msgcache_get_total_memory_usage(void)
+{
+	return msgcache_total_memusage;
+}
+
+void msgcache_journal_flags(MsgCache *cache, guint num)
+{
+	cm_return_if_fail(cache != NULL);
+
+	g_hash_table_insert(cache->journal_flags, GUINT_TO_POINTER(num),
+			    GINT_TO_POINTER(1));
+}
+
+void msgcache_journal_tags(MsgCache *cache, guint num)
+{
+	cm_return_if_fail(cache != NULL);
+
+	g_hash_table_insert(cache->journal_tags, GUINT_TO_POINTER(num),
+			    GINT_TO_POINTER(1));
+}
+
+/* Returns TRUE if every pending change of the requested kinds has been
+ * recorded per message, so that appending them to the journal is enough
+ * to bring the files on disk up to date. */
+gboolean msgcache_can_journal(MsgCache *cache, gboolean flags, gboolean tags)
+{
+	cm_return_val_if_fail(cache != NULL, FALSE);
+
+	if (flags && g_hash_table_size(cache->journal_flags) == 0)
+		return FALSE;
+	if (tags && g_hash_table_size(cache->journal_tags) == 0)
+		return FALSE;
+
+	return flags || tags;
+}
+
 /*
  *  Cache saving functions
  */
 
 #define READ_CACHE_DATA(data, fp, total_len) \
 { \
-	if ((tmp_len = msgcache_read_cache_data_str(fp, &data, conv)) < 0) { \
+	if ((tmp_len = msgcache_read_cache_data_str(fp, &data, str_term, swapping, conv, storage)) < 0) { \
 		procmsg_msginfo_free(&msginfo); \
 		error = TRUE; \
 		goto bail_err; \
@@ -335,19 +807,27 @@ gint msgcache_get_memory_usage(MsgCache *cache)
 #define GET_CACHE_DATA(data, total_len) \
 { \
 	GET_CACHE_DATA_INT(tmp_len);	\
-	if (rem_len < tmp_len) {								\
+	if (rem_len < tmp_len + str_term) {							\
 		g_print("error at rem_len:%d (tmp_len %d)\n", rem_len, tmp_len);		\
 		error = TRUE;									\
 		goto bail_err;									\
 	}											\
-	if ((tmp_len = msgcache_get_cache_data_str(walk_data, &data, tmp_len, conv)) < 0) { \
+	if (in_place) {										\
+		if (walk_data[tmp_len] != '\0') {						\
+			g_print("error at rem_len:%d (unterminated)\n", rem_len);		\
+			procmsg_msginfo_free(&msginfo);						\
+			error = TRUE;								\
+			goto bail_err;								\
+		}										\
+		data = tmp_len > 0 ? walk_data : NULL;						\
+	} else if ((tmp_len = msgcache_get_cache_data_str(walk_data, &data, tmp_len, conv, storage)) < 0) { \
 		g_print("error at rem_len:%d\n", rem_len);\
 		procmsg_msginfo_free(&msginfo); \
 		error = TRUE; \
 		goto bail_err; \
 	} \
 	total_len += tmp_len; \
-	walk_data += tmp_len; rem_len -= tmp_len; \
+	walk_data += tmp_len + str_term; rem_len -= tmp_len + str_term; \
 }
 
 
@@ -384,6 +864,11 @@ gint msgcache_get_memory_usage(MsgCache *cache)
 			w_err = 1;			\
 		wrote += len;				\
 	} \
+	if (w_err == 0) {				\
+		if (SC_FWRITE("", 1, 1, fp) != 1)	\
+			w_err = 1;			\
+		wrote += 1;				\
+	}						\
 }
 
 #define PUT_CACHE_DATA(data)				\
@@ -462,8 +947,10 @@ static FILE *msgcache_open_data_file(const gchar *file, guint version,
 	return fp;
 }
 
-static gint msgcache_read_cache_data_str(FILE *fp, gchar **str, 
-					 StringConverter *conv)
+static gint msgcache_read_cache_data_str(FILE *fp, gchar **str, gint term,
+					 gboolean swapping,
+					 StringConverter *conv,
+					 MsgCacheStorage *storage)
 {
 	gchar *tmpstr = NULL;
 	size_t ni;
@@ -489,20 +976,33 @@ static gint msgcache_read_cache_data_str(FILE *fp, gchar **str,
 		len = bswap_32(len);
 	}
 
-	if (len == 0)
+	if (len == 0) {
+		if (term && fgetc(fp) == EOF)
+			return -1;
 		return 0;
+	}
 
-	tmpstr = g_try_malloc(len + 1);
+	/* no string can be longer than the cache file itself */
+	if (storage != NULL && len >= storage->str_block_size) {
+		g_warning("read_data_str: refusing to allocate %u bytes.", len);
+		return -1;
+	}
+
+	if (storage != NULL && conv == NULL)
+		tmpstr = msgcache_storage_alloc(storage, len + 1, FALSE);
+	else
+		tmpstr = g_try_malloc(len + 1);
 
 	if(tmpstr == NULL) {
 		return -1;
 	}
 
-	if ((ni = fread(tmpstr, 1, len, fp)) != len) {
+	if ((ni = fread(tmpstr, 1, len + term, fp)) != len + term) {
 		g_warning("read_data_str: Cache data corrupted, read %zd of %u "
 			  "bytes at offset %ld",
 			  ni, len, ftell(fp));
-		g_free(tmpstr);
+		if (storage == NULL || conv != NULL)
+			g_free(tmpstr);
 		return -1;
 	}
 	tmpstr[len] = 0;
@@ -510,6 +1010,8 @@ static gint msgcache_read_cache_data_str(FILE *fp, gchar **str,
 	if (conv != NULL) {
 		*str = conv->convert(conv, tmpstr);
 		g_free(tmpstr);
+		if (storage != NULL)
+			*str = msgcache_storage_take_str(storage, *str);
 	} else 
 		*str = tmpstr;
 
@@ -517,7 +1019,8 @@ static gint msgcache_read_cache_data_str(FILE *fp, gchar **str,
 }
 
 static gint msgcache_get_cache_data_str(gchar *src, gchar **str, gint len,
-					 StringConverter *conv)
+					 StringConverter *conv,
+					 MsgCacheStorage *storage)
 {
 	gchar *tmpstr = NULL;
 
@@ -531,7 +1034,10 @@ static gint msgcache_get_cache_data_str(gchar *src, gchar **str, gint len,
 		return -1;
 	}
 
-	tmpstr = g_try_malloc(len + 1);
+	if (storage != NULL && conv == NULL)
+		tmpstr = msgcache_storage_alloc(storage, len + 1, FALSE);
+	else
+		tmpstr = g_try_malloc(len + 1);
 
 	if(tmpstr == NULL) {
 		return -1;
@@ -543,6 +1049,8 @@ static gint msgcache_get_cache_data_str(gchar *src, gchar **str, gint len,
 	if (conv != NULL) {
 		*str = conv->convert(conv, tmpstr);
 		g_free(tmpstr);
+		if (storage != NULL)
+			*str = msgcache_storage_take_str(storage, *str);
 	} else 
 		*str = tmpstr;
 
@@ -564,12 +1072,178 @@ static void strconv_charset_free(StringConverter *conv)
 	g_free(charsetconv->dstcharset);
 }
 
-MsgCache *msgcache_read_cache(FolderItem *item, const gchar *cache_file)
+static guint32 msgcache_get_record_int(const gchar *rec, guint field)
+{
+	const gchar *x = rec + field * 4;
+
+	/* columnar caches are always little-endian */
+	return MMAP_TO_GUINT32_SWAPPED(x);
+}
+
+static gboolean msgcache_get_heap_str(const gchar *heap, guint32 heap_len,
+				      guint32 offset, StringConverter *conv,
+				      MsgCacheStorage *storage, gchar **str)
+{
+	*str = NULL;
+
+	if (offset >= heap_len)
+		return FALSE;
+	if (offset == 0)
+		return TRUE;
+
+	if (conv != NULL)
+		*str = msgcache_storage_take_str(storage,
+				conv->convert(conv, (gchar *)heap + offset));
+	else
+		*str = (gchar *)heap + offset;
+
+	return TRUE;
+}
+
+/* Reads the part of a CACHE_VERSION file following the charset. The
+ * string heap is used in place, either from the file mapping or from
+ * a single arena block the rest of the file is read into, so building
+ * the MsgInfos only walks the record table and never touches the
+ * strings themselves. */
+static gboolean msgcache_read_columns(MsgCache *cache, FolderItem *item,
+				      FILE *fp, StringConverter *conv,
+				      MsgTmpFlags tmp_flags, guint *memusage)
+{
+	MsgCacheStorage *storage;
+	MsgInfo *msginfo;
+	struct stat st;
+	gchar *map = NULL, *data = NULL, *rec, *refs, *heap;
+	guint32 count, nrefs, heap_len, first_ref, refnum, i, j;
+	glong offset;
+	gsize data_len;
+	GSList *last_ref;
+	gchar *ref;
+	gboolean error = FALSE;
+
+	offset = ftell(fp);
+	if (offset < 0 || fstat(fileno(fp), &st) < 0 ||
+	    st.st_size < offset + CACHE_HEADER_SIZE_BYTES) {
+		g_warning("read_columns: Cache data truncated");
+		return FALSE;
+	}
+	data_len = st.st_size - offset;
+
+	storage = msgcache_storage_new(0);
+	cache->storage = storage;
+
+#ifndef G_OS_WIN32
+	if (MSGCACHE_KEEP_MAPPING && msgcache_use_mmap_read &&
+	    prefs_common.cache_mmap_strings && conv == NULL) {
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE, fileno(fp), 0);
+		if (map != NULL && map != MAP_FAILED) {
+			storage->map = map;
+			storage->map_len = st.st_size;
+			data = map + offset;
+		}
+	}
+#endif
+
+	if (data == NULL) {
+		data = msgcache_storage_alloc(storage, data_len, TRUE);
+		if (fread(data, 1, data_len, fp) != data_len) {
+			g_warning("read_columns: Cache data corrupted, short read "
+				  "at offset %ld", offset);
+			return FALSE;
+		}
+	}
+
+	count = msgcache_get_record_int(data, 0);
+	nrefs = msgcache_get_record_int(data, 1);
+	heap_len = msgcache_get_record_int(data, 2);
+
+	if (count > data_len / CACHE_RECORD_SIZE_BYTES ||
+	    nrefs > data_len / 4 ||
+	    CACHE_HEADER_SIZE_BYTES + (gsize)count * CACHE_RECORD_SIZE_BYTES +
+	    (gsize)nrefs * 4 + heap_len != data_len ||
+	    heap_len == 0 || data[data_len - 1] != '\0') {
+		g_warning("read_columns: Cache data corrupted (%u records, "
+			  "%u references, %u bytes of strings in %zd bytes)",
+			  count, nrefs, heap_len, data_len);
+		return FALSE;
+	}
+
+	rec = data + CACHE_HEADER_SIZE_BYTES;
+	refs = rec + (gsize)count * CACHE_RECORD_SIZE_BYTES;
+	heap = refs + (gsize)nrefs * 4;
+
+#define GET_HEAP_STR(str, field) \
+{ \
+	if (!msgcache_get_heap_str(heap, heap_len, \
+			msgcache_get_record_int(rec, field), \
+			conv, storage, &str)) \
+		error = TRUE; \
+}
+
+	for (i = 0; i < count; i++, rec += CACHE_RECORD_SIZE_BYTES) {
+		msginfo = msgcache_storage_new_msginfo(storage);
+		msginfo->msgnum = msgcache_get_record_int(rec, CACHE_RECORD_NUM);
+		msginfo->size = msgcache_get_record_int(rec, CACHE_RECORD_SIZE);
+		msginfo->mtime = msgcache_get_record_int(rec, CACHE_RECORD_MTIME);
+		msginfo->date_t = msgcache_get_record_int(rec, CACHE_RECORD_DATE_T);
+		msginfo->flags.tmp_flags =
+			msgcache_get_record_int(rec, CACHE_RECORD_TMP_FLAGS) | tmp_flags;
+		msginfo->planned_download =
+			msgcache_get_record_int(rec, CACHE_RECORD_PLANNED_DOWNLOAD);
+		msginfo->total_size =
+			msgcache_get_record_int(rec, CACHE_RECORD_TOTAL_SIZE);
+
+		GET_HEAP_STR(msginfo->fromname, CACHE_RECORD_FROMNAME);
+		GET_HEAP_STR(msginfo->date, CACHE_RECORD_DATE);
+		GET_HEAP_STR(msginfo->from, CACHE_RECORD_FROM);
+		GET_HEAP_STR(msginfo->to, CACHE_RECORD_TO);
+		GET_HEAP_STR(msginfo->cc, CACHE_RECORD_CC);
+		GET_HEAP_STR(msginfo->newsgroups, CACHE_RECORD_NEWSGROUPS);
+		GET_HEAP_STR(msginfo->subject, CACHE_RECORD_SUBJECT);
+		GET_HEAP_STR(msginfo->msgid, CACHE_RECORD_MSGID);
+		GET_HEAP_STR(msginfo->inreplyto, CACHE_RECORD_INREPLYTO);
+		GET_HEAP_STR(msginfo->xref, CACHE_RECORD_XREF);
+
+		first_ref = msgcache_get_record_int(rec, CACHE_RECORD_REFS);
+		refnum = msgcache_get_record_int(rec, CACHE_RECORD_REFNUM);
+		if (first_ref > nrefs || refnum > nrefs - first_ref)
+			error = TRUE;
+
+		for (j = 0, last_ref = NULL; !error && j < refnum; j++) {
+			if (!msgcache_get_heap_str(heap, heap_len,
+					msgcache_get_record_int(refs, first_ref + j),
+					conv, storage, &ref))
+				error = TRUE;
+			else if (ref && *ref)
+				msgcache_storage_add_ref(storage, msginfo,
+							 &last_ref, ref);
+		}
+
+		if (error) {
+			g_warning("read_columns: Cache data corrupted in record %u", i);
+			procmsg_msginfo_free(&msginfo);
+			return FALSE;
+		}
+
+		msginfo->folder = item;
+		*memusage += procmsg_msginfo_memusage(msginfo);
+
+		g_hash_table_insert(cache->msgnum_table, &msginfo->msgnum, msginfo);
+	}
+#undef GET_HEAP_STR
+
+	cache->msgid_table_pending = TRUE;
+
+	return TRUE;
+}
+
+static MsgCache *msgcache_read_cache_real(FolderItem *item,
+					  const gchar *cache_file,
+					  MsgTmpFlags tmp_flags)
 {
 	MsgCache *cache;
 	FILE *fp;
 	MsgInfo *msginfo;
-	MsgTmpFlags tmp_flags = 0;
 	gchar file_buf[BUFFSIZE];
 	guint32 num;
         guint refnum;
@@ -578,39 +1252,55 @@ MsgCache *msgcache_read_cache(FolderItem *item, const gchar *cache_file)
 	gchar *srccharset = NULL;
 	const gchar *dstcharset = NULL;
 	gchar *ref = NULL;
-	guint memusage = 0;
+	guint memusage = 0, str_len = 0;
 	gint tmp_len = 0, map_len = -1;
+	gint str_term = 1;
+	gboolean in_place = FALSE;
 	char *cache_data = NULL;
+	MsgCacheStorage *storage = NULL;
+	GSList *last_ref;
 	struct stat st;
+	gboolean swapping = TRUE;
+	gboolean columns = TRUE;
 
 	cm_return_val_if_fail(cache_file != NULL, NULL);
-	cm_return_val_if_fail(item != NULL, NULL);
-
-	swapping = TRUE;
 
 	/* In case we can't open the mark file with MARK_VERSION, check if we can open it with the
 	 * swapped MARK_VERSION. As msgcache_open_data_file swaps it too, if this succeeds, 
 	 * it means it's the old version (not little-endian) on a big-endian machine. The code has
 	 * no effect on x86 as their file doesn't change. */
 
+	/* Columnar caches have only ever been written little-endian;
+	 * older stream caches are still read and get upgraded on the
+	 * next write. */
 	if ((fp = msgcache_open_data_file
 		(cache_file, CACHE_VERSION, DATA_READ, file_buf, sizeof(file_buf))) == NULL) {
+		columns = FALSE;
 		if ((fp = msgcache_open_data_file
-		(cache_file, bswap_32(CACHE_VERSION), DATA_READ, file_buf, sizeof(file_buf))) == NULL)
-			return NULL;
-		else
-			swapping = FALSE;
+			(cache_file, CACHE_VERSION_STREAM, DATA_READ, file_buf, sizeof(file_buf))) == NULL) {
+			if ((fp = msgcache_open_data_file
+			(cache_file, bswap_32(CACHE_VERSION_STREAM), DATA_READ, file_buf, sizeof(file_buf))) != NULL)
+				swapping = FALSE;
+		}
 	}
 
-	debug_print("\tReading %sswapped message cache from %s...\n", swapping?"":"un", cache_file);
-
-	if (folder_has_parent_of_type(item, F_QUEUE)) {
-		tmp_flags |= MSG_QUEUED;
-	} else if (folder_has_parent_of_type(item, F_DRAFT)) {
-		tmp_flags |= MSG_DRAFT;
+	/* Caches written before strings were NUL-terminated are still
+	 * read (by copying); they get upgraded on the next write. */
+	if (fp == NULL) {
+		str_term = 0;
+		if ((fp = msgcache_open_data_file
+			(cache_file, CACHE_VERSION_UNTERMINATED, DATA_READ, file_buf, sizeof(file_buf))) == NULL) {
+			if ((fp = msgcache_open_data_file
+			(cache_file, bswap_32(CACHE_VERSION_UNTERMINATED), DATA_READ, file_buf, sizeof(file_buf))) == NULL)
+				return NULL;
+			else
+				swapping = FALSE;
+		}
 	}
 
-	if (msgcache_read_cache_data_str(fp, &srccharset, NULL) < 0) {
+	debug_print("\tReading %sswapped message cache from %s...\n", swapping?"":"un", cache_file);
+
+	if (msgcache_read_cache_data_str(fp, &srccharset, str_term, swapping, NULL, NULL) < 0) {
 		fclose(fp);
 		return NULL;
 	}
@@ -638,11 +1328,19 @@ MsgCache *msgcache_read_cache(FolderItem *item, const gchar *cache_file)
 
 	cache = msgcache_new();
 
+	if (columns) {
+		error = !msgcache_read_columns(cache, item, fp, conv,
+					       tmp_flags, &memusage);
+		storage = cache->storage;
+		goto bail_err;
+	}
+
+	if (fstat(fileno(fp), &st) >= 0)
+		map_len = st.st_size;
+	else
+		map_len = -1;
+
 	if (msgcache_use_mmap_read == TRUE) {
-		if (fstat(fileno(fp), &st) >= 0)
-			map_len = st.st_size;
-		else
-			map_len = -1;
 		if (map_len > 0) {
 #ifdef G_OS_WIN32
 			cache_data = NULL;
@@ -658,7 +1356,10 @@ MsgCache *msgcache_read_cache(FolderItem *item, const gchar *cache_file)
 		w32_fail:
 			;
 #else
-			cache_data = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+			/* writable, but private: pages stay shared with the
+			 * page cache unless something writes to a string */
+			cache_data = mmap(NULL, map_len, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE, fileno(fp), 0);
 #endif
 		}
 	} else {
@@ -668,107 +1369,118 @@ MsgCache *msgcache_read_cache(FolderItem *item, const gchar *cache_file)
 		int rem_len = map_len-ftell(fp);
 		char *walk_data = cache_data+ftell(fp);
 
+		/* Point the MsgInfo strings straight into the mapping,
+		 * which then lives as long as the cache's storage. */
+		if (MSGCACHE_KEEP_MAPPING && prefs_common.cache_mmap_strings &&
+		    str_term && conv == NULL) {
+			in_place = TRUE;
+			storage = msgcache_storage_new(0);
+			storage->map = cache_data;
+			storage->map_len = map_len;
+		} else
+			storage = msgcache_storage_new(map_len);
+		cache->storage = storage;
+
 		while(rem_len > 0) {
 			GET_CACHE_DATA_INT(num);
 			
-			msginfo = procmsg_msginfo_new();
+			msginfo = msgcache_storage_new_msginfo(storage);
 			msginfo->msgnum = num;
-			memusage += sizeof(MsgInfo);
 
 			GET_CACHE_DATA_INT(msginfo->size);
 			GET_CACHE_DATA_INT(msginfo->mtime);
 			GET_CACHE_DATA_INT(msginfo->date_t);
 			GET_CACHE_DATA_INT(msginfo->flags.tmp_flags);
 
-			GET_CACHE_DATA(msginfo->fromname, memusage);
+			GET_CACHE_DATA(msginfo->fromname, str_len);
 
-			GET_CACHE_DATA(msginfo->date, memusage);
-			GET_CACHE_DATA(msginfo->from, memusage);
-			GET_CACHE_DATA(msginfo->to, memusage);
-			GET_CACHE_DATA(msginfo->cc, memusage);
-			GET_CACHE_DATA(msginfo->newsgroups, memusage);
-			GET_CACHE_DATA(msginfo->subject, memusage);
-			GET_CACHE_DATA(msginfo->msgid, memusage);
-			GET_CACHE_DATA(msginfo->inreplyto, memusage);
-			GET_CACHE_DATA(msginfo->xref, memusage);
+			GET_CACHE_DATA(msginfo->date, str_len);
+			GET_CACHE_DATA(msginfo->from, str_len);
+			GET_CACHE_DATA(msginfo->to, str_len);
+			GET_CACHE_DATA(msginfo->cc, str_len);
+			GET_CACHE_DATA(msginfo->newsgroups, str_len);
+			GET_CACHE_DATA(msginfo->subject, str_len);
+			GET_CACHE_DATA(msginfo->msgid, str_len);
+			GET_CACHE_DATA(msginfo->inreplyto, str_len);
+			GET_CACHE_DATA(msginfo->xref, str_len);
 
 			GET_CACHE_DATA_INT(msginfo->planned_download);
 			GET_CACHE_DATA_INT(msginfo->total_size);
 			GET_CACHE_DATA_INT(refnum);
 
-			for (; refnum != 0; refnum--) {
+			for (last_ref = NULL; refnum != 0; refnum--) {
 				ref = NULL;
 
-				GET_CACHE_DATA(ref, memusage);
+				GET_CACHE_DATA(ref, str_len);
 
 				if (ref && *ref)
-					msginfo->references =
-						g_slist_prepend(msginfo->references, ref);
+					msgcache_storage_add_ref(storage, msginfo,
+								 &last_ref, ref);
 			}
-			if (msginfo->references)
-				msginfo->references =
-					g_slist_reverse(msginfo->references);
 
 			msginfo->folder = item;
 			msginfo->flags.tmp_flags |= tmp_flags;
 
+			memusage += procmsg_msginfo_memusage(msginfo);
+
 			g_hash_table_insert(cache->msgnum_table, &msginfo->msgnum, msginfo);
 			if(msginfo->msgid)
 				g_hash_table_insert(cache->msgid_table, msginfo->msgid, msginfo);
 		}
 	} else {
+		storage = msgcache_storage_new(MAX(map_len, 0));
+		cache->storage = storage;
+
 		while (fread(&num, sizeof(num), 1, fp) == 1) {
 			if (swapping)
 				num = bswap_32(num);
 
-			msginfo = procmsg_msginfo_new();
+			msginfo = msgcache_storage_new_msginfo(storage);
 			msginfo->msgnum = num;
-			memusage += sizeof(MsgInfo);
 
 			READ_CACHE_DATA_INT(msginfo->size, fp);
 			READ_CACHE_DATA_INT(msginfo->mtime, fp);
 			READ_CACHE_DATA_INT(msginfo->date_t, fp);
 			READ_CACHE_DATA_INT(msginfo->flags.tmp_flags, fp);
 
-			READ_CACHE_DATA(msginfo->fromname, fp, memusage);
+			READ_CACHE_DATA(msginfo->fromname, fp, str_len);
 
-			READ_CACHE_DATA(msginfo->date, fp, memusage);
-			READ_CACHE_DATA(msginfo->from, fp, memusage);
-			READ_CACHE_DATA(msginfo->to, fp, memusage);
-			READ_CACHE_DATA(msginfo->cc, fp, memusage);
-			READ_CACHE_DATA(msginfo->newsgroups, fp, memusage);
-			READ_CACHE_DATA(msginfo->subject, fp, memusage);
-			READ_CACHE_DATA(msginfo->msgid, fp, memusage);
-			READ_CACHE_DATA(msginfo->inreplyto, fp, memusage);
-			READ_CACHE_DATA(msginfo->xref, fp, memusage);
+			READ_CACHE_DATA(msginfo->date, fp, str_len);
+			READ_CACHE_DATA(msginfo->from, fp, str_len);
+			READ_CACHE_DATA(msginfo->to, fp, str_len);
+			READ_CACHE_DATA(msginfo->cc, fp, str_len);
+			READ_CACHE_DATA(msginfo->newsgroups, fp, str_len);
+			READ_CACHE_DATA(msginfo->subject, fp, str_len);
+			READ_CACHE_DATA(msginfo->msgid, fp, str_len);
+			READ_CACHE_DATA(msginfo->inreplyto, fp, str_len);
+			READ_CACHE_DATA(msginfo->xref, fp, str_len);
 
 			READ_CACHE_DATA_INT(msginfo->planned_download, fp);
 			READ_CACHE_DATA_INT(msginfo->total_size, fp);
 			READ_CACHE_DATA_INT(refnum, fp);
 
-			for (; refnum != 0; refnum--) {
+			for (last_ref = NULL; refnum != 0; refnum--) {
 				ref = NULL;
 
-				READ_CACHE_DATA(ref, fp, memusage);
+				READ_CACHE_DATA(ref, fp, str_len);
 
 				if (ref && *ref)
-					msginfo->references =
-						g_slist_prepend(msginfo->references, ref);
+					msgcache_storage_add_ref(storage, msginfo,
+								 &last_ref, ref);
 			}
-			if (msginfo->references)
-				msginfo->references =
-					g_slist_reverse(msginfo->references);
 
 			msginfo->folder = item;
 			msginfo->flags.tmp_flags |= tmp_flags;
 
+			memusage += procmsg_msginfo_memusage(msginfo);
+
 			g_hash_table_insert(cache->msgnum_table, &msginfo->msgnum, msginfo);
 			if(msginfo->msgid)
 				g_hash_table_insert(cache->msgid_table, msginfo->msgid, msginfo);
 		}
 	}
 bail_err:
-	if (cache_data != NULL && cache_data != MAP_FAILED) {
+	if (cache_data != NULL && cache_data != MAP_FAILED && !in_place) {
 #ifdef G_OS_WIN32
 		UnmapViewOfFile((void*) cache_data);
 #else
@@ -788,14 +1500,41 @@ bail_err:
 	}
 
 	cache->last_access = time(NULL);
-	cache->memusage = memusage;
+	/* arena and mapped strings are charged to the cache as a whole */
+	cache->memusage = memusage + storage->str_size + storage->map_len;
 
-	debug_print("done. (%d items read)\n", g_hash_table_size(cache->msgnum_table));
+	debug_print("done. (%d items read, %u bytes of strings)\n",
+		    g_hash_table_size(cache->msgnum_table), str_len);
 	debug_print("Cache size: %d messages, %u bytes\n", g_hash_table_size(cache->msgnum_table), cache->memusage);
 
 	return cache;
 }
 
+MsgCache *msgcache_read_cache(FolderItem *item, const gchar *cache_file)
+{
+	MsgTmpFlags tmp_flags = 0;
+
+	cm_return_val_if_fail(item != NULL, NULL);
+
+	if (folder_has_parent_of_type(item, F_QUEUE)) {
+		tmp_flags |= MSG_QUEUED;
+	} else if (folder_has_parent_of_type(item, F_DRAFT)) {
+		tmp_flags |= MSG_DRAFT;
+	}
+
+	return msgcache_read_cache_real(item, cache_file, tmp_flags);
+}
+
+/* Reads a cache without looking at its FolderItem, for readers off
+ * the main thread: the messages get their folder on msgcache_attach().
+ * tmp_flags are the flags msgcache_read_cache() would derive from the
+ * folder type. */
+MsgCache *msgcache_read_cache_detached(const gchar *cache_file,
+				       MsgTmpFlags tmp_flags)
+{
+	return msgcache_read_cache_real(NULL, cache_file, tmp_flags);
+}
+
 void msgcache_read_mark(MsgCache *cache, const gchar *mark_file)
 {
 	FILE *fp;
@@ -806,8 +1545,7 @@ void msgcache_read_mark(MsgCache *cache, const gchar *mark_file)
 	char *cache_data = NULL;
 	struct stat st;
 	gboolean error = FALSE;
-
-	swapping = TRUE;
+	gboolean swapping = TRUE;
 
 	/* In case we can't open the mark file with MARK_VERSION, check if we can open it with the
 	 * swapped MARK_VERSION. As msgcache_open_data_file swaps it too, if this succeeds, 
@@ -900,8 +1638,7 @@ void msgcache_read_tags(MsgCache *cache, const gchar *tags_file)
 	char *cache_data = NULL;
 	struct stat st;
 	gboolean error = FALSE;
-
-	swapping = TRUE;
+	gboolean swapping = TRUE;
 
 	/* In case we can't open the mark file with MARK_VERSION, check if we can open it with the
 	 * swapped MARK_VERSION. As msgcache_open_data_file swaps it too, if this succeeds, 
@@ -1003,37 +1740,187 @@ bail_err:
 	}
 }
 
-static int msgcache_write_cache(MsgInfo *msginfo, FILE *fp)
+void msgcache_read_journal(MsgCache *cache, const gchar *journal_file)
 {
-	MsgTmpFlags flags = msginfo->flags.tmp_flags & MSG_CACHED_FLAG_MASK;
-	GSList *cur;
-	int w_err = 0, wrote = 0;
+	FILE *fp;
+	MsgInfo *msginfo;
+	guint32 type, num, data;
+	gint id, count = 0;
+	GSList *tags;
+	gboolean error = FALSE;
 
-	WRITE_CACHE_DATA_INT(msginfo->msgnum, fp);
-	WRITE_CACHE_DATA_INT(msginfo->size, fp);
-	WRITE_CACHE_DATA_INT(msginfo->mtime, fp);
-	WRITE_CACHE_DATA_INT(msginfo->date_t, fp);
-	WRITE_CACHE_DATA_INT(flags, fp);
+	cm_return_if_fail(cache != NULL);
+
+	if ((fp = msgcache_open_data_file(journal_file, JOURNAL_VERSION,
+					  DATA_READ, NULL, 0)) == NULL)
+		return;
+
+	debug_print("replaying cache journal %s\n", journal_file);
+
+	/* A truncated record at the end (interrupted append) simply ends
+	 * the replay; everything before it is still valid. */
+	while (fread(&type, sizeof(type), 1, fp) == 1) {
+		type = bswap_32(type);
+		if (fread(&num, sizeof(num), 1, fp) != 1) {
+			error = TRUE;
+			break;
+		}
+		num = bswap_32(num);
+		msginfo = g_hash_table_lookup(cache->msgnum_table, &num);
+
+		if (type == JOURNAL_FLAGS) {
+			if (fread(&data, sizeof(data), 1, fp) != 1) {
+				error = TRUE;
+				break;
+			}
+			if (msginfo)
+				msginfo->flags.perm_flags = bswap_32(data);
+		} else if (type == JOURNAL_TAGS) {
+			tags = NULL;
+			do {
+				if (fread(&data, sizeof(data), 1, fp) != 1) {
+					error = TRUE;
+					break;
+				}
+				id = (gint)bswap_32(data);
+				if (id > 0)
+					tags = g_slist_prepend(tags,
+							GINT_TO_POINTER(id));
+			} while (id > 0);
+			if (error || msginfo == NULL) {
+				g_slist_free(tags);
+			} else {
+				g_slist_free(msginfo->tags);
+				msginfo->tags = g_slist_reverse(tags);
+			}
+			if (error)
+				break;
+		} else {
+			error = TRUE;
+			break;
+		}
+		count++;
+	}
+	fclose(fp);
 
-	WRITE_CACHE_DATA(msginfo->fromname, fp);
-
-	WRITE_CACHE_DATA(msginfo->date, fp);
-	WRITE_CACHE_DATA(msginfo->from, fp);
-	WRITE_CACHE_DATA(msginfo->to, fp);
-	WRITE_CACHE_DATA(msginfo->cc, fp);
-	WRITE_CACHE_DATA(msginfo->newsgroups, fp);
-	WRITE_CACHE_DATA(msginfo->subject, fp);
-	WRITE_CACHE_DATA(msginfo->msgid, fp);
-	WRITE_CACHE_DATA(msginfo->inreplyto, fp);
-	WRITE_CACHE_DATA(msginfo->xref, fp);
-	WRITE_CACHE_DATA_INT(msginfo->planned_download, fp);
-	WRITE_CACHE_DATA_INT(msginfo->total_size, fp);
-        
-	WRITE_CACHE_DATA_INT(g_slist_length(msginfo->references), fp);
+	if (error)
+		debug_print("cache journal %s truncated after %d records\n",
+			    journal_file, count);
+	else
+		debug_print("done. (%d journal records replayed)\n", count);
+}
+
+static void msgcache_put_int(GByteArray *array, guint32 n)
+{
+	guint8 data[4];
+
+	data[0] = n & 0x000000ff;
+	data[1] = (n & 0x0000ff00) >> 8;
+	data[2] = (n & 0x00ff0000) >> 16;
+	data[3] = (n & 0xff000000) >> 24;
+	g_byte_array_append(array, data, 4);
+}
+
+static guint32 msgcache_put_str(MsgCacheWriter *writer, const gchar *str)
+{
+	gpointer offset;
+
+	if (str == NULL || *str == '\0')
+		return 0;
+
+	if ((offset = g_hash_table_lookup(writer->offsets, str)) == NULL) {
+		offset = GUINT_TO_POINTER(writer->heap->len);
+		g_byte_array_append(writer->heap, (const guint8 *)str,
+				    strlen(str) + 1);
+		g_hash_table_insert(writer->offsets, (gpointer)str, offset);
+	}
+
+	return GPOINTER_TO_UINT(offset);
+}
+
+static MsgCacheWriter *msgcache_writer_new(void)
+{
+	MsgCacheWriter *writer;
+
+	writer = g_new0(MsgCacheWriter, 1);
+	writer->records = g_byte_array_new();
+	writer->refs = g_byte_array_new();
+	writer->heap = g_byte_array_new();
+	writer->offsets = g_hash_table_new(g_str_hash, g_str_equal);
+	/* offset 0 is the empty string, standing for NULL */
+	g_byte_array_append(writer->heap, (const guint8 *)"", 1);
+
+	return writer;
+}
+
+static void msgcache_writer_free(MsgCacheWriter *writer)
+{
+	g_byte_array_free(writer->records, TRUE);
+	g_byte_array_free(writer->refs, TRUE);
+	g_byte_array_free(writer->heap, TRUE);
+	g_hash_table_destroy(writer->offsets);
+	g_free(writer);
+}
+
+static void msgcache_write_cache(MsgInfo *msginfo, MsgCacheWriter *writer)
+{
+	MsgTmpFlags flags = msginfo->flags.tmp_flags & MSG_CACHED_FLAG_MASK;
+	GByteArray *rec = writer->records;
+	GSList *cur;
+	guint refnum = 0;
+
+	msgcache_put_int(rec, msginfo->msgnum);
+	msgcache_put_int(rec, msginfo->size);
+	msgcache_put_int(rec, msginfo->mtime);
+	msgcache_put_int(rec, msginfo->date_t);
+	msgcache_put_int(rec, flags);
+	msgcache_put_int(rec, msginfo->planned_download);
+	msgcache_put_int(rec, msginfo->total_size);
+
+	msgcache_put_int(rec, msgcache_put_str(writer, msginfo->fromname));
+	msgcache_put_int(rec, msgcache_put_str(writer, msginfo->date));
+	msgcache_put_int(rec, msgcache_put_str(writer, msginfo->from));
+	msgcache_put_int(rec, msgcache_put_str(writer, msginfo->to));
+	msgcache_put_int(rec, msgcache_put_str(writer, msginfo->cc));
+	msgcache_put_int(rec, msgcache_put_str(writer, msginfo->newsgroups));
+	msgcache_put_int(rec, msgcache_put_str(writer, msginfo->subject));
+	msgcache_put_int(rec, msgcache_put_str(writer, msginfo->msgid));
+	msgcache_put_int(rec, msgcache_put_str(writer, msginfo->inreplyto));
+	msgcache_put_int(rec, msgcache_put_str(writer, msginfo->xref));
 
 	for (cur = msginfo->references; cur != NULL; cur = cur->next) {
-		WRITE_CACHE_DATA((gchar *)cur->data, fp);
+		msgcache_put_int(writer->refs,
+				 msgcache_put_str(writer, (gchar *)cur->data));
+		refnum++;
 	}
+	msgcache_put_int(rec, writer->nrefs);
+	msgcache_put_int(rec, refnum);
+
+	writer->nrefs += refnum;
+	writer->count++;
+}
+
+/* Writes everything collected by msgcache_write_cache() after the
+ * header of a CACHE_VERSION file. */
+static int msgcache_write_columns(MsgCacheWriter *writer, FILE *fp)
+{
+	int w_err = 0, wrote = 0;
+
+	WRITE_CACHE_DATA_INT(writer->count, fp);
+	WRITE_CACHE_DATA_INT(writer->nrefs, fp);
+	WRITE_CACHE_DATA_INT(writer->heap->len, fp);
+
+	if (w_err == 0 && writer->records->len > 0 &&
+	    SC_FWRITE(writer->records->data, writer->records->len, 1, fp) != 1)
+		w_err = 1;
+	if (w_err == 0 && writer->refs->len > 0 &&
+	    SC_FWRITE(writer->refs->data, writer->refs->len, 1, fp) != 1)
+		w_err = 1;
+	if (w_err == 0 &&
+	    SC_FWRITE(writer->heap->data, writer->heap->len, 1, fp) != 1)
+		w_err = 1;
+	wrote += writer->records->len + writer->refs->len + writer->heap->len;
+
 	return w_err ? -1 : wrote;
 }
 
@@ -1063,11 +1950,88 @@ static int msgcache_write_tags(MsgInfo *msginfo, FILE *fp)
 	return w_err ? -1 : wrote;
 }
 
+static int msgcache_write_journal_records(GHashTable *table, MsgCache *cache,
+					  JournalRecordType type, FILE *fp)
+{
+	GHashTableIter iter;
+	gpointer key;
+	MsgInfo *msginfo;
+	guint num;
+	int w_err = 0, wrote = 0, tmp;
+
+	g_hash_table_iter_init(&iter, table);
+	while (w_err == 0 && g_hash_table_iter_next(&iter, &key, NULL)) {
+		num = GPOINTER_TO_UINT(key);
+		msginfo = g_hash_table_lookup(cache->msgnum_table, &num);
+		if (msginfo == NULL)
+			continue;
+
+		WRITE_CACHE_DATA_INT(type, fp);
+		if (type == JOURNAL_FLAGS)
+			tmp = msgcache_write_flags(msginfo, fp);
+		else
+			tmp = msgcache_write_tags(msginfo, fp);
+		if (tmp < 0)
+			w_err = 1;
+		else
+			wrote += tmp;
+	}
+
+	return w_err ? -1 : wrote;
+}
+
+/* Appends the pending flag and tag changes to the journal file instead of
+ * rewriting the mark and tags files. Returns the resulting size of the
+ * journal, or -1 on error. */
+gint msgcache_write_journal(const gchar *journal_file, MsgCache *cache)
+{
+	FILE *fp;
+	gint error = 0;
+
+	START_TIMING("");
+	cm_return_val_if_fail(journal_file != NULL, -1);
+	cm_return_val_if_fail(cache != NULL, -1);
+
+	fp = msgcache_open_data_file(journal_file, JOURNAL_VERSION,
+				     DATA_APPEND, NULL, 0);
+	if (fp == NULL)
+		return -1;
+
+	debug_print("\tAppending %d flag and %d tag changes to %s...\n",
+		    g_hash_table_size(cache->journal_flags),
+		    g_hash_table_size(cache->journal_tags), journal_file);
+
+	if (msgcache_write_journal_records(cache->journal_flags, cache,
+					   JOURNAL_FLAGS, fp) < 0)
+		error = 1;
+	if (!error && msgcache_write_journal_records(cache->journal_tags, cache,
+						     JOURNAL_TAGS, fp) < 0)
+		error = 1;
+
+	error |= (fflush(fp) != 0);
+	if (prefs_common.flush_metadata)
+		error |= (fsync(fileno(fp)) != 0);
+	error |= (fclose(fp) != 0);
+
+	if (error != 0) {
+		g_warning("failed to append to cache journal %s", journal_file);
+		return -1;
+	}
+
+	g_hash_table_remove_all(cache->journal_flags);
+	g_hash_table_remove_all(cache->journal_tags);
+	msgcache_touch(cache);
+
+	END_TIMING();
+	return (gint)get_file_size(journal_file);
+}
+
 struct write_fps
 {
 	FILE *cache_fp;
 	FILE *mark_fp;
 	FILE *tags_fp;
+	MsgCacheWriter *cache_writer;
 	int error;
 	guint cache_size;
 	guint mark_size;
@@ -1083,13 +2047,8 @@ static void msgcache_write_func(gpointer key, gpointer value, gpointer user_data
 	msginfo = (MsgInfo *)value;
 	write_fps = user_data;
 
-	if (write_fps->cache_fp) {
-		tmp = msgcache_write_cache(msginfo, write_fps->cache_fp);
-		if (tmp < 0)
-			write_fps->error = 1;
-		else
-			write_fps->cache_size += tmp;
-	}
+	if (write_fps->cache_writer)
+		msgcache_write_cache(msginfo, write_fps->cache_writer);
 	if (write_fps->mark_fp) {
 	tmp= msgcache_write_flags(msginfo, write_fps->mark_fp);
 		if (tmp < 0)
@@ -1106,7 +2065,8 @@ static void msgcache_write_func(gpointer key, gpointer value, gpointer user_data
 	}
 }
 
-gint msgcache_write(const gchar *cache_file, const gchar *mark_file, const gchar *tags_file, MsgCache *cache)
+gint msgcache_write(const gchar *cache_file, const gchar *mark_file, const gchar *tags_file,
+		    const gchar *journal_file, MsgCache *cache)
 {
 	struct write_fps write_fps;
 	gchar *new_cache, *new_mark, *new_tags;
@@ -1208,8 +2168,19 @@ gint msgcache_write(const gchar *cache_file, const gchar *mark_file, const gchar
 	if (write_fps.tags_fp)
 		flockfile(write_fps.tags_fp);
 #endif
-	/* write data to the files */
+	/* write data to the files; the cache file is written in one
+	 * go once all records and strings are known */
+	write_fps.cache_writer = write_fps.cache_fp ? msgcache_writer_new() : NULL;
 	g_hash_table_foreach(cache->msgnum_table, msgcache_write_func, (gpointer)&write_fps);
+	if (write_fps.cache_writer) {
+		gint tmp = msgcache_write_columns(write_fps.cache_writer,
+						  write_fps.cache_fp);
+		if (tmp < 0)
+			write_fps.error = 1;
+		else
+			write_fps.cache_size += tmp;
+		msgcache_writer_free(write_fps.cache_writer);
+	}
 #ifdef HAVE_FWRITE_UNLOCKED
 	/* unlock files */
 	if (write_fps.cache_fp)
@@ -1261,7 +2232,17 @@ gint msgcache_write(const gchar *cache_file, const gchar *mark_file, const gchar
 			move_file(new_mark, mark_file, TRUE);
 		if (tags_file)
 			move_file(new_tags, tags_file, TRUE);
-		cache->last_access = time(NULL);
+		/* the journal is folded into the new files; it only goes once
+		 * they are in place, so that a crash in between replays its
+		 * records, which hold whole flag and tag states, rather than
+		 * losing them */
+		if (journal_file)
+			claws_unlink(journal_file);
+		if (mark_file)
+			g_hash_table_remove_all(cache->journal_flags);
+		if (tags_file)
+			g_hash_table_remove_all(cache->journal_tags);
+		msgcache_touch(cache);
 	}
 
 	g_free(new_cache);
@@ -35,14 +35,28 @@ MsgCache   	*msgcache_new				(void);
 void	   	 msgcache_destroy			(MsgCache *cache);
 MsgCache   	*msgcache_read_cache			(FolderItem *item,
 							 const gchar *cache_file);
+MsgCache   	*msgcache_read_cache_detached		(const gchar *cache_file,
+							 MsgTmpFlags tmp_flags);
 void	   	 msgcache_read_mark			(MsgCache *cache,
 							 const gchar *mark_file);
 void	   	 msgcache_read_tags			(MsgCache *cache,
 							 const gchar *tags_file);
+void	   	 msgcache_read_journal			(MsgCache *cache,
+							 const gchar *journal_file);
 gint	   	 msgcache_write				(const gchar *cache_file,
 							 const gchar *mark_file,
 							 const gchar *tags_file,
+							 const gchar *journal_file,
 							 MsgCache *cache);
+gint	   	 msgcache_write_journal			(const gchar *journal_file,
+							 MsgCache *cache);
+void	   	 msgcache_journal_flags			(MsgCache *cache,
+							 guint num);
+void	   	 msgcache_journal_tags			(MsgCache *cache,
+							 guint num);
+gboolean   	 msgcache_can_journal			(MsgCache *cache,
+							 gboolean flags,
+							 gboolean tags);
 void 	   	 msgcache_add_msg			(MsgCache *cache,
 							 MsgInfo *msginfo);
 void 	   	 msgcache_remove_msg			(MsgCache *cache,
@@ -54,7 +68,18 @@ MsgInfo	   	*msgcache_get_msg			(MsgCache *cache,
 MsgInfo	   	*msgcache_get_msg_by_id			(MsgCache *cache,
 							 const gchar *msgid);
 MsgInfoList	*msgcache_get_msg_list			(MsgCache *cache);
+GArray		*msgcache_get_msgnum_array		(MsgCache *cache);
 time_t	   	 msgcache_get_last_access_time		(MsgCache *cache);
 gint	   	 msgcache_get_memory_usage		(MsgCache *cache);
+void		 msgcache_attach			(MsgCache *cache,
+							 FolderItem *item);
+FolderItem	*msgcache_get_item			(MsgCache *cache);
+MsgCache	*msgcache_get_lru_next			(MsgCache *cache);
+guint		 msgcache_get_total_memory_usage	(void);
+
+MsgCacheStorage	*msgcache_storage_ref			(MsgCacheStorage *storage);
+void		 msgcache_storage_unref			(MsgCacheStorage *storage);
+gboolean	 msgcache_storage_owns			(MsgCacheStorage *storage,
+							 gconstpointer ptr);
 
 #endif
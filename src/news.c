@@ -162,6 +162,7 @@ FolderClass *news_get_class(void)
 		news_class.idstr = "news";
 		news_class.uistr = "News";
 		news_class.supports_server_search = FALSE;
+		news_class.increasing_msgnums = TRUE;
 
 		/* Folder functions */
 		news_class.new_folder = news_folder_new;
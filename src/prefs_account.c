@@ -155,6 +155,8 @@ typedef struct ReceivePage
 	GtkWidget *imapdir_entry;
 	GtkWidget *subsonly_checkbtn;
 	GtkWidget *low_bandwidth_checkbtn;
+	GtkWidget *compress_checkbtn;
+	GtkWidget *max_connections_spinbtn;
 
 	GtkWidget *frame_maxarticle;
 	GtkWidget *maxarticle_label;
@@ -504,6 +506,14 @@ static PrefParam receive_param[] = {
 	 &receive_page.low_bandwidth_checkbtn,
 	 prefs_set_data_from_toggle, prefs_set_toggle},
 
+	{"imap_use_compress", "TRUE", &tmp_ac_prefs.imap_use_compress, P_BOOL,
+	 &receive_page.compress_checkbtn,
+	 prefs_set_data_from_toggle, prefs_set_toggle},
+
+	{"imap_max_connections", "2", &tmp_ac_prefs.imap_max_connections, P_INT,
+	 &receive_page.max_connections_spinbtn,
+	 prefs_set_data_from_spinbtn, prefs_set_spinbtn},
+
 	{NULL, NULL, NULL, P_OTHER, NULL, NULL, NULL}
 };
 
@@ -1402,6 +1412,10 @@ static void receive_create_widget_func(PrefsPage * _page,
 	GtkWidget *imapdir_entry;
 	GtkWidget *subsonly_checkbtn;
 	GtkWidget *low_bandwidth_checkbtn;
+	GtkWidget *compress_checkbtn;
+	GtkWidget *max_connections_label;
+	GtkWidget *max_connections_spinbtn;
+	GtkAdjustment *max_connections_spinbtn_adj;
 	GtkWidget *local_frame;
 	GtkWidget *local_vbox;
 	GtkWidget *local_hbox;
@@ -1627,6 +1641,33 @@ static void receive_create_widget_func(PrefsPage * _page,
 	gtk_widget_show (hbox1);
 	gtk_box_pack_start (GTK_BOX (vbox2), hbox1, FALSE, FALSE, 4);
 
+	PACK_CHECK_BUTTON (hbox1, compress_checkbtn,
+			   _("Compress the connection if the server supports it"));
+	CLAWS_SET_TIP(compress_checkbtn,
+			     _("Uses COMPRESS=DEFLATE, which greatly reduces the traffic on slow links at some CPU cost."));
+
+	hbox1 = gtk_hbox_new (FALSE, 8);
+	gtk_widget_show (hbox1);
+	gtk_box_pack_start (GTK_BOX (vbox2), hbox1, FALSE, FALSE, 4);
+
+	max_connections_label = gtk_label_new
+		(_("Maximum number of connections"));
+	gtk_widget_show (max_connections_label);
+	gtk_box_pack_start (GTK_BOX (hbox1), max_connections_label, FALSE, FALSE, 0);
+
+	max_connections_spinbtn_adj =
+		GTK_ADJUSTMENT(gtk_adjustment_new (2, 1, 8, 1, 1, 0));
+	max_connections_spinbtn = gtk_spin_button_new
+		(GTK_ADJUSTMENT (max_connections_spinbtn_adj), 1, 0);
+	gtk_widget_show (max_connections_spinbtn);
+	CLAWS_SET_TIP(max_connections_spinbtn,
+			     _("Extra connections are only opened to display a message while the first one is busy"));
+	gtk_box_pack_start (GTK_BOX (hbox1), max_connections_spinbtn,
+			    FALSE, FALSE, 0);
+	gtk_widget_set_size_request (max_connections_spinbtn, 64, -1);
+	gtk_spin_button_set_numeric
+		(GTK_SPIN_BUTTON (max_connections_spinbtn), TRUE);
+
 	PACK_CHECK_BUTTON (vbox1, filter_on_recv_checkbtn,
 			   _("Filter messages on receiving"));
 
@@ -1661,6 +1702,8 @@ static void receive_create_widget_func(PrefsPage * _page,
 	page->imapdir_entry		= imapdir_entry;
 	page->subsonly_checkbtn		= subsonly_checkbtn;
 	page->low_bandwidth_checkbtn	= low_bandwidth_checkbtn;
+	page->compress_checkbtn		= compress_checkbtn;
+	page->max_connections_spinbtn	= max_connections_spinbtn;
 	page->local_frame		= local_frame;
 	page->local_inbox_label	= local_inbox_label;
 	page->local_inbox_entry	= local_inbox_entry;
@@ -4407,6 +4450,7 @@ static void prefs_account_protocol_changed(GtkComboBox *combobox, gpointer data)
 		gtk_widget_hide(receive_page.imapdir_entry);
 		gtk_widget_hide(receive_page.subsonly_checkbtn);
 		gtk_widget_hide(receive_page.low_bandwidth_checkbtn);
+		gtk_widget_hide(receive_page.compress_checkbtn);
 		break;
 	case A_LOCAL:
 		gtk_widget_show(send_page.msgid_checkbtn);
@@ -4504,6 +4548,7 @@ static void prefs_account_protocol_changed(GtkComboBox *combobox, gpointer data)
 		gtk_widget_hide(receive_page.imapdir_entry);
 		gtk_widget_hide(receive_page.subsonly_checkbtn);
 		gtk_widget_hide(receive_page.low_bandwidth_checkbtn);
+		gtk_widget_hide(receive_page.compress_checkbtn);
 		break;
 	case A_IMAP4:
 #ifndef HAVE_LIBETPAN
@@ -4610,6 +4655,7 @@ static void prefs_account_protocol_changed(GtkComboBox *combobox, gpointer data)
 		gtk_widget_show(receive_page.imapdir_entry);
 		gtk_widget_show(receive_page.subsonly_checkbtn);
 		gtk_widget_show(receive_page.low_bandwidth_checkbtn);
+		gtk_widget_show(receive_page.compress_checkbtn);
 		break;
 	case A_NONE:
 		gtk_widget_show(send_page.msgid_checkbtn);
@@ -4705,6 +4751,7 @@ static void prefs_account_protocol_changed(GtkComboBox *combobox, gpointer data)
 		gtk_widget_hide(receive_page.imapdir_entry);
 		gtk_widget_hide(receive_page.subsonly_checkbtn);
 		gtk_widget_hide(receive_page.low_bandwidth_checkbtn);
+		gtk_widget_hide(receive_page.compress_checkbtn);
 		break;
 	case A_POP3:
 		/* continue to default: */
@@ -4807,6 +4854,7 @@ static void prefs_account_protocol_changed(GtkComboBox *combobox, gpointer data)
 		gtk_widget_hide(receive_page.imapdir_entry);
 		gtk_widget_hide(receive_page.subsonly_checkbtn);
 		gtk_widget_hide(receive_page.low_bandwidth_checkbtn);
+		gtk_widget_hide(receive_page.compress_checkbtn);
 		break;
 	}
 
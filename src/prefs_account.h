@@ -191,6 +191,8 @@ struct _PrefsAccount
 	gchar *imap_dir;
 	gboolean imap_subsonly;
 	gboolean low_bandwidth;
+	gboolean imap_use_compress;
+	gint imap_max_connections;
 
 	gboolean set_sent_folder;
 	gchar *sent_folder;
@@ -1100,6 +1100,28 @@ static PrefParam param[] = {
 	{"cache_min_keep_time", "0", &prefs_common.cache_min_keep_time, P_INT,
 	 NULL, NULL, NULL},
 #endif
+	{"cache_journal_max_size", "256", &prefs_common.cache_journal_max_size, P_INT,
+	 NULL, NULL, NULL},
+	{"cache_mmap_strings", "TRUE", &prefs_common.cache_mmap_strings, P_BOOL,
+	 NULL, NULL, NULL},
+	{"cache_read_threads", "4", &prefs_common.cache_read_threads, P_INT,
+	 NULL, NULL, NULL},
+	{"scan_threads", "4", &prefs_common.scan_threads, P_INT,
+	 NULL, NULL, NULL},
+	{"watch_mh_folders", "TRUE", &prefs_common.watch_mh_folders, P_BOOL,
+	 NULL, NULL, NULL},
+	{"imap_use_idle", "TRUE", &prefs_common.imap_use_idle, P_BOOL,
+	 NULL, NULL, NULL},
+	{"imap_partial_fetch_size", "0", &prefs_common.imap_partial_fetch_size, P_INT,
+	 NULL, NULL, NULL},
+	{"imap_cache_pack", "FALSE", &prefs_common.imap_cache_pack, P_BOOL,
+	 NULL, NULL, NULL},
+	{"imap_store_delay", "500", &prefs_common.imap_store_delay, P_INT,
+	 NULL, NULL, NULL},
+	{"imap_cache_max_size", "0", &prefs_common.imap_cache_max_size, P_INT,
+	 NULL, NULL, NULL},
+	{"imap_server_sort_min", "0", &prefs_common.imap_server_sort_min, P_INT,
+	 NULL, NULL, NULL},
 	{"thread_by_subject_max_age", "10", &prefs_common.thread_by_subject_max_age,
 	P_INT, NULL, NULL, NULL },
 	{"last_opened_folder", "", &prefs_common.last_opened_folder,
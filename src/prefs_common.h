@@ -430,6 +430,17 @@ struct _PrefsCommon
 	/* Memory cache*/
 	gint cache_max_mem_usage;
 	gint cache_min_keep_time;
+	gint cache_journal_max_size;
+	gboolean cache_mmap_strings;
+	gint cache_read_threads;
+	gint scan_threads;
+	gboolean watch_mh_folders;
+	gboolean imap_use_idle;
+	gint imap_partial_fetch_size; /* KB, 0 (default) to always fetch whole */
+	gboolean imap_cache_pack; /* keep cached bodies in a pack file */
+	gint imap_store_delay; /* ms to gather flag changes, 0 to send at once */
+	gint imap_cache_max_size; /* MB of cached bodies to keep, 0 for no limit */
+	gint imap_server_sort_min; /* messages from which the server sorts, 0 never */
 	
 	/* boolean for work offline 
 	   stored here for use in inc.c */
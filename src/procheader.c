@@ -749,6 +749,8 @@ static MsgInfo *parse_stream(void *data, gboolean isstring, MsgFlags flags,
 		msginfo->inreplyto =
 			g_strdup((gchar *)msginfo->references->data);
 
+	procmsg_msginfo_intern_strings(msginfo);
+
 	return msginfo;
 }
 
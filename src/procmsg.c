@@ -49,6 +49,7 @@
 #include "timing.h"
 #include "inc.h"
 #include "privacy.h"
+#include "stringtable.h"
 
 extern SessionStats session_stats;
 
@@ -1182,6 +1183,80 @@ gint procmsg_save_to_outbox(FolderItem *outbox, const gchar *file,
 }
 
 
+/* Addresses and message-ids referenced by threads repeat over and over
+ * across folders, so MsgInfos read from caches or headers share them
+ * through this table. Headers may be parsed from other threads. */
+static StringTable *msginfo_strings = NULL;
+G_LOCK_DEFINE_STATIC(msginfo_strings);
+
+static gchar *procmsg_msginfo_intern_take(gchar *str)
+{
+	gchar *interned;
+
+	if (str == NULL)
+		return NULL;
+
+	G_LOCK(msginfo_strings);
+	if (msginfo_strings == NULL)
+		msginfo_strings = string_table_new();
+	if (string_table_owns_string(msginfo_strings, str)) {
+		G_UNLOCK(msginfo_strings);
+		return str;
+	}
+	interned = string_table_insert_string(msginfo_strings, str);
+	G_UNLOCK(msginfo_strings);
+
+	g_free(str);
+	return interned;
+}
+
+static gboolean procmsg_msginfo_string_is_interned(const gchar *str)
+{
+	gboolean interned;
+
+	G_LOCK(msginfo_strings);
+	interned = msginfo_strings != NULL &&
+		   string_table_owns_string(msginfo_strings, str);
+	G_UNLOCK(msginfo_strings);
+
+	return interned;
+}
+
+static gboolean procmsg_msginfo_release_string(const gchar *str)
+{
+	gboolean interned = FALSE;
+
+	G_LOCK(msginfo_strings);
+	if (msginfo_strings != NULL &&
+	    string_table_owns_string(msginfo_strings, str)) {
+		string_table_free_string(msginfo_strings, str);
+		interned = TRUE;
+	}
+	G_UNLOCK(msginfo_strings);
+
+	return interned;
+}
+
+void procmsg_msginfo_intern_strings(MsgInfo *msginfo)
+{
+	GSList *cur;
+
+	cm_return_if_fail(msginfo != NULL);
+
+	/* already shared through the cache file mapping */
+	if (msginfo->storage != NULL)
+		return;
+
+	msginfo->fromname = procmsg_msginfo_intern_take(msginfo->fromname);
+	msginfo->from = procmsg_msginfo_intern_take(msginfo->from);
+	msginfo->to = procmsg_msginfo_intern_take(msginfo->to);
+	msginfo->cc = procmsg_msginfo_intern_take(msginfo->cc);
+	msginfo->newsgroups = procmsg_msginfo_intern_take(msginfo->newsgroups);
+	msginfo->inreplyto = procmsg_msginfo_intern_take(msginfo->inreplyto);
+	for (cur = msginfo->references; cur != NULL; cur = cur->next)
+		cur->data = procmsg_msginfo_intern_take(cur->data);
+}
+
 MsgInfo *procmsg_msginfo_new_ref(MsgInfo *msginfo)
 {
 	msginfo->refcnt++;
@@ -1373,9 +1448,21 @@ MsgInfo *procmsg_msginfo_get_full_info(MsgInfo *msginfo)
 }
 
 #define FREENULL(n) { g_free(n); n = NULL; }
+#define FREESTR(n) { \
+	if (!msgcache_storage_owns(msginfo->storage, n)) \
+		g_free(n); \
+	n = NULL; \
+}
+#define FREEISTR(n) { \
+	if (n != NULL && !msgcache_storage_owns(msginfo->storage, n) && \
+	    !procmsg_msginfo_release_string(n)) \
+		g_free(n); \
+	n = NULL; \
+}
 void procmsg_msginfo_free(MsgInfo **msginfo_ptr)
 {
 	MsgInfo *msginfo = *msginfo_ptr;
+	GSList *cur;
 
 	if (msginfo == NULL) return;
 
@@ -1390,17 +1477,17 @@ void procmsg_msginfo_free(MsgInfo **msginfo_ptr)
 
 	FREENULL(msginfo->fromspace);
 
-	FREENULL(msginfo->fromname);
+	FREEISTR(msginfo->fromname);
 
-	FREENULL(msginfo->date);
-	FREENULL(msginfo->from);
-	FREENULL(msginfo->to);
-	FREENULL(msginfo->cc);
-	FREENULL(msginfo->newsgroups);
-	FREENULL(msginfo->subject);
-	FREENULL(msginfo->msgid);
-	FREENULL(msginfo->inreplyto);
-	FREENULL(msginfo->xref);
+	FREESTR(msginfo->date);
+	FREEISTR(msginfo->from);
+	FREEISTR(msginfo->to);
+	FREEISTR(msginfo->cc);
+	FREEISTR(msginfo->newsgroups);
+	FREESTR(msginfo->subject);
+	FREESTR(msginfo->msgid);
+	FREEISTR(msginfo->inreplyto);
+	FREESTR(msginfo->xref);
 
 	if (msginfo->extradata) {
 		if (msginfo->extradata->avatars) {
@@ -1424,46 +1511,64 @@ void procmsg_msginfo_free(MsgInfo **msginfo_ptr)
 		FREENULL(msginfo->extradata->resent_from);
 		FREENULL(msginfo->extradata);
 	}
-	slist_free_strings_full(msginfo->references);
+	/* list nodes carved out of the cache's arena go away with it */
+	if (!msgcache_storage_owns(msginfo->storage, msginfo->references)) {
+		for (cur = msginfo->references; cur != NULL; cur = cur->next)
+			FREEISTR(cur->data);
+		g_slist_free(msginfo->references);
+	}
 	msginfo->references = NULL;
 	g_slist_free(msginfo->tags);
 	msginfo->tags = NULL;
 
 	FREENULL(msginfo->plaintext_file);
 
-	g_free(msginfo);
 	*msginfo_ptr = NULL;
+
+	/* so does the MsgInfo itself, if the cache allocated it */
+	if (msginfo->storage != NULL) {
+		msgcache_storage_unref(msginfo->storage);
+		return;
+	}
+
+	g_free(msginfo);
 }
+#undef FREEISTR
+#undef FREESTR
 #undef FREENULL
 
+/* Strings shared with other MsgInfos (interned) or owned by the cache
+ * they were read from (file mapping, arena) are not charged to the
+ * individual message. */
+static guint procmsg_msginfo_strlen(MsgInfo *msginfo, const gchar *str,
+				    gboolean internable)
+{
+	if (str == NULL || msgcache_storage_owns(msginfo->storage, str))
+		return 0;
+	if (internable && procmsg_msginfo_string_is_interned(str))
+		return 0;
+	return strlen(str);
+}
+
 guint procmsg_msginfo_memusage(MsgInfo *msginfo)
 {
 	guint memusage = 0;
 	GSList *tmp;
 	
 	memusage += sizeof(MsgInfo);
-	if (msginfo->fromname)
-		memusage += strlen(msginfo->fromname);
-	if (msginfo->date)
-		memusage += strlen(msginfo->date);
-	if (msginfo->from)
-		memusage += strlen(msginfo->from);
-	if (msginfo->to)
-		memusage += strlen(msginfo->to);
-	if (msginfo->cc)
-		memusage += strlen(msginfo->cc);
-	if (msginfo->newsgroups)
-		memusage += strlen(msginfo->newsgroups);
-	if (msginfo->subject)
-		memusage += strlen(msginfo->subject);
-	if (msginfo->msgid)
-		memusage += strlen(msginfo->msgid);
-	if (msginfo->inreplyto)
-		memusage += strlen(msginfo->inreplyto);
+	memusage += procmsg_msginfo_strlen(msginfo, msginfo->fromname, TRUE);
+	memusage += procmsg_msginfo_strlen(msginfo, msginfo->date, FALSE);
+	memusage += procmsg_msginfo_strlen(msginfo, msginfo->from, TRUE);
+	memusage += procmsg_msginfo_strlen(msginfo, msginfo->to, TRUE);
+	memusage += procmsg_msginfo_strlen(msginfo, msginfo->cc, TRUE);
+	memusage += procmsg_msginfo_strlen(msginfo, msginfo->newsgroups, TRUE);
+	memusage += procmsg_msginfo_strlen(msginfo, msginfo->subject, FALSE);
+	memusage += procmsg_msginfo_strlen(msginfo, msginfo->msgid, FALSE);
+	memusage += procmsg_msginfo_strlen(msginfo, msginfo->inreplyto, TRUE);
 
 	for (tmp = msginfo->references; tmp; tmp=tmp->next) {
 		gchar *r = (gchar *)tmp->data;
-		memusage += r?strlen(r):0 + sizeof(GSList);
+		memusage += procmsg_msginfo_strlen(msginfo, r, TRUE) + sizeof(GSList);
 	}
 	if (msginfo->fromspace)
 		memusage += strlen(msginfo->fromspace);
@@ -234,6 +234,11 @@ struct _MsgInfo
 	GSList *tags;
 
 	MsgInfoExtraData *extradata;
+
+	/* set when the MsgInfo was read from the cache: the struct and
+	 * its header strings then live in the cache's arena or file
+	 * mapping instead of being allocated one by one */
+	MsgCacheStorage *storage;
 };
 
 struct _MsgInfoExtraData
@@ -344,6 +349,7 @@ MsgInfo *procmsg_msginfo_get_full_info_from_file
 					const gchar *file);
 void	 procmsg_msginfo_free		(MsgInfo	**msginfo);
 guint	 procmsg_msginfo_memusage	(MsgInfo	*msginfo);
+void	 procmsg_msginfo_intern_strings	(MsgInfo	*msginfo);
 
 gint procmsg_send_message_queue_with_lock(const gchar *file,
 					  gchar **errstr,
@@ -49,6 +49,9 @@ typedef struct _MsgInfoExtraData	MsgInfoExtraData;
 struct _MsgInfoAvatar;
 typedef struct _MsgInfoAvatar		MsgInfoAvatar;
 
+struct _MsgCacheStorage;
+typedef struct _MsgCacheStorage		MsgCacheStorage;
+
 typedef GSList MsgInfoList;
 typedef GSList MsgNumberList;
 
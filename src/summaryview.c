@@ -388,6 +388,9 @@ static gint summary_cmp_by_locked	(GtkCMCList 		*clist,
 static gint summary_cmp_by_tags		(GtkCMCList 		*clist,
 				         gconstpointer 		 ptr1, 
 					 gconstpointer 		 ptr2);
+static gint summary_cmp_by_server_order	(GtkCMCList		*clist,
+					 gconstpointer		 ptr1,
+					 gconstpointer		 ptr2);
 
 static void quicksearch_execute_cb	(QuickSearch    *quicksearch,
 					 gpointer	 data);
@@ -1631,6 +1634,10 @@ void summary_clear_list(SummaryView *summaryview)
 		g_hash_table_destroy(summaryview->subject_table);
 		summaryview->subject_table = NULL;
 	}
+	if (summaryview->server_order) {
+		g_hash_table_destroy(summaryview->server_order);
+		summaryview->server_order = NULL;
+	}
 	summaryview->mlist = NULL;
 
 	gtk_cmclist_clear(clist);
@@ -2913,6 +2920,39 @@ void summary_reflect_prefs(void)
 		summary_show(summaryview, summaryview->folder_item);
 }
 
+/* Asks the folder for the order of its messages by sort_key, keeping
+ * each message's position in summaryview->server_order. */
+static gboolean summary_get_server_order(SummaryView *summaryview,
+					 FolderSortKey sort_key)
+{
+	FolderItem *item = summaryview->folder_item;
+	GSList *order, *cur;
+	guint pos = 0;
+
+	if (summaryview->server_order) {
+		g_hash_table_destroy(summaryview->server_order);
+		summaryview->server_order = NULL;
+	}
+
+	if (!item || !item->folder->klass->get_sort_order)
+		return FALSE;
+	/* the server knows nothing of the subject simplification */
+	if (sort_key == SORT_BY_SUBJECT && summaryview->simplify_subject_preg)
+		return FALSE;
+
+	order = item->folder->klass->get_sort_order(item->folder, item, sort_key);
+	if (!order)
+		return FALSE;
+
+	summaryview->server_order = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (cur = order; cur != NULL; cur = cur->next)
+		g_hash_table_insert(summaryview->server_order, cur->data,
+				    GUINT_TO_POINTER(++pos));
+	g_slist_free(order);
+
+	return TRUE;
+}
+
 void summary_sort(SummaryView *summaryview,
 		  FolderSortKey sort_key, FolderSortType sort_type)
 {
@@ -2986,6 +3026,9 @@ void summary_sort(SummaryView *summaryview,
 	if (summaryview->sort_key == SORT_BY_NONE)
 		goto unlock;
 
+	if (cmp_func != NULL && summary_get_server_order(summaryview, sort_key))
+		cmp_func = (GtkCMCListCompareFunc)summary_cmp_by_server_order;
+
 	if (cmp_func != NULL) {
 		debug_print("Sorting summary...");
 		STATUSBAR_PUSH(summaryview->mainwin, _("Sorting summary..."));
@@ -7599,6 +7642,34 @@ static gint summary_cmp_by_simplified_subject
 	return (res != 0)? res: summary_cmp_by_date(clist, ptr1, ptr2);
 }
 
+/* Messages the server didn't list, such as those that came in since,
+ * go after the others. */
+static gint summary_cmp_by_server_order(GtkCMCList *clist,
+					gconstpointer ptr1, gconstpointer ptr2)
+{
+	MsgInfo *msginfo1 = ((GtkCMCListRow *)ptr1)->data;
+	MsgInfo *msginfo2 = ((GtkCMCListRow *)ptr2)->data;
+	const SummaryView *sv = g_object_get_data(G_OBJECT(clist), "summaryview");
+	guint pos1 = G_MAXUINT, pos2 = G_MAXUINT;
+
+	cm_return_val_if_fail(sv, -1);
+
+	if (sv->server_order) {
+		gpointer pos;
+
+		if ((pos = g_hash_table_lookup(sv->server_order,
+				GUINT_TO_POINTER(msginfo1->msgnum))) != NULL)
+			pos1 = GPOINTER_TO_UINT(pos);
+		if ((pos = g_hash_table_lookup(sv->server_order,
+				GUINT_TO_POINTER(msginfo2->msgnum))) != NULL)
+			pos2 = GPOINTER_TO_UINT(pos);
+	}
+
+	if (pos1 != pos2)
+		return pos1 < pos2 ? -1 : 1;
+	return msginfo1->msgnum - msginfo2->msgnum;
+}
+
 static gint summary_cmp_by_score(GtkCMCList *clist,
 				 gconstpointer ptr1, gconstpointer ptr2)
 {
@@ -155,6 +155,8 @@ private:
 	/* table for looking up message-id */
 	GHashTable *msgid_table;
 	GHashTable *subject_table;
+	/* message number -> position in the order the server sorted by */
+	GHashTable *server_order;
 
 	/* list for moving/deleting messages */
 	GSList *mlist;
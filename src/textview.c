@@ -651,6 +651,21 @@ void textview_show_part(TextView *textview, MimeInfo *mimeinfo, FILE *fp)
 	END_TIMING();
 }
 
+/* Parts left out of a partially fetched message are empty until they
+ * are fetched; get an inline image before it is shown. */
+static void textview_fetch_part(TextView *textview, MimeInfo *mimeinfo)
+{
+	MsgInfo *msginfo = textview->messageview ?
+			   textview->messageview->msginfo : NULL;
+
+	if (mimeinfo->length != 0 || !msginfo || !msginfo->folder)
+		return;
+
+	if (folder_item_fetch_msg_part(msginfo->folder, msginfo->msgnum,
+				       mimeinfo) < 0)
+		g_warning("couldn't fetch part of message %d", msginfo->msgnum);
+}
+
 static void textview_add_part(TextView *textview, MimeInfo *mimeinfo)
 {
 	GtkAllocation allocation;
@@ -713,14 +728,22 @@ static void textview_add_part(TextView *textview, MimeInfo *mimeinfo)
 		return;
 	}
 
+	if (mimeinfo->type == MIMETYPE_IMAGE && prefs_common.inline_img)
+		textview_fetch_part(textview, mimeinfo);
+
 	name = procmime_mimeinfo_get_parameter(mimeinfo, "filename");
 	content_type = procmime_get_content_type_str(mimeinfo->type,
 						     mimeinfo->subtype);
 	if (name == NULL)
 		name = procmime_mimeinfo_get_parameter(mimeinfo, "name");
-	if (name != NULL)
+	/* a part that has not been fetched yet has no known size */
+	if (name != NULL && mimeinfo->length == 0)
+		g_snprintf(buf, sizeof(buf), "[%s  %s]", name, content_type);
+	else if (name != NULL)
 		g_snprintf(buf, sizeof(buf), _("[%s  %s (%d bytes)]"),
 			   name, content_type, mimeinfo->length);
+	else if (mimeinfo->length == 0)
+		g_snprintf(buf, sizeof(buf), "[%s]", content_type);
 	else
 		g_snprintf(buf, sizeof(buf), _("[%s (%d bytes)]"),
 			   content_type, mimeinfo->length);